@@ -0,0 +1,189 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "dbus.h"
+#include "dbus-private.h"
+#include "private.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_VERSION_MAJOR	2
+#define PCAP_VERSION_MINOR	4
+#define PCAP_LINKTYPE_DBUS	231
+#define PCAP_SNAPLEN		134217728
+
+/* Messages are collected here and written out once it fills up */
+#define CAPTURE_BUFFER_SIZE	65536
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __attribute__ ((packed));
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} __attribute__ ((packed));
+
+struct _dbus_capture {
+	int fd;
+	size_t len;
+	uint8_t buf[CAPTURE_BUFFER_SIZE];
+};
+
+static bool write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t written;
+
+	while (iovcnt) {
+		written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		while (iovcnt && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+static void capture_flush(struct _dbus_capture *capture)
+{
+	struct iovec iov = { .iov_base = capture->buf,
+				.iov_len = capture->len };
+
+	if (!capture->len)
+		return;
+
+	/* A failed write loses what was buffered, the capture goes on */
+	write_all(capture->fd, &iov, 1);
+	capture->len = 0;
+}
+
+struct _dbus_capture *_dbus_capture_new(const char *path)
+{
+	struct _dbus_capture *capture;
+	struct pcap_file_header hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = PCAP_SNAPLEN,
+		.linktype = PCAP_LINKTYPE_DBUS,
+	};
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	capture = l_new(struct _dbus_capture, 1);
+	capture->fd = fd;
+
+	memcpy(capture->buf, &hdr, sizeof(hdr));
+	capture->len = sizeof(hdr);
+
+	return capture;
+}
+
+void _dbus_capture_free(struct _dbus_capture *capture)
+{
+	if (!capture)
+		return;
+
+	capture_flush(capture);
+	close(capture->fd);
+	l_free(capture);
+}
+
+void _dbus_capture_message(struct _dbus_capture *capture,
+				const void *header, size_t header_size,
+				const void *body, size_t body_size)
+{
+	struct pcap_record_header hdr;
+	struct timespec ts;
+	size_t size = sizeof(hdr) + header_size + body_size;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	hdr.ts_sec = ts.tv_sec;
+	hdr.ts_usec = ts.tv_nsec / 1000;
+	hdr.incl_len = header_size + body_size;
+	hdr.orig_len = header_size + body_size;
+
+	if (capture->len + size > CAPTURE_BUFFER_SIZE)
+		capture_flush(capture);
+
+	/* Messages that do not fit the buffer at all are written directly */
+	if (size > CAPTURE_BUFFER_SIZE) {
+		struct iovec iov[3] = {
+			{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+			{ .iov_base = (void *) header, .iov_len = header_size },
+			{ .iov_base = (void *) body, .iov_len = body_size },
+		};
+
+		write_all(capture->fd, iov, 3);
+		return;
+	}
+
+	memcpy(capture->buf + capture->len, &hdr, sizeof(hdr));
+	capture->len += sizeof(hdr);
+	memcpy(capture->buf + capture->len, header, header_size);
+	capture->len += header_size;
+
+	if (body_size) {
+		memcpy(capture->buf + capture->len, body, body_size);
+		capture->len += body_size;
+	}
+}
@@ -25,9 +25,13 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+
 #include "dbus.h"
 #include "dbus-client.h"
+#include "dbus-private.h"
 #include "queue.h"
+#include "hashmap.h"
 #include "private.h"
 
 struct l_dbus_client {
@@ -35,6 +39,7 @@ struct l_dbus_client {
 	unsigned int watch;
 	unsigned int added_watch;
 	unsigned int removed_watch;
+	unsigned int properties_watch;
 	char *service;
 	uint32_t objects_call;
 
@@ -57,21 +62,42 @@ struct l_dbus_client {
 	l_dbus_destroy_func_t proxy_cb_data_destroy;
 
 	struct l_queue *proxies;
+	struct l_hashmap *proxy_index;
+	struct l_hashmap *property_names;
 };
 
+/*
+ * Values of basic types are decoded into the property itself.  Other
+ * values are read from the message that carried them, which is shared
+ * by all the properties it updated.
+ */
 struct proxy_property {
-	char *name;
-	struct l_dbus_message *msg;
+	const char *name;
+	char type;
+	union {
+		bool boolean;
+		uint8_t byte;
+		int16_t int16;
+		uint16_t uint16;
+		int32_t int32;
+		uint32_t uint32;
+		int64_t int64;
+		uint64_t uint64;
+		double dbl;
+		char *str;
+	} value;
+	struct l_dbus_message_iter iter;
 };
 
 struct l_dbus_proxy {
 	struct l_dbus_client *client;
 	char *interface;
 	char *path;
-	uint32_t properties_watch;
 	bool ready;
 
-	struct l_queue *properties;
+	/* Sorted by the address of the interned property name */
+	struct proxy_property *properties;
+	unsigned int num_properties;
 	struct l_queue *pending_calls;
 };
 
@@ -91,68 +117,266 @@ LIB_EXPORT const char *l_dbus_proxy_get_interface(struct l_dbus_proxy *proxy)
 	return proxy->interface;
 }
 
-static bool property_match_by_name(const void *a, const void *b)
+/*
+ * Property names are interned per client, most proxies of a client share
+ * the same handful of interfaces and thus names.
+ */
+static const char *intern_property_name(struct l_dbus_client *client,
+							const char *name)
 {
-	const struct proxy_property *prop = a;
-	const char *name = b;
+	char *interned = l_hashmap_lookup(client->property_names, name);
+
+	if (interned)
+		return interned;
 
-	return !strcmp(prop->name, name);
+	interned = l_strdup(name);
+	l_hashmap_insert(client->property_names, name, interned);
+
+	return interned;
+}
+
+static int property_compare(const void *a, const void *b)
+{
+	const struct proxy_property *prop_a = a;
+	const struct proxy_property *prop_b = b;
+
+	if (prop_a->name == prop_b->name)
+		return 0;
+
+	return prop_a->name < prop_b->name ? -1 : 1;
 }
 
 static struct proxy_property *find_property(struct l_dbus_proxy *proxy,
 							const char *name)
 {
-	return l_queue_find(proxy->properties, property_match_by_name, name);
+	struct proxy_property key;
+
+	key.name = l_hashmap_lookup(proxy->client->property_names, name);
+	if (!key.name)
+		return NULL;
+
+	return bsearch(&key, proxy->properties, proxy->num_properties,
+				sizeof(struct proxy_property), property_compare);
 }
 
 static struct proxy_property *get_property(struct l_dbus_proxy *proxy,
 							const char *name)
 {
 	struct proxy_property *prop;
+	unsigned int i;
 
-	prop = find_property(proxy, name);
-	if (prop)
-		return prop;
+	name = intern_property_name(proxy->client, name);
+
+	for (i = 0; i < proxy->num_properties; i++) {
+		prop = &proxy->properties[i];
 
-	prop = l_new(struct proxy_property, 1);
-	prop->name = l_strdup(name);
+		if (prop->name == name)
+			return prop;
+
+		if (prop->name > name)
+			break;
+	}
 
-	l_queue_push_tail(proxy->properties, prop);
+	proxy->properties = l_realloc(proxy->properties,
+					(proxy->num_properties + 1) *
+					sizeof(struct proxy_property));
+	memmove(&proxy->properties[i + 1], &proxy->properties[i],
+				(proxy->num_properties - i) *
+				sizeof(struct proxy_property));
+	proxy->num_properties += 1;
+
+	prop = &proxy->properties[i];
+	memset(prop, 0, sizeof(*prop));
+	prop->name = name;
 
 	return prop;
 }
 
+static void property_clear(struct proxy_property *prop)
+{
+	switch (prop->type) {
+	case 's':
+	case 'o':
+	case 'g':
+		l_free(prop->value.str);
+		break;
+	}
+
+	l_dbus_message_unref(prop->iter.message);
+
+	prop->type = 0;
+	memset(&prop->iter, 0, sizeof(prop->iter));
+}
+
+static bool property_get_basic(const struct proxy_property *prop, char type,
+								void *out)
+{
+	if (prop->type != type)
+		return false;
+
+	switch (type) {
+	case 'b':
+		*(bool *) out = prop->value.boolean;
+		break;
+	case 'y':
+		*(uint8_t *) out = prop->value.byte;
+		break;
+	case 'n':
+		*(int16_t *) out = prop->value.int16;
+		break;
+	case 'q':
+		*(uint16_t *) out = prop->value.uint16;
+		break;
+	case 'i':
+		*(int32_t *) out = prop->value.int32;
+		break;
+	case 'u':
+		*(uint32_t *) out = prop->value.uint32;
+		break;
+	case 'x':
+		*(int64_t *) out = prop->value.int64;
+		break;
+	case 't':
+		*(uint64_t *) out = prop->value.uint64;
+		break;
+	case 'd':
+		*(double *) out = prop->value.dbl;
+		break;
+	case 's':
+	case 'o':
+	case 'g':
+		*(const char **) out = prop->value.str;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+static bool property_has_signature(const struct proxy_property *prop,
+						const char *signature)
+{
+	if (prop->type)
+		return signature[0] == prop->type && !signature[1];
+
+	return prop->iter.message && strlen(signature) == prop->iter.sig_len &&
+		!memcmp(signature, prop->iter.sig_start, prop->iter.sig_len);
+}
+
 LIB_EXPORT bool l_dbus_proxy_get_property(struct l_dbus_proxy *proxy,
 						const char *name,
 						const char *signature, ...)
 {
 	struct proxy_property *prop;
+	struct l_dbus_message_iter iter;
 	va_list args;
 	bool res;
 
-	if (unlikely(!proxy))
+	if (unlikely(!proxy || !name || !signature))
 		return false;
 
 	prop = find_property(proxy, name);
-	if (!prop)
+	if (!prop || !property_has_signature(prop, signature))
 		return false;
 
 	va_start(args, signature);
-	res = l_dbus_message_get_arguments_valist(prop->msg, signature, args);
+
+	if (prop->type)
+		res = property_get_basic(prop, prop->type,
+						va_arg(args, void *));
+	else {
+		/* Iterate over a copy so the value can be read again */
+		iter = prop->iter;
+		res = _dbus_message_iter_get_variant_valist(&iter, signature,
+									args);
+	}
+
 	va_end(args);
 
 	return res;
 }
 
-static void property_free(void *data)
+static bool proxy_get_basic(struct l_dbus_proxy *proxy, const char *name,
+						char type, void *out)
 {
-	struct proxy_property *prop = data;
+	struct proxy_property *prop;
+
+	if (unlikely(!proxy || !name || !out))
+		return false;
 
-	if (prop->msg)
-		l_dbus_message_unref(prop->msg);
+	prop = find_property(proxy, name);
+	if (!prop)
+		return false;
 
-	l_free(prop->name);
-	l_free(prop);
+	return property_get_basic(prop, type, out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_boolean(struct l_dbus_proxy *proxy,
+						const char *name, bool *out)
+{
+	return proxy_get_basic(proxy, name, 'b', out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_int32(struct l_dbus_proxy *proxy,
+						const char *name, int32_t *out)
+{
+	return proxy_get_basic(proxy, name, 'i', out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_uint32(struct l_dbus_proxy *proxy,
+						const char *name, uint32_t *out)
+{
+	return proxy_get_basic(proxy, name, 'u', out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_int64(struct l_dbus_proxy *proxy,
+						const char *name, int64_t *out)
+{
+	return proxy_get_basic(proxy, name, 'x', out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_uint64(struct l_dbus_proxy *proxy,
+						const char *name, uint64_t *out)
+{
+	return proxy_get_basic(proxy, name, 't', out);
+}
+
+LIB_EXPORT bool l_dbus_proxy_get_double(struct l_dbus_proxy *proxy,
+						const char *name, double *out)
+{
+	return proxy_get_basic(proxy, name, 'd', out);
+}
+
+/**
+ * l_dbus_proxy_get_string:
+ * @proxy: proxy object
+ * @name: property name
+ *
+ * Returns: the value of a string, object path or signature property, or
+ *          #NULL if the property is not known or of a different type.
+ *          The string stays valid until the property changes.
+ **/
+LIB_EXPORT const char *l_dbus_proxy_get_string(struct l_dbus_proxy *proxy,
+							const char *name)
+{
+	struct proxy_property *prop;
+
+	if (unlikely(!proxy || !name))
+		return NULL;
+
+	prop = find_property(proxy, name);
+	if (!prop)
+		return NULL;
+
+	switch (prop->type) {
+	case 's':
+	case 'o':
+	case 'g':
+		return prop->value.str;
+	}
+
+	return NULL;
 }
 
 static void cancel_pending_calls(struct l_dbus_proxy *proxy)
@@ -169,16 +393,18 @@ static void cancel_pending_calls(struct l_dbus_proxy *proxy)
 
 static void dbus_proxy_destroy(struct l_dbus_proxy *proxy)
 {
+	unsigned int i;
+
 	if (unlikely(!proxy))
 		return;
 
-	if (proxy->properties_watch)
-		l_dbus_remove_signal_watch(proxy->client->dbus,
-						proxy->properties_watch);
-
 	cancel_pending_calls(proxy);
 	l_queue_destroy(proxy->pending_calls, NULL);
-	l_queue_destroy(proxy->properties, property_free);
+
+	for (i = 0; i < proxy->num_properties; i++)
+		property_clear(&proxy->properties[i]);
+
+	l_free(proxy->properties);
 	l_free(proxy->interface);
 	l_free(proxy->path);
 	l_free(proxy);
@@ -240,10 +466,7 @@ LIB_EXPORT bool l_dbus_proxy_set_property(struct l_dbus_proxy *proxy,
 		return false;
 
 	prop = find_property(proxy, name);
-	if (!prop)
-		return false;
-
-	if (strcmp(l_dbus_message_get_signature(prop->msg), signature))
+	if (!prop || !property_has_signature(prop, signature))
 		return false;
 
 	message = l_dbus_message_new_method_call(client->dbus, client->service,
@@ -279,13 +502,12 @@ LIB_EXPORT bool l_dbus_proxy_set_property(struct l_dbus_proxy *proxy,
 	req->user_data = user_data;
 	req->destroy = destroy;
 
+	/* A call turned away has already been freed by its destroy */
 	req->call_id = l_dbus_send_with_reply(client->dbus, message,
 						method_call_reply, req,
 						method_call_request_free);
-	if (!req->call_id) {
-		l_free(req);
+	if (!req->call_id)
 		return false;
-	}
 
 	l_queue_push_tail(proxy->pending_calls, L_UINT_TO_PTR(req->call_id));
 
@@ -314,44 +536,98 @@ LIB_EXPORT uint32_t l_dbus_proxy_method_call(struct l_dbus_proxy *proxy,
 						method, method_call_setup,
 						method_call_reply, req,
 						method_call_request_free);
-	if (!req->call_id) {
-		l_free(req);
+	if (!req->call_id)
 		return 0;
-	}
 
 	l_queue_push_tail(proxy->pending_calls, L_UINT_TO_PTR(req->call_id));
 
 	return req->call_id;
 }
 
+static void property_set(struct l_dbus_proxy *proxy,
+				struct proxy_property *prop,
+				const struct l_dbus_message_iter *value)
+{
+	char signature[256];
+	struct l_dbus_message_iter iter = *value;
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *msg;
+
+	memcpy(signature, value->sig_start, value->sig_len);
+	signature[value->sig_len] = '\0';
+
+	if (value->sig_len == 1 && strchr("bynqiuxtdsog", signature[0]) &&
+			l_dbus_message_iter_get_variant(&iter, signature,
+							&prop->value)) {
+		prop->type = signature[0];
+
+		if (strchr("sog", prop->type))
+			prop->value.str = l_strdup(prop->value.str);
+
+		return;
+	}
+
+	/*
+	 * Copy container values into a message of their own rather than
+	 * holding on to the one they came in, which may in turn pin the
+	 * whole receive buffer it points into
+	 */
+	msg = l_dbus_message_new_signal(proxy->client->dbus, proxy->path,
+						proxy->interface, prop->name);
+	if (!msg)
+		return;
+
+	iter = *value;
+	builder = l_dbus_message_builder_new(msg);
+
+	if (!l_dbus_message_builder_enter_variant(builder, signature) ||
+			!l_dbus_message_builder_append_from_iter(builder,
+								&iter) ||
+			!l_dbus_message_builder_leave_variant(builder) ||
+			!l_dbus_message_builder_finalize(builder) ||
+			!l_dbus_message_get_arguments(msg, "v", &prop->iter)) {
+		l_dbus_message_builder_destroy(builder);
+		l_dbus_message_unref(msg);
+		memset(&prop->iter, 0, sizeof(prop->iter));
+		return;
+	}
+
+	l_dbus_message_builder_destroy(builder);
+}
+
 static void proxy_update_property(struct l_dbus_proxy *proxy,
 					const char *name,
 					struct l_dbus_message_iter *property)
 {
+	struct l_dbus_client *client = proxy->client;
 	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *msg = NULL;
 	struct proxy_property *prop = get_property(proxy, name);
 
-	l_dbus_message_unref(prop->msg);
+	property_clear(prop);
 
-	if (!property) {
-		prop->msg = NULL;
-		goto done;
-	}
+	if (property)
+		property_set(proxy, prop, property);
 
-	prop->msg = l_dbus_message_new_signal(proxy->client->dbus, proxy->path,
-							proxy->interface, name);
-	if (!prop->msg)
+	if (!client->properties_changed_cb || !proxy->ready)
 		return;
 
-	builder = l_dbus_message_builder_new(prop->msg);
-	l_dbus_message_builder_append_from_iter(builder, property);
-	l_dbus_message_builder_finalize(builder);
-	l_dbus_message_builder_destroy(builder);
+	/* Build a message for the callback only, nothing keeps it */
+	if (property) {
+		msg = l_dbus_message_new_signal(client->dbus, proxy->path,
+							proxy->interface, name);
+		if (!msg)
+			return;
+
+		builder = l_dbus_message_builder_new(msg);
+		l_dbus_message_builder_append_from_iter(builder, property);
+		l_dbus_message_builder_finalize(builder);
+		l_dbus_message_builder_destroy(builder);
+	}
+
+	client->properties_changed_cb(proxy, name, msg, client->proxy_cb_data);
 
-done:
-	if (proxy->client->properties_changed_cb && proxy->ready)
-		proxy->client->properties_changed_cb(proxy, name, prop->msg,
-					proxy->client->proxy_cb_data);
+	l_dbus_message_unref(msg);
 }
 
 static void proxy_invalidate_properties(struct l_dbus_proxy *proxy,
@@ -373,18 +649,63 @@ static void proxy_update_properties(struct l_dbus_proxy *proxy,
 		proxy_update_property(proxy, name, &variant);
 }
 
+/*
+ * Proxies are indexed by "<path> <interface>", neither of which can
+ * contain a space.
+ */
+#define PROXY_KEY_SIZE(path, interface) \
+	(strlen(path) + strlen(interface) + 2)
+
+static char *proxy_key(char *key, const char *path, const char *interface)
+{
+	size_t path_len = strlen(path);
+
+	memcpy(key, path, path_len);
+	key[path_len] = ' ';
+	strcpy(key + path_len + 1, interface);
+
+	return key;
+}
+
+static struct l_dbus_proxy *find_proxy(struct l_dbus_client *client,
+					const char *path, const char *interface)
+{
+	char key[PROXY_KEY_SIZE(path, interface)];
+
+	return l_hashmap_lookup(client->proxy_index,
+					proxy_key(key, path, interface));
+}
+
+static void proxy_index_remove(struct l_dbus_client *client,
+						struct l_dbus_proxy *proxy)
+{
+	char key[PROXY_KEY_SIZE(proxy->path, proxy->interface)];
+
+	l_hashmap_remove(client->proxy_index,
+			proxy_key(key, proxy->path, proxy->interface));
+}
+
 static void properties_changed_callback(struct l_dbus_message *message,
 								void *user_data)
 {
-	struct l_dbus_proxy *proxy = user_data;
+	struct l_dbus_client *client = user_data;
+	struct l_dbus_proxy *proxy;
+	const char *path = l_dbus_message_get_path(message);
 	const char *interface;
 	struct l_dbus_message_iter changed;
 	struct l_dbus_message_iter invalidated;
 
+	if (!path)
+		return;
+
 	if (!l_dbus_message_get_arguments(message, "sa{sv}as", &interface,
 							&changed, &invalidated))
 		return;
 
+	proxy = find_proxy(client, path, interface);
+	if (!proxy)
+		return;
+
 	proxy_update_properties(proxy, &changed);
 	proxy_invalidate_properties(proxy, &invalidated);
 }
@@ -393,27 +714,16 @@ static struct l_dbus_proxy *dbus_proxy_new(struct l_dbus_client *client,
 					const char *path, const char *interface)
 {
 	struct l_dbus_proxy *proxy = l_new(struct l_dbus_proxy, 1);
-
-	proxy->properties_watch = l_dbus_add_signal_watch(client->dbus,
-						client->service, path,
-						L_DBUS_INTERFACE_PROPERTIES,
-						"PropertiesChanged",
-						L_DBUS_MATCH_ARGUMENT(0),
-						interface, L_DBUS_MATCH_NONE,
-						properties_changed_callback,
-						proxy);
-	if (!proxy->properties_watch) {
-		l_free(proxy);
-		return NULL;
-	}
+	char key[PROXY_KEY_SIZE(path, interface)];
 
 	proxy->client = client;
 	proxy->interface = l_strdup(interface);
 	proxy->path = l_strdup(path);
-	proxy->properties = l_queue_new();
 	proxy->pending_calls = l_queue_new();;
 
 	l_queue_push_tail(client->proxies, proxy);
+	l_hashmap_insert(client->proxy_index, proxy_key(key, path, interface),
+									proxy);
 
 	return proxy;
 }
@@ -436,23 +746,6 @@ static bool is_ignorable(const char *interface)
 	return false;
 }
 
-static struct l_dbus_proxy *find_proxy(struct l_dbus_client *client,
-					const char *path, const char *interface)
-{
-	const struct l_queue_entry *entry;
-
-	for (entry = l_queue_get_entries(client->proxies); entry;
-							entry = entry->next) {
-		struct l_dbus_proxy *proxy = entry->data;
-
-		if (!strcmp(proxy->interface, interface) &&
-						!strcmp(proxy->path, path))
-			return proxy;
-	}
-
-	return NULL;
-}
-
 static void parse_interface(struct l_dbus_client *client, const char *path,
 					const char *interface,
 					struct l_dbus_message_iter *properties)
@@ -525,6 +818,7 @@ static void interfaces_removed_callback(struct l_dbus_message *message,
 			continue;
 
 		l_queue_remove(proxy->client->proxies, proxy);
+		proxy_index_remove(client, proxy);
 
 		if (client->proxy_removed_cb)
 			client->proxy_removed_cb(proxy, client->proxy_cb_data);
@@ -595,6 +889,8 @@ static void service_disappeared_callback(struct l_dbus *dbus, void *user_data)
 
 	l_queue_clear(client->proxies,
 				(l_queue_destroy_func_t)dbus_proxy_destroy);
+	l_hashmap_destroy(client->proxy_index, NULL);
+	client->proxy_index = l_hashmap_string_new();
 }
 
 LIB_EXPORT struct l_dbus_client *l_dbus_client_new(struct l_dbus *dbus,
@@ -614,8 +910,27 @@ LIB_EXPORT struct l_dbus_client *l_dbus_client_new(struct l_dbus *dbus,
 		return NULL;
 	}
 
+	/*
+	 * A single match for all PropertiesChanged signals of the service,
+	 * they are handed to the right proxy through the proxy index.
+	 */
+	client->properties_watch = l_dbus_add_signal_watch(dbus, service,
+						NULL,
+						L_DBUS_INTERFACE_PROPERTIES,
+						"PropertiesChanged",
+						L_DBUS_MATCH_NONE,
+						properties_changed_callback,
+						client);
+	if (!client->properties_watch) {
+		l_dbus_remove_watch(dbus, client->watch);
+		l_free(client);
+		return NULL;
+	}
+
 	client->service = l_strdup(service);
 	client->proxies = l_queue_new();
+	client->proxy_index = l_hashmap_string_new();
+	client->property_names = l_hashmap_string_new();
 
 	return client;
 }
@@ -634,6 +949,10 @@ LIB_EXPORT void l_dbus_client_destroy(struct l_dbus_client *client)
 	if (client->removed_watch)
 		l_dbus_remove_signal_watch(client->dbus, client->removed_watch);
 
+	if (client->properties_watch)
+		l_dbus_remove_signal_watch(client->dbus,
+						client->properties_watch);
+
 	if (client->connect_cb_data_destroy)
 		client->connect_cb_data_destroy(client->connect_cb_data);
 
@@ -651,6 +970,8 @@ LIB_EXPORT void l_dbus_client_destroy(struct l_dbus_client *client)
 ;
 	l_queue_destroy(client->proxies,
 				(l_queue_destroy_func_t)dbus_proxy_destroy);
+	l_hashmap_destroy(client->proxy_index, NULL);
+	l_hashmap_destroy(client->property_names, l_free);
 
 	l_free(client->service);
 	l_free(client);
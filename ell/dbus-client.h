@@ -25,6 +25,7 @@
 #define __ELL_DBUS_CLIENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -79,6 +80,21 @@ const char *l_dbus_proxy_get_interface(struct l_dbus_proxy *proxy);
 bool l_dbus_proxy_get_property(struct l_dbus_proxy *proxy, const char *name,
 						const char *signature, ...);
 
+bool l_dbus_proxy_get_boolean(struct l_dbus_proxy *proxy, const char *name,
+								bool *out);
+bool l_dbus_proxy_get_int32(struct l_dbus_proxy *proxy, const char *name,
+								int32_t *out);
+bool l_dbus_proxy_get_uint32(struct l_dbus_proxy *proxy, const char *name,
+								uint32_t *out);
+bool l_dbus_proxy_get_int64(struct l_dbus_proxy *proxy, const char *name,
+								int64_t *out);
+bool l_dbus_proxy_get_uint64(struct l_dbus_proxy *proxy, const char *name,
+								uint64_t *out);
+bool l_dbus_proxy_get_double(struct l_dbus_proxy *proxy, const char *name,
+								double *out);
+const char *l_dbus_proxy_get_string(struct l_dbus_proxy *proxy,
+							const char *name);
+
 bool l_dbus_proxy_set_property(struct l_dbus_proxy *proxy,
 				l_dbus_client_proxy_result_func_t result,
 				void *user_data, l_dbus_destroy_func_t destroy,
@@ -39,12 +39,31 @@
 
 #define NODE_TYPE_CALLBACK	L_DBUS_MATCH_NONE
 
+struct filter_node;
+
+/*
+ * Match children of a node that test the same message field, indexed by
+ * the value they expect.  Sender nodes for well-known names can also be
+ * matched through the current owner and are kept on the aliases list.
+ */
+struct filter_index {
+	enum l_dbus_match_type type;
+	struct l_hashmap *children;
+	struct l_queue *aliases;
+	struct filter_index *next;
+};
+
+/*
+ * Callback children are always kept in front of the match children on
+ * the children list, which owns all of them.
+ */
 struct filter_node {
 	enum l_dbus_match_type type;
 	union {
 		struct {
 			char *value;
 			struct filter_node *children;
+			struct filter_index *index;
 			bool remote_rule;
 		} match;
 		struct {
@@ -65,15 +84,82 @@ struct _dbus_filter {
 	struct _dbus_name_cache *name_cache;
 };
 
+static void filter_index_free(struct filter_index *index)
+{
+	l_hashmap_destroy(index->children, NULL);
+	l_queue_destroy(index->aliases, NULL);
+	l_free(index);
+}
+
+static void filter_index_add(struct _dbus_filter *filter,
+				struct filter_node *parent,
+				struct filter_node *node)
+{
+	struct filter_index *index;
+
+	for (index = parent->match.index; index; index = index->next)
+		if (index->type == node->type)
+			break;
+
+	if (!index) {
+		index = l_new(struct filter_index, 1);
+		index->type = node->type;
+		index->children = l_hashmap_string_new();
+		index->next = parent->match.index;
+		parent->match.index = index;
+	}
+
+	l_hashmap_insert(index->children, node->match.value, node);
+
+	if (node->type != L_DBUS_MATCH_SENDER || !filter->name_cache ||
+			_dbus_parse_unique_name(node->match.value, NULL))
+		return;
+
+	if (!index->aliases)
+		index->aliases = l_queue_new();
+
+	l_queue_push_tail(index->aliases, node);
+}
+
+static void filter_index_remove(struct filter_node *parent,
+				struct filter_node *node)
+{
+	struct filter_index **index_ptr, *index;
+
+	for (index_ptr = &parent->match.index; *index_ptr;
+			index_ptr = &(*index_ptr)->next)
+		if ((*index_ptr)->type == node->type)
+			break;
+
+	index = *index_ptr;
+	if (!index)
+		return;
+
+	l_hashmap_remove(index->children, node->match.value);
+	l_queue_remove(index->aliases, node);
+
+	if (l_hashmap_size(index->children))
+		return;
+
+	*index_ptr = index->next;
+	filter_index_free(index);
+}
+
 static void filter_subtree_free(struct filter_node *node)
 {
 	struct filter_node *child, *next;
+	struct filter_index *index;
 
 	if (node->type == NODE_TYPE_CALLBACK) {
 		l_free(node);
 		return;
 	}
 
+	while ((index = node->match.index)) {
+		node->match.index = index->next;
+		filter_index_free(index);
+	}
+
 	next = node->match.children;
 
 	l_free(node->match.value);
@@ -97,63 +183,92 @@ static void dbus_filter_destroy(void *data)
 	l_free(filter);
 }
 
-static void filter_dispatch_match_recurse(struct _dbus_filter *filter,
-						struct filter_node *node,
-						struct l_dbus_message *message)
+static const char *filter_message_value(struct l_dbus_message *message,
+						enum l_dbus_match_type type)
 {
-	const char *value = NULL;
-	const char *alt_value = NULL;
-	struct filter_node *child;
-
-	switch ((int) node->type) {
-	case NODE_TYPE_CALLBACK:
-		node->callback.func(message, node->callback.user_data);
-		return;
-
+	switch ((int) type) {
 	case L_DBUS_MATCH_SENDER:
-		value = l_dbus_message_get_sender(message);
-		break;
-
+		return l_dbus_message_get_sender(message);
 	case L_DBUS_MATCH_TYPE:
-		value = _dbus_message_get_type_as_string(message);
-		break;
-
+		return _dbus_message_get_type_as_string(message);
 	case L_DBUS_MATCH_PATH:
-		value = l_dbus_message_get_path(message);
-		break;
-
+		return l_dbus_message_get_path(message);
 	case L_DBUS_MATCH_INTERFACE:
-		value = l_dbus_message_get_interface(message);
-		break;
-
+		return l_dbus_message_get_interface(message);
 	case L_DBUS_MATCH_MEMBER:
-		value = l_dbus_message_get_member(message);
-		break;
-
+		return l_dbus_message_get_member(message);
 	case L_DBUS_MATCH_ARG0...(L_DBUS_MATCH_ARG0 + 63):
-		value = _dbus_message_get_nth_string_argument(message,
-						node->type - L_DBUS_MATCH_ARG0);
-		break;
+		return _dbus_message_get_nth_string_argument(message,
+						type - L_DBUS_MATCH_ARG0);
 	}
 
-	if (!value)
-		return;
+	return NULL;
+}
+
+static bool filter_node_match(struct _dbus_filter *filter,
+				struct filter_node *node, const char *value)
+{
+	const char *alt_value = NULL;
+
+	if (!strcmp(value, node->match.value))
+		return true;
 
 	if (node->type == L_DBUS_MATCH_SENDER && filter->name_cache)
 		alt_value = _dbus_name_cache_lookup(filter->name_cache,
 							node->match.value);
 
-	if (strcmp(value, node->match.value) &&
-			(!alt_value || strcmp(value, alt_value)))
-		return;
+	return alt_value && !strcmp(value, alt_value);
+}
 
-	for (child = node->match.children; child; child = child->next)
-		filter_dispatch_match_recurse(filter, child, message);
+/*
+ * Only the children matching the message are visited, each field the
+ * children of a node test is looked up once in that node's index.
+ */
+static void filter_dispatch_match_recurse(struct _dbus_filter *filter,
+						struct filter_node *node,
+						struct l_dbus_message *message)
+{
+	struct filter_node *child;
+	struct filter_index *index;
+	const struct l_queue_entry *entry;
+	const char *value;
+
+	for (child = node->match.children; child &&
+			child->type == NODE_TYPE_CALLBACK; child = child->next)
+		child->callback.func(message, child->callback.user_data);
+
+	for (index = node->match.index; index; index = index->next) {
+		value = filter_message_value(message, index->type);
+		if (!value)
+			continue;
+
+		child = l_hashmap_lookup(index->children, value);
+		if (child)
+			filter_dispatch_match_recurse(filter, child, message);
+
+		for (entry = l_queue_get_entries(index->aliases); entry;
+				entry = entry->next) {
+			if (entry->data == child)
+				continue;
+
+			if (filter_node_match(filter, entry->data, value))
+				filter_dispatch_match_recurse(filter,
+							entry->data, message);
+		}
+	}
 }
 
 void _dbus_filter_dispatch(struct l_dbus_message *message, void *user_data)
 {
 	struct _dbus_filter *filter = user_data;
+	const char *value;
+
+	if (!filter->root)
+		return;
+
+	value = filter_message_value(message, filter->root->type);
+	if (!value || !filter_node_match(filter, filter->root, value))
+		return;
 
 	filter_dispatch_match_recurse(filter, filter->root, message);
 }
@@ -197,6 +312,7 @@ static int condition_compare(const void *a, const void *b)
 }
 
 static bool remove_recurse(struct _dbus_filter *filter,
+				struct filter_node *parent,
 				struct filter_node **node, unsigned int id)
 {
 	struct filter_node *tmp;
@@ -206,8 +322,8 @@ static bool remove_recurse(struct _dbus_filter *filter,
 			break;
 
 		if ((*node)->type != NODE_TYPE_CALLBACK &&
-				remove_recurse(filter, &(*node)->match.children,
-						id))
+				remove_recurse(filter, *node,
+						&(*node)->match.children, id))
 			break;
 	}
 
@@ -218,6 +334,9 @@ static bool remove_recurse(struct _dbus_filter *filter,
 		tmp = *node;
 		*node = tmp->next;
 
+		if (tmp->type != NODE_TYPE_CALLBACK && parent)
+			filter_index_remove(parent, tmp);
+
 		if (tmp->match.remote_rule)
 			filter->driver->remove_match(filter->dbus, tmp->id);
 
@@ -233,6 +352,67 @@ static bool remove_recurse(struct _dbus_filter *filter,
 	return true;
 }
 
+/*
+ * Find a node on the @node list matching any of the unused conditions.
+ * Only used for the top level, which has no parent to index it.
+ */
+static struct filter_node *filter_list_find(struct filter_node *node,
+				struct _dbus_filter_condition *unused,
+				struct _dbus_filter_condition *end,
+				struct _dbus_filter_condition **out)
+{
+	struct _dbus_filter_condition *condition;
+
+	for (; node; node = node->next) {
+		for (condition = unused; condition < end; condition++) {
+			if (condition->type > node->type)
+				break;
+
+			if (condition->type < node->type ||
+					condition->type == L_DBUS_MATCH_NONE)
+				continue;
+
+			if (!strcmp(node->match.value, condition->value)) {
+				*out = condition;
+				return node;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Look up a child of @parent matching any of the unused conditions */
+static struct filter_node *filter_index_find(struct filter_node *parent,
+				struct _dbus_filter_condition *unused,
+				struct _dbus_filter_condition *end,
+				struct _dbus_filter_condition **out)
+{
+	struct _dbus_filter_condition *condition;
+	struct filter_index *index;
+	struct filter_node *node;
+
+	for (condition = unused; condition < end; condition++) {
+		if (condition->type == L_DBUS_MATCH_NONE)
+			continue;
+
+		for (index = parent->match.index; index; index = index->next)
+			if (index->type == condition->type)
+				break;
+
+		if (!index)
+			continue;
+
+		node = l_hashmap_lookup(index->children, condition->value);
+		if (node) {
+			*out = condition;
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
 unsigned int _dbus_filter_add_rule(struct _dbus_filter *filter,
 				const struct _dbus_filter_condition *rule,
 				int rule_len,
@@ -242,6 +422,7 @@ unsigned int _dbus_filter_add_rule(struct _dbus_filter *filter,
 	struct filter_node **node_ptr = &filter->root;
 	struct filter_node *node;
 	struct filter_node *parent = filter->root;
+	struct filter_node *level = NULL;
 	bool remote_rule = false;
 	struct _dbus_filter_condition sorted[rule_len];
 	struct _dbus_filter_condition *unused, *condition;
@@ -260,43 +441,43 @@ unsigned int _dbus_filter_add_rule(struct _dbus_filter *filter,
 		/*
 		 * Find a child of the node that matches any unused
 		 * condition.  Note there could be multiple matches, we're
-		 * happy with the first we can find.
+		 * happy with the first we can find.  Below the top level
+		 * the children are looked up in their parent's index
+		 * rather than scanned.
 		 */
-		while (*node_ptr) {
-			node = *node_ptr;
-
-			for (condition = unused; condition < end; condition++) {
-				if (condition->type > node->type) {
-					condition = end;
-					break;
-				}
-
-				if (condition->type < node->type ||
-						condition->type ==
-						L_DBUS_MATCH_NONE)
-					continue;
-
-				if (!strcmp(node->match.value,
-						condition->value))
-					break;
-			}
-
-			if (condition < end)
-				break;
-
-			node_ptr = &node->next;
-		}
+		if (level)
+			node = filter_index_find(level, unused, end,
+								&condition);
+		else
+			node = filter_list_find(filter->root, unused, end,
+								&condition);
 
 		/* Add a node */
-		if (!*node_ptr) {
+		if (!node) {
 			condition = unused;
 
 			node = l_new(struct filter_node, 1);
 			node->type = condition->type;
 			node->match.value = l_strdup(condition->value);
 
+			/*
+			 * Top level nodes are appended, match children go
+			 * right after the callbacks of their parent.
+			 */
+			if (level)
+				while (*node_ptr && (*node_ptr)->type ==
+							NODE_TYPE_CALLBACK)
+					node_ptr = &(*node_ptr)->next;
+			else
+				while (*node_ptr)
+					node_ptr = &(*node_ptr)->next;
+
+			node->next = *node_ptr;
 			*node_ptr = node;
 
+			if (level)
+				filter_index_add(filter, level, node);
+
 			if (node->type == L_DBUS_MATCH_SENDER &&
 					filter->name_cache &&
 					!_dbus_parse_unique_name(
@@ -322,6 +503,7 @@ unsigned int _dbus_filter_add_rule(struct _dbus_filter *filter,
 		node_ptr = &node->match.children;
 
 		parent = node;
+		level = node;
 
 		/*
 		 * Only have to call AddMatch if none of the parent nodes
@@ -353,14 +535,14 @@ unsigned int _dbus_filter_add_rule(struct _dbus_filter *filter,
 err:
 	/* Remove all the nodes we may have added */
 	node->id = (unsigned int) -1;
-	remove_recurse(filter, &filter->root, node->id);
+	remove_recurse(filter, NULL, &filter->root, node->id);
 
 	return 0;
 }
 
 bool _dbus_filter_remove_rule(struct _dbus_filter *filter, unsigned int id)
 {
-	return remove_recurse(filter, &filter->root, id);
+	return remove_recurse(filter, NULL, &filter->root, id);
 }
 
 char *_dbus_filter_rule_to_str(const struct _dbus_filter_condition *rule,
@@ -27,11 +27,17 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.h"
+#include "queue.h"
+#include "hashmap.h"
 #include "private.h"
+#include "missing.h"
 #include "dbus.h"
 #include "dbus-private.h"
 #include "gvariant-private.h"
@@ -56,6 +62,15 @@
 
 #define DBUS_MAX_NESTING	32
 
+/* Payloads from this size on are passed in a sealed memfd */
+#define DBUS_PAYLOAD_MEMFD_MIN	(64 * 1024)
+
+struct payload_map {
+	void *addr;
+	size_t len;
+	struct payload_map *next;
+};
+
 struct l_dbus_message {
 	int refcount;
 	void *header;
@@ -73,9 +88,19 @@ struct l_dbus_message {
 	char *sender;
 	int fds[16];
 	uint32_t num_fds;
+	struct _dbus_recv_buffer *buffer;
+	struct _dbus_message_pool *pool;
+	size_t body_alloc;
+	struct payload_map *payloads;
+	struct l_queue *signatures;
+	struct l_hashmap *sig_starts;
+	unsigned int reply_timeout;
 
 	bool sealed : 1;
 	bool signature_free : 1;
+	bool reply_timeout_set : 1;
+	bool replaceable : 1;
+	bool deferred : 1;
 };
 
 struct l_dbus_message_builder {
@@ -84,6 +109,187 @@ struct l_dbus_message_builder {
 	struct builder_driver *driver;
 };
 
+/*
+ * Each connection keeps the shells and body buffers of released messages
+ * around for the next ones.  Buffers are kept in power of four size
+ * classes from 64 bytes to 64 KiB, new bodies start out in the smallest
+ * class holding the largest body built recently.
+ */
+#define POOL_MAX_SHELLS		32
+#define POOL_MAX_BUFFERS	8
+#define POOL_SIZE_CLASSES	6
+#define POOL_CLASS_SIZE(n)	(64U << ((n) * 2))
+
+struct _dbus_message_pool {
+	int refcount;
+	bool closed;
+	bool unix_fds;
+	struct l_dbus_message *shells[POOL_MAX_SHELLS];
+	unsigned int num_shells;
+	struct {
+		void *buffers[POOL_MAX_BUFFERS];
+		unsigned int num_buffers;
+	} classes[POOL_SIZE_CLASSES];
+	size_t recent_body_size;
+};
+
+struct _dbus_message_pool *_dbus_message_pool_new(void)
+{
+	struct _dbus_message_pool *pool;
+
+	pool = l_new(struct _dbus_message_pool, 1);
+	pool->refcount = 1;
+
+	return pool;
+}
+
+static void pool_flush(struct _dbus_message_pool *pool)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < pool->num_shells; i++)
+		l_free(pool->shells[i]);
+
+	pool->num_shells = 0;
+
+	for (i = 0; i < POOL_SIZE_CLASSES; i++) {
+		for (j = 0; j < pool->classes[i].num_buffers; j++)
+			l_free(pool->classes[i].buffers[j]);
+
+		pool->classes[i].num_buffers = 0;
+	}
+}
+
+static void pool_unref(struct _dbus_message_pool *pool)
+{
+	if (--pool->refcount)
+		return;
+
+	pool_flush(pool);
+	l_free(pool);
+}
+
+/*
+ * Called when the connection goes away, messages still alive hold on to
+ * the pool but from now on they release their memory as usual.
+ */
+void _dbus_message_pool_free(struct _dbus_message_pool *pool)
+{
+	if (!pool)
+		return;
+
+	pool_flush(pool);
+	pool->closed = true;
+	pool->unix_fds = false;
+	pool_unref(pool);
+}
+
+/* Whether the connection of the pool has agreed to pass unix fds */
+void _dbus_message_pool_set_unix_fds(struct _dbus_message_pool *pool,
+					bool unix_fds)
+{
+	pool->unix_fds = unix_fds;
+}
+
+static struct l_dbus_message *pool_get_shell(struct _dbus_message_pool *pool)
+{
+	struct l_dbus_message *message;
+
+	if (!pool || !pool->num_shells)
+		return l_new(struct l_dbus_message, 1);
+
+	message = pool->shells[--pool->num_shells];
+	memset(message, 0, sizeof(*message));
+
+	return message;
+}
+
+static bool pool_put_shell(struct _dbus_message_pool *pool,
+					struct l_dbus_message *message)
+{
+	if (pool->closed || pool->num_shells == POOL_MAX_SHELLS)
+		return false;
+
+	pool->shells[pool->num_shells++] = message;
+
+	return true;
+}
+
+static void *pool_get_buffer(struct _dbus_message_pool *pool,
+							size_t *out_size)
+{
+	unsigned int i;
+
+	for (i = 0; i < POOL_SIZE_CLASSES; i++)
+		if (POOL_CLASS_SIZE(i) >= pool->recent_body_size)
+			break;
+
+	/* Unusually large bodies are left to grow as they are built */
+	if (i == POOL_SIZE_CLASSES)
+		return NULL;
+
+	*out_size = POOL_CLASS_SIZE(i);
+
+	if (!pool->classes[i].num_buffers)
+		return l_malloc(*out_size);
+
+	return pool->classes[i].buffers[--pool->classes[i].num_buffers];
+}
+
+static bool pool_put_buffer(struct _dbus_message_pool *pool,
+						void *buffer, size_t size)
+{
+	unsigned int i;
+
+	if (pool->closed || !buffer || size < POOL_CLASS_SIZE(0))
+		return false;
+
+	/*
+	 * File the buffer under the largest class it can serve, unless it
+	 * is so much larger than the top class that keeping it around
+	 * would waste memory.
+	 */
+	for (i = 1; i < POOL_SIZE_CLASSES; i++)
+		if (POOL_CLASS_SIZE(i) > size)
+			break;
+
+	i -= 1;
+
+	if (size >= POOL_CLASS_SIZE(i) * 4)
+		return false;
+
+	if (pool->classes[i].num_buffers == POOL_MAX_BUFFERS)
+		return false;
+
+	pool->classes[i].buffers[pool->classes[i].num_buffers++] = buffer;
+
+	return true;
+}
+
+static void pool_record_body(struct _dbus_message_pool *pool, size_t size)
+{
+	/* Follow peaks right away but only forget them slowly */
+	if (size > pool->recent_body_size)
+		pool->recent_body_size = size;
+	else
+		pool->recent_body_size -= (pool->recent_body_size - size) / 16;
+}
+
+void _dbus_message_set_pool(struct l_dbus_message *message,
+					struct _dbus_message_pool *pool)
+{
+	if (message->pool == pool)
+		return;
+
+	if (message->pool)
+		pool_unref(message->pool);
+
+	message->pool = pool;
+
+	if (pool)
+		pool->refcount += 1;
+}
+
 static inline bool _dbus_message_is_gvariant(struct l_dbus_message *msg)
 {
 	struct dbus_header *hdr = msg->header;
@@ -213,14 +419,92 @@ LIB_EXPORT bool l_dbus_message_get_no_autostart(struct l_dbus_message *msg)
 
 }
 
-static struct l_dbus_message *message_new_common(uint8_t type, uint8_t flags,
-						uint8_t version)
+/**
+ * l_dbus_message_set_reply_timeout:
+ * @msg: method call message
+ * @msec: milliseconds to wait for the reply, 0 to wait forever
+ *
+ * Overrides the connection's reply timeout, see @l_dbus_set_reply_timeout,
+ * for this method call.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_message_set_reply_timeout(struct l_dbus_message *msg,
+							unsigned int msec)
+{
+	if (unlikely(!msg))
+		return false;
+
+	msg->reply_timeout = msec;
+	msg->reply_timeout_set = true;
+
+	return true;
+}
+
+bool _dbus_message_get_reply_timeout(struct l_dbus_message *msg,
+							unsigned int *msec)
+{
+	if (!msg->reply_timeout_set)
+		return false;
+
+	*msec = msg->reply_timeout;
+
+	return true;
+}
+
+/**
+ * l_dbus_message_set_replaceable:
+ * @msg: signal message
+ * @on: whether the signal may be replaced
+ *
+ * Marks a signal as carrying state that a newer signal from the same
+ * object, with the same interface and name and the same first string
+ * argument, if any, makes obsolete.  Such a newer signal takes the place
+ * of this one if it has not been written out yet.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_message_set_replaceable(struct l_dbus_message *msg,
+							bool on)
+{
+	if (unlikely(!msg))
+		return false;
+
+	if (_dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return false;
+
+	msg->replaceable = on;
+
+	return true;
+}
+
+bool _dbus_message_get_replaceable(struct l_dbus_message *msg)
+{
+	return msg->replaceable;
+}
+
+/* Marks a method call as deferred, only once, returns false if it was */
+bool _dbus_message_set_deferred(struct l_dbus_message *msg)
+{
+	if (msg->deferred)
+		return false;
+
+	msg->deferred = true;
+
+	return true;
+}
+
+static struct l_dbus_message *message_new_common(
+					struct _dbus_message_pool *pool,
+					uint8_t type, uint8_t flags,
+					uint8_t version)
 {
 	struct l_dbus_message *message;
 	struct dbus_header *hdr;
 
-	message = l_new(struct l_dbus_message, 1);
+	message = pool_get_shell(pool);
 	message->refcount = 1;
+	_dbus_message_set_pool(message, pool);
 
 	/*
 	 * We allocate the header with the initial 12 bytes (up to the field
@@ -240,15 +524,18 @@ static struct l_dbus_message *message_new_common(uint8_t type, uint8_t flags,
 	return message;
 }
 
-struct l_dbus_message *_dbus_message_new_method_call(uint8_t version,
-							const char *destination,
-							const char *path,
-							const char *interface,
-							const char *method)
+static struct l_dbus_message *message_new_method_call(
+					struct _dbus_message_pool *pool,
+					uint8_t version,
+					const char *destination,
+					const char *path,
+					const char *interface,
+					const char *method)
 {
 	struct l_dbus_message *message;
 
-	message = message_new_common(DBUS_MESSAGE_TYPE_METHOD_CALL, 0, version);
+	message = message_new_common(pool, DBUS_MESSAGE_TYPE_METHOD_CALL, 0,
+					version);
 
 	message->destination = l_strdup(destination);
 	message->path = l_strdup(path);
@@ -258,6 +545,16 @@ struct l_dbus_message *_dbus_message_new_method_call(uint8_t version,
 	return message;
 }
 
+struct l_dbus_message *_dbus_message_new_method_call(uint8_t version,
+							const char *destination,
+							const char *path,
+							const char *interface,
+							const char *method)
+{
+	return message_new_method_call(NULL, version, destination, path,
+						interface, method);
+}
+
 LIB_EXPORT struct l_dbus_message *l_dbus_message_new_method_call(
 							struct l_dbus *dbus,
 							const char *destination,
@@ -272,18 +569,20 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_new_method_call(
 
 	version = _dbus_get_version(dbus);
 
-	return _dbus_message_new_method_call(version, destination, path,
-						interface, method);
+	return message_new_method_call(_dbus_get_message_pool(dbus), version,
+					destination, path, interface, method);
 }
 
-struct l_dbus_message *_dbus_message_new_signal(uint8_t version,
-						const char *path,
-						const char *interface,
-						const char *name)
+static struct l_dbus_message *message_new_signal(
+					struct _dbus_message_pool *pool,
+					uint8_t version,
+					const char *path,
+					const char *interface,
+					const char *name)
 {
 	struct l_dbus_message *message;
 
-	message = message_new_common(DBUS_MESSAGE_TYPE_SIGNAL,
+	message = message_new_common(pool, DBUS_MESSAGE_TYPE_SIGNAL,
 					DBUS_MESSAGE_FLAG_NO_REPLY_EXPECTED,
 					version);
 
@@ -294,6 +593,14 @@ struct l_dbus_message *_dbus_message_new_signal(uint8_t version,
 	return message;
 }
 
+struct l_dbus_message *_dbus_message_new_signal(uint8_t version,
+						const char *path,
+						const char *interface,
+						const char *name)
+{
+	return message_new_signal(NULL, version, path, interface, name);
+}
+
 LIB_EXPORT struct l_dbus_message *l_dbus_message_new_signal(struct l_dbus *dbus,
 							const char *path,
 							const char *interface,
@@ -306,7 +613,8 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_new_signal(struct l_dbus *dbus,
 
 	version = _dbus_get_version(dbus);
 
-	return _dbus_message_new_signal(version, path, interface, name);
+	return message_new_signal(_dbus_get_message_pool(dbus), version,
+					path, interface, name);
 }
 
 LIB_EXPORT struct l_dbus_message *l_dbus_message_new_method_return(
@@ -316,7 +624,8 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_new_method_return(
 	struct dbus_header *hdr = method_call->header;
 	const char *sender;
 
-	message = message_new_common(DBUS_MESSAGE_TYPE_METHOD_RETURN,
+	message = message_new_common(method_call->pool,
+					DBUS_MESSAGE_TYPE_METHOD_RETURN,
 					DBUS_MESSAGE_FLAG_NO_REPLY_EXPECTED,
 					hdr->version);
 
@@ -330,18 +639,20 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_new_method_return(
 	return message;
 }
 
-struct l_dbus_message *_dbus_message_new_error(uint8_t version,
-						uint32_t reply_serial,
-						const char *destination,
-						const char *name,
-						const char *error)
+static struct l_dbus_message *message_new_error(
+					struct _dbus_message_pool *pool,
+					uint8_t version,
+					uint32_t reply_serial,
+					const char *destination,
+					const char *name,
+					const char *error)
 {
 	struct l_dbus_message *reply;
 
 	if (!_dbus_valid_interface(name))
 		return NULL;
 
-	reply = message_new_common(DBUS_MESSAGE_TYPE_ERROR,
+	reply = message_new_common(pool, DBUS_MESSAGE_TYPE_ERROR,
 					DBUS_MESSAGE_FLAG_NO_REPLY_EXPECTED,
 					version);
 
@@ -357,6 +668,16 @@ struct l_dbus_message *_dbus_message_new_error(uint8_t version,
 	return reply;
 }
 
+struct l_dbus_message *_dbus_message_new_error(uint8_t version,
+						uint32_t reply_serial,
+						const char *destination,
+						const char *name,
+						const char *error)
+{
+	return message_new_error(NULL, version, reply_serial, destination,
+					name, error);
+}
+
 LIB_EXPORT struct l_dbus_message *l_dbus_message_new_error_valist(
 					struct l_dbus_message *method_call,
 					const char *name,
@@ -371,7 +692,7 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_new_error_valist(
 	if (!l_dbus_message_get_no_reply(method_call))
 		reply_serial = _dbus_message_get_serial(method_call);
 
-	return _dbus_message_new_error(hdr->version, reply_serial,
+	return message_new_error(method_call->pool, hdr->version, reply_serial,
 					l_dbus_message_get_sender(method_call),
 					name, str);
 }
@@ -415,6 +736,14 @@ LIB_EXPORT void l_dbus_message_unref(struct l_dbus_message *message)
 	for (i = 0; i < message->num_fds; i++)
 		close(message->fds[i]);
 
+	while (message->payloads) {
+		struct payload_map *map = message->payloads;
+
+		message->payloads = map->next;
+		munmap(map->addr, map->len);
+		l_free(map);
+	}
+
 	if (!message->sealed) {
 		l_free(message->destination);
 		l_free(message->path);
@@ -427,11 +756,149 @@ LIB_EXPORT void l_dbus_message_unref(struct l_dbus_message *message)
 	if (message->signature_free)
 		l_free(message->signature);
 
-	l_free(message->header);
-	l_free(message->body);
+	l_hashmap_destroy(message->sig_starts, l_free);
+	l_queue_destroy(message->signatures, (l_queue_destroy_func_t)
+							_dbus_signature_put);
+
+	if (message->buffer)
+		_dbus_recv_buffer_unref(message->buffer);
+	else {
+		l_free(message->header);
+
+		if (!message->pool || !pool_put_buffer(message->pool,
+							message->body,
+							message->body_alloc))
+			l_free(message->body);
+	}
+
+	if (message->pool) {
+		struct _dbus_message_pool *pool = message->pool;
+
+		if (!pool_put_shell(pool, message))
+			l_free(message);
+
+		pool_unref(pool);
+		return;
+	}
+
 	l_free(message);
 }
 
+/*
+ * Where an iterator's signature starts within a compiled signature held
+ * by the message.  Iterators are public and can't carry the compiled
+ * form themselves, so the message keeps one of these per signature start
+ * its iterators have used.
+ */
+struct sig_start {
+	const struct _dbus_signature *signature;
+	size_t offset;
+};
+
+static void sig_start_set(struct l_dbus_message *message, const char *sig,
+				const struct _dbus_signature *signature,
+				size_t offset)
+{
+	struct sig_start *start;
+
+	if (!message->sig_starts)
+		message->sig_starts = l_hashmap_new();
+
+	start = l_hashmap_lookup(message->sig_starts, sig);
+	if (!start) {
+		start = l_new(struct sig_start, 1);
+		l_hashmap_insert(message->sig_starts, sig, start);
+	}
+
+	start->signature = signature;
+	start->offset = offset;
+}
+
+/*
+ * Returns the compiled form of a signature found in or used on @message.
+ * The message holds on to it and remembers where @sig starts in it, so
+ * iterators over the message can find their compiled types without
+ * looking the signature up again every time they step into a container.
+ */
+struct _dbus_signature *_dbus_message_signature_get(
+					struct l_dbus_message *message,
+					const char *sig, size_t len)
+{
+	const struct l_queue_entry *entry;
+	struct _dbus_signature *signature;
+
+	if (!message)
+		return NULL;
+
+	for (entry = l_queue_get_entries(message->signatures); entry;
+			entry = entry->next) {
+		signature = entry->data;
+
+		if (signature->len == len && !memcmp(signature->str, sig, len))
+			goto done;
+	}
+
+	signature = _dbus_signature_get(sig, len);
+	if (!signature)
+		return NULL;
+
+	if (!message->signatures)
+		message->signatures = l_queue_new();
+
+	l_queue_push_tail(message->signatures, signature);
+
+done:
+	sig_start_set(message, sig, signature, 0);
+
+	return signature;
+}
+
+/*
+ * Notes that @sub, a container's contents within the signature starting
+ * at @sig, is compiled as part of the same signature as @sig.
+ */
+void _dbus_message_signature_enter(struct l_dbus_message *message,
+					const char *sig, const char *sub)
+{
+	const struct sig_start *start;
+
+	if (!message)
+		return;
+
+	start = l_hashmap_lookup(message->sig_starts, sig);
+	if (!start)
+		return;
+
+	sig_start_set(message, sub, start->signature,
+			start->offset + (sub - sig));
+}
+
+/*
+ * Returns the compiled types for the @len characters at @sig if the
+ * message knows where they start.  The memory a start was noted in may
+ * since have been reused, so the characters are checked to still match.
+ */
+const struct _dbus_signature_type *_dbus_message_signature_types(
+					struct l_dbus_message *message,
+					const char *sig, size_t len)
+{
+	const struct sig_start *start;
+
+	if (!message)
+		return NULL;
+
+	start = l_hashmap_lookup(message->sig_starts, sig);
+	if (!start)
+		return NULL;
+
+	if (start->offset + len > start->signature->len ||
+			memcmp(start->signature->str + start->offset,
+				sig, len))
+		return NULL;
+
+	return &start->signature->types[start->offset];
+}
+
 const char *_dbus_message_get_nth_string_argument(
 					struct l_dbus_message *message, int n)
 {
@@ -699,17 +1166,22 @@ unsigned int _dbus_message_unix_fds_from_header(const void *data, size_t size)
 {
 	struct l_dbus_message message;
 	uint32_t unix_fds;
+	bool found;
 
+	memset(&message, 0, sizeof(message));
 	message.header = (uint8_t *) data;
 	message.header_size = size;
 	message.body_size = 0;
 	message.sealed = true;
 
-	if (!get_header_field(&message, DBUS_MESSAGE_FIELD_UNIX_FDS,
-				'u', &unix_fds))
-		return 0;
+	found = get_header_field(&message, DBUS_MESSAGE_FIELD_UNIX_FDS,
+					'u', &unix_fds);
 
-	return unix_fds;
+	l_hashmap_destroy(message.sig_starts, l_free);
+	l_queue_destroy(message.signatures, (l_queue_destroy_func_t)
+							_dbus_signature_put);
+
+	return found ? unix_fds : 0;
 }
 
 struct l_dbus_message *dbus_message_from_blob(const void *data, size_t size,
@@ -869,6 +1341,81 @@ struct l_dbus_message *dbus_message_build(void *header, size_t header_size,
 	return message;
 }
 
+struct _dbus_recv_buffer *_dbus_recv_buffer_new(size_t size)
+{
+	struct _dbus_recv_buffer *buffer;
+
+	buffer = l_malloc(sizeof(struct _dbus_recv_buffer) + size);
+	buffer->refcount = 1;
+	buffer->size = size;
+
+	return buffer;
+}
+
+void _dbus_recv_buffer_unref(struct _dbus_recv_buffer *buffer)
+{
+	if (!buffer)
+		return;
+
+	if (__sync_sub_and_fetch(&buffer->refcount, 1))
+		return;
+
+	l_free(buffer);
+}
+
+/*
+ * Build a message whose header and body point straight into a receive
+ * buffer instead of into allocations of its own.  The message holds a
+ * reference on the buffer, so it stays valid for as long as it is
+ * retained.  While messages are outstanding the owner of the buffer may
+ * only append to it, and must continue in a fresh buffer once full.
+ *
+ * A retained view pins the whole buffer, so views are limited to buffers
+ * of the default size.  In a buffer grown for a large message, messages
+ * that take less than half of it are copied out instead.
+ */
+struct l_dbus_message *_dbus_message_new_view(struct _dbus_recv_buffer *buffer,
+						size_t offset,
+						size_t header_size,
+						size_t body_size,
+						int fds[], uint32_t num_fds)
+{
+	struct l_dbus_message *message;
+	uint8_t *data = buffer->data + offset;
+	void *header, *body;
+
+	/*
+	 * Fixed arrays handed out from the body are only aligned if the
+	 * message itself is, so a message following a body whose length
+	 * is not a multiple of 8 still gets copied.
+	 */
+	if ((offset & 7) || (buffer->size > DBUS_RECV_BUFFER_SIZE &&
+				(header_size + body_size) * 2 < buffer->size)) {
+		header = l_memdup(data, header_size);
+		body = body_size ? l_memdup(data + header_size, body_size) :
+									NULL;
+
+		message = dbus_message_build(header, header_size,
+						body, body_size, fds, num_fds);
+		if (!message) {
+			l_free(header);
+			l_free(body);
+		}
+
+		return message;
+	}
+
+	message = dbus_message_build(data, header_size, data + header_size,
+					body_size, fds, num_fds);
+	if (!message)
+		return NULL;
+
+	message->buffer = buffer;
+	__sync_fetch_and_add(&buffer->refcount, 1);
+
+	return message;
+}
+
 bool dbus_message_compare(struct l_dbus_message *message,
 					const void *data, size_t size)
 {
@@ -904,6 +1451,7 @@ done:
 
 struct builder_driver {
 	bool (*append_basic)(struct dbus_builder *, char, const void *);
+	bool (*append_bytes)(struct dbus_builder *, const void *, size_t);
 	bool (*enter_struct)(struct dbus_builder *, const char *);
 	bool (*leave_struct)(struct dbus_builder *);
 	bool (*enter_dict)(struct dbus_builder *, const char *);
@@ -917,10 +1465,13 @@ struct builder_driver {
 	bool (*rewind)(struct dbus_builder *);
 	struct dbus_builder *(*new)(void *, size_t);
 	void (*free)(struct dbus_builder *);
+	void (*set_buffer)(struct dbus_builder *, void *, size_t);
+	size_t (*get_capacity)(struct dbus_builder *);
 };
 
 static struct builder_driver dbus1_driver = {
 	.append_basic = _dbus1_builder_append_basic,
+	.append_bytes = _dbus1_builder_append_bytes,
 	.enter_struct = _dbus1_builder_enter_struct,
 	.leave_struct = _dbus1_builder_leave_struct,
 	.enter_dict = _dbus1_builder_enter_dict,
@@ -934,10 +1485,13 @@ static struct builder_driver dbus1_driver = {
 	.rewind = _dbus1_builder_rewind,
 	.new = _dbus1_builder_new,
 	.free = _dbus1_builder_free,
+	.set_buffer = _dbus1_builder_set_buffer,
+	.get_capacity = _dbus1_builder_get_capacity,
 };
 
 static struct builder_driver gvariant_driver = {
 	.append_basic = _gvariant_builder_append_basic,
+	.append_bytes = _gvariant_builder_append_bytes,
 	.enter_struct = _gvariant_builder_enter_struct,
 	.leave_struct = _gvariant_builder_leave_struct,
 	.enter_dict = _gvariant_builder_enter_dict,
@@ -951,6 +1505,8 @@ static struct builder_driver gvariant_driver = {
 	.rewind = _gvariant_builder_rewind,
 	.new = _gvariant_builder_new,
 	.free = _gvariant_builder_free,
+	.set_buffer = _gvariant_builder_set_buffer,
+	.get_capacity = _gvariant_builder_get_capacity,
 };
 
 static void add_field(struct dbus_builder *builder,
@@ -1393,6 +1949,16 @@ LIB_EXPORT bool l_dbus_message_iter_next_entry(struct l_dbus_message_iter *iter,
 	return result;
 }
 
+bool _dbus_message_iter_get_variant_valist(struct l_dbus_message_iter *iter,
+					const char *signature, va_list args)
+{
+	if (!iter->sig_start || strlen(signature) != iter->sig_len ||
+			memcmp(iter->sig_start, signature, iter->sig_len))
+		return false;
+
+	return message_iter_next_entry_valist(iter, args);
+}
+
 LIB_EXPORT bool l_dbus_message_iter_get_variant(
 					struct l_dbus_message_iter *iter,
 					const char *signature, ...)
@@ -1403,12 +1969,8 @@ LIB_EXPORT bool l_dbus_message_iter_get_variant(
 	if (unlikely(!iter))
 		return false;
 
-	if (!iter->sig_start || strlen(signature) != iter->sig_len ||
-			memcmp(iter->sig_start, signature, iter->sig_len))
-		return false;
-
 	va_start(args, signature);
-	result = message_iter_next_entry_valist(iter, args);
+	result = _dbus_message_iter_get_variant_valist(iter, signature, args);
 	va_end(args);
 
 	return result;
@@ -1427,6 +1989,97 @@ LIB_EXPORT bool l_dbus_message_iter_get_fixed_array(
 	return _dbus1_iter_get_fixed_array(iter, out, n_elem);
 }
 
+static bool map_payload(struct l_dbus_message *message, int fd,
+				uint64_t offset, uint64_t size, const void **out)
+{
+	struct payload_map *map;
+	struct stat st;
+	void *addr;
+	int seals;
+
+	/* The sender must not be able to change or truncate the data */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+					(F_SEAL_SHRINK | F_SEAL_WRITE))
+		return false;
+
+	if (fstat(fd, &st) < 0)
+		return false;
+
+	if (offset > (uint64_t) st.st_size ||
+			size > (uint64_t) st.st_size - offset ||
+			offset + size > SIZE_MAX)
+		return false;
+
+	if (!size) {
+		*out = NULL;
+		return true;
+	}
+
+	addr = mmap(NULL, offset + size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return false;
+
+	map = l_new(struct payload_map, 1);
+	map->addr = addr;
+	map->len = offset + size;
+	map->next = message->payloads;
+	message->payloads = map;
+
+	*out = addr + offset;
+
+	return true;
+}
+
+/**
+ * l_dbus_message_iter_get_payload:
+ * @iter: iterator for the contents of a variant
+ * @out: location for the payload data
+ * @out_size: location for the payload size
+ *
+ * Reads a payload written by @l_dbus_message_builder_append_payload.
+ * Payloads passed in a memfd are mapped read-only instead of being
+ * copied.  The data stays valid for as long as the message is.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_message_iter_get_payload(
+					struct l_dbus_message_iter *iter,
+					const void **out, size_t *out_size)
+{
+	struct l_dbus_message_iter array;
+	uint64_t offset, size;
+	uint32_t n_elem;
+	bool result;
+	int fd;
+
+	if (unlikely(!iter || !out || !out_size))
+		return false;
+
+	if (l_dbus_message_iter_get_variant(iter, "ay", &array)) {
+		if (!l_dbus_message_iter_get_fixed_array(&array, out, &n_elem))
+			return false;
+
+		*out_size = n_elem;
+		return true;
+	}
+
+	if (!l_dbus_message_iter_get_variant(iter, "(htt)",
+							&fd, &offset, &size))
+		return false;
+
+	if (fd < 0)
+		return false;
+
+	result = map_payload(iter->message, fd, offset, size, out);
+	close(fd);
+
+	if (result)
+		*out_size = size;
+
+	return result;
+}
+
 void _dbus_message_set_sender(struct l_dbus_message *message,
 					const char *sender)
 {
@@ -1470,6 +2123,14 @@ LIB_EXPORT struct l_dbus_message_builder *l_dbus_message_builder_new(
 
 	ret->builder = ret->driver->new(NULL, 0);
 
+	if (message->pool) {
+		size_t size;
+		void *buffer = pool_get_buffer(message->pool, &size);
+
+		if (buffer)
+			ret->driver->set_buffer(ret->builder, buffer, size);
+	}
+
 	return ret;
 }
 
@@ -1952,6 +2613,114 @@ LIB_EXPORT bool l_dbus_message_builder_append_from_valist(
 	return true;
 }
 
+static int payload_memfd_new(const void *data, size_t size)
+{
+	size_t pos = 0;
+	ssize_t written;
+	int fd;
+
+	fd = syscall(__NR_memfd_create, "ell-dbus-payload",
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	while (pos < size) {
+		written = write(fd, data + pos, size - pos);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto error;
+		}
+
+		pos += written;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+					F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto error;
+
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static bool append_payload_fd(struct l_dbus_message_builder *builder,
+					int fd, size_t size)
+{
+	struct l_dbus_message *message = builder->message;
+	struct builder_driver *driver = builder->driver;
+	uint64_t offset = 0;
+	uint64_t size64 = size;
+
+	if (!driver->enter_variant(builder->builder, "(htt)") ||
+			!driver->enter_struct(builder->builder, "htt") ||
+			!driver->append_basic(builder->builder, 'h',
+							&message->num_fds)) {
+		close(fd);
+		return false;
+	}
+
+	message->fds[message->num_fds++] = fd;
+
+	return driver->append_basic(builder->builder, 't', &offset) &&
+		driver->append_basic(builder->builder, 't', &size64) &&
+		driver->leave_struct(builder->builder) &&
+		driver->leave_variant(builder->builder);
+}
+
+/**
+ * l_dbus_message_builder_append_payload:
+ * @builder: message builder
+ * @data: payload data
+ * @size: payload size
+ *
+ * Appends a block of bytes as a variant.  Small payloads are sent inline
+ * as a byte array, large ones are copied once into a sealed memfd which
+ * is passed along with its size and offset, so the bus only has to pass
+ * on the file descriptor.  The memfd is only used for messages created
+ * on a connection that has agreed to unix fd passing, everything else
+ * gets the bytes inline.  Use @l_dbus_message_iter_get_payload to read
+ * the payload back.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_message_builder_append_payload(
+					struct l_dbus_message_builder *builder,
+					const void *data, size_t size)
+{
+	struct builder_driver *driver;
+	int fd;
+
+	if (unlikely(!builder || (!data && size)))
+		return false;
+
+	/*
+	 * Fall back to sending the bytes inline if no memfd can be had or
+	 * the connection the message was made for cannot pass it on
+	 */
+	if (size >= DBUS_PAYLOAD_MEMFD_MIN && builder->message->pool &&
+			builder->message->pool->unix_fds &&
+			builder->message->num_fds <
+				L_ARRAY_SIZE(builder->message->fds)) {
+		fd = payload_memfd_new(data, size);
+		if (fd >= 0)
+			return append_payload_fd(builder, fd, size);
+	}
+
+	driver = builder->driver;
+
+	if (!driver->enter_variant(builder->builder, "ay") ||
+			!driver->enter_array(builder->builder, "y") ||
+			!driver->append_bytes(builder->builder, data, size))
+		return false;
+
+	return driver->leave_array(builder->builder) &&
+		driver->leave_variant(builder->builder);
+}
+
 LIB_EXPORT struct l_dbus_message *l_dbus_message_builder_finalize(
 					struct l_dbus_message_builder *builder)
 {
@@ -1963,6 +2732,12 @@ LIB_EXPORT struct l_dbus_message *l_dbus_message_builder_finalize(
 	generated_signature = builder->driver->finish(builder->builder,
 						&builder->message->body,
 						&builder->message->body_size);
+	builder->message->body_alloc =
+			builder->driver->get_capacity(builder->builder);
+
+	if (builder->message->pool)
+		pool_record_body(builder->message->pool,
+					builder->message->body_size);
 
 	build_header(builder->message, generated_signature);
 	builder->message->sealed = true;
@@ -1987,3 +2762,58 @@ bool _dbus_message_builder_rewind(struct l_dbus_message_builder *builder)
 
 	return builder->driver->rewind(builder->builder);
 }
+
+/*
+ * The raw body accessors below are only provided for the classic wire
+ * format, GVariant arrays carry framing offsets that would have to be
+ * rewritten when bytes are copied between messages.
+ */
+bool _dbus_message_builder_get_offset(struct l_dbus_message_builder *builder,
+					size_t *offset)
+{
+	if (unlikely(!builder))
+		return false;
+
+	if (builder->driver != &dbus1_driver)
+		return false;
+
+	*offset = _dbus1_builder_get_offset(builder->builder);
+
+	return true;
+}
+
+void *_dbus_message_builder_copy(struct l_dbus_message_builder *builder,
+					size_t start, size_t *out_len)
+{
+	if (unlikely(!builder))
+		return NULL;
+
+	if (builder->driver != &dbus1_driver)
+		return NULL;
+
+	return _dbus1_builder_copy(builder->builder, start, out_len);
+}
+
+bool _dbus_message_builder_append_raw(struct l_dbus_message_builder *builder,
+					const void *data, size_t len)
+{
+	if (unlikely(!builder))
+		return false;
+
+	if (builder->driver != &dbus1_driver)
+		return false;
+
+	return _dbus1_builder_append_raw(builder->builder, data, len);
+}
+
+void _dbus_message_builder_reserve(struct l_dbus_message_builder *builder,
+					size_t size)
+{
+	if (unlikely(!builder))
+		return;
+
+	if (builder->driver != &dbus1_driver)
+		return;
+
+	_dbus1_builder_reserve(builder->builder, size);
+}
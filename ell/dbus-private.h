@@ -60,6 +60,9 @@ struct dbus_header {
 } __attribute__ ((packed));
 #define DBUS_HEADER_SIZE 16
 
+/* Initial size of the receive buffer, enough for many typical messages */
+#define DBUS_RECV_BUFFER_SIZE 65536
+
 struct dbus_builder;
 struct l_string;
 struct l_dbus_interface;
@@ -72,6 +75,7 @@ struct l_dbus;
 struct _dbus_filter;
 struct _dbus_filter_condition;
 struct _dbus_filter_ops;
+struct _dbus_message_pool;
 
 void _dbus1_iter_init(struct l_dbus_message_iter *iter,
 			struct l_dbus_message *message,
@@ -109,6 +113,17 @@ char *_dbus1_builder_finish(struct dbus_builder *builder,
 				void **body, size_t *body_size);
 bool _dbus1_builder_mark(struct dbus_builder *builder);
 bool _dbus1_builder_rewind(struct dbus_builder *builder);
+size_t _dbus1_builder_get_offset(struct dbus_builder *builder);
+void *_dbus1_builder_copy(struct dbus_builder *builder, size_t start,
+				size_t *out_len);
+bool _dbus1_builder_append_raw(struct dbus_builder *builder,
+					const void *data, size_t len);
+bool _dbus1_builder_append_bytes(struct dbus_builder *builder,
+					const void *data, size_t len);
+void _dbus1_builder_reserve(struct dbus_builder *builder, size_t size);
+void _dbus1_builder_set_buffer(struct dbus_builder *builder,
+					void *buffer, size_t size);
+size_t _dbus1_builder_get_capacity(struct dbus_builder *builder);
 
 void *_dbus_message_get_body(struct l_dbus_message *msg, size_t *out_size);
 void *_dbus_message_get_header(struct l_dbus_message *msg, size_t *out_size);
@@ -116,6 +131,12 @@ void *_dbus_message_get_footer(struct l_dbus_message *msg, size_t *out_size);
 int *_dbus_message_get_fds(struct l_dbus_message *msg, uint32_t *num_fds);
 void _dbus_message_set_serial(struct l_dbus_message *msg, uint32_t serial);
 uint32_t _dbus_message_get_serial(struct l_dbus_message *msg);
+bool _dbus_message_get_reply_timeout(struct l_dbus_message *msg,
+							unsigned int *msec);
+bool _dbus_message_get_replaceable(struct l_dbus_message *msg);
+bool _dbus_message_set_deferred(struct l_dbus_message *msg);
+bool _dbus_message_iter_get_variant_valist(struct l_dbus_message_iter *iter,
+					const char *signature, va_list args);
 uint32_t _dbus_message_get_reply_serial(struct l_dbus_message *message);
 
 void _dbus_message_set_sender(struct l_dbus_message *message,
@@ -145,21 +166,87 @@ struct l_dbus_message *_dbus_message_new_error(uint8_t version,
 						const char *name,
 						const char *error);
 
+struct _dbus_message_pool *_dbus_message_pool_new(void);
+void _dbus_message_pool_free(struct _dbus_message_pool *pool);
+void _dbus_message_pool_set_unix_fds(struct _dbus_message_pool *pool,
+					bool unix_fds);
+void _dbus_message_set_pool(struct l_dbus_message *message,
+					struct _dbus_message_pool *pool);
+
 struct l_dbus_message *dbus_message_from_blob(const void *data, size_t size,
 						int fds[], uint32_t num_fds);
 struct l_dbus_message *dbus_message_build(void *header, size_t header_size,
 						void *body, size_t body_size,
 						int fds[], uint32_t num_fds);
+
+struct _dbus_recv_buffer {
+	int refcount;
+	size_t size;
+	uint8_t data[] __attribute__ ((aligned(8)));
+};
+
+struct _dbus_recv_buffer *_dbus_recv_buffer_new(size_t size);
+void _dbus_recv_buffer_unref(struct _dbus_recv_buffer *buffer);
+
+struct l_dbus_message *_dbus_message_new_view(struct _dbus_recv_buffer *buffer,
+						size_t offset,
+						size_t header_size,
+						size_t body_size,
+						int fds[], uint32_t num_fds);
 bool dbus_message_compare(struct l_dbus_message *message,
 					const void *data, size_t size);
 
 bool _dbus_message_builder_mark(struct l_dbus_message_builder *builder);
 bool _dbus_message_builder_rewind(struct l_dbus_message_builder *builder);
+bool _dbus_message_builder_get_offset(struct l_dbus_message_builder *builder,
+					size_t *offset);
+void *_dbus_message_builder_copy(struct l_dbus_message_builder *builder,
+					size_t start, size_t *out_len);
+bool _dbus_message_builder_append_raw(struct l_dbus_message_builder *builder,
+					const void *data, size_t len);
+void _dbus_message_builder_reserve(struct l_dbus_message_builder *builder,
+					size_t size);
 
 unsigned int _dbus_message_unix_fds_from_header(const void *data, size_t size);
 
 const char *_dbus_signature_end(const char *signature);
 
+/*
+ * Compiled form of a signature, types[i] describes the complete type
+ * starting at character i of the signature.  Entries for characters that
+ * don't start a complete type, such as closing brackets, are left zeroed.
+ */
+struct _dbus_signature_type {
+	uint8_t length;			/* Characters in the complete type */
+	uint8_t alignment;
+	uint8_t gvariant_alignment;
+	uint16_t fixed_size;		/* 0 when not fixed size */
+	uint16_t gvariant_fixed_size;	/* 0 when not fixed size */
+};
+
+struct _dbus_signature {
+	const char *str;
+	size_t len;
+	unsigned int ref_count;
+	uint8_t num_children;
+	bool dbus1_valid : 1;
+	struct _dbus_signature_type types[];
+};
+
+struct _dbus_signature *_dbus_signature_get(const char *sig, size_t len);
+void _dbus_signature_put(struct _dbus_signature *signature);
+struct _dbus_signature *_dbus_message_signature_get(
+					struct l_dbus_message *message,
+					const char *sig, size_t len);
+void _dbus_message_signature_enter(struct l_dbus_message *message,
+					const char *sig, const char *sub);
+const struct _dbus_signature_type *_dbus_message_signature_types(
+					struct l_dbus_message *message,
+					const char *sig, size_t len);
+const struct _dbus_signature_type *_dbus_iter_get_type(
+				const struct l_dbus_message_iter *iter,
+				struct _dbus_signature **lookup);
+
 bool _dbus_valid_object_path(const char *path);
 bool _dbus_valid_signature(const char *sig);
 int _dbus_num_children(const char *sig);
@@ -244,6 +331,7 @@ typedef void (*_dbus_name_owner_change_func_t)(const char *name,
 						void *user_data);
 
 uint8_t _dbus_get_version(struct l_dbus *dbus);
+struct _dbus_message_pool *_dbus_get_message_pool(struct l_dbus *dbus);
 int _dbus_get_fd(struct l_dbus *dbus);
 struct _dbus_object_tree *_dbus_get_tree(struct l_dbus *dbus);
 
@@ -274,6 +362,41 @@ unsigned int _dbus_name_cache_add_watch(struct _dbus_name_cache *cache,
 bool _dbus_name_cache_remove_watch(struct _dbus_name_cache *cache,
 					unsigned int id);
 
+struct _dbus_capture;
+
+struct _dbus_capture *_dbus_capture_new(const char *path);
+void _dbus_capture_free(struct _dbus_capture *capture);
+void _dbus_capture_message(struct _dbus_capture *capture,
+				const void *header, size_t header_size,
+				const void *body, size_t body_size);
+
+struct _dbus_stats;
+
+struct _dbus_stats *_dbus_stats_new(void);
+void _dbus_stats_free(struct _dbus_stats *stats);
+void _dbus_stats_reset(struct _dbus_stats *stats);
+
+void _dbus_stats_message_sent(struct _dbus_stats *stats,
+				struct l_dbus_message *message, size_t size);
+void _dbus_stats_message_received(struct _dbus_stats *stats,
+				struct l_dbus_message *message, size_t size);
+void _dbus_stats_call_timed_out(struct _dbus_stats *stats);
+void _dbus_stats_send_queue(struct _dbus_stats *stats, unsigned int length);
+void _dbus_stats_pending_calls(struct _dbus_stats *stats, unsigned int count);
+void _dbus_stats_record(struct _dbus_stats *stats,
+				enum l_dbus_stats_histogram type,
+				const char *interface, const char *member,
+				uint64_t usec);
+
+void _dbus_stats_get(struct _dbus_stats *stats, struct l_dbus_stats *out);
+void _dbus_stats_foreach_histogram(struct _dbus_stats *stats,
+					l_dbus_stats_histogram_func_t function,
+					void *user_data);
+
+void _dbus_stats_setup_interface(struct l_dbus_interface *interface);
+
+struct _dbus_stats *_dbus_get_stats(struct l_dbus *dbus);
+
 struct _dbus_filter_condition {
 	enum l_dbus_match_type type;
 	const char *value;
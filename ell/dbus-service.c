@@ -39,6 +39,8 @@
 #include "dbus-private.h"
 #include "private.h"
 #include "idle.h"
+#include "timeout.h"
+#include "time.h"
 
 #define XML_ID "-//freedesktop//DTD D-BUS Object Introspection 1.0//EN"
 #define XML_DTD "http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd"
@@ -75,26 +77,62 @@ struct l_dbus_interface {
 	struct l_queue *methods;
 	struct l_queue *signals;
 	struct l_queue *properties;
+	struct l_hashmap *method_table;
+	struct l_hashmap *signal_table;
+	struct l_hashmap *property_table;
+	char *introspection;
+	unsigned int emit_interval;
+	bool cache_properties;
 	bool handle_old_style_properties;
+	unsigned int max_pending;
+	unsigned int num_pending;
+	struct l_queue *queued_calls;
 	void (*instance_destroy)(void *);
 	char name[];
 };
 
+struct l_dbus_pending_reply {
+	struct l_dbus *dbus;
+	struct _dbus_object_tree *tree;
+	struct l_dbus_interface *interface;
+	struct l_dbus_message *message;
+	struct l_dbus_pending_reply *prev;
+	struct l_dbus_pending_reply *next;
+};
+
+/* Nodes with more children than this also index them by subpath */
+#define CHILD_INDEX_MIN		8
+
+/* Path elements are looked up in place, without NUL termination */
+struct child_key {
+	const char *str;
+	size_t len;
+};
+
 struct child_node {
 	struct object_node *node;
 	struct child_node *next;
+	struct child_node *prev;
+	struct child_key key;
 	char subpath[];
 };
 
 struct interface_instance {
 	struct l_dbus_interface *interface;
 	void *user_data;
+	uint64_t last_emit;
 };
 
 struct object_node {
 	struct object_node *parent;
+	struct child_node *entry;
 	struct l_queue *instances;
 	struct child_node *children;
+	struct l_hashmap *child_index;
+	unsigned int num_children;
+	char *introspection;
+	void *managed_blob;
+	size_t managed_blob_len;
 	void *user_data;
 	void (*destroy) (void *);
 };
@@ -104,6 +142,7 @@ struct object_manager {
 	struct l_dbus *dbus;
 	struct l_queue *announce_added;
 	struct l_queue *announce_removed;
+	size_t reply_size;
 };
 
 struct interface_add_record {
@@ -131,8 +170,17 @@ struct _dbus_object_tree {
 	struct object_node *root;
 	struct l_queue *object_managers;
 	struct l_queue *property_changes;
+	struct l_queue *get_objects_jobs;
 	struct l_idle *emit_signals_work;
+	struct l_timeout *emit_deferred_work;
+	uint64_t emit_deadline;
 	bool flushing;
+	bool signals_held;
+	struct l_dbus_pending_reply *pending_replies;
+	struct l_queue *ready_interfaces;
+	struct l_idle *queued_calls_work;
+	struct l_dbus *queued_calls_dbus;
+	bool *dispatch_destroyed;
 };
 
 void _dbus_method_introspection(struct _dbus_method *info,
@@ -244,9 +292,20 @@ void _dbus_property_introspection(struct _dbus_property *info,
 		l_string_append(buf, "/>\n");
 }
 
-void _dbus_interface_introspection(struct l_dbus_interface *interface,
-						struct l_string *buf)
+/*
+ * The XML fragment of an interface is rendered once and then shared by
+ * every object implementing it, it is only dropped when a member gets
+ * added to the interface.
+ */
+static const char *interface_introspection(struct l_dbus_interface *interface)
 {
+	struct l_string *buf;
+
+	if (interface->introspection)
+		return interface->introspection;
+
+	buf = l_string_new(256);
+
 	l_string_append_printf(buf, "\t<interface name=\"%s\">\n",
 				interface->name);
 
@@ -258,6 +317,23 @@ void _dbus_interface_introspection(struct l_dbus_interface *interface,
 		(l_queue_foreach_func_t) _dbus_property_introspection, buf);
 
 	l_string_append(buf, "\t</interface>\n");
+
+	interface->introspection = l_string_unwrap(buf);
+
+	return interface->introspection;
+}
+
+static void interface_invalidate_introspection(
+					struct l_dbus_interface *interface)
+{
+	l_free(interface->introspection);
+	interface->introspection = NULL;
+}
+
+void _dbus_interface_introspection(struct l_dbus_interface *interface,
+						struct l_string *buf)
+{
+	l_string_append(buf, interface_introspection(interface));
 }
 
 #define COPY_PARAMS(dest, signature, args)	\
@@ -289,6 +365,32 @@ void _dbus_interface_introspection(struct l_dbus_interface *interface,
 		len;	\
 	})
 
+/*
+ * Members are looked up by name on every incoming call, so besides the
+ * queues, which keep the declaration order for introspection, they are
+ * also indexed by name.  The keys point into the member's own metainfo.
+ */
+static struct l_hashmap *interface_table_new(void)
+{
+	struct l_hashmap *table = l_hashmap_new();
+
+	l_hashmap_set_hash_function(table, l_str_hash);
+	l_hashmap_set_compare_function(table,
+				(l_hashmap_compare_func_t) strcmp);
+
+	return table;
+}
+
+static void interface_table_insert(struct l_hashmap *table,
+					const char *name, void *info)
+{
+	/* The first member declared with a name wins, like before */
+	if (l_hashmap_lookup(table, name))
+		return;
+
+	l_hashmap_insert(table, name, info);
+}
+
 LIB_EXPORT bool l_dbus_interface_method(struct l_dbus_interface *interface,
 					const char *name, uint32_t flags,
 					l_dbus_interface_method_cb_t cb,
@@ -346,6 +448,8 @@ LIB_EXPORT bool l_dbus_interface_method(struct l_dbus_interface *interface,
 	va_end(args);
 
 	l_queue_push_tail(interface->methods, info);
+	interface_table_insert(interface->method_table, info->metainfo, info);
+	interface_invalidate_introspection(interface);
 
 	return true;
 }
@@ -389,6 +493,8 @@ LIB_EXPORT bool l_dbus_interface_signal(struct l_dbus_interface *interface,
 	va_end(args);
 
 	l_queue_push_tail(interface->signals, info);
+	interface_table_insert(interface->signal_table, info->metainfo, info);
+	interface_invalidate_introspection(interface);
 
 	return true;
 }
@@ -426,6 +532,8 @@ LIB_EXPORT bool l_dbus_interface_property(struct l_dbus_interface *interface,
 	strcpy(p, signature);
 
 	l_queue_push_tail(interface->properties, info);
+	interface_table_insert(interface->property_table, info->metainfo, info);
+	interface_invalidate_introspection(interface);
 
 	return true;
 }
@@ -439,6 +547,15 @@ struct l_dbus_interface *_dbus_interface_new(const char *name)
 	interface->methods = l_queue_new();
 	interface->signals = l_queue_new();
 	interface->properties = l_queue_new();
+	interface->method_table = interface_table_new();
+	interface->signal_table = interface_table_new();
+	interface->property_table = interface_table_new();
+	interface->introspection = NULL;
+	interface->emit_interval = 0;
+	interface->cache_properties = false;
+	interface->max_pending = 0;
+	interface->num_pending = 0;
+	interface->queued_calls = NULL;
 
 	strcpy(interface->name, name);
 
@@ -450,59 +567,32 @@ void _dbus_interface_free(struct l_dbus_interface *interface)
 	l_queue_destroy(interface->methods, l_free);
 	l_queue_destroy(interface->signals, l_free);
 	l_queue_destroy(interface->properties, l_free);
+	l_hashmap_destroy(interface->method_table, NULL);
+	l_hashmap_destroy(interface->signal_table, NULL);
+	l_hashmap_destroy(interface->property_table, NULL);
+	l_free(interface->introspection);
+	l_queue_destroy(interface->queued_calls,
+				(l_queue_destroy_func_t) l_dbus_message_unref);
 
 	l_free(interface);
 }
 
-static bool match_method(const void *a, const void *b)
-{
-	const struct _dbus_method *method = a;
-	const char *name = b;
-
-	if (!strcmp(method->metainfo, name))
-		return true;
-
-	return false;
-}
-
 struct _dbus_method *_dbus_interface_find_method(struct l_dbus_interface *i,
 							const char *method)
 {
-	return l_queue_find(i->methods, match_method, (char *) method);
-}
-
-static bool match_signal(const void *a, const void *b)
-{
-	const struct _dbus_signal *signal = a;
-	const char *name = b;
-
-	if (!strcmp(signal->metainfo, name))
-		return true;
-
-	return false;
+	return l_hashmap_lookup(i->method_table, method);
 }
 
 struct _dbus_signal *_dbus_interface_find_signal(struct l_dbus_interface *i,
 							const char *signal)
 {
-	return l_queue_find(i->signals, match_signal, (char *) signal);
-}
-
-static bool match_property(const void *a, const void *b)
-{
-	const struct _dbus_property *property = a;
-	const char *name = b;
-
-	if (!strcmp(property->metainfo, name))
-		return true;
-
-	return false;
+	return l_hashmap_lookup(i->signal_table, signal);
 }
 
 struct _dbus_property *_dbus_interface_find_property(struct l_dbus_interface *i,
 							const char *property)
 {
-	return l_queue_find(i->properties, match_property, (char *) property);
+	return l_hashmap_lookup(i->property_table, property);
 }
 
 static void interface_instance_free(struct interface_instance *instance)
@@ -524,6 +614,32 @@ static bool match_interface_instance(const void *a, const void *b)
 	return false;
 }
 
+static bool match_interface_instance_ptr(const void *a, const void *b)
+{
+	const struct interface_instance *instance = a;
+
+	return instance->interface == b;
+}
+
+/*
+ * Resolve the interface name with a single hash lookup, the object's
+ * instances then only need comparing by pointer.
+ */
+static struct interface_instance *object_find_instance(
+					struct _dbus_object_tree *tree,
+					const struct object_node *object,
+					const char *interface_name)
+{
+	struct l_dbus_interface *interface;
+
+	interface = l_hashmap_lookup(tree->interfaces, interface_name);
+	if (!interface)
+		return NULL;
+
+	return l_queue_find(object->instances, match_interface_instance_ptr,
+				interface);
+}
+
 static void interface_add_record_free(void *data)
 {
 	struct interface_add_record *rec = data;
@@ -570,6 +686,8 @@ struct _dbus_object_tree *_dbus_object_tree_new()
 	tree->root = l_new(struct object_node, 1);
 
 	tree->property_changes = l_queue_new();
+	tree->get_objects_jobs = l_queue_new();
+	tree->ready_interfaces = l_queue_new();
 
 	_dbus_object_tree_register_interface(tree, L_DBUS_INTERFACE_PROPERTIES,
 						properties_setup_func, NULL,
@@ -597,6 +715,10 @@ static void subtree_free(struct object_node *node)
 		l_free(child);
 	}
 
+	l_hashmap_destroy(node->child_index, NULL);
+	l_free(node->introspection);
+	l_free(node->managed_blob);
+
 	l_queue_destroy(node->instances,
 			(l_queue_destroy_func_t) interface_instance_free);
 
@@ -617,8 +739,28 @@ static void object_manager_free(void *data)
 	l_free(manager);
 }
 
+static void get_objects_job_free(void *data);
+
 void _dbus_object_tree_free(struct _dbus_object_tree *tree)
 {
+	struct l_dbus_pending_reply *pending;
+
+	if (tree->dispatch_destroyed)
+		*tree->dispatch_destroyed = true;
+
+	/* Replies still outstanding can be sent but go nowhere */
+	for (pending = tree->pending_replies; pending;
+						pending = pending->next) {
+		pending->dbus = NULL;
+		pending->tree = NULL;
+		pending->interface = NULL;
+	}
+
+	l_queue_destroy(tree->ready_interfaces, NULL);
+	l_idle_remove(tree->queued_calls_work);
+
+	l_queue_destroy(tree->get_objects_jobs, get_objects_job_free);
+
 	subtree_free(tree->root);
 
 	l_hashmap_destroy(tree->interfaces,
@@ -632,104 +774,177 @@ void _dbus_object_tree_free(struct _dbus_object_tree *tree)
 	if (tree->emit_signals_work)
 		l_idle_remove(tree->emit_signals_work);
 
+	l_timeout_remove(tree->emit_deferred_work);
+
 	l_free(tree);
 }
 
-static struct object_node *makepath_recurse(struct object_node *node,
-						const char *path)
+/*
+ * The rendered XML of a node lists its interfaces and the names of its
+ * children, so it has to go whenever either of those changes.
+ */
+static void node_invalidate_introspection(struct object_node *node)
 {
-	const char *end;
+	l_free(node->introspection);
+	node->introspection = NULL;
+}
+
+/* The cached GetManagedObjects entry of a node has to go on any change */
+static void node_invalidate_managed(struct object_node *node)
+{
+	l_free(node->managed_blob);
+	node->managed_blob = NULL;
+}
+
+static unsigned int child_key_hash(const void *p)
+{
+	const struct child_key *key = p;
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < key->len; i++)
+		hash = (hash ^ (uint8_t) key->str[i]) * 16777619U;
+
+	return hash;
+}
+
+static int child_key_compare(const void *a, const void *b)
+{
+	const struct child_key *key_a = a, *key_b = b;
+
+	if (key_a->len != key_b->len)
+		return key_a->len < key_b->len ? -1 : 1;
+
+	return memcmp(key_a->str, key_b->str, key_a->len);
+}
+
+static struct child_node *find_child(struct object_node *node,
+					const char *subpath, size_t len)
+{
+	struct child_key key = { .str = subpath, .len = len };
 	struct child_node *child;
 
-	if (*path == '\0')
-		return node;
+	if (node->child_index)
+		return l_hashmap_lookup(node->child_index, &key);
 
-	path += 1;
-	end = strchrnul(path, '/');
-	child = node->children;
+	for (child = node->children; child; child = child->next)
+		if (child->key.len == len &&
+				!memcmp(child->subpath, subpath, len))
+			return child;
 
-	while (child) {
-		if (!strncmp(child->subpath, path, end - path) &&
-				child->subpath[end - path] == '\0')
-			goto done;
+	return NULL;
+}
 
-		child = child->next;
-	}
+static struct child_node *add_child(struct object_node *node,
+					const char *subpath, size_t len)
+{
+	struct child_node *child;
 
-	child = l_malloc(sizeof(*child) + end - path + 1);
+	child = l_malloc(sizeof(*child) + len + 1);
 	child->node = l_new(struct object_node, 1);
 	child->node->parent = node;
-	memcpy(child->subpath, path, end - path);
-	child->subpath[end-path] = '\0';
+	child->node->entry = child;
+	memcpy(child->subpath, subpath, len);
+	child->subpath[len] = '\0';
+	child->key.str = child->subpath;
+	child->key.len = len;
+
+	child->prev = NULL;
 	child->next = node->children;
+
+	if (node->children)
+		node->children->prev = child;
+
 	node->children = child;
+	node->num_children += 1;
+	node_invalidate_introspection(node);
 
-done:
-	return makepath_recurse(child->node, end);
+	if (node->child_index) {
+		l_hashmap_insert(node->child_index, &child->key, child);
+		return child;
+	}
+
+	if (node->num_children <= CHILD_INDEX_MIN)
+		return child;
+
+	node->child_index = l_hashmap_new();
+	l_hashmap_set_hash_function(node->child_index, child_key_hash);
+	l_hashmap_set_compare_function(node->child_index, child_key_compare);
+
+	for (child = node->children; child; child = child->next)
+		l_hashmap_insert(node->child_index, &child->key, child);
+
+	return node->children;
 }
 
-struct object_node *_dbus_object_tree_makepath(struct _dbus_object_tree *tree,
-						const char *path)
+static void remove_child(struct object_node *node, struct child_node *child)
 {
-	if (path[0] == '/' && path[1] == '\0')
-		return tree->root;
+	if (child->prev)
+		child->prev->next = child->next;
+	else
+		node->children = child->next;
+
+	if (child->next)
+		child->next->prev = child->prev;
+
+	node->num_children -= 1;
+	node_invalidate_introspection(node);
 
-	return makepath_recurse(tree->root, path);
+	if (node->child_index)
+		l_hashmap_remove(node->child_index, &child->key);
+
+	subtree_free(child->node);
+	l_free(child);
 }
 
-static struct object_node *lookup_recurse(struct object_node *node,
-						const char *path)
+/*
+ * Walk down from @node one path element at a time, each element is found
+ * with a hash lookup once a node has many children.  The elements are
+ * matched in place within @path.
+ */
+static struct object_node *tree_walk(struct object_node *node,
+					const char *path, bool create)
 {
-	const char *end;
 	struct child_node *child;
+	const char *subpath, *end;
 
-	if (*path == '\0')
+	if (path[0] == '\0' || (path[0] == '/' && path[1] == '\0'))
 		return node;
 
-	path += 1;
-	end = strchrnul(path, '/');
-	child = node->children;
+	for (subpath = path + 1; node; subpath = end + 1) {
+		end = strchrnul(subpath, '/');
+
+		child = find_child(node, subpath, end - subpath);
+		if (!child && create)
+			child = add_child(node, subpath, end - subpath);
 
-	while (child) {
-		if (!strncmp(child->subpath, path, end - path) &&
-				child->subpath[end - path] == '\0')
-			return lookup_recurse(child->node, end);
+		node = child ? child->node : NULL;
 
-		child = child->next;
+		if (*end == '\0')
+			break;
 	}
 
-	return NULL;
+	return node;
 }
 
-struct object_node *_dbus_object_tree_lookup(struct _dbus_object_tree *tree,
+struct object_node *_dbus_object_tree_makepath(struct _dbus_object_tree *tree,
 						const char *path)
 {
-	if (path[0] == '/' && path[1] == '\0')
-		return tree->root;
+	return tree_walk(tree->root, path, true);
+}
 
-	return lookup_recurse(tree->root, path);
+struct object_node *_dbus_object_tree_lookup(struct _dbus_object_tree *tree,
+						const char *path)
+{
+	return tree_walk(tree->root, path, false);
 }
 
 void _dbus_object_tree_prune_node(struct object_node *node)
 {
 	struct object_node *parent = node->parent;
-	struct child_node *p = NULL, *c;
 
 	while (parent) {
-		for (c = parent->children, p = NULL; c; p = c, c = c->next) {
-			if (c->node != node)
-				continue;
-
-			if (p)
-				p->next = c->next;
-			else
-				parent->children = c->next;
-
-			subtree_free(c->node);
-			l_free(c);
-
-			break;
-		}
+		remove_child(parent, node->entry);
 
 		if (parent->children != NULL)
 			return;
@@ -795,6 +1010,8 @@ bool _dbus_object_tree_object_destroy(struct _dbus_object_tree *tree,
 
 	l_queue_destroy(node->instances, NULL);
 	node->instances = NULL;
+	node_invalidate_introspection(node);
+	node_invalidate_managed(node);
 
 	if (node->destroy) {
 		node->destroy(node->user_data);
@@ -935,6 +1152,9 @@ static struct l_dbus_message *build_old_property_changed_signal(
 						rec->instance->interface->name,
 						"PropertyChanged");
 
+	/* Only the latest value matters while the signal is still queued */
+	l_dbus_message_set_replaceable(signal, true);
+
 	builder = l_dbus_message_builder_new(signal);
 
 	l_dbus_message_builder_append_basic(builder, 's', property->metainfo);
@@ -1027,10 +1247,17 @@ done:
 	return signal;
 }
 
+static void schedule_emit_deferred(struct l_dbus *dbus, uint64_t deadline);
+static void schedule_emit_signals(struct l_dbus *dbus);
+static void get_objects_jobs_complete(struct l_dbus *dbus, const char *path);
+
 struct emit_signals_data {
 	struct l_dbus *dbus;
 	struct object_manager *manager;
 	struct object_node *node;
+	uint64_t now;
+	uint64_t deadline;
+	unsigned int deferred;
 };
 
 static bool emit_interfaces_removed(void *data, void *user_data)
@@ -1069,16 +1296,41 @@ static bool emit_interfaces_added(void *data, void *user_data)
 	return true;
 }
 
+static uint64_t instance_emit_deadline(const struct interface_instance *i)
+{
+	if (!i->interface->emit_interval || !i->last_emit)
+		return 0;
+
+	return i->last_emit + i->interface->emit_interval * L_USEC_PER_MSEC;
+}
+
 static bool emit_properties_changed(void *data, void *user_data)
 {
 	struct property_change_record *rec = data;
 	struct emit_signals_data *es = user_data;
 	struct l_dbus_message *signal;
 	const struct l_queue_entry *entry;
+	uint64_t deadline;
 
 	if (es->node && rec->object != es->node)
 		return false;
 
+	/*
+	 * Keep merging changes into the record until the interval of the
+	 * interface has passed, the getters only run when the signal is
+	 * finally built so it carries the latest values.
+	 */
+	deadline = instance_emit_deadline(rec->instance);
+	if (deadline > es->now) {
+		if (!es->deadline || deadline < es->deadline)
+			es->deadline = deadline;
+
+		es->deferred += 1;
+		return false;
+	}
+
+	rec->instance->last_emit = es->now;
+
 	if (rec->instance->interface->handle_old_style_properties)
 		for (entry = l_queue_get_entries(rec->properties);
 				entry; entry = entry->next) {
@@ -1107,13 +1359,41 @@ void _dbus_object_tree_signals_flush(struct l_dbus *dbus, const char *path)
 	struct emit_signals_data data;
 	bool all_done = true;
 
-	if (!tree->emit_signals_work || tree->flushing)
+	if ((!tree->emit_signals_work && !tree->signals_held) ||
+			tree->flushing)
 		return;
 
+	/*
+	 * While a GetManagedObjects reply is being built in batches the
+	 * signals are held back, otherwise a client could see an object
+	 * removed or a property changed before the reply still carrying the
+	 * old state.  The reply reschedules the flush once it is sent.
+	 *
+	 * A message going out on a path must not overtake the signals held
+	 * for it either, so in that case the replies covering the path are
+	 * completed right away and its signals follow them out.  Replies for
+	 * other subtrees keep being built in batches, the signals of their
+	 * objects stay held.
+	 */
+	if (!l_queue_isempty(tree->get_objects_jobs)) {
+		if (!path) {
+			l_idle_remove(tree->emit_signals_work);
+			tree->emit_signals_work = NULL;
+			tree->signals_held = true;
+			return;
+		}
+
+		get_objects_jobs_complete(dbus, path);
+	}
+
+	tree->signals_held = false;
 	tree->flushing = true;
 
 	data.dbus = dbus;
 	data.node = path ? _dbus_object_tree_lookup(tree, path) : NULL;
+	data.now = l_time_now();
+	data.deadline = 0;
+	data.deferred = 0;
 
 	for (entry = l_queue_get_entries(tree->object_managers); entry;
 			entry = entry->next) {
@@ -1135,13 +1415,18 @@ void _dbus_object_tree_signals_flush(struct l_dbus *dbus, const char *path)
 	l_queue_foreach_remove(tree->property_changes,
 				emit_properties_changed, &data);
 
-	if (!l_queue_isempty(tree->property_changes))
+	/* Rate limited changes are picked up again by the deferred work */
+	if (l_queue_length(tree->property_changes) > data.deferred)
 		all_done = false;
 
+	if (data.deadline)
+		schedule_emit_deferred(dbus, data.deadline);
+
 	if (all_done) {
 		l_idle_remove(tree->emit_signals_work);
 		tree->emit_signals_work = NULL;
-	}
+	} else
+		schedule_emit_signals(dbus);
 
 	tree->flushing = false;
 }
@@ -1163,6 +1448,43 @@ static void schedule_emit_signals(struct l_dbus *dbus)
 	tree->emit_signals_work = l_idle_create(emit_signals, dbus, NULL);
 }
 
+static void emit_deferred(struct l_timeout *timeout, void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+	struct _dbus_object_tree *tree = _dbus_get_tree(dbus);
+
+	tree->emit_deadline = 0;
+
+	schedule_emit_signals(dbus);
+}
+
+/*
+ * A single timeout covers all rate limited objects, it is armed for the
+ * earliest deadline and whatever else is due by then goes out in the same
+ * flush.
+ */
+static void schedule_emit_deferred(struct l_dbus *dbus, uint64_t deadline)
+{
+	struct _dbus_object_tree *tree = _dbus_get_tree(dbus);
+	uint64_t now = l_time_now();
+	unsigned long ms = 1;
+
+	if (tree->emit_deadline && tree->emit_deadline <= deadline)
+		return;
+
+	tree->emit_deadline = deadline;
+
+	if (deadline > now)
+		ms = l_time_to_msecs(deadline - now + L_USEC_PER_MSEC - 1);
+
+	if (tree->emit_deferred_work)
+		l_timeout_modify_ms(tree->emit_deferred_work, ms ?: 1);
+	else
+		tree->emit_deferred_work = l_timeout_create_ms(ms ?: 1,
+							emit_deferred,
+							dbus, NULL);
+}
+
 static bool match_property_changes_instance(const void *a, const void *b)
 {
 	const struct property_change_record *rec = a;
@@ -1185,13 +1507,13 @@ bool _dbus_object_tree_property_changed(struct l_dbus *dbus,
 	struct interface_instance *instance;
 	struct _dbus_property *property;
 	struct _dbus_object_tree *tree = _dbus_get_tree(dbus);
+	uint64_t deadline;
 
 	object = l_hashmap_lookup(tree->objects, path);
 	if (!object)
 		return false;
 
-	instance = l_queue_find(object->instances, match_interface_instance,
-				interface_name);
+	instance = object_find_instance(tree, object, interface_name);
 	if (!instance)
 		return false;
 
@@ -1200,6 +1522,8 @@ bool _dbus_object_tree_property_changed(struct l_dbus *dbus,
 	if (!property)
 		return false;
 
+	node_invalidate_managed(object);
+
 	rec = l_queue_find(tree->property_changes,
 				match_property_changes_instance, instance);
 
@@ -1218,7 +1542,11 @@ bool _dbus_object_tree_property_changed(struct l_dbus *dbus,
 
 	l_queue_push_tail(rec->properties, property);
 
-	schedule_emit_signals(dbus);
+	deadline = instance_emit_deadline(instance);
+	if (deadline > l_time_now())
+		schedule_emit_deferred(dbus, deadline);
+	else
+		schedule_emit_signals(dbus);
 
 	return true;
 }
@@ -1405,6 +1733,9 @@ bool _dbus_object_tree_unregister_interface(struct _dbus_object_tree *tree,
 {
 	struct l_dbus_interface *interface;
 	struct interface_check state = { tree, interface_name };
+	struct l_dbus_pending_reply *pending;
+	struct l_dbus_message *message;
+	struct l_dbus_message *error;
 
 	interface = l_hashmap_lookup(tree->interfaces, interface_name);
 	if (!interface)
@@ -1414,15 +1745,81 @@ bool _dbus_object_tree_unregister_interface(struct _dbus_object_tree *tree,
 	l_hashmap_foreach(tree->objects, check_interface_used, &state);
 
 	l_hashmap_remove(tree->interfaces, interface_name);
+	l_queue_remove(tree->ready_interfaces, interface);
+
+	for (pending = tree->pending_replies; pending;
+						pending = pending->next)
+		if (pending->interface == interface)
+			pending->interface = NULL;
+
+	/* Calls still waiting for the interface will never be dispatched */
+	while ((message = l_queue_pop_head(interface->queued_calls))) {
+		error = l_dbus_message_new_error(message,
+				"org.freedesktop.DBus.Error.UnknownMethod",
+				"Interface %s was unregistered",
+				interface_name);
+		l_dbus_send(tree->queued_calls_dbus, error);
+		l_dbus_message_unref(message);
+	}
 
 	_dbus_interface_free(interface);
 
 	return true;
 }
 
-static void collect_instances(struct object_node *node,
-				const char *path,
-				struct l_queue *announce)
+/*
+ * Paths of a subtree are built up in one buffer, each level appends its
+ * element on the way down and truncates it again on the way back up.
+ */
+struct walk_path {
+	char *str;
+	size_t len;
+	size_t size;
+};
+
+static void walk_path_init(struct walk_path *walk, const char *path)
+{
+	/* The root is kept as an empty prefix, see walk_path_get */
+	if (!strcmp(path, "/"))
+		path = "";
+
+	walk->len = strlen(path);
+	walk->size = walk->len + 64;
+	walk->str = l_malloc(walk->size);
+	memcpy(walk->str, path, walk->len + 1);
+}
+
+static const char *walk_path_get(const struct walk_path *walk)
+{
+	return walk->len ? walk->str : "/";
+}
+
+static size_t walk_path_push(struct walk_path *walk, const char *subpath)
+{
+	size_t len = walk->len;
+	size_t sublen = strlen(subpath);
+
+	if (len + sublen + 2 > walk->size) {
+		walk->size = (len + sublen + 2) * 2;
+		walk->str = l_realloc(walk->str, walk->size);
+	}
+
+	walk->str[len] = '/';
+	memcpy(walk->str + len + 1, subpath, sublen + 1);
+	walk->len = len + sublen + 1;
+
+	return len;
+}
+
+static void walk_path_pop(struct walk_path *walk, size_t len)
+{
+	walk->len = len;
+	walk->str[len] = '\0';
+}
+
+static void collect_instances_walk(struct object_node *node,
+					struct walk_path *walk,
+					struct l_queue *announce)
 {
 	const struct l_queue_entry *entry;
 	struct interface_add_record *change_rec;
@@ -1432,7 +1829,7 @@ static void collect_instances(struct object_node *node,
 		goto recurse;
 
 	change_rec = l_new(struct interface_add_record, 1);
-	change_rec->path = l_strdup(path);
+	change_rec->path = l_strdup(walk_path_get(walk));
 	change_rec->object = node;
 	change_rec->instances = l_queue_new();
 
@@ -1443,18 +1840,23 @@ static void collect_instances(struct object_node *node,
 	l_queue_push_tail(announce, change_rec);
 
 recurse:
-	if (!strcmp(path, "/"))
-		path = "";
-
 	for (child = node->children; child; child = child->next) {
-		char *child_path;
+		size_t len = walk_path_push(walk, child->subpath);
 
-		child_path = l_strdup_printf("%s/%s", path, child->subpath);
+		collect_instances_walk(child->node, walk, announce);
+		walk_path_pop(walk, len);
+	}
+}
 
-		collect_instances(child->node, child_path, announce);
+static void collect_instances(struct object_node *node,
+				const char *path,
+				struct l_queue *announce)
+{
+	struct walk_path walk;
 
-		l_free(child_path);
-	}
+	walk_path_init(&walk, path);
+	collect_instances_walk(node, &walk, announce);
+	l_free(walk.str);
 }
 
 static bool match_interfaces_added_object(const void *a, const void *b)
@@ -1508,6 +1910,8 @@ bool _dbus_object_tree_add_interface(struct _dbus_object_tree *tree,
 	instance->user_data = user_data;
 
 	l_queue_push_tail(object->instances, instance);
+	node_invalidate_introspection(object);
+	node_invalidate_managed(object);
 
 	for (entry = l_queue_get_entries(tree->object_managers); entry;
 			entry = entry->next) {
@@ -1584,6 +1988,9 @@ bool _dbus_object_tree_remove_interface(struct _dbus_object_tree *tree,
 	if (!instance)
 		return false;
 
+	node_invalidate_introspection(node);
+	node_invalidate_managed(node);
+
 	if (!strcmp(interface, L_DBUS_INTERFACE_OBJECT_MANAGER)) {
 		manager = l_queue_remove_if(tree->object_managers,
 						match_object_manager_path,
@@ -1649,43 +2056,65 @@ bool _dbus_object_tree_remove_interface(struct _dbus_object_tree *tree,
 	return true;
 }
 
-static void generate_interface_instance(void *data, void *user)
-{
-	struct interface_instance *instance = data;
-	struct l_string *buf = user;
-
-	_dbus_interface_introspection(instance->interface, buf);
-}
-
-void _dbus_object_tree_introspect(struct _dbus_object_tree *tree,
-					const char *path, struct l_string *buf)
+static const char *node_introspection(struct object_node *node)
 {
-	struct object_node *node;
+	struct l_string *buf;
+	const struct l_queue_entry *entry;
+	const struct interface_instance *instance;
 	struct child_node *child;
 
-	node = l_hashmap_lookup(tree->objects, path);
-	if (!node)
-		node = _dbus_object_tree_lookup(tree, path);
+	if (node->introspection)
+		return node->introspection;
+
+	buf = l_string_new(1024);
 
 	l_string_append(buf, XML_HEAD);
 	l_string_append(buf, "<node>\n");
+	l_string_append(buf, static_introspectable);
 
-	if (node) {
-		l_string_append(buf, static_introspectable);
-		l_queue_foreach(node->instances,
-					generate_interface_instance, buf);
-
-		for (child = node->children; child; child = child->next)
-			l_string_append_printf(buf, "\t<node name=\"%s\"/>\n",
-						child->subpath);
+	for (entry = l_queue_get_entries(node->instances); entry;
+			entry = entry->next) {
+		instance = entry->data;
+		l_string_append(buf, interface_introspection(
+							instance->interface));
 	}
 
+	for (child = node->children; child; child = child->next)
+		l_string_append_printf(buf, "\t<node name=\"%s\"/>\n",
+					child->subpath);
+
 	l_string_append(buf, "</node>\n");
+
+	node->introspection = l_string_unwrap(buf);
+
+	return node->introspection;
 }
 
-bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
-					struct l_dbus *dbus,
-					struct l_dbus_message *message)
+static const char *tree_introspection(struct _dbus_object_tree *tree,
+					const char *path)
+{
+	struct object_node *node;
+
+	node = l_hashmap_lookup(tree->objects, path);
+	if (!node)
+		node = _dbus_object_tree_lookup(tree, path);
+
+	if (!node)
+		return XML_HEAD "<node>\n</node>\n";
+
+	return node_introspection(node);
+}
+
+void _dbus_object_tree_introspect(struct _dbus_object_tree *tree,
+					const char *path, struct l_string *buf)
+{
+	l_string_append(buf, tree_introspection(tree, path));
+}
+
+static bool object_tree_dispatch(struct _dbus_object_tree *tree,
+					struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					bool queued)
 {
 	const char *path;
 	const char *interface;
@@ -1696,6 +2125,10 @@ bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
 	struct interface_instance *instance;
 	struct _dbus_method *method;
 	struct l_dbus_message *reply;
+	struct _dbus_stats *stats;
+	bool *outer_destroyed;
+	bool destroyed = false;
+	uint64_t start;
 
 	path = l_dbus_message_get_path(message);
 	interface = l_dbus_message_get_interface(message);
@@ -1708,19 +2141,11 @@ bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
 	if (!strcmp(interface, "org.freedesktop.DBus.Introspectable") &&
 			!strcmp(member, "Introspect") &&
 			!strcmp(msg_sig, "")) {
-		struct l_string *buf;
-		char *xml;
-
-		buf = l_string_new(0);
-		_dbus_object_tree_introspect(tree, path, buf);
-		xml = l_string_unwrap(buf);
-
 		reply = l_dbus_message_new_method_return(message);
-		l_dbus_message_set_arguments(reply, "s", xml);
+		l_dbus_message_set_arguments(reply, "s",
+						tree_introspection(tree, path));
 		l_dbus_send(dbus, reply);
 
-		l_free(xml);
-
 		return true;
 	}
 
@@ -1728,8 +2153,7 @@ bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
 	if (!node)
 		return false;
 
-	instance = l_queue_find(node->instances,
-				match_interface_instance, (char *) interface);
+	instance = object_find_instance(tree, node, interface);
 	if (!instance)
 		return false;
 
@@ -1742,13 +2166,186 @@ bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
 	if (strcmp(msg_sig, sig))
 		return false;
 
+	/*
+	 * Calls beyond the limit of the interface wait, in order, for one
+	 * of those in progress to get its reply.  New calls also line up
+	 * behind any already waiting.
+	 */
+	if (instance->interface->max_pending && !queued &&
+			(instance->interface->num_pending >=
+				instance->interface->max_pending ||
+			!l_queue_isempty(instance->interface->queued_calls))) {
+		if (!instance->interface->queued_calls)
+			instance->interface->queued_calls = l_queue_new();
+
+		l_queue_push_tail(instance->interface->queued_calls,
+					l_dbus_message_ref(message));
+		tree->queued_calls_dbus = dbus;
+
+		return true;
+	}
+
+	/* Time the handler itself, calls that had to wait included */
+	stats = dbus ? _dbus_get_stats(dbus) : NULL;
+	start = stats ? l_time_now() : 0;
+
+	/* The method handler may destroy the connection */
+	outer_destroyed = tree->dispatch_destroyed;
+	tree->dispatch_destroyed = &destroyed;
+
 	reply = method->cb(dbus, message, instance->user_data);
+
+	if (destroyed) {
+		if (outer_destroyed)
+			*outer_destroyed = true;
+
+		l_dbus_message_unref(reply);
+		return true;
+	}
+
+	tree->dispatch_destroyed = outer_destroyed;
+
+	/* Statistics may have been turned off by the handler */
+	if (start && (stats = _dbus_get_stats(dbus)))
+		_dbus_stats_record(stats, L_DBUS_STATS_DISPATCH_TIME,
+					interface, member,
+					l_time_diff(start, l_time_now()));
+
 	if (reply)
 		l_dbus_send(dbus, reply);
 
 	return true;
 }
 
+bool _dbus_object_tree_dispatch(struct _dbus_object_tree *tree,
+					struct l_dbus *dbus,
+					struct l_dbus_message *message)
+{
+	return object_tree_dispatch(tree, dbus, message, false);
+}
+
+static bool interface_can_dispatch(const struct l_dbus_interface *interface)
+{
+	if (l_queue_isempty(interface->queued_calls))
+		return false;
+
+	return !interface->max_pending ||
+			interface->num_pending < interface->max_pending;
+}
+
+static void queued_calls_work(struct l_idle *idle, void *user_data)
+{
+	struct _dbus_object_tree *tree = user_data;
+	struct l_dbus *dbus = tree->queued_calls_dbus;
+	struct l_dbus_interface *interface;
+	struct l_dbus_message *message;
+	struct l_dbus_message *error;
+	bool destroyed = false;
+
+	l_idle_remove(tree->queued_calls_work);
+	tree->queued_calls_work = NULL;
+
+	/* The method handlers may destroy the connection */
+	tree->dispatch_destroyed = &destroyed;
+
+	while ((interface = l_queue_pop_head(tree->ready_interfaces))) {
+		if (!interface_can_dispatch(interface))
+			continue;
+
+		message = l_queue_pop_head(interface->queued_calls);
+
+		/* Take turns with the other interfaces that have room */
+		if (!l_queue_isempty(interface->queued_calls))
+			l_queue_push_tail(tree->ready_interfaces, interface);
+
+		/* The object may have gone while the call was waiting */
+		if (!object_tree_dispatch(tree, dbus, message, true) &&
+				!destroyed) {
+			error = l_dbus_message_new_error(message,
+					"org.freedesktop.DBus.Error.NotFound",
+					"No matching method found");
+			l_dbus_send(dbus, error);
+		}
+
+		l_dbus_message_unref(message);
+
+		if (destroyed)
+			return;
+	}
+
+	tree->dispatch_destroyed = NULL;
+}
+
+static bool match_interface_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static void interface_call_done(struct _dbus_object_tree *tree,
+					struct l_dbus_interface *interface)
+{
+	interface->num_pending -= 1;
+
+	if (!interface_can_dispatch(interface))
+		return;
+
+	if (!l_queue_find(tree->ready_interfaces, match_interface_ptr,
+								interface))
+		l_queue_push_tail(tree->ready_interfaces, interface);
+
+	if (!tree->queued_calls_work)
+		tree->queued_calls_work = l_idle_create(queued_calls_work,
+								tree, NULL);
+}
+
+/**
+ * l_dbus_interface_set_emit_interval:
+ * @interface: interface being set up
+ * @msec: minimum interval between PropertiesChanged signals, 0 for none
+ *
+ * Changes to the properties of an object implementing @interface are
+ * signalled at most once every @msec milliseconds, changes made in
+ * between are merged into the next PropertiesChanged.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_interface_set_emit_interval(
+					struct l_dbus_interface *interface,
+					unsigned int msec)
+{
+	if (unlikely(!interface))
+		return false;
+
+	interface->emit_interval = msec;
+
+	return true;
+}
+
+/**
+ * l_dbus_interface_set_cache_properties:
+ * @interface: interface being set up
+ * @cache: whether the properties of @interface may be cached
+ *
+ * The GetManagedObjects entry of an object whose interfaces all have
+ * cacheable properties is serialized once and reused until one of its
+ * properties is signalled as changed or its interfaces change.  Only
+ * enable this when every property change is signalled with
+ * @l_dbus_property_changed and the getters don't depend on the caller.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_interface_set_cache_properties(
+					struct l_dbus_interface *interface,
+					bool cache)
+{
+	if (unlikely(!interface))
+		return false;
+
+	interface->cache_properties = cache;
+
+	return true;
+}
+
 LIB_EXPORT bool l_dbus_property_changed(struct l_dbus *dbus, const char *path,
 					const char *interface,
 					const char *property)
@@ -1757,6 +2354,141 @@ LIB_EXPORT bool l_dbus_property_changed(struct l_dbus *dbus, const char *path,
 							property);
 }
 
+/**
+ * l_dbus_interface_set_max_pending_replies:
+ * @interface: interface being set up
+ * @max: maximum number of calls in progress, or 0 for no limit
+ *
+ * Limits the calls to methods of @interface whose replies have been
+ * deferred with @l_dbus_method_defer and not sent yet.  Further calls
+ * are queued and their methods called, in order, as replies are sent.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_interface_set_max_pending_replies(
+					struct l_dbus_interface *interface,
+					unsigned int max)
+{
+	if (unlikely(!interface))
+		return false;
+
+	interface->max_pending = max;
+
+	return true;
+}
+
+/**
+ * l_dbus_method_defer:
+ * @dbus: D-Bus connection the method call came in on
+ * @message: the method call
+ *
+ * Lets a method handler finish before it has a reply, for example
+ * while the work is carried out by another process.  The handler then
+ * returns NULL and the reply is sent later, from any main loop callback,
+ * with @l_dbus_pending_reply_send.  Such methods should be registered
+ * with L_DBUS_METHOD_FLAG_ASYNC.
+ *
+ * Returns: a pending reply, which must eventually be completed with
+ *          @l_dbus_pending_reply_send, or NULL on error or if @message
+ *          has already been deferred
+ **/
+LIB_EXPORT struct l_dbus_pending_reply *l_dbus_method_defer(
+					struct l_dbus *dbus,
+					struct l_dbus_message *message)
+{
+	struct _dbus_object_tree *tree;
+	struct l_dbus_pending_reply *pending;
+	const char *interface;
+
+	if (unlikely(!dbus || !message))
+		return NULL;
+
+	if (_dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return NULL;
+
+	/* Each call gets one reply, and counts against the limit once */
+	if (!_dbus_message_set_deferred(message))
+		return NULL;
+
+	tree = _dbus_get_tree(dbus);
+
+	pending = l_new(struct l_dbus_pending_reply, 1);
+	pending->dbus = dbus;
+	pending->tree = tree;
+	pending->message = l_dbus_message_ref(message);
+
+	interface = l_dbus_message_get_interface(message);
+	if (interface)
+		pending->interface = l_hashmap_lookup(tree->interfaces,
+								interface);
+
+	if (pending->interface)
+		pending->interface->num_pending += 1;
+
+	pending->next = tree->pending_replies;
+	if (pending->next)
+		pending->next->prev = pending;
+
+	tree->pending_replies = pending;
+
+	return pending;
+}
+
+LIB_EXPORT struct l_dbus_message *l_dbus_pending_reply_get_message(
+					struct l_dbus_pending_reply *pending)
+{
+	if (unlikely(!pending))
+		return NULL;
+
+	return pending->message;
+}
+
+/**
+ * l_dbus_pending_reply_send:
+ * @pending: pending reply returned by @l_dbus_method_defer
+ * @reply: method return or error for the call, or NULL to send none
+ *
+ * Sends @reply, taking ownership of it, and frees @pending.  If the
+ * connection has gone in the meantime @reply is just dropped.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_pending_reply_send(struct l_dbus_pending_reply *pending,
+						struct l_dbus_message *reply)
+{
+	struct _dbus_object_tree *tree;
+
+	if (unlikely(!pending))
+		return false;
+
+	tree = pending->tree;
+
+	if (!tree) {
+		l_dbus_message_unref(reply);
+		goto done;
+	}
+
+	if (pending->prev)
+		pending->prev->next = pending->next;
+	else
+		tree->pending_replies = pending->next;
+
+	if (pending->next)
+		pending->next->prev = pending->prev;
+
+	if (reply)
+		l_dbus_send(pending->dbus, reply);
+
+	if (pending->interface)
+		interface_call_done(tree, pending->interface);
+
+done:
+	l_dbus_message_unref(pending->message);
+	l_free(pending);
+
+	return true;
+}
+
 static struct l_dbus_message *properties_get(struct l_dbus *dbus,
 						struct l_dbus_message *message,
 						void *user_data)
@@ -1780,9 +2512,7 @@ static struct l_dbus_message *properties_get(struct l_dbus *dbus,
 					l_dbus_message_get_path(message));
 	/* If we got here the object must exist */
 
-	instance = l_queue_find(object->instances,
-				match_interface_instance,
-				(char *) interface_name);
+	instance = object_find_instance(tree, object, interface_name);
 	if (!instance)
 		return l_dbus_message_new_error(message,
 						"org.freedesktop.DBus.Error."
@@ -1872,9 +2602,7 @@ static struct l_dbus_message *properties_set(struct l_dbus *dbus,
 					l_dbus_message_get_path(message));
 	/* If we got here the object must exist */
 
-	instance = l_queue_find(object->instances,
-				match_interface_instance,
-				(char *) interface_name);
+	instance = object_find_instance(tree, object, interface_name);
 	if (!instance)
 		return l_dbus_message_new_error(message,
 						"org.freedesktop.DBus.Error."
@@ -1913,9 +2641,7 @@ static struct l_dbus_message *properties_get_all(struct l_dbus *dbus,
 					l_dbus_message_get_path(message));
 	/* If we got here the object must exist */
 
-	instance = l_queue_find(object->instances,
-				match_interface_instance,
-				(char *) interface_name);
+	instance = object_find_instance(tree, object, interface_name);
 	if (!instance)
 		return l_dbus_message_new_error(message,
 						"org.freedesktop.DBus.Error."
@@ -1960,21 +2686,66 @@ static void properties_setup_func(struct l_dbus_interface *interface)
 				"invalidated_properties");
 }
 
-static bool collect_objects(struct l_dbus *dbus, struct l_dbus_message *message,
+/* Objects serialized per idle once GetManagedObjects has to be split up */
+#define GET_OBJECTS_BATCH	64
+
+struct get_objects_job {
+	struct _dbus_object_tree *tree;
+	struct l_dbus *dbus;
+	struct l_dbus_message *message;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	struct l_queue *paths;
+	struct l_idle *work;
+	char *path;
+	bool running : 1;
+};
+
+static void collect_object_paths_walk(const struct object_node *node,
+					struct walk_path *walk,
+					struct l_queue *paths)
+{
+	const struct child_node *child;
+
+	if (node->instances)
+		l_queue_push_tail(paths, l_strdup(walk_path_get(walk)));
+
+	for (child = node->children; child; child = child->next) {
+		size_t len = walk_path_push(walk, child->subpath);
+
+		collect_object_paths_walk(child->node, walk, paths);
+		walk_path_pop(walk, len);
+	}
+}
+
+static void collect_object_paths(const struct object_node *node,
+					const char *path, struct l_queue *paths)
+{
+	struct walk_path walk;
+
+	walk_path_init(&walk, path);
+	collect_object_paths_walk(node, &walk, paths);
+	l_free(walk.str);
+}
+
+static bool append_object(struct l_dbus *dbus, struct l_dbus_message *message,
 				struct l_dbus_message_builder *builder,
-				const struct object_node *node,
-				const char *path)
+				struct object_node *node, const char *path)
 {
 	const struct l_queue_entry *entry;
-	const struct child_node *child;
-	char *child_path;
 	const struct interface_instance *instance;
-	bool r;
+	bool cacheable;
+	size_t start;
 
-	if (!node->instances)
-		goto recurse;
+	if (node->managed_blob &&
+			_dbus_message_builder_append_raw(builder,
+							node->managed_blob,
+							node->managed_blob_len))
+		return true;
 
 	l_dbus_message_builder_enter_dict(builder, "oa{sa{sv}}");
+	cacheable = _dbus_message_builder_get_offset(builder, &start);
+
 	l_dbus_message_builder_append_basic(builder, 'o', path);
 	l_dbus_message_builder_enter_array(builder, "{sa{sv}}");
 
@@ -1982,6 +2753,11 @@ static bool collect_objects(struct l_dbus *dbus, struct l_dbus_message *message,
 			entry = entry->next) {
 		instance = entry->data;
 
+		if (!instance->interface->cache_properties &&
+				!l_queue_isempty(
+					instance->interface->properties))
+			cacheable = false;
+
 		l_dbus_message_builder_enter_dict(builder, "sa{sv}");
 		l_dbus_message_builder_append_basic(builder, 's',
 						instance->interface->name);
@@ -1997,69 +2773,204 @@ static bool collect_objects(struct l_dbus *dbus, struct l_dbus_message *message,
 	l_dbus_message_builder_leave_array(builder);
 	l_dbus_message_builder_leave_dict(builder);
 
-recurse:
-	if (!strcmp(path, "/"))
-		path = "";
-
-	for (child = node->children; child; child = child->next) {
-		child_path = l_strdup_printf("%s/%s", path, child->subpath);
+	if (cacheable)
+		node->managed_blob = _dbus_message_builder_copy(builder, start,
+						&node->managed_blob_len);
 
-		r = collect_objects(dbus, message, builder,
-					child->node, child_path);
+	return true;
+}
 
-		l_free(child_path);
+static void get_objects_job_free(void *data)
+{
+	struct get_objects_job *job = data;
 
-		if (!r)
-			return false;
-	}
+	if (job->work)
+		l_idle_remove(job->work);
 
-	return true;
+	l_dbus_message_builder_destroy(job->builder);
+	l_dbus_message_unref(job->reply);
+	l_dbus_message_unref(job->message);
+	l_queue_destroy(job->paths, l_free);
+	l_free(job->path);
+	l_free(job);
 }
 
-struct l_dbus_message *_dbus_object_tree_get_objects(
+static struct get_objects_job *get_objects_job_new(
 						struct _dbus_object_tree *tree,
 						struct l_dbus *dbus,
 						const char *path,
 						struct l_dbus_message *message)
 {
+	struct get_objects_job *job;
 	const struct object_node *node;
-	struct l_dbus_message *reply;
-	struct l_dbus_message_builder *builder;
+	const struct object_manager *manager;
+
+	job = l_new(struct get_objects_job, 1);
+	job->tree = tree;
+	job->dbus = dbus;
+	job->message = l_dbus_message_ref(message);
+	job->reply = l_dbus_message_new_method_return(message);
+	job->builder = l_dbus_message_builder_new(job->reply);
+	job->paths = l_queue_new();
+	job->path = l_strdup(path);
+
+	/* Start out with room for what the last reply needed */
+	manager = l_queue_find(tree->object_managers,
+				match_object_manager_path, path);
+	if (manager)
+		_dbus_message_builder_reserve(job->builder,
+						manager->reply_size);
+
+	l_dbus_message_builder_enter_array(job->builder, "{oa{sa{sv}}}");
 
+	/*
+	 * Only the paths are collected up front, the tree may change between
+	 * batches so every object is looked up again when its turn comes.
+	 */
 	node = l_hashmap_lookup(tree->objects, path);
+	if (node)
+		collect_object_paths(node, path, job->paths);
 
-	reply = l_dbus_message_new_method_return(message);
-	builder = l_dbus_message_builder_new(reply);
+	return job;
+}
 
-	l_dbus_message_builder_enter_array(builder, "{oa{sa{sv}}}");
+static bool get_objects_job_run(struct get_objects_job *job,
+					unsigned int max)
+{
+	struct object_node *node;
+	char *path;
+	bool success = true;
 
-	if (!collect_objects(dbus, message, builder, node, path)) {
-		l_dbus_message_builder_destroy(builder);
-		l_dbus_message_unref(reply);
+	while (success && max-- && (path = l_queue_pop_head(job->paths))) {
+		node = l_hashmap_lookup(job->tree->objects, path);
 
-		return l_dbus_message_new_error(message,
+		if (node)
+			success = append_object(job->dbus, job->message,
+						job->builder, node, path);
+
+		l_free(path);
+	}
+
+	return success;
+}
+
+static struct l_dbus_message *get_objects_job_finish(
+						struct get_objects_job *job,
+						bool success)
+{
+	struct l_dbus_message *reply;
+	struct object_manager *manager;
+
+	if (success) {
+		l_dbus_message_builder_leave_array(job->builder);
+		l_dbus_message_builder_finalize(job->builder);
+
+		reply = l_dbus_message_ref(job->reply);
+
+		manager = l_queue_find(job->tree->object_managers,
+					match_object_manager_path, job->path);
+		if (manager)
+			_dbus_message_get_body(reply, &manager->reply_size);
+	} else
+		reply = l_dbus_message_new_error(job->message,
 						"org.freedesktop.DBus.Error."
 						"Failed",
 						"Getting property values "
 						"failed");
-	}
-
-	l_dbus_message_builder_leave_array(builder);
 
-	l_dbus_message_builder_finalize(builder);
-	l_dbus_message_builder_destroy(builder);
+	get_objects_job_free(job);
 
 	return reply;
 }
 
+struct l_dbus_message *_dbus_object_tree_get_objects(
+						struct _dbus_object_tree *tree,
+						struct l_dbus *dbus,
+						const char *path,
+						struct l_dbus_message *message)
+{
+	struct get_objects_job *job;
+
+	job = get_objects_job_new(tree, dbus, path, message);
+
+	return get_objects_job_finish(job, get_objects_job_run(job, -1U));
+}
+
+static void get_objects_work(struct l_idle *idle, void *user_data)
+{
+	struct get_objects_job *job = user_data;
+	struct l_dbus *dbus = job->dbus;
+	struct l_dbus_message *reply;
+	bool success;
+
+	/* A getter sending on a path in the subtree must not finish us */
+	job->running = true;
+	success = get_objects_job_run(job, GET_OBJECTS_BATCH);
+	job->running = false;
+
+	if (success && !l_queue_isempty(job->paths))
+		return;
+
+	l_queue_remove(job->tree->get_objects_jobs, job);
+	reply = get_objects_job_finish(job, success);
+	l_dbus_send(dbus, reply);
+
+	/* Let out the signals held back while the reply was being built */
+	schedule_emit_signals(dbus);
+}
+
+static bool match_get_objects_job_subtree(const void *a, const void *b)
+{
+	const struct get_objects_job *job = a;
+	const char *path = b;
+	size_t path_len = strlen(job->path);
+
+	if (job->running)
+		return false;
+
+	return !strncmp(path, job->path, path_len) &&
+		(path[path_len] == '\0' || path[path_len] == '/' ||
+		 path_len == 1);
+}
+
+/* Finish the replies whose subtree @path is in */
+static void get_objects_jobs_complete(struct l_dbus *dbus, const char *path)
+{
+	struct _dbus_object_tree *tree = _dbus_get_tree(dbus);
+	struct get_objects_job *job;
+	struct l_dbus_message *reply;
+
+	while ((job = l_queue_remove_if(tree->get_objects_jobs,
+					match_get_objects_job_subtree,
+					path))) {
+		reply = get_objects_job_finish(job,
+					get_objects_job_run(job, -1U));
+		l_dbus_send(dbus, reply);
+	}
+}
+
 static struct l_dbus_message *get_managed_objects(struct l_dbus *dbus,
 						struct l_dbus_message *message,
 						void *user_data)
 {
 	struct _dbus_object_tree *tree = _dbus_get_tree(dbus);
 	const char *path = l_dbus_message_get_path(message);
+	struct get_objects_job *job;
+
+	job = get_objects_job_new(tree, dbus, path, message);
+
+	if (l_queue_length(job->paths) <= GET_OBJECTS_BATCH)
+		return get_objects_job_finish(job,
+					get_objects_job_run(job, -1U));
 
-	return _dbus_object_tree_get_objects(tree, dbus, path, message);
+	/*
+	 * Large trees are serialized a batch of objects per idle so that
+	 * the property getters don't block the main loop for the whole tree.
+	 */
+	job->work = l_idle_create(get_objects_work, job, NULL);
+	l_queue_push_tail(tree->get_objects_jobs, job);
+
+	return NULL;
 }
 
 static void object_manager_setup_func(struct l_dbus_interface *interface)
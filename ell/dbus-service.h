@@ -33,6 +33,7 @@ extern "C" {
 struct l_dbus;
 struct l_dbus_interface;
 struct l_dbus_message;
+struct l_dbus_pending_reply;
 
 enum l_dbus_method_flag {
 	L_DBUS_METHOD_FLAG_DEPRECATED =	1,
@@ -83,9 +84,24 @@ bool l_dbus_interface_property(struct l_dbus_interface *interface,
 				l_dbus_property_get_cb_t getter,
 				l_dbus_property_set_cb_t setter);
 
+bool l_dbus_interface_set_emit_interval(struct l_dbus_interface *interface,
+						unsigned int msec);
+bool l_dbus_interface_set_cache_properties(struct l_dbus_interface *interface,
+						bool cache);
+bool l_dbus_interface_set_max_pending_replies(
+					struct l_dbus_interface *interface,
+					unsigned int max);
+
 bool l_dbus_property_changed(struct l_dbus *dbus, const char *path,
 				const char *interface, const char *property);
 
+struct l_dbus_pending_reply *l_dbus_method_defer(struct l_dbus *dbus,
+					struct l_dbus_message *message);
+struct l_dbus_message *l_dbus_pending_reply_get_message(
+					struct l_dbus_pending_reply *pending);
+bool l_dbus_pending_reply_send(struct l_dbus_pending_reply *pending,
+					struct l_dbus_message *reply);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,380 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "hashmap.h"
+#include "dbus.h"
+#include "dbus-service.h"
+#include "dbus-private.h"
+#include "private.h"
+
+/*
+ * Bucket n of a histogram counts the samples that took from 2^n up to
+ * 2^(n + 1) microseconds, bucket 0 also takes anything faster and the
+ * last one anything slower.
+ */
+struct stats_histogram {
+	enum l_dbus_stats_histogram type;
+	char *interface;
+	char *member;
+	uint64_t buckets[L_DBUS_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct _dbus_stats {
+	struct l_dbus_stats counters;
+	struct l_hashmap *histograms;
+};
+
+struct histogram_foreach_data {
+	l_dbus_stats_histogram_func_t function;
+	void *user_data;
+};
+
+static const char *histogram_type_names[] = {
+	[L_DBUS_STATS_CALL_LATENCY] = "call",
+	[L_DBUS_STATS_DISPATCH_TIME] = "dispatch",
+};
+
+static void histogram_free(void *data)
+{
+	struct stats_histogram *histogram = data;
+
+	l_free(histogram->interface);
+	l_free(histogram->member);
+	l_free(histogram);
+}
+
+struct _dbus_stats *_dbus_stats_new(void)
+{
+	struct _dbus_stats *stats = l_new(struct _dbus_stats, 1);
+
+	stats->histograms = l_hashmap_string_new();
+
+	return stats;
+}
+
+void _dbus_stats_free(struct _dbus_stats *stats)
+{
+	if (!stats)
+		return;
+
+	l_hashmap_destroy(stats->histograms, histogram_free);
+	l_free(stats);
+}
+
+void _dbus_stats_reset(struct _dbus_stats *stats)
+{
+	/* The current queue lengths are a state, not a statistic */
+	uint32_t send_queue_length = stats->counters.send_queue_length;
+	uint32_t pending_calls = stats->counters.pending_calls;
+
+	memset(&stats->counters, 0, sizeof(stats->counters));
+
+	stats->counters.send_queue_length = send_queue_length;
+	stats->counters.send_queue_max = send_queue_length;
+	stats->counters.pending_calls = pending_calls;
+	stats->counters.pending_calls_max = pending_calls;
+
+	l_hashmap_destroy(stats->histograms, histogram_free);
+	stats->histograms = l_hashmap_string_new();
+}
+
+void _dbus_stats_message_sent(struct _dbus_stats *stats,
+				struct l_dbus_message *message, size_t size)
+{
+	stats->counters.messages_sent += 1;
+	stats->counters.bytes_sent += size;
+
+	switch (_dbus_message_get_type(message)) {
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		stats->counters.calls_sent += 1;
+		break;
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		stats->counters.signals_sent += 1;
+		break;
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+	case DBUS_MESSAGE_TYPE_ERROR:
+		break;
+	}
+}
+
+void _dbus_stats_message_received(struct _dbus_stats *stats,
+				struct l_dbus_message *message, size_t size)
+{
+	stats->counters.messages_received += 1;
+	stats->counters.bytes_received += size;
+
+	switch (_dbus_message_get_type(message)) {
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		stats->counters.calls_received += 1;
+		break;
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		stats->counters.replies_received += 1;
+		break;
+	case DBUS_MESSAGE_TYPE_ERROR:
+		stats->counters.errors_received += 1;
+		break;
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		stats->counters.signals_received += 1;
+		break;
+	}
+}
+
+void _dbus_stats_call_timed_out(struct _dbus_stats *stats)
+{
+	stats->counters.calls_timed_out += 1;
+}
+
+void _dbus_stats_send_queue(struct _dbus_stats *stats, unsigned int length)
+{
+	stats->counters.send_queue_length = length;
+
+	if (length > stats->counters.send_queue_max)
+		stats->counters.send_queue_max = length;
+}
+
+void _dbus_stats_pending_calls(struct _dbus_stats *stats, unsigned int count)
+{
+	stats->counters.pending_calls = count;
+
+	if (count > stats->counters.pending_calls_max)
+		stats->counters.pending_calls_max = count;
+}
+
+static unsigned int histogram_bucket(uint64_t usec)
+{
+	unsigned int bucket;
+
+	if (usec < 2)
+		return 0;
+
+	bucket = 63 - __builtin_clzll(usec);
+	if (bucket >= L_DBUS_STATS_HISTOGRAM_BUCKETS)
+		bucket = L_DBUS_STATS_HISTOGRAM_BUCKETS - 1;
+
+	return bucket;
+}
+
+void _dbus_stats_record(struct _dbus_stats *stats,
+				enum l_dbus_stats_histogram type,
+				const char *interface, const char *member,
+				uint64_t usec)
+{
+	struct stats_histogram *histogram;
+	char key[2 * 256 + 4];
+
+	if (!interface)
+		interface = "";
+
+	if (!member)
+		member = "";
+
+	snprintf(key, sizeof(key), "%c %s %s", '0' + type, interface, member);
+
+	histogram = l_hashmap_lookup(stats->histograms, key);
+	if (!histogram) {
+		histogram = l_new(struct stats_histogram, 1);
+		histogram->type = type;
+		histogram->interface = l_strdup(interface);
+		histogram->member = l_strdup(member);
+
+		l_hashmap_insert(stats->histograms, key, histogram);
+	}
+
+	histogram->buckets[histogram_bucket(usec)] += 1;
+}
+
+void _dbus_stats_get(struct _dbus_stats *stats, struct l_dbus_stats *out)
+{
+	memcpy(out, &stats->counters, sizeof(*out));
+}
+
+static void histogram_foreach(const void *key, void *value, void *user_data)
+{
+	const struct stats_histogram *histogram = value;
+	struct histogram_foreach_data *data = user_data;
+
+	data->function(histogram->type, histogram->interface,
+			histogram->member, histogram->buckets,
+			data->user_data);
+}
+
+void _dbus_stats_foreach_histogram(struct _dbus_stats *stats,
+					l_dbus_stats_histogram_func_t function,
+					void *user_data)
+{
+	struct histogram_foreach_data data = {
+		.function = function,
+		.user_data = user_data,
+	};
+
+	l_hashmap_foreach(stats->histograms, histogram_foreach, &data);
+}
+
+static struct l_dbus_message *stats_not_enabled(struct l_dbus_message *message)
+{
+	return l_dbus_message_new_error(message,
+					"org.freedesktop.DBus.Error.Failed",
+					"Statistics are not enabled");
+}
+
+static void append_counter(struct l_dbus_message_builder *builder,
+				const char *name, char type, const void *value)
+{
+	char signature[2] = { type, '\0' };
+
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', name);
+	l_dbus_message_builder_enter_variant(builder, signature);
+	l_dbus_message_builder_append_basic(builder, type, value);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static struct l_dbus_message *stats_get_stats(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct _dbus_stats *stats = _dbus_get_stats(dbus);
+	const struct l_dbus_stats *counters;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+
+	if (!stats)
+		return stats_not_enabled(message);
+
+	counters = &stats->counters;
+
+	reply = l_dbus_message_new_method_return(message);
+	builder = l_dbus_message_builder_new(reply);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	append_counter(builder, "MessagesSent", 't', &counters->messages_sent);
+	append_counter(builder, "MessagesReceived", 't',
+					&counters->messages_received);
+	append_counter(builder, "BytesSent", 't', &counters->bytes_sent);
+	append_counter(builder, "BytesReceived", 't',
+					&counters->bytes_received);
+	append_counter(builder, "CallsSent", 't', &counters->calls_sent);
+	append_counter(builder, "CallsReceived", 't',
+					&counters->calls_received);
+	append_counter(builder, "RepliesReceived", 't',
+					&counters->replies_received);
+	append_counter(builder, "ErrorsReceived", 't',
+					&counters->errors_received);
+	append_counter(builder, "SignalsSent", 't', &counters->signals_sent);
+	append_counter(builder, "SignalsReceived", 't',
+					&counters->signals_received);
+	append_counter(builder, "CallsTimedOut", 't',
+					&counters->calls_timed_out);
+	append_counter(builder, "SendQueueLength", 'u',
+					&counters->send_queue_length);
+	append_counter(builder, "SendQueueMax", 'u',
+					&counters->send_queue_max);
+	append_counter(builder, "PendingCalls", 'u', &counters->pending_calls);
+	append_counter(builder, "PendingCallsMax", 'u',
+					&counters->pending_calls_max);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static void append_histogram(enum l_dbus_stats_histogram type,
+				const char *interface, const char *member,
+				const uint64_t *buckets, void *user_data)
+{
+	struct l_dbus_message_builder *builder = user_data;
+	unsigned int i;
+
+	l_dbus_message_builder_enter_struct(builder, "sssat");
+	l_dbus_message_builder_append_basic(builder, 's',
+						histogram_type_names[type]);
+	l_dbus_message_builder_append_basic(builder, 's', interface);
+	l_dbus_message_builder_append_basic(builder, 's', member);
+
+	l_dbus_message_builder_enter_array(builder, "t");
+
+	for (i = 0; i < L_DBUS_STATS_HISTOGRAM_BUCKETS; i++)
+		l_dbus_message_builder_append_basic(builder, 't', &buckets[i]);
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_leave_struct(builder);
+}
+
+static struct l_dbus_message *stats_get_histograms(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct _dbus_stats *stats = _dbus_get_stats(dbus);
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+
+	if (!stats)
+		return stats_not_enabled(message);
+
+	reply = l_dbus_message_new_method_return(message);
+	builder = l_dbus_message_builder_new(reply);
+
+	l_dbus_message_builder_enter_array(builder, "(sssat)");
+	_dbus_stats_foreach_histogram(stats, append_histogram, builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static struct l_dbus_message *stats_reset(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct _dbus_stats *stats = _dbus_get_stats(dbus);
+
+	if (!stats)
+		return stats_not_enabled(message);
+
+	_dbus_stats_reset(stats);
+
+	return l_dbus_message_new_method_return(message);
+}
+
+void _dbus_stats_setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "GetStats", 0,
+				stats_get_stats, "a{sv}", "", "stats");
+	l_dbus_interface_method(interface, "GetHistograms", 0,
+				stats_get_histograms, "a(sssat)", "",
+				"histograms");
+	l_dbus_interface_method(interface, "Reset", 0, stats_reset, "", "");
+}
@@ -38,6 +38,7 @@
 #include "dbus-private.h"
 #include "string.h"
 #include "queue.h"
+#include "hashmap.h"
 
 #define DBUS_MAX_INTERFACE_LEN 255
 #define DBUS_MAX_METHOD_LEN 255
@@ -235,33 +236,269 @@ static bool valid_dict_signature(const char *sig)
 	return true;
 }
 
-bool _dbus_valid_signature(const char *sig)
+/* Signatures compiled recently, shared by every message using them */
+#define SIGNATURE_CACHE_MAX	256
+
+static struct l_hashmap *signature_cache;
+
+static unsigned int signature_hash(const void *p)
 {
-	const char *s = sig;
+	const struct _dbus_signature *signature = p;
+	unsigned int hash = 2166136261U;
+	size_t i;
 
-	do {
-		s = validate_next_type(s);
+	for (i = 0; i < signature->len; i++) {
+		hash ^= (uint8_t) signature->str[i];
+		hash *= 16777619U;
+	}
 
-		if (!s)
-			return false;
-	} while (*s);
+	return hash;
+}
 
-	return true;
+static int signature_compare(const void *a, const void *b)
+{
+	const struct _dbus_signature *sa = a;
+	const struct _dbus_signature *sb = b;
+
+	if (sa->len != sb->len)
+		return sa->len < sb->len ? -1 : 1;
+
+	return memcmp(sa->str, sb->str, sa->len);
 }
 
-int _dbus_num_children(const char *sig)
+static bool is_basic_type(char c)
+{
+	return c && strchr(simple_types, c);
+}
+
+/*
+ * Compile the complete type starting at @pos and return the position
+ * past it, or -1 if it is not a valid type.  The grammar is the GVariant
+ * one, which is a superset of the classic one, types only valid in
+ * GVariant clear dbus1_valid.
+ */
+static int compile_type(struct _dbus_signature *signature, unsigned int pos,
+			bool in_array)
 {
-	const char *s = sig;
-	int num_children = 0;
+	struct _dbus_signature_type *type;
+	const struct _dbus_signature_type *member;
+	const char *sig = signature->str;
+	unsigned int size = 0, gvariant_size = 0, gvariant_alignment = 1;
+	unsigned int members = 0;
+	bool fixed = true, gvariant_fixed = true;
+	char close;
+	int end;
+
+	if (pos >= signature->len)
+		return -1;
+
+	type = &signature->types[pos];
+
+	if (is_basic_type(sig[pos]) || sig[pos] == 'v') {
+		type->length = 1;
+		type->alignment = get_alignment(sig[pos]);
+		type->fixed_size = get_basic_size(sig[pos]);
+		type->gvariant_fixed_size = sig[pos] == 'b' ? 1 :
+						type->fixed_size;
+		type->gvariant_alignment = type->gvariant_fixed_size ?:
+						(sig[pos] == 'v' ? 8 : 1);
+		return pos + 1;
+	}
+
+	switch (sig[pos]) {
+	case 'a':
+		end = compile_type(signature, pos + 1, true);
+		if (end < 0)
+			return -1;
+
+		type->length = end - pos;
+		type->alignment = 4;
+		type->gvariant_alignment =
+			signature->types[pos + 1].gvariant_alignment;
+		return end;
+	case '{':
+		/* Dictionary keys can only be basic types */
+		if (pos + 1 >= signature->len || !is_basic_type(sig[pos + 1]))
+			return -1;
+
+		if (!in_array)
+			signature->dbus1_valid = false;
+
+		close = '}';
+		break;
+	case '(':
+		close = ')';
+		break;
+	default:
+		return -1;
+	}
 
-	do {
-		s = validate_next_type(s);
+	end = pos + 1;
 
-		if (!s)
+	while (end < (int) signature->len && sig[end] != close) {
+		member = &signature->types[end];
+		end = compile_type(signature, end, false);
+		if (end < 0)
 			return -1;
 
-		num_children += 1;
-	} while (*s);
+		members += 1;
+
+		if (!member->fixed_size)
+			fixed = false;
+		else
+			size = align_len(size, member->alignment) +
+							member->fixed_size;
+
+		if (!member->gvariant_fixed_size)
+			gvariant_fixed = false;
+		else
+			gvariant_size = align_len(gvariant_size,
+						member->gvariant_alignment) +
+						member->gvariant_fixed_size;
+
+		if (member->gvariant_alignment > gvariant_alignment)
+			gvariant_alignment = member->gvariant_alignment;
+	}
+
+	if (end >= (int) signature->len)
+		return -1;
+
+	if (close == '}' && members != 2)
+		return -1;
+
+	/* The unit type only exists in GVariant */
+	if (!members) {
+		signature->dbus1_valid = false;
+		gvariant_size = 1;
+	}
+
+	type->length = end + 1 - pos;
+	type->alignment = 8;
+	type->fixed_size = fixed ? size : 0;
+	type->gvariant_alignment = gvariant_alignment;
+	type->gvariant_fixed_size = gvariant_fixed ?
+			align_len(gvariant_size, gvariant_alignment) : 0;
+
+	return end + 1;
+}
+
+static struct _dbus_signature *signature_compile(const char *sig, size_t len)
+{
+	struct _dbus_signature *signature;
+	char *str;
+	int pos = 0;
+
+	signature = l_malloc(sizeof(*signature) +
+				len * sizeof(struct _dbus_signature_type) +
+				len + 1);
+	memset(signature->types, 0, len * sizeof(struct _dbus_signature_type));
+
+	str = (char *) (signature->types + len);
+	memcpy(str, sig, len);
+	str[len] = '\0';
+
+	signature->str = str;
+	signature->len = len;
+	signature->ref_count = 1;
+	signature->num_children = 0;
+	signature->dbus1_valid = true;
+
+	while (pos < (int) len) {
+		pos = compile_type(signature, pos, false);
+		if (pos < 0) {
+			l_free(signature);
+			return NULL;
+		}
+
+		signature->num_children += 1;
+	}
+
+	return signature;
+}
+
+/*
+ * Returns the compiled form of the @len characters at @sig, or NULL if
+ * they are not a valid GVariant signature.  The result must be released
+ * with _dbus_signature_put().
+ */
+struct _dbus_signature *_dbus_signature_get(const char *sig, size_t len)
+{
+	struct _dbus_signature key = { .str = sig, .len = len };
+	struct _dbus_signature *signature;
+
+	if (!len || len > 255)
+		return NULL;
+
+	if (signature_cache) {
+		signature = l_hashmap_lookup(signature_cache, &key);
+		if (signature) {
+			signature->ref_count += 1;
+			return signature;
+		}
+	}
+
+	signature = signature_compile(sig, len);
+	if (!signature)
+		return NULL;
+
+	/*
+	 * Peers control the variant signatures so the cache can't grow
+	 * without bounds, start over once it is full.  Compiled signatures
+	 * in use stay valid as they hold their own reference.
+	 */
+	if (signature_cache &&
+			l_hashmap_size(signature_cache) >= SIGNATURE_CACHE_MAX) {
+		l_hashmap_destroy(signature_cache, (l_hashmap_destroy_func_t)
+							_dbus_signature_put);
+		signature_cache = NULL;
+	}
+
+	if (!signature_cache) {
+		signature_cache = l_hashmap_new();
+		l_hashmap_set_hash_function(signature_cache, signature_hash);
+		l_hashmap_set_compare_function(signature_cache,
+							signature_compare);
+	}
+
+	l_hashmap_insert(signature_cache, signature, signature);
+	signature->ref_count += 1;
+
+	return signature;
+}
+
+void _dbus_signature_put(struct _dbus_signature *signature)
+{
+	if (!signature)
+		return;
+
+	if (--signature->ref_count)
+		return;
+
+	l_free(signature);
+}
+
+bool _dbus_valid_signature(const char *sig)
+{
+	struct _dbus_signature *signature;
+	bool valid;
+
+	signature = _dbus_signature_get(sig, strlen(sig));
+	valid = signature && signature->dbus1_valid;
+	_dbus_signature_put(signature);
+
+	return valid;
+}
+
+int _dbus_num_children(const char *sig)
+{
+	struct _dbus_signature *signature;
+	int num_children = -1;
+
+	signature = _dbus_signature_get(sig, strlen(sig));
+	if (signature && signature->dbus1_valid)
+		num_children = signature->num_children;
+
+	_dbus_signature_put(signature);
 
 	return num_children;
 }
@@ -432,12 +669,10 @@ bool _dbus1_header_is_valid(void *data, size_t size)
 }
 
 static inline void dbus1_iter_init_internal(struct l_dbus_message_iter *iter,
-						struct l_dbus_message *message,
-						enum dbus_container_type type,
-						const char *sig_start,
-						const char *sig_end,
-						const void *data, size_t len,
-						size_t pos)
+				struct l_dbus_message *message,
+				enum dbus_container_type type,
+				const char *sig_start, const char *sig_end,
+				const void *data, size_t len, size_t pos)
 {
 	size_t sig_len;
 
@@ -457,135 +692,141 @@ static inline void dbus1_iter_init_internal(struct l_dbus_message_iter *iter,
 	iter->container_type = type;
 }
 
+/*
+ * Returns the compiled type at the current position of @iter.  The
+ * message knows where the signatures of its iterators start within the
+ * compiled signatures it holds.  Iterators set up without a message have
+ * nothing to point into, for those the signature is looked up and
+ * returned in @lookup, to be released by the caller once done with the
+ * type.
+ */
+const struct _dbus_signature_type *_dbus_iter_get_type(
+				const struct l_dbus_message_iter *iter,
+				struct _dbus_signature **lookup)
+{
+	const struct _dbus_signature_type *types;
+
+	*lookup = NULL;
+
+	if (iter->sig_pos >= iter->sig_len)
+		return NULL;
+
+	types = _dbus_message_signature_types(iter->message, iter->sig_start,
+							iter->sig_len);
+
+	if (!types) {
+		*lookup = _dbus_signature_get(iter->sig_start, iter->sig_len);
+		if (!*lookup)
+			return NULL;
+
+		types = (*lookup)->types;
+	}
+
+	return &types[iter->sig_pos];
+}
+
 void _dbus1_iter_init(struct l_dbus_message_iter *iter,
 			struct l_dbus_message *message,
 			const char *sig_start, const char *sig_end,
 			const void *data, size_t len)
 {
+	size_t sig_len = sig_end ? (size_t) (sig_end - sig_start) :
+							strlen(sig_start);
+
+	_dbus_message_signature_get(message, sig_start, sig_len);
+
 	dbus1_iter_init_internal(iter, message, DBUS_CONTAINER_TYPE_STRUCT,
 					sig_start, sig_end, data, len, 0);
 }
 
-static const char *calc_len_next_item(const char *signature, const void *data,
-					size_t data_pos, size_t data_len,
-					size_t *out_len)
+static bool calc_len_next_item(const char *signature,
+				const struct _dbus_signature_type *type,
+				const void *data, size_t data_pos,
+				size_t data_len, size_t *out_len)
 {
-	unsigned int alignment;
+	struct _dbus_signature *var_sig;
 	size_t pos;
 	size_t len;
-	const char *sig_end;
-	const char *var_sig;
-
-	alignment = get_alignment(*signature);
-	if (alignment == 0)
-		return NULL;
+	unsigned int i;
+	bool valid;
 
-	pos = align_len(data_pos, alignment);
+	pos = align_len(data_pos, type->alignment);
 	if (pos > data_len)
-		return NULL;
+		return false;
+
+	/* Basic types and structs made up of them need no parsing */
+	if (type->fixed_size) {
+		pos += type->fixed_size;
+		goto done;
+	}
 
 	switch (*signature) {
 	case 'o':
 	case 's':
 		if (pos + 5 > data_len)
-			return NULL;
+			return false;
 
 		pos += l_get_u32(data + pos) + 5;
 		break;
 	case 'g':
 		if (pos + 2 > data_len)
-			return NULL;
+			return false;
 
 		pos += l_get_u8(data + pos) + 2;
 		break;
-	case 'y':
-		pos += 1;
-		break;
-	case 'n':
-	case 'q':
-		pos += 2;
-		break;
-	case 'b':
-	case 'i':
-	case 'u':
-	case 'h':
-		pos += 4;
-		break;
-	case 'x':
-	case 't':
-	case 'd':
-		pos += 8;
-		break;
 	case 'a':
 		if (pos + 4 > data_len)
-			return NULL;
+			return false;
 
 		len = l_get_u32(data + pos);
 		pos += 4;
 
-		alignment = get_alignment(signature[1]);
-		pos = align_len(pos, alignment);
+		pos = align_len(pos, type[1].alignment);
 		pos += len;
-
-		sig_end = _dbus_signature_end(signature) + 1;
-		goto done;
+		break;
 	case '(':
-		sig_end = signature + 1;
-
-		while (*sig_end != ')') {
-			sig_end = calc_len_next_item(sig_end, data, pos,
-							data_len, &len);
-
-			if (!sig_end)
-				return NULL;
+	case '{':
+		for (i = 1; i + 1 < type->length; i += type[i].length) {
+			if (!calc_len_next_item(signature + i, type + i, data,
+						pos, data_len, &len))
+				return false;
 
 			pos += len;
 		}
 
-		sig_end += 1;
-		goto done;
-	case '{':
-		sig_end = calc_len_next_item(signature + 1, data, pos,
-						data_len, &len);
-
-		if (!sig_end)
-			return NULL;
-
-		pos += len;
-
-		sig_end = calc_len_next_item(sig_end, data, pos,
-						data_len, &len);
+		break;
+	case 'v':
+		if (pos + 2 > data_len)
+			return false;
 
-		if (!sig_end)
-			return NULL;
+		len = l_get_u8(data + pos);
+		if (pos + len + 2 > data_len)
+			return false;
 
-		pos += len;
-		sig_end += 1;
-		goto done;
-	case 'v':
-		if (!calc_len_next_item("g", data, pos, data_len, &len))
-			return NULL;
+		var_sig = _dbus_signature_get(data + pos + 1, len);
+		pos += len + 2;
 
-		var_sig = data + pos + 1;
-		pos += len;
+		valid = var_sig && var_sig->dbus1_valid &&
+			var_sig->num_children == 1 &&
+			calc_len_next_item(var_sig->str, var_sig->types,
+						data, pos, data_len, &len);
+		_dbus_signature_put(var_sig);
 
-		if (!calc_len_next_item(var_sig, data, pos, data_len, &len))
-			return NULL;
+		if (!valid)
+			return false;
 
 		pos += len;
 		break;
 	default:
-		return NULL;
+		return false;
 	}
 
-	sig_end = signature + 1;
-
 done:
 	if (pos > data_len)
-		return NULL;
+		return false;
 
 	*out_len = pos - data_pos;
-	return sig_end;
+	return true;
 }
 
 bool _dbus1_iter_next_entry_basic(struct l_dbus_message_iter *iter,
@@ -721,12 +962,14 @@ bool _dbus1_iter_get_fixed_array(struct l_dbus_message_iter *iter,
 bool _dbus1_iter_enter_struct(struct l_dbus_message_iter *iter,
 					struct l_dbus_message_iter *structure)
 {
+	const struct _dbus_signature_type *type;
+	struct _dbus_signature *lookup;
 	size_t len;
 	size_t pos;
-	const char *sig_start;
-	const char *sig_end;
+	unsigned int sig_len;
 	bool is_dict = iter->sig_start[iter->sig_pos] == '{';
 	bool is_struct = iter->sig_start[iter->sig_pos] == '(';
+	bool valid;
 
 	if (!is_dict && !is_struct)
 		return false;
@@ -735,20 +978,31 @@ bool _dbus1_iter_enter_struct(struct l_dbus_message_iter *iter,
 	if (pos >= iter->len)
 		return false;
 
-	sig_start = iter->sig_start + iter->sig_pos + 1;
-	sig_end = _dbus_signature_end(iter->sig_start + iter->sig_pos);
+	type = _dbus_iter_get_type(iter, &lookup);
+	if (!type)
+		return false;
+
+	sig_len = type->length;
+	valid = calc_len_next_item(iter->sig_start + iter->sig_pos, type,
+					iter->data, pos, iter->len, &len);
+	_dbus_signature_put(lookup);
 
-	if (!calc_len_next_item(iter->sig_start + iter->sig_pos,
-				iter->data, pos, iter->len, &len))
+	if (!valid)
 		return false;
 
+	if (!lookup)
+		_dbus_message_signature_enter(iter->message, iter->sig_start,
+					iter->sig_start + iter->sig_pos + 1);
+
 	dbus1_iter_init_internal(structure, iter->message,
 					DBUS_CONTAINER_TYPE_STRUCT,
-					sig_start, sig_end, iter->data,
-					len, pos);
+					iter->sig_start + iter->sig_pos + 1,
+					iter->sig_start + iter->sig_pos +
+					sig_len - 1,
+					iter->data, len, pos);
 
 	if (iter->container_type != DBUS_CONTAINER_TYPE_ARRAY)
-		iter->sig_pos += sig_end - sig_start + 2;
+		iter->sig_pos += sig_len;
 
 	iter->pos = pos + len;
 
@@ -758,10 +1012,13 @@ bool _dbus1_iter_enter_struct(struct l_dbus_message_iter *iter,
 bool _dbus1_iter_enter_variant(struct l_dbus_message_iter *iter,
 					struct l_dbus_message_iter *variant)
 {
+	struct _dbus_signature *signature;
+	struct _dbus_signature *lookup = NULL;
 	size_t pos;
 	uint8_t sig_len;
 	size_t len;
 	const char *sig_start;
+	bool valid;
 
 	if (iter->sig_start[iter->sig_pos] != 'v')
 		return false;
@@ -773,8 +1030,22 @@ bool _dbus1_iter_enter_variant(struct l_dbus_message_iter *iter,
 	sig_len = l_get_u8(iter->data + pos);
 	sig_start = iter->data + pos + 1;
 
-	if (!calc_len_next_item(sig_start, iter->data, pos + sig_len + 2,
-					iter->len, &len))
+	if (pos + sig_len + 2 > iter->len)
+		return false;
+
+	if (iter->message)
+		signature = _dbus_message_signature_get(iter->message,
+							sig_start, sig_len);
+	else
+		signature = lookup = _dbus_signature_get(sig_start, sig_len);
+
+	valid = signature && signature->dbus1_valid &&
+		signature->num_children == 1 &&
+		calc_len_next_item(sig_start, signature->types, iter->data,
+					pos + sig_len + 2, iter->len, &len);
+	_dbus_signature_put(lookup);
+
+	if (!valid)
 		return false;
 
 	dbus1_iter_init_internal(variant, iter->message,
@@ -793,16 +1064,23 @@ bool _dbus1_iter_enter_variant(struct l_dbus_message_iter *iter,
 bool _dbus1_iter_enter_array(struct l_dbus_message_iter *iter,
 					struct l_dbus_message_iter *array)
 {
+	const struct _dbus_signature_type *type;
+	struct _dbus_signature *lookup;
 	size_t pos;
 	size_t len;
-	const char *sig_start;
-	const char *sig_end;
+	unsigned int sig_len;
+	unsigned int alignment;
 
 	if (iter->sig_start[iter->sig_pos] != 'a')
 		return false;
 
-	sig_start = iter->sig_start + iter->sig_pos + 1;
-	sig_end = _dbus_signature_end(sig_start) + 1;
+	type = _dbus_iter_get_type(iter, &lookup);
+	if (!type)
+		return false;
+
+	sig_len = type->length;
+	alignment = type[1].alignment;
+	_dbus_signature_put(lookup);
 
 	pos = align_len(iter->pos, 4);
 	if (pos + 4 > iter->len)
@@ -811,14 +1089,20 @@ bool _dbus1_iter_enter_array(struct l_dbus_message_iter *iter,
 	len = l_get_u32(iter->data + pos);
 	pos += 4;
 
-	pos = align_len(pos, get_alignment(*sig_start));
+	pos = align_len(pos, alignment);
+
+	if (!lookup)
+		_dbus_message_signature_enter(iter->message, iter->sig_start,
+					iter->sig_start + iter->sig_pos + 1);
+
 	dbus1_iter_init_internal(array, iter->message,
 					DBUS_CONTAINER_TYPE_ARRAY,
-					sig_start, sig_end,
+					iter->sig_start + iter->sig_pos + 1,
+					iter->sig_start + iter->sig_pos + sig_len,
 					iter->data, len, pos);
 
 	if (iter->container_type != DBUS_CONTAINER_TYPE_ARRAY)
-		iter->sig_pos += sig_end - sig_start + 1;
+		iter->sig_pos += sig_len;
 
 	iter->pos = pos + len;
 
@@ -827,16 +1111,26 @@ bool _dbus1_iter_enter_array(struct l_dbus_message_iter *iter,
 
 bool _dbus1_iter_skip_entry(struct l_dbus_message_iter *iter)
 {
+	const struct _dbus_signature_type *type;
+	struct _dbus_signature *lookup;
 	size_t len;
-	const char *sig_end;
+	unsigned int sig_len;
+	bool valid;
+
+	type = _dbus_iter_get_type(iter, &lookup);
+	if (!type)
+		return false;
 
-	sig_end = calc_len_next_item(iter->sig_start + iter->sig_pos,
+	sig_len = type->length;
+	valid = calc_len_next_item(iter->sig_start + iter->sig_pos, type,
 					iter->data, iter->pos, iter->len, &len);
-	if (!sig_end)
+	_dbus_signature_put(lookup);
+
+	if (!valid)
 		return false;
 
 	iter->pos += len;
-	iter->sig_pos = sig_end - iter->sig_start;
+	iter->sig_pos += sig_len;
 
 	return true;
 }
@@ -885,9 +1179,15 @@ static inline size_t grow_body(struct dbus_builder *builder,
 {
 	size_t size = align_len(builder->body_pos, alignment);
 
+	/* Grow by at least half again so appends do not realloc each time */
 	if (size + len > builder->body_size) {
-		builder->body = l_realloc(builder->body, size + len);
-		builder->body_size = size + len;
+		size_t alloc = builder->body_size + builder->body_size / 2;
+
+		if (alloc < size + len)
+			alloc = size + len;
+
+		builder->body = l_realloc(builder->body, alloc);
+		builder->body_size = alloc;
 	}
 
 	if (size - builder->body_pos > 0)
@@ -1244,6 +1544,88 @@ bool _dbus1_builder_leave_array(struct dbus_builder *builder)
 	return true;
 }
 
+size_t _dbus1_builder_get_offset(struct dbus_builder *builder)
+{
+	return builder->body_pos;
+}
+
+void *_dbus1_builder_copy(struct dbus_builder *builder, size_t start,
+				size_t *out_len)
+{
+	if (unlikely(start > builder->body_pos))
+		return NULL;
+
+	*out_len = builder->body_pos - start;
+
+	return l_memdup(builder->body + start, *out_len);
+}
+
+/*
+ * Append elements to the array being built from bytes copied out of an
+ * earlier builder.  The bytes must have started at an 8 byte boundary
+ * there, which is the case for structs and dict entries.
+ */
+bool _dbus1_builder_append_raw(struct dbus_builder *builder,
+					const void *data, size_t len)
+{
+	struct container *container = l_queue_peek_head(builder->containers);
+	size_t start;
+
+	if (unlikely(container->type != DBUS_CONTAINER_TYPE_ARRAY))
+		return false;
+
+	start = grow_body(builder, len, 8);
+	memcpy(builder->body + start, data, len);
+
+	return true;
+}
+
+/* Append all elements of the byte array being built in one copy */
+bool _dbus1_builder_append_bytes(struct dbus_builder *builder,
+					const void *data, size_t len)
+{
+	struct container *container = l_queue_peek_head(builder->containers);
+	size_t start;
+
+	if (unlikely(container->type != DBUS_CONTAINER_TYPE_ARRAY ||
+			strcmp(container->signature, "y")))
+		return false;
+
+	start = grow_body(builder, len, 1);
+	memcpy(builder->body + start, data, len);
+
+	return true;
+}
+
+void _dbus1_builder_reserve(struct dbus_builder *builder, size_t size)
+{
+	if (size <= builder->body_size)
+		return;
+
+	builder->body = l_realloc(builder->body, size);
+	builder->body_size = size;
+}
+
+/*
+ * Hand an empty builder a @size byte buffer to write the body into, it is
+ * only reallocated once the body outgrows it.
+ */
+void _dbus1_builder_set_buffer(struct dbus_builder *builder,
+					void *buffer, size_t size)
+{
+	l_free(builder->body);
+
+	builder->body = buffer;
+	builder->body_size = size;
+	builder->body_pos = 0;
+}
+
+/* Allocated size of the body buffer, still valid once it has been taken */
+size_t _dbus1_builder_get_capacity(struct dbus_builder *builder)
+{
+	return builder->body_size;
+}
+
 bool _dbus1_builder_mark(struct dbus_builder *builder)
 {
 	struct container *container = l_queue_peek_head(builder->containers);
@@ -1280,6 +1662,12 @@ bool _dbus1_builder_rewind(struct dbus_builder *builder)
 	return true;
 }
 
+/*
+ * Hands the body and the signature over to the caller.  The builder is
+ * spent afterwards, it can only be asked for the size of the buffer it
+ * allocated with _dbus1_builder_get_capacity() and then freed, it is not
+ * reused.
+ */
 char *_dbus1_builder_finish(struct dbus_builder *builder,
 				void **body, size_t *body_size)
 {
@@ -1297,7 +1685,6 @@ char *_dbus1_builder_finish(struct dbus_builder *builder,
 	*body = builder->body;
 	*body_size = builder->body_pos;
 	builder->body = NULL;
-	builder->body_size = 0;
 
 	return signature;
 }
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,8 +39,11 @@
 #include "util.h"
 #include "io.h"
 #include "idle.h"
+#include "timeout.h"
+#include "time.h"
 #include "queue.h"
 #include "hashmap.h"
+#include "random.h"
 #include "dbus.h"
 #include "private.h"
 #include "dbus-private.h"
@@ -52,17 +56,33 @@
 
 #define DBUS_MAXIMUM_MATCH_RULE_LENGTH	1024
 
+#define DBUS_MAXIMUM_MESSAGE_LENGTH	134217728
+
+/* Messages written per sendmsg, each takes a header and a body iovec */
+#define DBUS_SEND_BATCH_MAX		(IOV_MAX / 2)
+
+/* Failed AUTH attempts a server allows before it hangs up */
+#define DBUS_AUTH_MAX_FAILURES		3
+
+/* Milliseconds method calls wait for their reply unless told otherwise */
+#define DBUS_DEFAULT_REPLY_TIMEOUT	25000
+
 enum auth_state {
 	WAITING_FOR_OK,
 	WAITING_FOR_AGREE_UNIX_FD,
+	WAITING_FOR_AUTH,
+	WAITING_FOR_BEGIN,
 	SETUP_DONE
 };
 
 struct l_dbus_ops {
 	char version;
+	bool peer;
 	bool (*send_message)(struct l_dbus *bus,
 				struct l_dbus_message *message);
-	struct l_dbus_message *(*recv_message)(struct l_dbus *bus);
+	int (*send_flush)(struct l_dbus *bus);
+	struct l_dbus_message *(*recv_message)(struct l_dbus *bus,
+						bool read_socket);
 	void (*free)(struct l_dbus *bus);
 	struct _dbus_name_ops name_ops;
 	struct _dbus_filter_ops filter_ops;
@@ -70,6 +90,7 @@ struct l_dbus_ops {
 				bool allow_replacement, bool replace_existing,
 				bool queue, l_dbus_name_acquire_func_t callback,
 				void *user_data);
+	bool (*cancel)(struct l_dbus *dbus, uint32_t serial);
 };
 
 struct l_dbus {
@@ -82,7 +103,25 @@ struct l_dbus {
 	unsigned int next_id;
 	uint32_t next_serial;
 	struct l_queue *message_queue;
-	struct l_hashmap *message_list;
+	unsigned int send_queued;
+	unsigned int send_low_water;
+	unsigned int send_high_water;
+	bool send_blocked;
+	bool send_blocked_notified;
+	struct l_idle *writable_work;
+	l_dbus_writable_func_t writable_handler;
+	l_dbus_destroy_func_t writable_destroy;
+	void *writable_data;
+	struct l_hashmap *replaceable_signals;
+	struct message_callback **pending_calls;
+	unsigned int pending_size;
+	unsigned int pending_count;
+	unsigned int num_calls;
+	unsigned int max_calls;
+	unsigned int reply_timeout;
+	struct message_callback *deadlines;
+	struct message_callback *deadlines_tail;
+	struct l_timeout *deadline_timeout;
 	struct l_hashmap *signal_list;
 	l_dbus_ready_func_t ready_handler;
 	l_dbus_destroy_func_t ready_destroy;
@@ -94,9 +133,14 @@ struct l_dbus {
 	l_dbus_destroy_func_t debug_destroy;
 	void *debug_data;
 	struct _dbus_object_tree *tree;
+	struct _dbus_message_pool *message_pool;
 	struct _dbus_name_cache *name_cache;
 	struct _dbus_filter *filter;
 	bool name_notify_enabled;
+	bool *dispatch_destroyed;
+	struct _dbus_stats *stats;
+	bool stats_exported;
+	struct _dbus_capture *capture;
 
 	const struct l_dbus_ops *driver;
 };
@@ -108,14 +152,47 @@ struct l_dbus_classic {
 	struct l_hashmap *match_strings;
 	int *fd_buf;
 	unsigned int num_fds;
+	struct _dbus_recv_buffer *recv_buf;
+	size_t recv_start;
+	size_t recv_end;
+	struct l_dbus_message *send_batch[DBUS_SEND_BATCH_MAX];
+	unsigned int send_count;
+	size_t send_offset;
+	char auth_line[256];
+	size_t auth_line_len;
+	unsigned int auth_failures;
+	struct l_queue *peer_requests;
+	struct l_idle *peer_work;
+};
+
+struct l_dbus_server {
+	struct l_io *io;
+	char *guid;
+	char *path;
+	l_dbus_server_connect_func_t connect_handler;
+	l_dbus_destroy_func_t connect_destroy;
+	void *connect_data;
+};
+
+struct peer_request {
+	uint32_t serial;
+	char *name;
+	l_dbus_name_acquire_func_t callback;
+	void *user_data;
 };
 
 struct message_callback {
 	uint32_t serial;
+	bool priority;
 	struct l_dbus_message *message;
 	l_dbus_message_func_t callback;
 	l_dbus_destroy_func_t destroy;
 	void *user_data;
+	uint64_t deadline;
+	struct message_callback *prev;
+	struct message_callback *next;
+	char *replace_key;
+	uint64_t sent_time;
 };
 
 struct signal_callback {
@@ -134,12 +211,353 @@ static void message_queue_destroy(void *data)
 	if (callback->destroy)
 		callback->destroy(callback->user_data);
 
+	l_free(callback->replace_key);
 	l_free(callback);
 }
 
-static void message_list_destroy(void *value)
+static void writable_work(struct l_idle *idle, void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+
+	l_idle_remove(dbus->writable_work);
+	dbus->writable_work = NULL;
+
+	if (dbus->send_blocked == dbus->send_blocked_notified)
+		return;
+
+	dbus->send_blocked_notified = dbus->send_blocked;
+
+	if (dbus->writable_handler)
+		dbus->writable_handler(!dbus->send_blocked,
+						dbus->writable_data);
+}
+
+/*
+ * The queue is reported unwritable when it reaches the high-water mark
+ * and writable again once it has drained to the low-water mark.  The
+ * handler is called from an idle so it never runs in the middle of a
+ * send or a write.
+ */
+static void send_queue_check_watermarks(struct l_dbus *dbus)
+{
+	if (dbus->send_blocked) {
+		if (dbus->send_high_water &&
+				dbus->send_queued > dbus->send_low_water)
+			return;
+
+		dbus->send_blocked = false;
+	} else {
+		if (!dbus->send_high_water ||
+				dbus->send_queued < dbus->send_high_water)
+			return;
+
+		dbus->send_blocked = true;
+	}
+
+	if (!dbus->writable_work)
+		dbus->writable_work = l_idle_create(writable_work, dbus, NULL);
+}
+
+static void send_queue_push(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	if (callback->priority)
+		l_queue_push_head(dbus->message_queue, callback);
+	else
+		l_queue_push_tail(dbus->message_queue, callback);
+
+	if (callback->replace_key)
+		l_hashmap_insert(dbus->replaceable_signals,
+						callback->replace_key, callback);
+
+	dbus->send_queued += 1;
+	send_queue_check_watermarks(dbus);
+
+	if (dbus->stats)
+		_dbus_stats_send_queue(dbus->stats, dbus->send_queued);
+}
+
+static void send_queue_unlink(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	if (callback->replace_key)
+		l_hashmap_remove(dbus->replaceable_signals,
+						callback->replace_key);
+
+	dbus->send_queued -= 1;
+	send_queue_check_watermarks(dbus);
+
+	if (dbus->stats)
+		_dbus_stats_send_queue(dbus->stats, dbus->send_queued);
+}
+
+static bool send_queue_remove(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	if (!l_queue_remove(dbus->message_queue, callback))
+		return false;
+
+	send_queue_unlink(dbus, callback);
+
+	return true;
+}
+
+/*
+ * Messages go out in the order they were queued, peers rely on that.
+ * Until the connection is ready only the Hello call, queued at the head,
+ * may go out.
+ */
+static struct message_callback *send_queue_peek(struct l_dbus *dbus)
+{
+	struct message_callback *callback;
+
+	callback = l_queue_peek_head(dbus->message_queue);
+
+	if (callback && !dbus->is_ready && !callback->priority)
+		return NULL;
+
+	return callback;
+}
+
+static void send_queue_pop(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	l_queue_pop_head(dbus->message_queue);
+	send_queue_unlink(dbus, callback);
+}
+
+static bool send_queue_is_empty(struct l_dbus *dbus)
+{
+	return dbus->send_queued == 0;
+}
+
+/*
+ * Calls waiting for their reply are kept in an open addressed table
+ * indexed by serial.  Serials are handed out sequentially so the low bits
+ * spread the calls evenly and lookups stay O(1) however many calls are
+ * outstanding.  The table doubles whenever it gets half full.
+ */
+#define PENDING_CALLS_MIN_SIZE	64
+
+static void pending_calls_insert(struct l_dbus *dbus,
+					struct message_callback *callback)
+{
+	unsigned int mask;
+	unsigned int i;
+
+	if ((dbus->pending_count + 1) * 2 > dbus->pending_size) {
+		struct message_callback **old = dbus->pending_calls;
+		unsigned int old_size = dbus->pending_size;
+
+		dbus->pending_size = old_size ? old_size * 2 :
+						PENDING_CALLS_MIN_SIZE;
+		dbus->pending_calls = l_new(struct message_callback *,
+							dbus->pending_size);
+		dbus->pending_count = 0;
+
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				pending_calls_insert(dbus, old[i]);
+
+		l_free(old);
+	}
+
+	mask = dbus->pending_size - 1;
+
+	for (i = callback->serial & mask; dbus->pending_calls[i];
+							i = (i + 1) & mask)
+		;
+
+	dbus->pending_calls[i] = callback;
+	dbus->pending_count += 1;
+
+	if (dbus->stats)
+		_dbus_stats_pending_calls(dbus->stats, dbus->pending_count);
+}
+
+static struct message_callback *pending_calls_remove(struct l_dbus *dbus,
+							uint32_t serial)
+{
+	struct message_callback *callback;
+	unsigned int mask = dbus->pending_size - 1;
+	unsigned int i, j, home;
+
+	if (!dbus->pending_count)
+		return NULL;
+
+	for (i = serial & mask; dbus->pending_calls[i]; i = (i + 1) & mask)
+		if (dbus->pending_calls[i]->serial == serial)
+			break;
+
+	callback = dbus->pending_calls[i];
+	if (!callback)
+		return NULL;
+
+	/* Shift back any entries of the probe sequence past the hole */
+	for (j = (i + 1) & mask; dbus->pending_calls[j]; j = (j + 1) & mask) {
+		home = dbus->pending_calls[j]->serial & mask;
+
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		dbus->pending_calls[i] = dbus->pending_calls[j];
+		i = j;
+	}
+
+	dbus->pending_calls[i] = NULL;
+	dbus->pending_count -= 1;
+
+	if (dbus->stats)
+		_dbus_stats_pending_calls(dbus->stats, dbus->pending_count);
+
+	return callback;
+}
+
+static void pending_calls_destroy(struct l_dbus *dbus)
+{
+	unsigned int i;
+
+	for (i = 0; i < dbus->pending_size; i++)
+		if (dbus->pending_calls[i])
+			message_queue_destroy(dbus->pending_calls[i]);
+
+	l_free(dbus->pending_calls);
+	dbus->pending_calls = NULL;
+	dbus->pending_size = 0;
+	dbus->pending_count = 0;
+}
+
+static void deadline_timeout_arm(struct l_dbus *dbus);
+
+/*
+ * Calls with a reply timeout are also linked in the order of their
+ * deadlines.  Most calls use the connection default so new ones tend to
+ * go at the tail, and only the earliest deadline needs a timer.
+ */
+static void deadlines_add(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	struct message_callback *prev = dbus->deadlines_tail;
+
+	while (prev && prev->deadline > callback->deadline)
+		prev = prev->prev;
+
+	callback->prev = prev;
+	callback->next = prev ? prev->next : dbus->deadlines;
+
+	if (callback->next)
+		callback->next->prev = callback;
+	else
+		dbus->deadlines_tail = callback;
+
+	if (prev)
+		prev->next = callback;
+	else {
+		dbus->deadlines = callback;
+		deadline_timeout_arm(dbus);
+	}
+}
+
+static void deadlines_remove(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	if (!callback->deadline)
+		return;
+
+	if (callback->prev)
+		callback->prev->next = callback->next;
+	else
+		dbus->deadlines = callback->next;
+
+	if (callback->next)
+		callback->next->prev = callback->prev;
+	else
+		dbus->deadlines_tail = callback->prev;
+
+	callback->prev = NULL;
+	callback->next = NULL;
+	callback->deadline = 0;
+}
+
+/* A call that had a reply callback is done, one way or another */
+static void call_done(struct l_dbus *dbus, struct message_callback *callback)
+{
+	if (!callback->callback)
+		return;
+
+	deadlines_remove(dbus, callback);
+	dbus->num_calls -= 1;
+}
+
+static void deadline_timeout_expired(struct l_timeout *timeout,
+							void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+	struct message_callback *callback;
+	struct l_dbus_message *error;
+	uint64_t now = l_time_now();
+	bool destroyed = false;
+
+	/* The callbacks may destroy the connection */
+	dbus->dispatch_destroyed = &destroyed;
+
+	while ((callback = dbus->deadlines) &&
+			!l_time_after(callback->deadline, now)) {
+		if (!pending_calls_remove(dbus, callback->serial)) {
+			send_queue_remove(dbus, callback);
+			_dbus_message_set_serial(callback->message,
+							callback->serial);
+		}
+
+		call_done(dbus, callback);
+
+		if (dbus->stats)
+			_dbus_stats_call_timed_out(dbus->stats);
+
+		error = l_dbus_message_new_error(callback->message,
+					"org.freedesktop.DBus.Error.NoReply",
+					"Did not receive a reply");
+		callback->callback(error, callback->user_data);
+		l_dbus_message_unref(error);
+
+		message_queue_destroy(callback);
+
+		if (destroyed)
+			return;
+	}
+
+	dbus->dispatch_destroyed = NULL;
+
+	deadline_timeout_arm(dbus);
+}
+
+static void deadline_timeout_arm(struct l_dbus *dbus)
 {
-	message_queue_destroy(value);
+	uint64_t now = l_time_now();
+	uint64_t msec;
+
+	if (!dbus->deadlines)
+		return;
+
+	/*
+	 * The timer is left running when the earliest call gets its reply
+	 * and is only moved when it expires or an earlier deadline is added.
+	 */
+	if (l_time_after(dbus->deadlines->deadline, now))
+		msec = (dbus->deadlines->deadline - now + L_USEC_PER_MSEC - 1) /
+							L_USEC_PER_MSEC;
+	else
+		msec = 1;
+
+	if (msec > ULONG_MAX)
+		msec = ULONG_MAX;
+
+	if (dbus->deadline_timeout)
+		l_timeout_modify_ms(dbus->deadline_timeout, msec);
+	else
+		dbus->deadline_timeout = l_timeout_create_ms(msec,
+						deadline_timeout_expired,
+						dbus, NULL);
 }
 
 static void signal_list_destroy(void *value)
@@ -159,44 +577,79 @@ static bool message_write_handler(struct l_io *io, void *user_data)
 	struct message_callback *callback;
 	const void *header, *body;
 	size_t header_size, body_size;
+	int err;
+
+	/*
+	 * Hand as many queued messages to the driver as it can write in
+	 * one go.  Until the connection is ready only priority messages,
+	 * i.e. the Hello call, may go out.
+	 */
+	while ((callback = send_queue_peek(dbus))) {
+		message = callback->message;
+		if (_dbus_message_get_type(message) ==
+					DBUS_MESSAGE_TYPE_METHOD_CALL &&
+				callback->callback == NULL)
+			l_dbus_message_set_no_reply(message, true);
+
+		_dbus_message_set_serial(message, callback->serial);
+
+		if (!dbus->driver->send_message(dbus, message))
+			break;
 
-	callback = l_queue_pop_head(dbus->message_queue);
-	if (!callback)
-		return false;
+		send_queue_pop(dbus, callback);
 
-	message = callback->message;
-	if (_dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
-			callback->callback == NULL)
-		l_dbus_message_set_no_reply(message, true);
+		/* Round trips are timed from when the call goes out */
+		if (callback->callback && dbus->stats)
+			callback->sent_time = l_time_now();
 
-	_dbus_message_set_serial(message, callback->serial);
+		header = _dbus_message_get_header(message, &header_size);
+		body = _dbus_message_get_body(message, &body_size);
+		l_util_hexdump_two(false, header, header_size, body, body_size,
+					dbus->debug_handler, dbus->debug_data);
 
-	if (!dbus->driver->send_message(dbus, message)) {
-		message_queue_destroy(callback);
-		return false;
-	}
+		if (dbus->capture)
+			_dbus_capture_message(dbus->capture, header,
+						header_size, body, body_size);
 
-	header = _dbus_message_get_header(message, &header_size);
-	body = _dbus_message_get_body(message, &body_size);
-	l_util_hexdump_two(false, header, header_size, body, body_size,
-				dbus->debug_handler, dbus->debug_data);
+		if (dbus->stats)
+			_dbus_stats_message_sent(dbus->stats, message,
+						header_size + body_size);
 
-	if (callback->callback == NULL) {
-		message_queue_destroy(callback);
-		goto done;
+		if (callback->callback == NULL) {
+			message_queue_destroy(callback);
+			continue;
+		}
+
+		pending_calls_insert(dbus, callback);
 	}
 
-	l_hashmap_insert(dbus->message_list,
-				L_UINT_TO_PTR(callback->serial), callback);
+	err = dbus->driver->send_flush(dbus);
+	if (err == -EAGAIN)
+		return true;
+
+	if (err < 0)
+		return false;
 
-done:
-	if (l_queue_isempty(dbus->message_queue))
+	if (send_queue_is_empty(dbus))
 		return false;
 
 	/* Only continue sending messges if the connection is ready */
 	return dbus->is_ready;
 }
 
+/* Calls sent while statistics were enabled have their round trip timed */
+static void stats_record_reply(struct l_dbus *dbus,
+				struct message_callback *callback)
+{
+	if (!dbus->stats || !callback->sent_time)
+		return;
+
+	_dbus_stats_record(dbus->stats, L_DBUS_STATS_CALL_LATENCY,
+				l_dbus_message_get_interface(callback->message),
+				l_dbus_message_get_member(callback->message),
+				l_time_diff(callback->sent_time, l_time_now()));
+}
+
 static void handle_method_return(struct l_dbus *dbus,
 					struct l_dbus_message *message)
 {
@@ -207,11 +660,13 @@ static void handle_method_return(struct l_dbus *dbus,
 	if (reply_serial == 0)
 		return;
 
-	callback = l_hashmap_remove(dbus->message_list,
-					L_UINT_TO_PTR(reply_serial));
+	callback = pending_calls_remove(dbus, reply_serial);
 	if (!callback)
 		return;
 
+	call_done(dbus, callback);
+	stats_record_reply(dbus, callback);
+
 	if (callback->callback)
 		callback->callback(message, callback->user_data);
 
@@ -227,11 +682,13 @@ static void handle_error(struct l_dbus *dbus, struct l_dbus_message *message)
 	if (reply_serial == 0)
 		return;
 
-	callback = l_hashmap_remove(dbus->message_list,
-					L_UINT_TO_PTR(reply_serial));
+	callback = pending_calls_remove(dbus, reply_serial);
 	if (!callback)
 		return;
 
+	call_done(dbus, callback);
+	stats_record_reply(dbus, callback);
+
 	if (callback->callback)
 		callback->callback(message, callback->user_data);
 
@@ -252,23 +709,35 @@ static void handle_signal(struct l_dbus *dbus, struct l_dbus_message *message)
 	l_hashmap_foreach(dbus->signal_list, process_signal, message);
 }
 
-static bool message_read_handler(struct l_io *io, void *user_data)
+static void dispatch_method_call(struct l_dbus *dbus,
+					struct l_dbus_message *message)
+{
+	if (!_dbus_object_tree_dispatch(dbus->tree, dbus, message)) {
+		struct l_dbus_message *error;
+
+		error = l_dbus_message_new_error(message,
+				"org.freedesktop.DBus.Error.NotFound",
+				"No matching method found");
+		l_dbus_send(dbus, error);
+	}
+}
+
+static void dispatch_message(struct l_dbus *dbus,
+					struct l_dbus_message *message)
 {
-	struct l_dbus *dbus = user_data;
-	struct l_dbus_message *message;
 	const void *header, *body;
 	size_t header_size, body_size;
 	enum dbus_message_type msgtype;
 
-	message = dbus->driver->recv_message(dbus);
-	if (!message)
-		return true;
-
 	header = _dbus_message_get_header(message, &header_size);
 	body = _dbus_message_get_body(message, &body_size);
 	l_util_hexdump_two(true, header, header_size, body, body_size,
 				dbus->debug_handler, dbus->debug_data);
 
+	if (dbus->stats)
+		_dbus_stats_message_received(dbus->stats, message,
+						header_size + body_size);
+
 	msgtype = _dbus_message_get_type(message);
 
 	switch (msgtype) {
@@ -282,23 +751,68 @@ static bool message_read_handler(struct l_io *io, void *user_data)
 		handle_signal(dbus, message);
 		break;
 	case DBUS_MESSAGE_TYPE_METHOD_CALL:
-		if (!_dbus_object_tree_dispatch(dbus->tree, dbus, message)) {
-			struct l_dbus_message *error;
+		dispatch_method_call(dbus, message);
+		break;
+	}
+}
 
-			error = l_dbus_message_new_error(message,
-					"org.freedesktop.DBus.Error.NotFound",
-					"No matching method found");
-			l_dbus_send(dbus, error);
-		}
+static bool message_read_handler(struct l_io *io, void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+	struct l_dbus_message *message;
+	bool destroyed = false;
 
-		break;
+	/*
+	 * Dispatch every complete message that one read brought in before
+	 * going back to the main loop.  Any handler may destroy the
+	 * connection, so stop as soon as that happens.
+	 */
+	dbus->dispatch_destroyed = &destroyed;
+
+	message = dbus->driver->recv_message(dbus, true);
+
+	while (message) {
+		dispatch_message(dbus, message);
+		l_dbus_message_unref(message);
+
+		if (destroyed)
+			return true;
+
+		message = dbus->driver->recv_message(dbus, false);
 	}
 
-	l_dbus_message_unref(message);
+	dbus->dispatch_destroyed = NULL;
 
 	return true;
 }
 
+/*
+ * Replaceable signals supersede each other when they come from the same
+ * object, have the same name and, if they have one, the same first
+ * string argument, such as the property name of PropertyChanged.
+ */
+static char *signal_replace_key(struct l_dbus_message *message)
+{
+	const char *arg0 = _dbus_message_get_nth_string_argument(message, 0);
+
+	return l_strdup_printf("%s %s %s %s",
+				l_dbus_message_get_path(message),
+				l_dbus_message_get_interface(message),
+				l_dbus_message_get_member(message),
+				arg0 ?: "");
+}
+
+/*
+ * Only calls made through the public API count against the limit, the
+ * calls the connection makes on its own behalf are never held back
+ */
+static bool call_limit_reached(struct l_dbus *dbus,
+					l_dbus_message_func_t function)
+{
+	return function && dbus->max_calls &&
+				dbus->num_calls >= dbus->max_calls;
+}
+
 static uint32_t send_message(struct l_dbus *dbus, bool priority,
 				struct l_dbus_message *message,
 				l_dbus_message_func_t function,
@@ -306,7 +820,9 @@ static uint32_t send_message(struct l_dbus *dbus, bool priority,
 {
 	struct message_callback *callback;
 	enum dbus_message_type type;
+	unsigned int timeout;
 	const char *path;
+	char *replace_key = NULL;
 
 	type = _dbus_message_get_type(message);
 
@@ -322,16 +838,47 @@ static uint32_t send_message(struct l_dbus *dbus, bool priority,
 			!l_dbus_message_get_signature(message))
 		l_dbus_message_set_arguments(message, "");
 
+	/* A newer replaceable signal takes the place of a queued one */
+	if (type == DBUS_MESSAGE_TYPE_SIGNAL &&
+			_dbus_message_get_replaceable(message)) {
+		replace_key = signal_replace_key(message);
+
+		callback = l_hashmap_lookup(dbus->replaceable_signals,
+								replace_key);
+		if (callback) {
+			l_dbus_message_unref(callback->message);
+			callback->message = message;
+			l_free(replace_key);
+
+			return callback->serial;
+		}
+	}
+
 	callback = l_new(struct message_callback, 1);
 
 	callback->serial = dbus->next_serial++;
+	callback->priority = priority;
 	callback->message = message;
 	callback->callback = function;
 	callback->destroy = destroy;
 	callback->user_data = user_data;
+	callback->replace_key = replace_key;
+
+	if (function) {
+		dbus->num_calls += 1;
+
+		if (!_dbus_message_get_reply_timeout(message, &timeout))
+			timeout = dbus->reply_timeout;
+
+		if (timeout) {
+			callback->deadline = l_time_offset(l_time_now(),
+						timeout * L_USEC_PER_MSEC);
+			deadlines_add(dbus, callback);
+		}
+	}
 
 	if (priority) {
-		l_queue_push_head(dbus->message_queue, callback);
+		send_queue_push(dbus, callback);
 
 		l_io_set_write_handler(dbus->io, message_write_handler,
 							dbus, NULL);
@@ -343,7 +890,7 @@ static uint32_t send_message(struct l_dbus *dbus, bool priority,
 	if (path)
 		_dbus_object_tree_signals_flush(dbus, path);
 
-	l_queue_push_tail(dbus->message_queue, callback);
+	send_queue_push(dbus, callback);
 
 	if (dbus->is_ready)
 		l_io_set_write_handler(dbus->io, message_write_handler,
@@ -352,32 +899,90 @@ static uint32_t send_message(struct l_dbus *dbus, bool priority,
 	return callback->serial;
 }
 
-static void bus_ready(struct l_dbus *dbus)
+static void peer_request_free(void *data)
 {
-	dbus->is_ready = true;
+	struct peer_request *req = data;
 
-	if (dbus->ready_handler)
-		dbus->ready_handler(dbus->ready_data);
+	l_free(req->name);
+	l_free(req);
+}
 
-	l_io_set_read_handler(dbus->io, message_read_handler, dbus, NULL);
+/*
+ * With no bus in between, the other end of a peer connection stands in
+ * for every name and owns whatever names are requested.  The answers are
+ * still delivered from an idle once the connection is up, like the
+ * replies a bus would send.
+ */
+static void peer_work(struct l_idle *idle, void *user_data)
+{
+	struct l_dbus_classic *classic = user_data;
+	struct l_dbus *dbus = &classic->super;
+	struct peer_request *req;
+	bool destroyed = false;
 
-	/* Check for messages added before the connection was ready */
-	if (l_queue_isempty(dbus->message_queue))
-		return;
+	l_idle_remove(classic->peer_work);
+	classic->peer_work = NULL;
 
-	l_io_set_write_handler(dbus->io, message_write_handler, dbus, NULL);
-}
+	/* The callbacks may destroy the connection */
+	dbus->dispatch_destroyed = &destroyed;
 
-static void hello_callback(struct l_dbus_message *message, void *user_data)
-{
-	struct l_dbus *dbus = user_data;
-	const char *signature;
-	const char *unique_name;
+	while ((req = l_queue_pop_head(classic->peer_requests))) {
+		if (req->callback)
+			req->callback(dbus, true, false, req->user_data);
+		else
+			_dbus_name_cache_notify(dbus->name_cache, req->name,
+								dbus->guid);
 
-	signature = l_dbus_message_get_signature(message);
-	if (!signature || strcmp(signature, "s")) {
-		close(l_io_get_fd(dbus->io));
-		return;
+		peer_request_free(req);
+
+		if (destroyed)
+			return;
+	}
+
+	dbus->dispatch_destroyed = NULL;
+}
+
+static void peer_schedule_requests(struct l_dbus *dbus)
+{
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+
+	if (!dbus->is_ready || classic->peer_work ||
+			l_queue_isempty(classic->peer_requests))
+		return;
+
+	classic->peer_work = l_idle_create(peer_work, classic, NULL);
+}
+
+static void bus_ready(struct l_dbus *dbus)
+{
+	dbus->is_ready = true;
+
+	if (dbus->driver->peer)
+		peer_schedule_requests(dbus);
+
+	if (dbus->ready_handler)
+		dbus->ready_handler(dbus->ready_data);
+
+	l_io_set_read_handler(dbus->io, message_read_handler, dbus, NULL);
+
+	/* Check for messages added before the connection was ready */
+	if (send_queue_is_empty(dbus))
+		return;
+
+	l_io_set_write_handler(dbus->io, message_write_handler, dbus, NULL);
+}
+
+static void hello_callback(struct l_dbus_message *message, void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+	const char *signature;
+	const char *unique_name;
+
+	signature = l_dbus_message_get_signature(message);
+	if (!signature || strcmp(signature, "s")) {
+		close(l_io_get_fd(dbus->io));
+		return;
 	}
 
 	if (!l_dbus_message_get_arguments(message, "s", &unique_name)) {
@@ -422,6 +1027,12 @@ static bool auth_write_handler(struct l_io *io, void *user_data)
 	l_free(classic->auth_command);
 	classic->auth_command = NULL;
 
+	if (classic->auth_state == SETUP_DONE && dbus->driver->peer) {
+		/* There is no bus to say Hello to */
+		bus_ready(dbus);
+		return true;
+	}
+
 	if (classic->auth_state == SETUP_DONE) {
 		struct l_dbus_message *message;
 
@@ -523,6 +1134,8 @@ static bool auth_read_handler(struct l_io *io, void *user_data)
 			static const char *command = "BEGIN\r\n";
 
 			dbus->support_unix_fd = true;
+			_dbus_message_pool_set_unix_fds(dbus->message_pool,
+								true);
 
 			classic->auth_command = l_strdup(command);
 			classic->auth_state = SETUP_DONE;
@@ -538,13 +1151,175 @@ static bool auth_read_handler(struct l_io *io, void *user_data)
 		}
 		break;
 
+	case WAITING_FOR_AUTH:
+	case WAITING_FOR_BEGIN:
+	case SETUP_DONE:
+		break;
+	}
+
+	l_io_set_write_handler(io, auth_write_handler, dbus, NULL);
+
+	return true;
+}
+
+static bool server_auth_check(struct l_dbus_classic *classic,
+							const char *hexuid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	unsigned char *uid;
+	size_t uid_len;
+	char expected[16];
+	bool valid;
+
+	if (getsockopt(l_io_get_fd(classic->super.io), SOL_SOCKET,
+					SO_PEERCRED, &cred, &len) < 0)
+		return false;
+
+	/* Only processes of the same user, or root, may connect */
+	if (cred.uid != geteuid() && cred.uid != 0)
+		return false;
+
+	uid = l_util_from_hexstring(hexuid, &uid_len);
+	if (!uid)
+		return false;
+
+	snprintf(expected, sizeof(expected), "%u", cred.uid);
+	valid = uid_len == strlen(expected) &&
+				!memcmp(uid, expected, uid_len);
+	l_free(uid);
+
+	return valid;
+}
+
+static const char *server_auth_process(struct l_dbus_classic *classic,
+							const char *line)
+{
+	struct l_dbus *dbus = &classic->super;
+
+	switch (classic->auth_state) {
+	case WAITING_FOR_AUTH:
+		if (!strncmp(line, "AUTH EXTERNAL ", 14) &&
+				server_auth_check(classic, line + 14)) {
+			classic->auth_state = WAITING_FOR_BEGIN;
+			return "OK";
+		}
+
+		if (!strncmp(line, "BEGIN", 5) ||
+				++classic->auth_failures >=
+						DBUS_AUTH_MAX_FAILURES)
+			return NULL;
+
+		return "REJECTED EXTERNAL";
+
+	case WAITING_FOR_BEGIN:
+		if (!strcmp(line, "BEGIN")) {
+			classic->auth_state = SETUP_DONE;
+			bus_ready(dbus);
+			return "";
+		}
+
+		if (!strcmp(line, "NEGOTIATE_UNIX_FD")) {
+			dbus->support_unix_fd = true;
+			_dbus_message_pool_set_unix_fds(dbus->message_pool,
+								true);
+			return "AGREE_UNIX_FD";
+		}
+
+		if (!strcmp(line, "CANCEL") || !strncmp(line, "ERROR", 5)) {
+			classic->auth_state = WAITING_FOR_AUTH;
+			return "REJECTED EXTERNAL";
+		}
+
+		return "ERROR";
+
+	case WAITING_FOR_OK:
+	case WAITING_FOR_AGREE_UNIX_FD:
 	case SETUP_DONE:
 		break;
 	}
 
+	return NULL;
+}
+
+/*
+ * The server side of the handshake reads one line at a time, the client
+ * may follow BEGIN with its first messages right away and those have to
+ * stay in the socket for the message reader.
+ */
+static bool server_auth_read_handler(struct l_io *io, void *user_data)
+{
+	struct l_dbus_classic *classic = user_data;
+	struct l_dbus *dbus = &classic->super;
+	char buffer[sizeof(classic->auth_line)];
+	const char *reply;
+	char *end;
+	ssize_t len;
+	int fd = l_io_get_fd(io);
+
+	len = TEMP_FAILURE_RETRY(recv(fd, buffer, sizeof(buffer),
+						MSG_PEEK | MSG_DONTWAIT));
+	if (len <= 0)
+		return len < 0 && errno == EAGAIN;
+
+	/* Skip the credentials-passing nul byte sent first */
+	if (classic->auth_state == WAITING_FOR_AUTH &&
+			!classic->auth_line_len && buffer[0] == '\0') {
+		recv(fd, buffer, 1, MSG_DONTWAIT);
+		return true;
+	}
+
+	end = memmem(buffer, len, "\r\n", 2);
+	if (end)
+		len = end + 2 - buffer;
+
+	if (classic->auth_line_len + len >= sizeof(classic->auth_line))
+		goto hangup;
+
+	len = TEMP_FAILURE_RETRY(recv(fd, classic->auth_line +
+						classic->auth_line_len,
+						len, MSG_DONTWAIT));
+	if (len <= 0)
+		return len < 0 && errno == EAGAIN;
+
+	classic->auth_line_len += len;
+	classic->auth_line[classic->auth_line_len] = '\0';
+
+	end = strstr(classic->auth_line, "\r\n");
+	if (!end)
+		return true;
+
+	l_util_hexdump(true, classic->auth_line, classic->auth_line_len,
+					dbus->debug_handler, dbus->debug_data);
+
+	*end = '\0';
+	classic->auth_line_len = 0;
+
+	reply = server_auth_process(classic, classic->auth_line);
+	if (!reply)
+		goto hangup;
+
+	/* After BEGIN the message reader has taken over */
+	if (!*reply)
+		return true;
+
+	l_free(classic->auth_command);
+
+	if (!strcmp(reply, "OK"))
+		classic->auth_command = l_strdup_printf("OK %s\r\n",
+								dbus->guid);
+	else
+		classic->auth_command = l_strdup_printf("%s\r\n", reply);
+
 	l_io_set_write_handler(io, auth_write_handler, dbus, NULL);
 
 	return true;
+
+hangup:
+	l_util_debug(dbus->debug_handler, dbus->debug_data,
+						"authentication failed");
+	shutdown(fd, SHUT_RDWR);
+	return false;
 }
 
 static void disconnect_handler(struct l_io *io, void *user_data)
@@ -561,6 +1336,7 @@ static void disconnect_handler(struct l_io *io, void *user_data)
 
 static void dbus_init(struct l_dbus *dbus, int fd)
 {
+
 	dbus->io = l_io_new(fd);
 	l_io_set_close_on_destroy(dbus->io, true);
 	l_io_set_disconnect_handler(dbus->io, disconnect_handler, dbus, NULL);
@@ -570,10 +1346,13 @@ static void dbus_init(struct l_dbus *dbus, int fd)
 	dbus->next_serial = 1;
 
 	dbus->message_queue = l_queue_new();
-	dbus->message_list = l_hashmap_new();
+
+	dbus->replaceable_signals = l_hashmap_string_new();
+	dbus->reply_timeout = DBUS_DEFAULT_REPLY_TIMEOUT;
 	dbus->signal_list = l_hashmap_new();
 
 	dbus->tree = _dbus_object_tree_new();
+	dbus->message_pool = _dbus_message_pool_new();
 }
 
 static void classic_free(struct l_dbus *dbus)
@@ -586,6 +1365,12 @@ static void classic_free(struct l_dbus *dbus)
 		close(classic->fd_buf[i]);
 	l_free(classic->fd_buf);
 
+	for (i = 0; i < classic->send_count; i++)
+		l_dbus_message_unref(classic->send_batch[i]);
+
+	_dbus_recv_buffer_unref(classic->recv_buf);
+	l_idle_remove(classic->peer_work);
+	l_queue_destroy(classic->peer_requests, peer_request_free);
 	l_free(classic->auth_command);
 	l_hashmap_destroy(classic->match_strings, l_free);
 	l_free(classic);
@@ -594,28 +1379,78 @@ static void classic_free(struct l_dbus *dbus)
 static bool classic_send_message(struct l_dbus *dbus,
 					struct l_dbus_message *message)
 {
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+
+	if (classic->send_count == DBUS_SEND_BATCH_MAX)
+		return false;
+
+	classic->send_batch[classic->send_count++] =
+					l_dbus_message_ref(message);
+
+	return true;
+}
+
+/*
+ * Write out the batched messages with as few sendmsg calls as possible.
+ * File descriptors are attached to the first byte of the message that
+ * carries them, so such a message always starts a new sendmsg.  A short
+ * write leaves the rest of the batch for the next writable event, any
+ * other error drops it.
+ */
+static int classic_send_flush(struct l_dbus *dbus)
+{
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
 	int fd = l_io_get_fd(dbus->io);
+	struct iovec iov[DBUS_SEND_BATCH_MAX * 2];
 	struct msghdr msg;
-	struct iovec iov[2], *iovpos;
-	ssize_t r;
-	int *fds = NULL;
-	uint32_t num_fds = 0;
 	struct cmsghdr *cmsg;
-	int iovlen;
+	ssize_t r;
+	int *fds;
+	uint32_t num_fds;
+	unsigned int i, iovlen, done;
+	size_t len;
+
+	while (classic->send_count) {
+		memset(&msg, 0, sizeof(msg));
+		iovlen = 0;
+		num_fds = 0;
 
-	iov[0].iov_base = _dbus_message_get_header(message, &iov[0].iov_len);
-	iov[1].iov_base = _dbus_message_get_body(message, &iov[1].iov_len);
+		for (i = 0; i < classic->send_count; i++) {
+			struct l_dbus_message *message = classic->send_batch[i];
+			uint32_t n = 0;
 
-	if (dbus->support_unix_fd)
-		fds = _dbus_message_get_fds(message, &num_fds);
+			if (dbus->support_unix_fd)
+				_dbus_message_get_fds(message, &n);
 
-	iovpos = iov;
-	iovlen = 2;
+			if (n) {
+				if (i)
+					break;
 
-	while (1) {
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_iov = iovpos;
-		msg.msg_iovlen = iovlen;
+				/* Already transmitted with the first byte */
+				if (!classic->send_offset)
+					num_fds = n;
+			}
+
+			iov[iovlen].iov_base = _dbus_message_get_header(message,
+							&iov[iovlen].iov_len);
+			iov[iovlen + 1].iov_base = _dbus_message_get_body(message,
+							&iov[iovlen + 1].iov_len);
+			iovlen += 2;
+		}
+
+		/* Skip what a previous short write already sent */
+		len = classic->send_offset;
+
+		for (i = 0; len >= iov[i].iov_len; i++)
+			len -= iov[i].iov_len;
+
+		iov[i].iov_base += len;
+		iov[i].iov_len -= len;
+
+		msg.msg_iov = iov + i;
+		msg.msg_iovlen = iovlen - i;
 
 		if (num_fds) {
 			msg.msg_control =
@@ -626,182 +1461,288 @@ static bool classic_send_message(struct l_dbus *dbus,
 			cmsg->cmsg_len = msg.msg_controllen;
 			cmsg->cmsg_level = SOL_SOCKET;
 			cmsg->cmsg_type = SCM_RIGHTS;
+			fds = _dbus_message_get_fds(classic->send_batch[0],
+								&num_fds);
 			memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
 		}
 
-		r = TEMP_FAILURE_RETRY(sendmsg(fd, &msg, 0));
-		if (r < 0)
-			return false;
+		r = TEMP_FAILURE_RETRY(sendmsg(fd, &msg, MSG_DONTWAIT));
+		if (r < 0 && errno == EAGAIN)
+			return -EAGAIN;
 
-		while ((size_t) r >= iovpos->iov_len) {
-			r -= iovpos->iov_len;
-			iovpos++;
-			iovlen--;
+		/* Nothing more can go out, fail the whole batch */
+		if (r < 0) {
+			int err = -errno;
 
-			if (!iovlen)
+			for (i = 0; i < classic->send_count; i++)
+				l_dbus_message_unref(classic->send_batch[i]);
+
+			classic->send_count = 0;
+			classic->send_offset = 0;
+
+			return err;
+		}
+
+		/* Release every message that is now completely written */
+		r += classic->send_offset;
+
+		for (done = 0; done < classic->send_count; done++) {
+			size_t header_size, body_size;
+			struct l_dbus_message *message =
+						classic->send_batch[done];
+
+			_dbus_message_get_header(message, &header_size);
+			_dbus_message_get_body(message, &body_size);
+
+			if ((size_t) r < header_size + body_size)
 				break;
+
+			r -= header_size + body_size;
+			l_dbus_message_unref(message);
 		}
 
-		if (!iovlen)
-			break;
+		classic->send_count -= done;
+		memmove(classic->send_batch, classic->send_batch + done,
+				classic->send_count * sizeof(void *));
+		classic->send_offset = r;
+	}
 
-		iovpos->iov_base += r;
-		iovpos->iov_len -= r;
+	return 0;
+}
 
-		/* The FDs have been transmitted, don't retransmit */
-		num_fds = 0;
+/* Close the first @count queued file descriptors, keep the rest queued */
+static void classic_drop_fds(struct l_dbus_classic *classic,
+							unsigned int count)
+{
+	unsigned int i;
+
+	if (count > classic->num_fds)
+		count = classic->num_fds;
+
+	for (i = 0; i < count; i++)
+		close(classic->fd_buf[i]);
+
+	classic->num_fds -= count;
+
+	if (classic->num_fds) {
+		memmove(classic->fd_buf, classic->fd_buf + count,
+				classic->num_fds * sizeof(int));
+		return;
 	}
 
-	return true;
+	l_free(classic->fd_buf);
+	classic->fd_buf = NULL;
 }
 
-static struct l_dbus_message *classic_recv_message(struct l_dbus *dbus)
+/*
+ * Read as much as is available into the free end of the receive buffer,
+ * making room for at least @need bytes first.  Received messages point
+ * into the buffer, so it is only compacted in place while none of them
+ * are alive.  Otherwise the unparsed tail moves to a new buffer and the
+ * old one goes away with the last message using it.  File descriptors are
+ * queued in arrival order, each message then takes as many as its
+ * UNIX_FDS header field says.  The sender attaches them to the first
+ * byte of the message, so they are always queued by the time the whole
+ * message has been read.
+ */
+static bool classic_recv_fill(struct l_dbus_classic *classic, size_t need)
 {
-	struct l_dbus_classic *classic =
-		l_container_of(dbus, struct l_dbus_classic, super);
+	struct l_dbus *dbus = &classic->super;
 	int fd = l_io_get_fd(dbus->io);
-	struct dbus_header hdr;
+	size_t pending = classic->recv_end - classic->recv_start;
+	struct _dbus_recv_buffer *buf = classic->recv_buf;
 	struct msghdr msg;
-	struct iovec iov[2], *iovpos;
+	struct iovec iov;
 	struct cmsghdr *cmsg;
-	ssize_t len, r;
-	void *header, *body;
-	size_t header_size, body_size;
 	union {
 		uint8_t bytes[CMSG_SPACE(16 * sizeof(int))];
 		struct cmsghdr align;
 	} fd_buf;
-	int *fds = NULL;
-	uint32_t num_fds = 0;
-	int iovlen;
-	struct l_dbus_message *message;
+	ssize_t r;
 	unsigned int i;
 
-	len = recv(fd, &hdr, DBUS_HEADER_SIZE, MSG_PEEK | MSG_DONTWAIT);
-	if (len != DBUS_HEADER_SIZE)
-		return NULL;
+	if (buf && buf->refcount == 1 && classic->recv_start) {
+		memmove(buf->data, buf->data + classic->recv_start, pending);
+		classic->recv_start = 0;
+		classic->recv_end = pending;
+	}
 
-	header_size = align_len(DBUS_HEADER_SIZE + hdr.dbus1.field_length, 8);
-	header = l_malloc(header_size);
+	if (!buf || classic->recv_start + need > buf->size ||
+			classic->recv_end == buf->size) {
+		classic->recv_buf = _dbus_recv_buffer_new(align_len(need,
+						DBUS_RECV_BUFFER_SIZE));
 
-	body_size = hdr.dbus1.body_length;
-	body = l_malloc(body_size);
+		if (pending)
+			memcpy(classic->recv_buf->data,
+				buf->data + classic->recv_start, pending);
+
+		_dbus_recv_buffer_unref(buf);
+		buf = classic->recv_buf;
 
-	iov[0].iov_base = header;
-	iov[0].iov_len  = header_size;
-	iov[1].iov_base = body;
-	iov[1].iov_len  = body_size;
+		classic->recv_start = 0;
+		classic->recv_end = pending;
+	}
 
-	iovpos = iov;
-	iovlen = 2;
+	iov.iov_base = buf->data + classic->recv_end;
+	iov.iov_len = buf->size - classic->recv_end;
 
-	while (1) {
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_iov = iovpos;
-		msg.msg_iovlen = iovlen;
-		msg.msg_control = &fd_buf;
-		msg.msg_controllen = sizeof(fd_buf);
-
-		r = TEMP_FAILURE_RETRY(recvmsg(fd, &msg,
-					MSG_CMSG_CLOEXEC | MSG_WAITALL));
-		if (r < 0)
-			goto cmsg_fail;
-
-		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
-				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-			if (cmsg->cmsg_level != SOL_SOCKET ||
-					cmsg->cmsg_type != SCM_RIGHTS)
-				continue;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &fd_buf;
+	msg.msg_controllen = sizeof(fd_buf);
 
-			num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
-			fds = (void *) CMSG_DATA(cmsg);
+	r = TEMP_FAILURE_RETRY(recvmsg(fd, &msg,
+					MSG_CMSG_CLOEXEC | MSG_DONTWAIT));
+	if (r <= 0)
+		return false;
 
-			/* Set FD_CLOEXEC on all file descriptors */
-			for (i = 0; i < num_fds; i++) {
-				long flags;
+	classic->recv_end += r;
 
-				flags = fcntl(fds[i], F_GETFD, NULL);
-				if (flags < 0)
-					continue;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		unsigned int num_fds;
+		int *fds;
 
-				if (!(flags & FD_CLOEXEC))
-					fcntl(fds[i], F_SETFD,
-						flags | FD_CLOEXEC);
-			}
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
 
-			classic->fd_buf = l_realloc(classic->fd_buf,
-						(classic->num_fds + num_fds) *
-						sizeof(int));
-			memcpy(classic->fd_buf + classic->num_fds, fds,
-				num_fds * sizeof(int));
-			classic->num_fds += num_fds;
-		}
+		num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		fds = (void *) CMSG_DATA(cmsg);
 
-		while ((size_t) r >= iovpos->iov_len) {
-			r -= iovpos->iov_len;
-			iovpos++;
-			iovlen--;
+		/* Set FD_CLOEXEC on all file descriptors */
+		for (i = 0; i < num_fds; i++) {
+			long flags;
 
-			if (!iovlen)
-				break;
+			flags = fcntl(fds[i], F_GETFD, NULL);
+			if (flags < 0)
+				continue;
+
+			if (!(flags & FD_CLOEXEC))
+				fcntl(fds[i], F_SETFD, flags | FD_CLOEXEC);
 		}
 
-		if (!iovlen)
-			break;
+		classic->fd_buf = l_realloc(classic->fd_buf,
+					(classic->num_fds + num_fds) *
+					sizeof(int));
+		memcpy(classic->fd_buf + classic->num_fds, fds,
+			num_fds * sizeof(int));
+		classic->num_fds += num_fds;
+	}
+
+	return true;
+}
+
+static struct l_dbus_message *classic_recv_message(struct l_dbus *dbus,
+							bool read_socket)
+{
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+	struct dbus_header hdr;
+	size_t header_size, body_size;
+	size_t pending, total;
+	uint8_t *data;
+	uint32_t num_fds;
+	struct l_dbus_message *message;
+
+next:
+	pending = classic->recv_end - classic->recv_start;
 
-		iovpos->iov_base += r;
-		iovpos->iov_len -= r;
+	if (pending < DBUS_HEADER_SIZE) {
+		total = DBUS_HEADER_SIZE;
+		goto need_more;
+	}
+
+	data = classic->recv_buf->data + classic->recv_start;
+	memcpy(&hdr, data, DBUS_HEADER_SIZE);
+
+	header_size = align_len(DBUS_HEADER_SIZE +
+				(size_t) hdr.dbus1.field_length, 8);
+	body_size = hdr.dbus1.body_length;
+	total = header_size + body_size;
+
+	/* The stream can't be resynchronized past a bogus length */
+	if (total > DBUS_MAXIMUM_MESSAGE_LENGTH) {
+		l_util_debug(dbus->debug_handler, dbus->debug_data,
+				"Message too long, disconnecting");
+		classic_drop_fds(classic, classic->num_fds);
+		shutdown(l_io_get_fd(dbus->io), SHUT_RDWR);
+		return NULL;
 	}
 
+	if (pending < total)
+		goto need_more;
+
+	classic->recv_start += total;
+
+	/* Capture messages as they arrive, including those dropped below */
+	if (dbus->capture)
+		_dbus_capture_message(dbus->capture, data, header_size,
+					data + header_size, body_size);
+
 	if (hdr.endian != DBUS_NATIVE_ENDIAN) {
 		l_util_debug(dbus->debug_handler,
 				dbus->debug_data, "Endianness incorrect");
-		goto bad_msg;
+		classic_drop_fds(classic, classic->num_fds);
+		goto next;
 	}
 
 	if (hdr.version != 1) {
 		l_util_debug(dbus->debug_handler,
 				dbus->debug_data, "Protocol version incorrect");
-		goto bad_msg;
+		classic_drop_fds(classic, classic->num_fds);
+		goto next;
 	}
 
-	num_fds = _dbus_message_unix_fds_from_header(header, header_size);
+	num_fds = _dbus_message_unix_fds_from_header(data, header_size);
 	if (num_fds > classic->num_fds)
 		goto bad_msg;
 
-	message = dbus_message_build(header, header_size, body, body_size,
+	message = _dbus_message_new_view(classic->recv_buf,
+					classic->recv_start - total,
+					header_size, body_size,
 					classic->fd_buf, num_fds);
+	if (!message)
+		goto bad_msg;
 
-	if (message && num_fds) {
-		if (classic->num_fds > num_fds) {
-			memmove(classic->fd_buf, classic->fd_buf + num_fds,
-				(classic->num_fds - num_fds) * sizeof(int));
-			classic->num_fds -= num_fds;
-		} else {
-			l_free(classic->fd_buf);
+	/* Replies to the message come out of the connection's pool */
+	_dbus_message_set_pool(message, dbus->message_pool);
 
-			classic->fd_buf = NULL;
-			classic->num_fds = 0;
-		}
+	if (num_fds) {
+		classic->num_fds -= num_fds;
+		memmove(classic->fd_buf, classic->fd_buf + num_fds,
+				classic->num_fds * sizeof(int));
+	}
+
+	/* Don't hold on to the space an unusually large message took */
+	if (classic->recv_start == classic->recv_end &&
+			classic->recv_buf->size > DBUS_RECV_BUFFER_SIZE) {
+		_dbus_recv_buffer_unref(classic->recv_buf);
+		classic->recv_buf = NULL;
+		classic->recv_start = 0;
+		classic->recv_end = 0;
 	}
 
-	if (message)
-		return message;
+	return message;
 
 bad_msg:
-cmsg_fail:
-	for (i = 0; i < classic->num_fds; i++)
-		close(classic->fd_buf[i]);
+	/* Only the bad message's own fds go, later messages keep theirs */
+	classic_drop_fds(classic, num_fds);
 
-	l_free(classic->fd_buf);
+	/* Skip over the bad message like the rest of the stream */
+	goto next;
 
-	classic->fd_buf = NULL;
-	classic->num_fds = 0;
+need_more:
+	if (!read_socket)
+		return NULL;
 
-	l_free(header);
-	l_free(body);
+	read_socket = false;
 
-	return NULL;
+	if (!classic_recv_fill(classic, total))
+		return NULL;
+
+	goto next;
 }
 
 static bool classic_add_match(struct l_dbus *dbus, unsigned int id,
@@ -912,8 +1853,9 @@ static bool classic_get_name_owner(struct l_dbus *bus, const char *name)
 
 	l_dbus_message_set_arguments(req->message, "s", name);
 
-	send_message(bus, false, req->message, get_name_owner_reply_cb,
-			req, l_free);
+	if (!send_message(bus, false, req->message, get_name_owner_reply_cb,
+				req, l_free))
+		return false;
 
 	if (!bus->name_notify_enabled) {
 		static struct _dbus_filter_condition rule[] = {
@@ -1018,36 +1960,145 @@ static uint32_t classic_name_acquire(struct l_dbus *dbus, const char *name,
 				req, free);
 }
 
-static const struct l_dbus_ops classic_ops = {
-	.version = 1,
-	.send_message = classic_send_message,
-	.recv_message = classic_recv_message,
-	.free = classic_free,
-	.name_ops = {
-		.get_name_owner = classic_get_name_owner,
-	},
-	.filter_ops = {
-		.add_match = classic_add_match,
-		.remove_match = classic_remove_match,
-	},
-	.name_acquire = classic_name_acquire,
-};
-
-static struct l_dbus *setup_dbus1(int fd, const char *guid)
+static bool peer_get_name_owner(struct l_dbus *dbus, const char *name)
 {
-	static const unsigned char creds = 0x00;
-	char uid[6], hexuid[12], *ptr = hexuid;
-	struct l_dbus *dbus;
-	struct l_dbus_classic *classic;
-	ssize_t written;
-	unsigned int i;
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+	struct peer_request *req;
 
-	if (snprintf(uid, sizeof(uid), "%d", geteuid()) < 1) {
-		close(fd);
-		return NULL;
-	}
+	req = l_new(struct peer_request, 1);
+	req->name = l_strdup(name);
 
-	for (i = 0; i < strlen(uid); i++)
+	l_queue_push_tail(classic->peer_requests, req);
+	peer_schedule_requests(dbus);
+
+	return true;
+}
+
+static bool peer_add_match(struct l_dbus *dbus, unsigned int id,
+				const struct _dbus_filter_condition *rule,
+				int rule_len)
+{
+	/* Everything the peer sends arrives anyway */
+	return true;
+}
+
+static bool peer_remove_match(struct l_dbus *dbus, unsigned int id)
+{
+	return true;
+}
+
+static uint32_t peer_name_acquire(struct l_dbus *dbus, const char *name,
+					bool allow_replacement,
+					bool replace_existing, bool queue,
+					l_dbus_name_acquire_func_t callback,
+					void *user_data)
+{
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+	struct peer_request *req;
+	uint32_t serial = dbus->next_serial++;
+
+	if (callback) {
+		req = l_new(struct peer_request, 1);
+		req->serial = serial;
+		req->callback = callback;
+		req->user_data = user_data;
+
+		l_queue_push_tail(classic->peer_requests, req);
+		peer_schedule_requests(dbus);
+	}
+
+	return serial;
+}
+
+static bool match_peer_request_serial(const void *a, const void *b)
+{
+	const struct peer_request *req = a;
+
+	return req->callback && req->serial == L_PTR_TO_UINT(b);
+}
+
+static bool peer_cancel(struct l_dbus *dbus, uint32_t serial)
+{
+	struct l_dbus_classic *classic =
+		l_container_of(dbus, struct l_dbus_classic, super);
+	struct peer_request *req;
+
+	req = l_queue_remove_if(classic->peer_requests,
+				match_peer_request_serial,
+				L_UINT_TO_PTR(serial));
+	if (!req)
+		return false;
+
+	peer_request_free(req);
+
+	return true;
+}
+
+static const struct l_dbus_ops classic_ops = {
+	.version = 1,
+	.send_message = classic_send_message,
+	.send_flush = classic_send_flush,
+	.recv_message = classic_recv_message,
+	.free = classic_free,
+	.name_ops = {
+		.get_name_owner = classic_get_name_owner,
+	},
+	.filter_ops = {
+		.add_match = classic_add_match,
+		.remove_match = classic_remove_match,
+	},
+	.name_acquire = classic_name_acquire,
+};
+
+static const struct l_dbus_ops peer_ops = {
+	.version = 1,
+	.peer = true,
+	.send_message = classic_send_message,
+	.send_flush = classic_send_flush,
+	.recv_message = classic_recv_message,
+	.free = classic_free,
+	.name_ops = {
+		.get_name_owner = peer_get_name_owner,
+	},
+	.filter_ops = {
+		.add_match = peer_add_match,
+		.remove_match = peer_remove_match,
+	},
+	.name_acquire = peer_name_acquire,
+	.cancel = peer_cancel,
+};
+
+static struct l_dbus_classic *classic_new(int fd, bool peer)
+{
+	struct l_dbus_classic *classic;
+
+	classic = l_new(struct l_dbus_classic, 1);
+	classic->super.driver = peer ? &peer_ops : &classic_ops;
+	classic->match_strings = l_hashmap_new();
+	classic->peer_requests = l_queue_new();
+
+	dbus_init(&classic->super, fd);
+
+	return classic;
+}
+
+static struct l_dbus *setup_dbus1(int fd, const char *guid, bool peer)
+{
+	static const unsigned char creds = 0x00;
+	char uid[6], hexuid[12], *ptr = hexuid;
+	struct l_dbus *dbus;
+	struct l_dbus_classic *classic;
+	ssize_t written;
+	unsigned int i;
+
+	if (snprintf(uid, sizeof(uid), "%d", geteuid()) < 1) {
+		close(fd);
+		return NULL;
+	}
+
+	for (i = 0; i < strlen(uid); i++)
 		ptr += sprintf(ptr, "%02x", uid[i]);
 
 	/* Send special credentials-passing nul byte */
@@ -1057,13 +2108,8 @@ static struct l_dbus *setup_dbus1(int fd, const char *guid)
 		return NULL;
 	}
 
-	classic = l_new(struct l_dbus_classic, 1);
+	classic = classic_new(fd, peer);
 	dbus = &classic->super;
-	dbus->driver = &classic_ops;
-
-	classic->match_strings = l_hashmap_new();
-
-	dbus_init(dbus, fd);
 	dbus->guid = l_strdup(guid);
 
 	classic->auth_command = l_strdup_printf("AUTH EXTERNAL %s\r\n", hexuid);
@@ -1078,13 +2124,14 @@ static struct l_dbus *setup_dbus1(int fd, const char *guid)
 	return dbus;
 }
 
-static struct l_dbus *setup_unix(char *params)
+/* Parse the parameters of a unix: address, modifying the string */
+static bool parse_unix_address(char *params, struct sockaddr_un *addr,
+					socklen_t *addr_len, char **out_guid,
+					char **out_path)
 {
 	char *path = NULL, *guid = NULL;
 	bool abstract = false;
-	struct sockaddr_un addr;
 	size_t len;
-	int fd;
 
 	while (params) {
 		char *key = strsep(&params, ",");
@@ -1110,65 +2157,87 @@ static struct l_dbus *setup_unix(char *params)
 	}
 
 	if (!path)
-		return NULL;
-
-	fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (fd < 0)
-		return NULL;
+		return false;
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
 
 	len = strlen(path);
 
 	if (abstract) {
-		if (len > sizeof(addr.sun_path) - 1) {
-			close(fd);
-			return NULL;
-		}
+		if (len > sizeof(addr->sun_path) - 1)
+			return false;
 
-		addr.sun_path[0] = '\0';
-		strncpy(addr.sun_path + 1, path, sizeof(addr.sun_path) - 2);
+		addr->sun_path[0] = '\0';
+		strncpy(addr->sun_path + 1, path, sizeof(addr->sun_path) - 2);
 		len++;
 	} else {
-		if (len > sizeof(addr.sun_path)) {
-			close(fd);
-			return NULL;
-		}
+		if (len > sizeof(addr->sun_path))
+			return false;
 
-		strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+		strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
 	}
 
-	if (connect(fd, (struct sockaddr *) &addr,
-				sizeof(addr.sun_family) + len) < 0) {
+	*addr_len = sizeof(addr->sun_family) + len;
+
+	if (out_guid)
+		*out_guid = guid;
+
+	if (out_path)
+		*out_path = abstract ? NULL : path;
+
+	return true;
+}
+
+static struct l_dbus *setup_unix(char *params, bool peer)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	char *guid;
+	int fd;
+
+	if (!parse_unix_address(params, &addr, &addr_len, &guid, NULL))
+		return NULL;
+
+	fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
 		close(fd);
 		return NULL;
 	}
 
-	return setup_dbus1(fd, guid);
+	return setup_dbus1(fd, guid, peer);
 }
 
-static struct l_dbus *setup_address(const char *address)
+static char *split_address(char **address, char **params)
 {
-	struct l_dbus *dbus = NULL;
-	char *address_copy;
+	char *transport;
 
-	address_copy = strdupa(address);
+	transport = strsep(address, ";");
+	if (!transport)
+		return NULL;
 
-	while (address_copy) {
-		char *transport = strsep(&address_copy, ";");
-		char *params;
+	*params = strchr(transport, ':');
+	if (*params)
+		*(*params)++ = '\0';
 
-		if (!transport)
-			break;
+	return transport;
+}
 
-		params = strchr(transport, ':');
-		if (params)
-			*params++ = '\0';
+static struct l_dbus *setup_address(const char *address, bool peer)
+{
+	struct l_dbus *dbus = NULL;
+	char *address_copy;
+	char *transport, *params;
 
+	address_copy = strdupa(address);
+
+	while ((transport = split_address(&address_copy, &params))) {
 		if (!strcmp(transport, "unix")) {
 			/* Function will modify params string */
-			dbus = setup_unix(params);
+			dbus = setup_unix(params, peer);
 			break;
 		}
 	}
@@ -1181,7 +2250,26 @@ LIB_EXPORT struct l_dbus *l_dbus_new(const char *address)
 	if (unlikely(!address))
 		return NULL;
 
-	return setup_address(address);
+	return setup_address(address, false);
+}
+
+/**
+ * l_dbus_new_peer:
+ * @address: address the peer listens on
+ *
+ * Connects directly to a peer, such as an l_dbus_server, instead of to a
+ * message bus.  Messages carry no sender or bus names on such a
+ * connection, signal watches match regardless of the sender and every
+ * service watch sees its service appear once the connection is up.
+ *
+ * Returns: a newly allocated l_dbus object or NULL on failure
+ **/
+LIB_EXPORT struct l_dbus *l_dbus_new_peer(const char *address)
+{
+	if (unlikely(!address))
+		return NULL;
+
+	return setup_address(address, true);
 }
 
 LIB_EXPORT struct l_dbus *l_dbus_new_default(enum l_dbus_bus bus)
@@ -1203,14 +2291,18 @@ LIB_EXPORT struct l_dbus *l_dbus_new_default(enum l_dbus_bus bus)
 		return NULL;
 	}
 
-	return setup_address(address);
+	return setup_address(address, false);
 }
 
 LIB_EXPORT void l_dbus_destroy(struct l_dbus *dbus)
 {
+
 	if (unlikely(!dbus))
 		return;
 
+	if (dbus->dispatch_destroyed)
+		*dbus->dispatch_destroyed = true;
+
 	if (dbus->ready_destroy)
 		dbus->ready_destroy(dbus->ready_data);
 
@@ -1219,9 +2311,21 @@ LIB_EXPORT void l_dbus_destroy(struct l_dbus *dbus)
 	_dbus_name_cache_free(dbus->name_cache);
 
 	l_hashmap_destroy(dbus->signal_list, signal_list_destroy);
-	l_hashmap_destroy(dbus->message_list, message_list_destroy);
+	pending_calls_destroy(dbus);
+
+	l_hashmap_destroy(dbus->replaceable_signals, NULL);
+
 	l_queue_destroy(dbus->message_queue, message_queue_destroy);
 
+	l_timeout_remove(dbus->deadline_timeout);
+	l_idle_remove(dbus->writable_work);
+
+	_dbus_stats_free(dbus->stats);
+	_dbus_capture_free(dbus->capture);
+
+	if (dbus->writable_destroy)
+		dbus->writable_destroy(dbus->writable_data);
+
 	l_io_destroy(dbus->io);
 
 	if (dbus->disconnect_destroy)
@@ -1234,10 +2338,152 @@ LIB_EXPORT void l_dbus_destroy(struct l_dbus *dbus)
 	l_free(dbus->unique_name);
 
 	_dbus_object_tree_free(dbus->tree);
+	_dbus_message_pool_free(dbus->message_pool);
 
 	dbus->driver->free(dbus);
 }
 
+static bool server_read_handler(struct l_io *io, void *user_data)
+{
+	struct l_dbus_server *server = user_data;
+	struct l_dbus_classic *classic;
+	int fd;
+
+	fd = accept4(l_io_get_fd(io), NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	if (!server->connect_handler) {
+		close(fd);
+		return true;
+	}
+
+	classic = classic_new(fd, true);
+	classic->super.guid = l_strdup(server->guid);
+	classic->auth_state = WAITING_FOR_AUTH;
+
+	l_io_set_read_handler(classic->super.io, server_auth_read_handler,
+							classic, NULL);
+
+	server->connect_handler(server, &classic->super, server->connect_data);
+
+	return true;
+}
+
+/**
+ * l_dbus_server_new:
+ * @address: unix: address to listen on
+ *
+ * Listens for direct connections from peers, as made with
+ * @l_dbus_new_peer.  Only processes running as the same user as this
+ * one, or as root, are let in.
+ *
+ * Returns: a newly allocated l_dbus_server object or NULL on failure
+ **/
+LIB_EXPORT struct l_dbus_server *l_dbus_server_new(const char *address)
+{
+	struct l_dbus_server *server;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	char *address_copy, *transport, *params, *path;
+	uint8_t guid[16];
+	int fd;
+
+	if (unlikely(!address))
+		return NULL;
+
+	address_copy = strdupa(address);
+
+	while ((transport = split_address(&address_copy, &params)))
+		if (!strcmp(transport, "unix"))
+			break;
+
+	if (!transport || !parse_unix_address(params, &addr, &addr_len,
+							NULL, &path))
+		return NULL;
+
+	if (!l_getrandom(guid, sizeof(guid)))
+		return NULL;
+
+	fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (bind(fd, (struct sockaddr *) &addr, addr_len) < 0 ||
+			listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	server = l_new(struct l_dbus_server, 1);
+	server->io = l_io_new(fd);
+	l_io_set_close_on_destroy(server->io, true);
+
+	server->guid = l_util_hexstring(guid, sizeof(guid));
+	server->path = l_strdup(path);
+
+	l_io_set_read_handler(server->io, server_read_handler, server, NULL);
+
+	return server;
+}
+
+/**
+ * l_dbus_server_destroy:
+ * @server: server to destroy
+ *
+ * Stops listening.  Connections already handed out through the connect
+ * handler are not affected.
+ **/
+LIB_EXPORT void l_dbus_server_destroy(struct l_dbus_server *server)
+{
+	if (unlikely(!server))
+		return;
+
+	if (server->connect_destroy)
+		server->connect_destroy(server->connect_data);
+
+	l_io_destroy(server->io);
+
+	if (server->path)
+		unlink(server->path);
+
+	l_free(server->path);
+	l_free(server->guid);
+	l_free(server);
+}
+
+/**
+ * l_dbus_server_set_connect_handler:
+ * @server: server object
+ * @function: function called with each new peer connection
+ * @user_data: user data passed to @function
+ * @destroy: destroy function for @user_data
+ *
+ * Sets the function that takes over each accepted connection.  The
+ * connection is handed out before the authentication completes, so its
+ * ready handler can still be set, and has to be freed with
+ * @l_dbus_destroy.  Connections are refused while no handler is set.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_server_set_connect_handler(
+				struct l_dbus_server *server,
+				l_dbus_server_connect_func_t function,
+				void *user_data, l_dbus_destroy_func_t destroy)
+{
+	if (unlikely(!server))
+		return false;
+
+	if (server->connect_destroy)
+		server->connect_destroy(server->connect_data);
+
+	server->connect_handler = function;
+	server->connect_destroy = destroy;
+	server->connect_data = user_data;
+
+	return true;
+}
+
 LIB_EXPORT bool l_dbus_set_ready_handler(struct l_dbus *dbus,
 				l_dbus_ready_func_t function,
 				void *user_data, l_dbus_destroy_func_t destroy)
@@ -1291,6 +2537,293 @@ LIB_EXPORT bool l_dbus_set_debug(struct l_dbus *dbus,
 	return true;
 }
 
+/**
+ * l_dbus_set_reply_timeout:
+ * @dbus: D-Bus connection
+ * @msec: milliseconds to wait for a reply, 0 to wait forever
+ *
+ * Sets how long method calls sent on this connection wait for their reply
+ * before their callback is handed an org.freedesktop.DBus.Error.NoReply
+ * error instead.  The default is 25 seconds.  Calls already sent keep
+ * their timeout.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_set_reply_timeout(struct l_dbus *dbus,
+							unsigned int msec)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	dbus->reply_timeout = msec;
+
+	return true;
+}
+
+/**
+ * l_dbus_set_max_pending_calls:
+ * @dbus: D-Bus connection
+ * @max: maximum number of calls awaiting a reply, 0 for no limit
+ *
+ * Limits the number of method calls with a reply callback that may be
+ * outstanding on this connection.  Once the limit is reached
+ * @l_dbus_send_with_reply and @l_dbus_method_call fail until replies
+ * arrive, time out or calls get cancelled.  The destroy callback of a
+ * call turned away is called before these return.  Calls the connection
+ * makes on its own, such as name lookups and requests, are not limited.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_set_max_pending_calls(struct l_dbus *dbus,
+							unsigned int max)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	dbus->max_calls = max;
+
+	return true;
+}
+
+/**
+ * l_dbus_set_send_watermarks:
+ * @dbus: D-Bus connection
+ * @low_water: number of queued messages at which the queue is writable again
+ * @high_water: number of queued messages at which the queue is unwritable,
+ *              0 to never report it unwritable
+ *
+ * Sets the limits for the writable handler, see
+ * @l_dbus_set_writable_handler.  Messages are still accepted above the
+ * high-water mark, it is up to the producers to hold back.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_set_send_watermarks(struct l_dbus *dbus,
+						unsigned int low_water,
+						unsigned int high_water)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	if (high_water && low_water >= high_water)
+		return false;
+
+	dbus->send_low_water = low_water;
+	dbus->send_high_water = high_water;
+	send_queue_check_watermarks(dbus);
+
+	return true;
+}
+
+/**
+ * l_dbus_set_writable_handler:
+ * @dbus: D-Bus connection
+ * @function: function called when the send queue changes writability
+ * @user_data: user data passed to @function
+ * @destroy: destroy function for @user_data
+ *
+ * Sets the function told when the queue of messages waiting to be written
+ * reaches the high-water mark, with @writable set to #false, and when it
+ * has drained to the low-water mark again, with @writable set to #true.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_dbus_set_writable_handler(struct l_dbus *dbus,
+					l_dbus_writable_func_t function,
+					void *user_data,
+					l_dbus_destroy_func_t destroy)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	if (dbus->writable_destroy)
+		dbus->writable_destroy(dbus->writable_data);
+
+	dbus->writable_handler = function;
+	dbus->writable_destroy = destroy;
+	dbus->writable_data = user_data;
+
+	return true;
+}
+
+/**
+ * l_dbus_stats_enable:
+ * @dbus: D-Bus connection
+ * @enable: whether to collect statistics
+ *
+ * Starts or stops collecting message counters, queue high-water marks
+ * and latency histograms for @dbus.  Collection is off by default,
+ * stopping it discards everything collected so far.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_stats_enable(struct l_dbus *dbus, bool enable)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	if (!enable) {
+		_dbus_stats_free(dbus->stats);
+		dbus->stats = NULL;
+		return true;
+	}
+
+	if (dbus->stats)
+		return true;
+
+	dbus->stats = _dbus_stats_new();
+	_dbus_stats_send_queue(dbus->stats, dbus->send_queued);
+	_dbus_stats_pending_calls(dbus->stats, dbus->pending_count);
+
+	return true;
+}
+
+LIB_EXPORT bool l_dbus_stats_get(struct l_dbus *dbus,
+					struct l_dbus_stats *stats)
+{
+	if (unlikely(!dbus || !stats))
+		return false;
+
+	if (!dbus->stats)
+		return false;
+
+	_dbus_stats_get(dbus->stats, stats);
+
+	return true;
+}
+
+/**
+ * l_dbus_stats_foreach_histogram:
+ * @dbus: D-Bus connection
+ * @function: called for each histogram
+ * @user_data: user data passed to @function
+ *
+ * Calls @function for every interface and member that a histogram has
+ * been kept for.  L_DBUS_STATS_CALL_LATENCY histograms time the method
+ * calls made on @dbus from sending to receiving the reply,
+ * L_DBUS_STATS_DISPATCH_TIME ones the method handlers of the objects
+ * registered on @dbus.  Bucket n counts the samples that took from 2^n
+ * up to 2^(n + 1) microseconds.
+ *
+ * Returns: true on success, false if statistics are not enabled
+ **/
+LIB_EXPORT bool l_dbus_stats_foreach_histogram(struct l_dbus *dbus,
+					l_dbus_stats_histogram_func_t function,
+					void *user_data)
+{
+	if (unlikely(!dbus || !function))
+		return false;
+
+	if (!dbus->stats)
+		return false;
+
+	_dbus_stats_foreach_histogram(dbus->stats, function, user_data);
+
+	return true;
+}
+
+LIB_EXPORT bool l_dbus_stats_reset(struct l_dbus *dbus)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	if (!dbus->stats)
+		return false;
+
+	_dbus_stats_reset(dbus->stats);
+
+	return true;
+}
+
+/**
+ * l_dbus_stats_export:
+ * @dbus: D-Bus connection
+ * @path: object path
+ *
+ * Enables statistics on @dbus and makes them readable over @dbus itself
+ * through the L_DBUS_INTERFACE_STATS interface at @path.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_stats_export(struct l_dbus *dbus, const char *path)
+{
+	if (unlikely(!dbus || !path))
+		return false;
+
+	if (unlikely(!dbus->tree))
+		return false;
+
+	if (!dbus->stats_exported) {
+		if (!_dbus_object_tree_register_interface(dbus->tree,
+						L_DBUS_INTERFACE_STATS,
+						_dbus_stats_setup_interface,
+						NULL, false))
+			return false;
+
+		dbus->stats_exported = true;
+	}
+
+	if (!_dbus_object_tree_add_interface(dbus->tree, path,
+						L_DBUS_INTERFACE_STATS, NULL))
+		return false;
+
+	return l_dbus_stats_enable(dbus, true);
+}
+
+/**
+ * l_dbus_capture_start:
+ * @dbus: D-Bus connection
+ * @path: file to write the capture to
+ *
+ * Records every message sent or received on @dbus from now on, with a
+ * timestamp, to a pcap file at @path using the D-Bus link type.  Received
+ * messages are recorded as they are read, so those that are dropped or
+ * never dispatched are included too.  A capture already running is
+ * stopped first.  Messages are buffered and written out in batches, so
+ * the file is only complete once the capture stops.
+ *
+ * Returns: true on success, false otherwise
+ **/
+LIB_EXPORT bool l_dbus_capture_start(struct l_dbus *dbus, const char *path)
+{
+	struct _dbus_capture *capture;
+
+	if (unlikely(!dbus || !path))
+		return false;
+
+	capture = _dbus_capture_new(path);
+	if (!capture)
+		return false;
+
+	_dbus_capture_free(dbus->capture);
+	dbus->capture = capture;
+
+	return true;
+}
+
+/**
+ * l_dbus_capture_stop:
+ * @dbus: D-Bus connection
+ *
+ * Stops the capture started with @l_dbus_capture_start, writes out what
+ * is still buffered and closes the file.
+ *
+ * Returns: true on success, false if no capture was running
+ **/
+LIB_EXPORT bool l_dbus_capture_stop(struct l_dbus *dbus)
+{
+	if (unlikely(!dbus))
+		return false;
+
+	if (!dbus->capture)
+		return false;
+
+	_dbus_capture_free(dbus->capture);
+	dbus->capture = NULL;
+
+	return true;
+}
+
 LIB_EXPORT uint32_t l_dbus_send_with_reply(struct l_dbus *dbus,
 						struct l_dbus_message *message,
 						l_dbus_message_func_t function,
@@ -1300,6 +2833,16 @@ LIB_EXPORT uint32_t l_dbus_send_with_reply(struct l_dbus *dbus,
 	if (unlikely(!dbus || !message))
 		return 0;
 
+	/* Push back on callers once too many calls await their replies */
+	if (call_limit_reached(dbus, function)) {
+		l_dbus_message_unref(message);
+
+		if (destroy)
+			destroy(user_data);
+
+		return 0;
+	}
+
 	return send_message(dbus, false, message, function, user_data, destroy);
 }
 
@@ -1312,37 +2855,37 @@ LIB_EXPORT uint32_t l_dbus_send(struct l_dbus *dbus,
 	return send_message(dbus, false, message, NULL, NULL, NULL);
 }
 
-static bool remove_entry(void *data, void *user_data)
+static bool match_serial(const void *a, const void *b)
 {
-	struct message_callback *callback = data;
-	uint32_t serial = L_PTR_TO_UINT(user_data);
+	const struct message_callback *callback = a;
+	uint32_t serial = L_PTR_TO_UINT(b);
 
-	if (callback->serial == serial) {
-		message_queue_destroy(callback);
-		return true;
-	}
-
-	return false;
+	return callback->serial == serial;
 }
 
 LIB_EXPORT bool l_dbus_cancel(struct l_dbus *dbus, uint32_t serial)
 {
 	struct message_callback *callback;
-	unsigned int count;
 
 	if (unlikely(!dbus || !serial))
 		return false;
 
-	callback = l_hashmap_remove(dbus->message_list, L_UINT_TO_PTR(serial));
-        if (callback) {
-		message_queue_destroy(callback);
-		return true;
-	}
+	callback = pending_calls_remove(dbus, serial);
 
-	count = l_queue_foreach_remove(dbus->message_queue, remove_entry,
+	if (!callback) {
+		callback = l_queue_find(dbus->message_queue, match_serial,
 							L_UINT_TO_PTR(serial));
-	if (!count)
-		return false;
+		if (callback)
+			send_queue_remove(dbus, callback);
+	}
+
+	/* Requests the driver answers itself carry no message */
+	if (!callback)
+		return dbus->driver->cancel &&
+			dbus->driver->cancel(dbus, serial);
+
+	call_done(dbus, callback);
+	message_queue_destroy(callback);
 
 	return true;
 }
@@ -1397,6 +2940,13 @@ LIB_EXPORT uint32_t l_dbus_method_call(struct l_dbus *dbus,
 	if (unlikely(!dbus))
 		return 0;
 
+	if (call_limit_reached(dbus, function)) {
+		if (destroy)
+			destroy(user_data);
+
+		return 0;
+	}
+
 	message = l_dbus_message_new_method_call(dbus, destination, path,
 							interface, method);
 
@@ -1413,6 +2963,11 @@ uint8_t _dbus_get_version(struct l_dbus *dbus)
 	return dbus->driver->version;
 }
 
+struct _dbus_message_pool *_dbus_get_message_pool(struct l_dbus *dbus)
+{
+	return dbus->message_pool;
+}
+
 int _dbus_get_fd(struct l_dbus *dbus)
 {
 	return l_io_get_fd(dbus->io);
@@ -1423,6 +2978,11 @@ struct _dbus_object_tree *_dbus_get_tree(struct l_dbus *dbus)
 	return dbus->tree;
 }
 
+struct _dbus_stats *_dbus_get_stats(struct l_dbus *dbus)
+{
+	return dbus->stats;
+}
+
 /**
  * l_dbus_register_interface:
  * @dbus: D-Bus connection as returned by @l_dbus_new*
@@ -1703,7 +3263,8 @@ LIB_EXPORT unsigned int l_dbus_add_signal_watch(struct l_dbus *dbus,
 	rule[rule_len].type = L_DBUS_MATCH_TYPE;
 	rule[rule_len++].value = "signal";
 
-	if (sender) {
+	/* Messages on a peer connection carry no sender */
+	if (sender && !dbus->driver->peer) {
 		rule[rule_len].type = L_DBUS_MATCH_SENDER;
 		rule[rule_len++].value = sender;
 	}
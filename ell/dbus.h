@@ -36,6 +36,9 @@ extern "C" {
 #define L_DBUS_INTERFACE_INTROSPECTABLE	"org.freedesktop.DBus.Introspectable"
 #define L_DBUS_INTERFACE_PROPERTIES	"org.freedesktop.DBus.Properties"
 #define L_DBUS_INTERFACE_OBJECT_MANAGER	"org.freedesktop.DBus.ObjectManager"
+#define L_DBUS_INTERFACE_STATS		"org.ell.DBus.Stats"
+
+#define L_DBUS_STATS_HISTOGRAM_BUCKETS	32
 
 enum l_dbus_bus {
 	L_DBUS_SYSTEM_BUS,
@@ -55,11 +58,13 @@ enum l_dbus_match_type {
 #define L_DBUS_MATCH_ARGUMENT(i)	(L_DBUS_MATCH_ARG0 + (i))
 
 struct l_dbus;
+struct l_dbus_server;
 struct l_dbus_interface;
 struct l_dbus_message_builder;
 
 typedef void (*l_dbus_ready_func_t) (void *user_data);
 typedef void (*l_dbus_disconnect_func_t) (void *user_data);
+typedef void (*l_dbus_writable_func_t) (bool writable, void *user_data);
 
 typedef void (*l_dbus_debug_func_t) (const char *str, void *user_data);
 typedef void (*l_dbus_destroy_func_t) (void *user_data);
@@ -70,8 +75,13 @@ typedef void (*l_dbus_watch_func_t) (struct l_dbus *dbus, void *user_data);
 typedef void (*l_dbus_name_acquire_func_t) (struct l_dbus *dbus, bool success,
 						bool queued, void *user_data);
 
+typedef void (*l_dbus_server_connect_func_t) (struct l_dbus_server *server,
+						struct l_dbus *dbus,
+						void *user_data);
+
 struct l_dbus *l_dbus_new(const char *address);
 struct l_dbus *l_dbus_new_default(enum l_dbus_bus bus);
+struct l_dbus *l_dbus_new_peer(const char *address);
 void l_dbus_destroy(struct l_dbus *dbus);
 
 bool l_dbus_set_ready_handler(struct l_dbus *dbus, l_dbus_ready_func_t function,
@@ -83,6 +93,62 @@ bool l_dbus_set_disconnect_handler(struct l_dbus *dbus,
 bool l_dbus_set_debug(struct l_dbus *dbus, l_dbus_debug_func_t function,
 				void *user_data, l_dbus_destroy_func_t destroy);
 
+bool l_dbus_set_reply_timeout(struct l_dbus *dbus, unsigned int msec);
+bool l_dbus_set_max_pending_calls(struct l_dbus *dbus, unsigned int max);
+
+bool l_dbus_set_send_watermarks(struct l_dbus *dbus, unsigned int low_water,
+						unsigned int high_water);
+bool l_dbus_set_writable_handler(struct l_dbus *dbus,
+				l_dbus_writable_func_t function,
+				void *user_data, l_dbus_destroy_func_t destroy);
+
+struct l_dbus_stats {
+	uint64_t messages_sent;
+	uint64_t messages_received;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t calls_sent;
+	uint64_t calls_received;
+	uint64_t replies_received;
+	uint64_t errors_received;
+	uint64_t signals_sent;
+	uint64_t signals_received;
+	uint64_t calls_timed_out;
+	uint32_t send_queue_length;
+	uint32_t send_queue_max;
+	uint32_t pending_calls;
+	uint32_t pending_calls_max;
+};
+
+enum l_dbus_stats_histogram {
+	L_DBUS_STATS_CALL_LATENCY,
+	L_DBUS_STATS_DISPATCH_TIME,
+};
+
+typedef void (*l_dbus_stats_histogram_func_t) (
+					enum l_dbus_stats_histogram type,
+					const char *interface,
+					const char *member,
+					const uint64_t *buckets,
+					void *user_data);
+
+bool l_dbus_stats_enable(struct l_dbus *dbus, bool enable);
+bool l_dbus_stats_get(struct l_dbus *dbus, struct l_dbus_stats *stats);
+bool l_dbus_stats_foreach_histogram(struct l_dbus *dbus,
+					l_dbus_stats_histogram_func_t function,
+					void *user_data);
+bool l_dbus_stats_reset(struct l_dbus *dbus);
+bool l_dbus_stats_export(struct l_dbus *dbus, const char *path);
+
+bool l_dbus_capture_start(struct l_dbus *dbus, const char *path);
+bool l_dbus_capture_stop(struct l_dbus *dbus);
+
+struct l_dbus_server *l_dbus_server_new(const char *address);
+void l_dbus_server_destroy(struct l_dbus_server *server);
+bool l_dbus_server_set_connect_handler(struct l_dbus_server *server,
+				l_dbus_server_connect_func_t function,
+				void *user_data, l_dbus_destroy_func_t destroy);
+
 struct l_dbus_message;
 
 struct l_dbus_message_iter {
@@ -137,6 +203,10 @@ bool l_dbus_message_get_no_reply(struct l_dbus_message *message);
 bool l_dbus_message_set_no_autostart(struct l_dbus_message *message, bool on);
 bool l_dbus_message_get_no_autostart(struct l_dbus_message *message);
 
+bool l_dbus_message_set_reply_timeout(struct l_dbus_message *message,
+							unsigned int msec);
+bool l_dbus_message_set_replaceable(struct l_dbus_message *message, bool on);
+
 typedef void (*l_dbus_message_func_t) (struct l_dbus_message *message,
 							void *user_data);
 
@@ -173,6 +243,8 @@ bool l_dbus_message_iter_get_variant(struct l_dbus_message_iter *iter,
 						const char *signature, ...);
 bool l_dbus_message_iter_get_fixed_array(struct l_dbus_message_iter *iter,
 						void *out, uint32_t *n_elem);
+bool l_dbus_message_iter_get_payload(struct l_dbus_message_iter *iter,
+					const void **out, size_t *out_size);
 
 bool l_dbus_message_set_arguments(struct l_dbus_message *message,
 						const char *signature, ...);
@@ -221,6 +293,10 @@ bool l_dbus_message_builder_append_from_valist(
 					struct l_dbus_message_builder *builder,
 					const char *signature, va_list args);
 
+bool l_dbus_message_builder_append_payload(
+					struct l_dbus_message_builder *builder,
+					const void *data, size_t size);
+
 struct l_dbus_message *l_dbus_message_builder_finalize(
 					struct l_dbus_message_builder *builder);
 
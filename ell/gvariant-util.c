@@ -176,39 +176,26 @@ static const char *validate_next_type(const char *sig, int *out_alignment)
 
 bool _gvariant_valid_signature(const char *sig)
 {
-	const char *s = sig;
-	int a;
-
-	if (strlen(sig) > 255)
-		return false;
+	struct _dbus_signature *signature;
+	bool valid;
 
-	do {
-		s = validate_next_type(s, &a);
-
-		if (!s)
-			return false;
-	} while (*s);
+	signature = _dbus_signature_get(sig, strlen(sig));
+	valid = signature != NULL;
+	_dbus_signature_put(signature);
 
-	return true;
+	return valid;
 }
 
 int _gvariant_num_children(const char *sig)
 {
-	const char *s = sig;
-	int a;
-	int num_children = 0;
+	struct _dbus_signature *signature;
+	int num_children = -1;
 
-	if (strlen(sig) > 255)
-		return false;
+	signature = _dbus_signature_get(sig, strlen(sig));
+	if (signature)
+		num_children = signature->num_children;
 
-	do {
-		s = validate_next_type(s, &a);
-
-		if (!s)
-			return -1;
-
-		num_children += 1;
-	} while (*s);
+	_dbus_signature_put(signature);
 
 	return num_children;
 }
@@ -354,80 +341,74 @@ static inline void write_word_le(void *p, size_t value, size_t sz) {
 }
 
 static bool gvariant_iter_init_internal(struct l_dbus_message_iter *iter,
-					struct l_dbus_message *message,
-					enum dbus_container_type type,
-					const char *sig_start,
-					const char *sig_end, const void *data,
-					size_t len)
+				struct l_dbus_message *message,
+				enum dbus_container_type type,
+				const char *sig_start, const char *sig_end,
+				const void *data, size_t len)
 {
-	const char *p;
+	const struct _dbus_signature_type *sig_types;
+	const struct _dbus_signature_type *child_type;
+	struct _dbus_signature *lookup = NULL;
+	unsigned int pos;
 	int i;
 	int v;
-	char subsig[256];
 	unsigned int num_variable = 0;
 	unsigned int offset_len = offset_length(len, 0);
 	size_t last_offset;
 	struct gvariant_type_info {
-		uint8_t sig_start;
-		uint8_t sig_end;
 		bool fixed_size : 1;
 		unsigned int alignment : 4;
 		size_t end;		/* Index past the end of the type */
-	} *children;
-	int n_children;
-
-	if (sig_end) {
-		size_t len = sig_end - sig_start;
-		memcpy(subsig, sig_start, len);
-		subsig[len] = '\0';
-	} else
-		strcpy(subsig, sig_start);
+	} children[255];
+	int n_children = 0;
 
 	iter->message = message;
 	iter->sig_start = sig_start;
-	iter->sig_len = strlen(subsig);
+	iter->sig_len = sig_end ? (size_t) (sig_end - sig_start) :
+							strlen(sig_start);
 	iter->sig_pos = 0;
 	iter->data = data;
 	iter->len = len;
 	iter->pos = 0;
 
-	if (subsig[0] != '\0') {
-		n_children = _gvariant_num_children(subsig);
-		if (n_children < 0)
-			return false;
+	sig_types = _dbus_message_signature_types(message, sig_start,
+							iter->sig_len);
 
-		children = l_new(struct gvariant_type_info, n_children);
-	} else {
-		n_children = 0;
+	/* Iterators without a message look their signature up */
+	if (iter->sig_len && !sig_types) {
+		lookup = _dbus_signature_get(sig_start, iter->sig_len);
+		if (!lookup)
+			return false;
 
-		children = NULL;
+		sig_types = lookup->types;
 	}
 
-	for (p = sig_start, i = 0; i < n_children; i++) {
-		int alignment;
-		size_t size;
-		size_t len;
+	for (pos = 0; pos < iter->sig_len; pos += child_type->length) {
+		child_type = &sig_types[pos];
 
-		children[i].sig_start = p - sig_start;
-		p = validate_next_type(p, &alignment);
-		children[i].sig_end = p - sig_start;
+		if (!child_type->length)
+			break;
 
-		len = children[i].sig_end - children[i].sig_start;
-		memcpy(subsig, sig_start + children[i].sig_start, len);
-		subsig[len] = '\0';
+		children[n_children].alignment =
+					child_type->gvariant_alignment;
+		children[n_children].fixed_size =
+					child_type->gvariant_fixed_size;
 
-		children[i].alignment = alignment;
-		children[i].fixed_size = _gvariant_is_fixed_size(subsig);
+		if (child_type->gvariant_fixed_size)
+			children[n_children].end =
+					child_type->gvariant_fixed_size;
 
-		if (children[i].fixed_size) {
-			size = _gvariant_get_fixed_size(subsig);
-			children[i].end = size;
-		} else if (i + 1 < n_children)
-			num_variable += 1;
+		n_children += 1;
 	}
 
+	_dbus_signature_put(lookup);
+
+	for (i = 0; i + 1 < n_children; i++)
+		if (!children[i].fixed_size)
+			num_variable += 1;
+
 	if (len < num_variable * offset_len)
-		goto fail;
+		return false;
 
 	last_offset = len - num_variable * offset_len;
 
@@ -448,7 +429,7 @@ static bool gvariant_iter_init_internal(struct l_dbus_message_iter *iter,
 			children[i].end += o;
 
 			if (children[i].end > len)
-				goto fail;
+				return false;
 
 			continue;
 		}
@@ -464,7 +445,7 @@ static bool gvariant_iter_init_internal(struct l_dbus_message_iter *iter,
 		num_variable -= 1;
 
 		if (children[i].end > len)
-			goto fail;
+			return false;
 	}
 
 	iter->container_type = type;
@@ -476,13 +457,7 @@ static bool gvariant_iter_init_internal(struct l_dbus_message_iter *iter,
 		iter->offsets = iter->data + offset;
 	}
 
-	l_free(children);
-
 	return true;
-
-fail:
-	l_free(children);
-	return false;
 }
 
 bool _gvariant_iter_init(struct l_dbus_message_iter *iter,
@@ -490,42 +465,42 @@ bool _gvariant_iter_init(struct l_dbus_message_iter *iter,
 				const char *sig_start, const char *sig_end,
 				const void *data, size_t len)
 {
+	size_t sig_len = sig_end ? (size_t) (sig_end - sig_start) :
+							strlen(sig_start);
+
+	_dbus_message_signature_get(message, sig_start, sig_len);
+
 	return gvariant_iter_init_internal(iter, message,
-						DBUS_CONTAINER_TYPE_STRUCT,
-						sig_start, sig_end, data, len);
+					DBUS_CONTAINER_TYPE_STRUCT,
+					sig_start, sig_end, data, len);
 }
 
 static const void *next_item(struct l_dbus_message_iter *iter,
 							size_t *out_item_size)
 {
+	const struct _dbus_signature_type *type;
+	struct _dbus_signature *lookup;
 	const void *start;
-	const char *p;
-	char sig[256];
-	int alignment;
-	bool fixed_size;
+	unsigned int alignment;
+	unsigned int fixed_size;
 	bool last_member;
 	unsigned int sig_len;
 	unsigned int offset_len;
 
-	memcpy(sig, iter->sig_start + iter->sig_pos,
-			iter->sig_len - iter->sig_pos);
-	sig[iter->sig_len - iter->sig_pos] = '\0';
+	type = _dbus_iter_get_type(iter, &lookup);
+	if (!type)
+		return NULL;
 
 	/*
 	 * Find the next type and make a note whether it is the last in the
 	 * structure.  Arrays will always have a single complete type, so
 	 * last_member will always be true.
 	 */
-	p = validate_next_type(sig, &alignment);
-	if (!p)
-		return NULL;
-
-	sig_len = p - sig;
-
-	last_member = *p == '\0';
-	sig[sig_len] = '\0';
-
-	fixed_size = _gvariant_is_fixed_size(sig);
+	sig_len = type->length;
+	alignment = type->gvariant_alignment;
+	fixed_size = type->gvariant_fixed_size;
+	last_member = iter->sig_pos + sig_len == iter->sig_len;
+	_dbus_signature_put(lookup);
 
 	if (iter->container_type != DBUS_CONTAINER_TYPE_ARRAY)
 		iter->sig_pos += sig_len;
@@ -533,7 +508,7 @@ static const void *next_item(struct l_dbus_message_iter *iter,
 	iter->pos = align_len(iter->pos, alignment);
 
 	if (fixed_size) {
-		*out_item_size = _gvariant_get_fixed_size(sig);
+		*out_item_size = fixed_size;
 		goto done;
 	}
 
@@ -678,6 +653,9 @@ bool _gvariant_iter_enter_struct(struct l_dbus_message_iter *iter,
 	type = is_dict ? DBUS_CONTAINER_TYPE_DICT_ENTRY :
 			DBUS_CONTAINER_TYPE_STRUCT;
 
+	_dbus_message_signature_enter(iter->message, iter->sig_start,
+							sig_start);
+
 	return gvariant_iter_init_internal(structure, iter->message,
 						type, sig_start, sig_end,
 						start, item_size);
@@ -686,9 +664,11 @@ bool _gvariant_iter_enter_struct(struct l_dbus_message_iter *iter,
 bool _gvariant_iter_enter_variant(struct l_dbus_message_iter *iter,
 					struct l_dbus_message_iter *variant)
 {
+	struct _dbus_signature *signature;
+	struct _dbus_signature *lookup = NULL;
 	size_t item_size;
 	const void *start, *end, *nul;
-	char signature[256];
+	bool single;
 
 	if (iter->sig_start[iter->sig_pos] != 'v')
 		return false;
@@ -707,16 +687,23 @@ bool _gvariant_iter_enter_variant(struct l_dbus_message_iter *iter,
 	if (end - nul - 1 > 255)
 		return false;
 
-	memcpy(signature, nul + 1, end - nul - 1);
-	signature[end - nul - 1] = '\0';
+	if (iter->message)
+		signature = _dbus_message_signature_get(iter->message,
+							nul + 1, end - nul - 1);
+	else
+		signature = lookup = _dbus_signature_get(nul + 1,
+							end - nul - 1);
 
-	if (_gvariant_num_children(signature) != 1)
+	single = signature && signature->num_children == 1;
+	_dbus_signature_put(lookup);
+
+	if (!single)
 		return false;
 
 	return gvariant_iter_init_internal(variant, iter->message,
-						DBUS_CONTAINER_TYPE_VARIANT,
-						nul + 1, end,
-						start, nul - start);
+					DBUS_CONTAINER_TYPE_VARIANT,
+					nul + 1, end,
+					start, nul - start);
 }
 
 bool _gvariant_iter_enter_array(struct l_dbus_message_iter *iter,
@@ -742,10 +729,13 @@ bool _gvariant_iter_enter_array(struct l_dbus_message_iter *iter,
 	else
 		sig_end = iter->sig_start + iter->sig_pos;
 
+	_dbus_message_signature_enter(iter->message, iter->sig_start,
+							sig_start);
+
 	return gvariant_iter_init_internal(array, iter->message,
-						DBUS_CONTAINER_TYPE_ARRAY,
-						sig_start, sig_end,
-						start, item_size);
+					DBUS_CONTAINER_TYPE_ARRAY,
+					sig_start, sig_end,
+					start, item_size);
 }
 
 bool _gvariant_iter_skip_entry(struct l_dbus_message_iter *iter)
@@ -789,9 +779,15 @@ static inline size_t grow_body(struct dbus_builder *builder,
 {
 	size_t size = align_len(builder->body_pos, alignment);
 
+	/* Grow by at least half again so appends do not realloc each time */
 	if (size + len > builder->body_size) {
-		builder->body = l_realloc(builder->body, size + len);
-		builder->body_size = size + len;
+		size_t alloc = builder->body_size + builder->body_size / 2;
+
+		if (alloc < size + len)
+			alloc = size + len;
+
+		builder->body = l_realloc(builder->body, alloc);
+		builder->body_size = alloc;
 	}
 
 	if (size - builder->body_pos > 0)
@@ -1263,6 +1259,24 @@ bool _gvariant_builder_append_basic(struct dbus_builder *builder,
 	return true;
 }
 
+/* Append all elements of the byte array being built in one copy */
+bool _gvariant_builder_append_bytes(struct dbus_builder *builder,
+					const void *data, size_t len)
+{
+	struct container *container = l_queue_peek_head(builder->containers);
+	size_t start;
+
+	if (unlikely(container->type != DBUS_CONTAINER_TYPE_ARRAY ||
+			strcmp(container->signature, "y")))
+		return false;
+
+	start = grow_body(builder, len, 1);
+	memcpy(builder->body + start, data, len);
+	container->variable_is_last = false;
+
+	return true;
+}
+
 bool _gvariant_builder_mark(struct dbus_builder *builder)
 {
 	struct container *container = l_queue_peek_head(builder->containers);
@@ -1303,6 +1317,12 @@ bool _gvariant_builder_rewind(struct dbus_builder *builder)
 	return true;
 }
 
+/*
+ * Hands the body and the signature over to the caller.  The builder is
+ * spent afterwards, it can only be asked for the size of the buffer it
+ * allocated with _gvariant_builder_get_capacity() and then freed, it is
+ * not reused.
+ */
 char *_gvariant_builder_finish(struct dbus_builder *builder,
 				void **body, size_t *body_size)
 {
@@ -1342,9 +1362,11 @@ char *_gvariant_builder_finish(struct dbus_builder *builder,
 	 * _gvariant_message_finalize.
 	 */
 	size = 3 + strlen(signature) + 8;
-	if (builder->body_pos + size > builder->body_size)
+	if (builder->body_pos + size > builder->body_size) {
 		builder->body = l_realloc(builder->body,
 						builder->body_pos + size);
+		builder->body_size = builder->body_pos + size;
+	}
 
 	variant_buf = builder->body + builder->body_pos;
 	*variant_buf++ = 0;
@@ -1355,11 +1377,30 @@ char *_gvariant_builder_finish(struct dbus_builder *builder,
 	*body = builder->body;
 	*body_size = builder->body_pos;
 	builder->body = NULL;
-	builder->body_size = 0;
 
 	return signature;
 }
 
+/*
+ * Hand an empty builder a @size byte buffer to write the body into, it is
+ * only reallocated once the body outgrows it.
+ */
+void _gvariant_builder_set_buffer(struct dbus_builder *builder,
+					void *buffer, size_t size)
+{
+	l_free(builder->body);
+
+	builder->body = buffer;
+	builder->body_size = size;
+	builder->body_pos = 0;
+}
+
+/* Allocated size of the body buffer, still valid once it has been taken */
+size_t _gvariant_builder_get_capacity(struct dbus_builder *builder)
+{
+	return builder->body_size;
+}
+
 /*
  * Write the header's framing offset after the body variant which is the
  * last piece of data in the message after the header, the padding and
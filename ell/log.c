@@ -33,9 +33,14 @@
 #include <fnmatch.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
 
 #include "queue.h"
+#include "hashmap.h"
+#include "string.h"
+#include "time.h"
 #include "log.h"
+#include "log-private.h"
 #include "private.h"
 
 struct debug_section {
@@ -68,8 +73,41 @@ static const char *log_ident = "";
 static int log_fd = -1;
 static unsigned long log_pid;
 
+/*
+ * Asynchronous mode: syslog and journal records are formatted straight
+ * into a preallocated ring and written out in batches from the main loop.
+ * Every record starts with a 32-bit payload length and is padded to 4
+ * bytes.  A record never wraps, if it does not fit at the end of the
+ * buffer the remaining space is skipped (wrap is set) and the record is
+ * placed at offset 0 instead.  Both producer and consumer run on the
+ * main loop thread, so no locking is needed.
+ */
+#define LOG_RECORD_MAX		4096
+#define LOG_RING_MIN		(4 * LOG_RECORD_MAX)
+#define LOG_BATCH_MAX		64
+
+struct log_ring {
+	uint8_t *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t wrap;
+	unsigned int dropped;
+	int idle_id;
+	bool watching;
+	struct mmsghdr msgs[LOG_BATCH_MAX];
+	struct iovec iov[LOG_BATCH_MAX];
+};
+
+static struct log_ring *log_ring;
+
+static void log_ring_flush(bool blocking);
+
 static inline void close_log(void)
 {
+	if (log_ring)
+		log_ring_flush(true);
+
 	if (log_fd > 0) {
 		close(log_fd);
 		log_fd = -1;
@@ -96,6 +134,254 @@ static int open_log(const char *path)
 	return 0;
 }
 
+static inline size_t log_record_len(size_t payload)
+{
+	return align_len(sizeof(uint32_t) + payload, 4);
+}
+
+/*
+ * Returns a pointer to LOG_RECORD_MAX bytes of contiguous free space for
+ * the next record, or NULL if the ring is full.
+ */
+static uint8_t *log_ring_reserve(struct log_ring *ring)
+{
+	size_t need = log_record_len(LOG_RECORD_MAX);
+
+	if (ring->head == ring->tail) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->wrap = SIZE_MAX;
+	}
+
+	if (ring->head >= ring->tail) {
+		if (ring->size - ring->head >= need)
+			goto done;
+
+		/* Never let head catch up with tail, that means empty */
+		if (ring->tail <= need)
+			return NULL;
+
+		ring->wrap = ring->head;
+		ring->head = 0;
+		goto done;
+	}
+
+	if (ring->tail - ring->head <= need)
+		return NULL;
+
+done:
+	return ring->buf + ring->head + sizeof(uint32_t);
+}
+
+static void log_ring_commit(struct log_ring *ring, size_t len)
+{
+	uint32_t record_len = len;
+
+	memcpy(ring->buf + ring->head, &record_len, sizeof(record_len));
+	ring->head += log_record_len(len);
+}
+
+static void log_ring_watch_destroy(void *user_data)
+{
+	struct log_ring *ring = user_data;
+
+	ring->watching = false;
+}
+
+static void log_ring_writable(int fd, uint32_t events, void *user_data)
+{
+	watch_remove(fd);
+
+	log_ring_flush(false);
+}
+
+static void log_ring_idle_destroy(void *user_data)
+{
+	struct log_ring *ring = user_data;
+
+	ring->idle_id = -1;
+}
+
+static void log_ring_idle(void *user_data)
+{
+	struct log_ring *ring = user_data;
+
+	idle_remove(ring->idle_id);
+
+	log_ring_flush(false);
+}
+
+/*
+ * Write out queued records with as few sendmmsg calls as possible.  In
+ * non-blocking mode a full socket stops the flush and an EPOLLOUT watch
+ * resumes it once the reader catches up.
+ */
+static void log_ring_flush(bool blocking)
+{
+	struct log_ring *ring = log_ring;
+	int flags = blocking ? 0 : MSG_DONTWAIT;
+
+	if (ring->idle_id >= 0)
+		idle_remove(ring->idle_id);
+
+	if (ring->watching)
+		watch_remove(log_fd);
+
+	if (log_fd < 0) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->wrap = SIZE_MAX;
+		return;
+	}
+
+	while (ring->head != ring->tail) {
+		size_t pos = ring->tail;
+		size_t ends[LOG_BATCH_MAX];
+		unsigned int n = 0;
+		int sent;
+
+		/* A batch stops at the wrap point, the next one restarts at 0 */
+		while (n < LOG_BATCH_MAX && pos != ring->head &&
+							pos != ring->wrap) {
+			uint32_t len;
+
+			memcpy(&len, ring->buf + pos, sizeof(len));
+
+			ring->iov[n].iov_base = ring->buf + pos +
+							sizeof(uint32_t);
+			ring->iov[n].iov_len = len;
+			memset(&ring->msgs[n], 0, sizeof(ring->msgs[n]));
+			ring->msgs[n].msg_hdr.msg_iov = &ring->iov[n];
+			ring->msgs[n].msg_hdr.msg_iovlen = 1;
+
+			pos += log_record_len(len);
+			ends[n++] = pos;
+		}
+
+		sent = sendmmsg(log_fd, ring->msgs, n, flags);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN && !blocking) {
+				if (!watch_add(log_fd, EPOLLOUT,
+						log_ring_writable, ring,
+						log_ring_watch_destroy))
+					ring->watching = true;
+
+				return;
+			}
+
+			/* Drop the record the receiver refused */
+			ring->dropped += 1;
+			sent = 1;
+		}
+
+		ring->tail = ends[sent - 1];
+
+		if (ring->tail == ring->wrap) {
+			ring->tail = 0;
+			ring->wrap = SIZE_MAX;
+		}
+	}
+}
+
+static void log_ring_schedule(struct log_ring *ring)
+{
+	if (ring->idle_id >= 0 || ring->watching)
+		return;
+
+	ring->idle_id = idle_add(log_ring_idle, ring,
+					IDLE_FLAG_NO_WARN_DANGLING,
+					log_ring_idle_destroy);
+
+	/* No main loop to defer to, write out right away */
+	if (ring->idle_id < 0)
+		log_ring_flush(true);
+}
+
+static void log_ring_syslog(int priority, const char *format, va_list ap)
+{
+	uint8_t *rec = log_ring_reserve(log_ring);
+	int hdr_len, str_len;
+
+	if (!rec) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	hdr_len = snprintf((char *) rec, LOG_RECORD_MAX, "<%i>%s[%lu]: ",
+				priority, log_ident, (unsigned long) log_pid);
+	if (hdr_len < 0 || hdr_len >= LOG_RECORD_MAX) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	str_len = vsnprintf((char *) rec + hdr_len, LOG_RECORD_MAX - hdr_len,
+								format, ap);
+	if (str_len < 0) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	/* Truncate oversized messages, the NUL is not sent */
+	if (str_len >= LOG_RECORD_MAX - hdr_len)
+		str_len = LOG_RECORD_MAX - hdr_len - 1;
+
+	log_ring_commit(log_ring, hdr_len + str_len);
+	log_ring_schedule(log_ring);
+}
+
+static void log_ring_journal(int priority, const char *file, const char *line,
+				const char *func, const char *format,
+				va_list ap)
+{
+	static const char trailer_format[] = "PRIORITY=%u\nCODE_FILE=%s\n"
+					"CODE_LINE=%s\nCODE_FUNC=%s\n";
+	uint8_t *rec = log_ring_reserve(log_ring);
+	char *str;
+	int len, str_len, str_max, trailer_len;
+
+	if (!rec) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	/* Room is kept for the trailer, a long message gets truncated */
+	trailer_len = snprintf(NULL, 0, trailer_format,
+					priority, file, line, func);
+	str_max = LOG_RECORD_MAX - 8 - trailer_len - 1;
+
+	if (trailer_len < 0 || str_max < 1) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	str = (char *) rec;
+	memcpy(str, "MESSAGE=", 8);
+	len = 8;
+
+	str_len = vsnprintf(str + len, str_max + 1, format, ap);
+	if (str_len < 0) {
+		log_ring->dropped += 1;
+		return;
+	}
+
+	/* The MESSAGE field still has to end with a newline */
+	if (str_len > str_max) {
+		str_len = str_max;
+		str[len + str_len - 1] = '\n';
+	}
+
+	len += str_len;
+
+	snprintf(str + len, LOG_RECORD_MAX - len, trailer_format,
+					priority, file, line, func);
+
+	log_ring_commit(log_ring, len + trailer_len);
+	log_ring_schedule(log_ring);
+}
+
 /**
  * l_log_set_ident:
  * @ident: string identifier
@@ -165,6 +451,11 @@ static void log_syslog(int priority, const char *file, const char *line,
 	char hdr[64], *str;
 	int hdr_len, str_len;
 
+	if (log_ring) {
+		log_ring_syslog(priority, format, ap);
+		return;
+	}
+
 	str_len = vasprintf(&str, format, ap);
 	if (str_len < 0)
 		return;
@@ -192,10 +483,15 @@ static void log_syslog(int priority, const char *file, const char *line,
  * Enable logging to syslog.
  **/
 LIB_EXPORT void l_log_set_syslog(void)
+{
+	_log_set_syslog("/dev/log");
+}
+
+void _log_set_syslog(const char *path)
 {
 	close_log();
 
-	if (open_log("/dev/log") < 0) {
+	if (open_log(path) < 0) {
 		log_func = log_null;
 		return;
 	}
@@ -213,6 +509,11 @@ static void log_journal(int priority, const char *file, const char *line,
 	char prio[16], *str;
 	int prio_len, str_len;
 
+	if (log_ring) {
+		log_ring_journal(priority, file, line, func, format, ap);
+		return;
+	}
+
 	str_len = vasprintf(&str, format, ap);
 	if (str_len < 0)
 		return;
@@ -259,10 +560,15 @@ static void log_journal(int priority, const char *file, const char *line,
  * Enable logging to journal.
  **/
 LIB_EXPORT void l_log_set_journal(void)
+{
+	_log_set_journal("/run/systemd/journal/socket");
+}
+
+void _log_set_journal(const char *path)
 {
 	close_log();
 
-	if (open_log("/run/systemd/journal/socket") < 0) {
+	if (open_log(path) < 0) {
 		log_func = log_null;
 		return;
 	}
@@ -272,6 +578,70 @@ LIB_EXPORT void l_log_set_journal(void)
 	log_func = log_journal;
 }
 
+/**
+ * l_log_set_async:
+ * @size: size of the record buffer in bytes, or 0
+ *
+ * Makes the syslog and journal handlers asynchronous.  Log lines are
+ * formatted into a preallocated buffer of @size bytes and written out in
+ * batches from the main loop, so a stalled log daemon no longer blocks
+ * the caller.  Records that do not fit are dropped and counted, see
+ * l_log_get_dropped().  Without a main loop records are written out
+ * immediately.
+ *
+ * A @size of 0 flushes pending records and returns to synchronous mode.
+ **/
+LIB_EXPORT void l_log_set_async(size_t size)
+{
+	if (log_ring) {
+		log_ring_flush(true);
+		l_free(log_ring->buf);
+		l_free(log_ring);
+		log_ring = NULL;
+	}
+
+	if (!size)
+		return;
+
+	if (size < LOG_RING_MIN)
+		size = LOG_RING_MIN;
+
+	log_ring = l_new(struct log_ring, 1);
+	log_ring->size = align_len(size, 4);
+	log_ring->buf = l_malloc(log_ring->size);
+	log_ring->wrap = SIZE_MAX;
+	log_ring->idle_id = -1;
+}
+
+/**
+ * l_log_flush:
+ *
+ * Writes out all records queued in asynchronous mode, blocking if
+ * necessary.  Called automatically by l_main_exit() and when the log
+ * handler is changed.
+ **/
+LIB_EXPORT void l_log_flush(void)
+{
+	if (!log_ring)
+		return;
+
+	log_ring_flush(true);
+}
+
+/**
+ * l_log_get_dropped:
+ *
+ * Returns: the number of records dropped in asynchronous mode because the
+ * buffer was full or the log daemon refused them.
+ **/
+LIB_EXPORT unsigned int l_log_get_dropped(void)
+{
+	if (!log_ring)
+		return 0;
+
+	return log_ring->dropped;
+}
+
 /**
  * l_log_with_location:
  * @priority: priority level
@@ -322,15 +692,20 @@ LIB_EXPORT void l_log_with_location(int priority,
  **/
 
 static const char *debug_pattern;
+static size_t trace_size;
 
 void debug_enable(struct l_debug_desc *start, struct l_debug_desc *stop)
 {
 	struct l_debug_desc *desc;
 	char *pattern_copy;
+	unsigned int flags = L_DEBUG_FLAG_PRINT;
 
 	if (!debug_pattern)
 		return;
 
+	if (trace_size)
+		flags |= L_DEBUG_FLAG_TRACE;
+
 	pattern_copy = strdupa(debug_pattern);
 
 	while (pattern_copy) {
@@ -340,9 +715,9 @@ void debug_enable(struct l_debug_desc *start, struct l_debug_desc *stop)
 
 		for (desc = start; desc < stop; desc++) {
 			if (!fnmatch(str, desc->file, 0))
-				desc->flags |= L_DEBUG_FLAG_PRINT;
+				desc->flags |= flags;
 			if (!fnmatch(str, desc->func, 0))
-				desc->flags |= L_DEBUG_FLAG_PRINT;
+				desc->flags |= flags;
 		}
 	}
 }
@@ -352,7 +727,7 @@ void debug_disable(struct l_debug_desc *start, struct l_debug_desc *stop)
 	struct l_debug_desc *desc;
 
 	for (desc = start; desc < stop; desc++)
-		desc->flags &= ~L_DEBUG_FLAG_PRINT;
+		desc->flags &= ~(L_DEBUG_FLAG_PRINT | L_DEBUG_FLAG_TRACE);
 }
 
 /**
@@ -441,6 +816,877 @@ LIB_EXPORT void l_debug_disable(void)
 	debug_pattern = NULL;
 }
 
+/*
+ * Binary trace mode.  Instead of formatting, each enabled l_debug site
+ * appends a record to a per-thread ring of 64-bit words:
+ *
+ *   word 0: descriptor address
+ *   word 1: format string address
+ *   word 2: timestamp, l_time_now()
+ *   word 3: number of argument words that follow
+ *   ...   : one word per integer, pointer or double argument, %m stores
+ *           errno.  %s stores the byte length followed by the bytes
+ *           padded to a whole word.
+ *
+ * The ring is a flight recorder, the oldest records are overwritten.
+ * l_debug_trace_dump() writes out the descriptor strings of all debug
+ * sections followed by the ring contents, and l_debug_trace_decode()
+ * renders such a dump, typically in another process.  Descriptors don't
+ * keep their format, which would change their size and with it the
+ * layout of the debug sections of existing binaries, so the dump takes
+ * the format of each descriptor from its records.
+ */
+#define TRACE_MAGIC		"ELLTRACE"
+#define TRACE_VERSION		1
+#define TRACE_RECORD_HEADER	4
+#define TRACE_RECORD_MAX	64
+#define TRACE_STRING_MAX	((TRACE_RECORD_MAX - 8) * 8)
+#define TRACE_WIDTH_MAX		1024
+#define TRACE_DUMP_BUFFER	4096
+
+struct trace_ring {
+	uint64_t *words;
+	size_t size;
+	uint64_t head;
+	uint64_t tail;
+	struct trace_ring *next;
+};
+
+/*
+ * Every thread's ring is also linked into trace_rings so that
+ * l_debug_trace_disable() can free them all.  A thread notices that its
+ * ring is gone through the generation count.
+ */
+static __thread struct trace_ring *trace_ring;
+static __thread unsigned int trace_ring_generation;
+static struct trace_ring *trace_rings;
+static unsigned int trace_generation;
+
+enum trace_arg {
+	TRACE_ARG_NONE,
+	TRACE_ARG_INT,
+	TRACE_ARG_LONG,
+	TRACE_ARG_LONG_LONG,
+	TRACE_ARG_DOUBLE,
+	TRACE_ARG_POINTER,
+	TRACE_ARG_STRING,
+	TRACE_ARG_ERRNO,
+	TRACE_ARG_UNSUPPORTED,
+};
+
+struct trace_spec {
+	const char *start;
+	size_t len;
+	enum trace_arg arg;
+	bool star_width;
+	bool star_precision;
+};
+
+/*
+ * Find the next conversion in @format.  Returns a pointer past it, or NULL
+ * at the end of the string.  Literal text before the conversion is
+ * described by [@format, spec->start).
+ */
+static const char *trace_next_spec(const char *format, struct trace_spec *spec)
+{
+	const char *p = strchr(format, '%');
+	enum trace_arg integer = TRACE_ARG_INT;
+
+	if (!p)
+		return NULL;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+
+	while (*p && strchr("#0- +'I", *p))
+		p++;
+
+	if (*p == '*') {
+		spec->star_width = true;
+		p++;
+	}
+
+	while (*p >= '0' && *p <= '9')
+		p++;
+
+	if (*p == '.') {
+		p++;
+
+		if (*p == '*') {
+			spec->star_precision = true;
+			p++;
+		}
+
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	for (; *p && strchr("hlLqjzt", *p); p++) {
+		if (*p == 'h')
+			continue;
+
+		if (*p == 'L' || *p == 'q' || *p == 'j' ||
+						integer == TRACE_ARG_LONG)
+			integer = TRACE_ARG_LONG_LONG;
+		else
+			integer = TRACE_ARG_LONG;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		spec->arg = integer;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		/* long double does not fit a word */
+		spec->arg = integer == TRACE_ARG_INT ?
+				TRACE_ARG_DOUBLE : TRACE_ARG_UNSUPPORTED;
+		break;
+	case 'p':
+		spec->arg = TRACE_ARG_POINTER;
+		break;
+	case 's':
+		spec->arg = TRACE_ARG_STRING;
+		break;
+	case 'm':
+		spec->arg = TRACE_ARG_ERRNO;
+		break;
+	case '%':
+		spec->arg = TRACE_ARG_NONE;
+		break;
+	case '\0':
+		spec->arg = TRACE_ARG_UNSUPPORTED;
+		spec->len = p - spec->start;
+		return p;
+	default:
+		spec->arg = TRACE_ARG_UNSUPPORTED;
+		break;
+	}
+
+	p++;
+	spec->len = p - spec->start;
+
+	return p;
+}
+
+static void trace_ring_push(struct trace_ring *ring, const uint64_t *rec,
+								size_t n)
+{
+	size_t i;
+
+	/* Make room by dropping whole records from the old end */
+	while (ring->head + n - ring->tail > ring->size)
+		ring->tail += TRACE_RECORD_HEADER +
+				ring->words[(ring->tail + 3) % ring->size];
+
+	for (i = 0; i < n; i++)
+		ring->words[(ring->head + i) % ring->size] = rec[i];
+
+	ring->head += n;
+}
+
+/**
+ * l_debug_trace:
+ * @desc: debug descriptor of the call site
+ * @format: format string of the call site
+ * @...: arguments matching @format
+ *
+ * Records a debug statement into the binary trace ring without formatting
+ * it.  Called by l_debug() when trace mode is enabled.
+ **/
+LIB_EXPORT void l_debug_trace(const struct l_debug_desc *desc,
+						const char *format, ...)
+{
+	uint64_t rec[TRACE_RECORD_MAX];
+	struct trace_spec spec;
+	size_t n = TRACE_RECORD_HEADER;
+	int saved_errno = errno;
+	va_list ap;
+
+	if (unlikely(!trace_size || !desc))
+		return;
+
+	if (unlikely(!trace_ring ||
+			trace_ring_generation != trace_generation)) {
+		trace_ring = l_new(struct trace_ring, 1);
+		trace_ring->size = trace_size;
+		trace_ring->words = l_new(uint64_t, trace_size);
+		trace_ring_generation = trace_generation;
+
+		do {
+			trace_ring->next = trace_rings;
+		} while (!__sync_bool_compare_and_swap(&trace_rings,
+							trace_ring->next,
+							trace_ring));
+	}
+
+	rec[0] = (uintptr_t) desc;
+	rec[1] = (uintptr_t) format;
+	rec[2] = l_time_now();
+
+	va_start(ap, format);
+
+	while (format && n < TRACE_RECORD_MAX) {
+		const char *str;
+		size_t len;
+
+		format = trace_next_spec(format, &spec);
+		if (!format)
+			break;
+
+		if (spec.star_width)
+			rec[n++] = va_arg(ap, int);
+
+		if (spec.star_precision && n < TRACE_RECORD_MAX)
+			rec[n++] = va_arg(ap, int);
+
+		if (n >= TRACE_RECORD_MAX)
+			break;
+
+		switch (spec.arg) {
+		case TRACE_ARG_NONE:
+			break;
+		case TRACE_ARG_INT:
+			rec[n++] = va_arg(ap, int);
+			break;
+		case TRACE_ARG_LONG:
+			rec[n++] = va_arg(ap, long);
+			break;
+		case TRACE_ARG_LONG_LONG:
+			rec[n++] = va_arg(ap, long long);
+			break;
+		case TRACE_ARG_DOUBLE:
+		{
+			double d = va_arg(ap, double);
+
+			memcpy(&rec[n++], &d, sizeof(d));
+			break;
+		}
+		case TRACE_ARG_POINTER:
+			rec[n++] = (uintptr_t) va_arg(ap, void *);
+			break;
+		case TRACE_ARG_STRING:
+			str = va_arg(ap, const char *);
+			len = str ? strnlen(str, TRACE_STRING_MAX) : 0;
+			len = minsize(len, (TRACE_RECORD_MAX - n - 1) * 8);
+
+			rec[n++] = str ? len : UINT64_MAX;
+
+			if (len) {
+				rec[n + align_len(len, 8) / 8 - 1] = 0;
+				memcpy(&rec[n], str, len);
+				n += align_len(len, 8) / 8;
+			}
+			break;
+		case TRACE_ARG_ERRNO:
+			rec[n++] = saved_errno;
+			break;
+		case TRACE_ARG_UNSUPPORTED:
+			/* Cannot know the size, stop reading arguments */
+			goto done;
+		}
+	}
+
+done:
+	va_end(ap);
+
+	rec[3] = n - TRACE_RECORD_HEADER;
+	trace_ring_push(trace_ring, rec, n);
+}
+
+static void trace_set_flags(bool enable)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(debug_sections); entry;
+					entry = entry->next) {
+		const struct debug_section *section = entry->data;
+		struct l_debug_desc *desc;
+
+		for (desc = section->start; desc < section->end; desc++) {
+			if (enable && (desc->flags & L_DEBUG_FLAG_PRINT))
+				desc->flags |= L_DEBUG_FLAG_TRACE;
+			else
+				desc->flags &= ~L_DEBUG_FLAG_TRACE;
+		}
+	}
+}
+
+/**
+ * l_debug_trace_enable:
+ * @size: number of bytes to keep per thread
+ *
+ * Switches all enabled l_debug statements, and those enabled later, to
+ * binary trace mode.  Instead of being formatted and logged, their
+ * arguments are recorded into a per-thread ring of @size bytes, which
+ * l_debug_trace_dump() writes out for offline decoding.
+ *
+ * Returns: #true on success
+ **/
+LIB_EXPORT bool l_debug_trace_enable(size_t size)
+{
+	size_t words = size / sizeof(uint64_t);
+
+	if (unlikely(words < TRACE_RECORD_MAX))
+		return false;
+
+	l_debug_trace_disable();
+
+	trace_size = words;
+	trace_set_flags(true);
+
+	return true;
+}
+
+/**
+ * l_debug_trace_disable:
+ *
+ * Returns enabled l_debug statements to logging and frees the trace rings
+ * of all threads.  Must not race with other threads still recording.
+ **/
+LIB_EXPORT void l_debug_trace_disable(void)
+{
+	struct trace_ring *ring;
+
+	trace_set_flags(false);
+	trace_size = 0;
+
+	ring = __sync_lock_test_and_set(&trace_rings, NULL);
+	__sync_fetch_and_add(&trace_generation, 1);
+
+	while (ring) {
+		struct trace_ring *next = ring->next;
+
+		l_free(ring->words);
+		l_free(ring);
+		ring = next;
+	}
+
+	trace_ring = NULL;
+}
+
+struct trace_writer {
+	int fd;
+	size_t len;
+	uint8_t buf[TRACE_DUMP_BUFFER];
+};
+
+static bool trace_write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len) {
+		ssize_t written = TEMP_FAILURE_RETRY(write(fd, p, len));
+
+		if (written < 0)
+			return false;
+
+		p += written;
+		len -= written;
+	}
+
+	return true;
+}
+
+static bool trace_flush(struct trace_writer *writer)
+{
+	size_t len = writer->len;
+
+	writer->len = 0;
+
+	return trace_write_all(writer->fd, writer->buf, len);
+}
+
+static bool trace_write(struct trace_writer *writer,
+				const void *data, size_t len)
+{
+	if (!len)
+		return true;
+
+	if (writer->len + len > sizeof(writer->buf) && !trace_flush(writer))
+		return false;
+
+	if (len > sizeof(writer->buf))
+		return trace_write_all(writer->fd, data, len);
+
+	memcpy(writer->buf + writer->len, data, len);
+	writer->len += len;
+
+	return true;
+}
+
+static bool trace_write_string(struct trace_writer *writer, const char *str)
+{
+	uint32_t len = str ? strlen(str) : 0;
+
+	return trace_write(writer, &len, sizeof(len)) &&
+					trace_write(writer, str, len);
+}
+
+/* Each descriptor's format, as recorded by the live records of @ring */
+static struct l_hashmap *trace_ring_formats(const struct trace_ring *ring)
+{
+	struct l_hashmap *formats = l_hashmap_new();
+	uint64_t pos;
+
+	if (!ring)
+		return formats;
+
+	for (pos = ring->tail; pos < ring->head; pos += TRACE_RECORD_HEADER +
+					ring->words[(pos + 3) % ring->size])
+		l_hashmap_insert(formats,
+			L_UINT_TO_PTR(ring->words[pos % ring->size]),
+			L_UINT_TO_PTR(ring->words[(pos + 1) % ring->size]));
+
+	return formats;
+}
+
+/**
+ * l_debug_trace_dump:
+ * @fd: file descriptor to write to
+ *
+ * Writes the trace ring of the calling thread to @fd, together with the
+ * file, function and format strings of every debug descriptor known to
+ * ell so that the dump can be decoded without access to the binary.
+ *
+ * Returns: #true on success
+ **/
+LIB_EXPORT bool l_debug_trace_dump(int fd)
+{
+	const struct l_queue_entry *entry;
+	struct trace_ring *ring = NULL;
+	struct l_hashmap *formats;
+	struct trace_writer *writer;
+	uint32_t version = TRACE_VERSION;
+	uint32_t count = 0;
+	const uint64_t *words = NULL;
+	const uint64_t *wrapped = NULL;
+	uint64_t n_words = 0;
+	uint64_t first = 0;
+	bool ret = false;
+
+	for (entry = l_queue_get_entries(debug_sections); entry;
+					entry = entry->next) {
+		const struct debug_section *section = entry->data;
+
+		count += section->end - section->start;
+	}
+
+	if (trace_ring && trace_ring_generation == trace_generation)
+		ring = trace_ring;
+
+	formats = trace_ring_formats(ring);
+	writer = l_new(struct trace_writer, 1);
+	writer->fd = fd;
+
+	if (!trace_write(writer, TRACE_MAGIC, 8) ||
+			!trace_write(writer, &version, sizeof(version)) ||
+			!trace_write(writer, &count, sizeof(count)))
+		goto done;
+
+	for (entry = l_queue_get_entries(debug_sections); entry;
+					entry = entry->next) {
+		const struct debug_section *section = entry->data;
+		const struct l_debug_desc *desc;
+
+		for (desc = section->start; desc < section->end; desc++) {
+			uint64_t addr = (uintptr_t) desc;
+
+			if (!trace_write(writer, &addr, sizeof(addr)) ||
+				!trace_write_string(writer, desc->file) ||
+				!trace_write_string(writer, desc->func) ||
+				!trace_write_string(writer,
+					l_hashmap_lookup(formats, desc)))
+				goto done;
+		}
+	}
+
+	/* The live part of the ring is at most two contiguous runs */
+	if (ring) {
+		uint64_t start = ring->tail % ring->size;
+
+		n_words = ring->head - ring->tail;
+		first = minsize(n_words, ring->size - start);
+		words = ring->words + start;
+		wrapped = ring->words;
+	}
+
+	if (!trace_write(writer, &n_words, sizeof(n_words)) ||
+			!trace_write(writer, words,
+					first * sizeof(uint64_t)) ||
+			!trace_write(writer, wrapped,
+					(n_words - first) * sizeof(uint64_t)))
+		goto done;
+
+	ret = trace_flush(writer);
+
+done:
+	l_free(writer);
+	l_hashmap_destroy(formats, NULL);
+	return ret;
+}
+
+struct trace_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+};
+
+static const void *trace_read(struct trace_reader *reader, size_t len)
+{
+	const void *p;
+
+	if (reader->len - reader->pos < len)
+		return NULL;
+
+	p = reader->data + reader->pos;
+	reader->pos += len;
+
+	return p;
+}
+
+static bool trace_read_u64(struct trace_reader *reader, uint64_t *out)
+{
+	const void *p = trace_read(reader, sizeof(*out));
+
+	if (!p)
+		return false;
+
+	memcpy(out, p, sizeof(*out));
+	return true;
+}
+
+static char *trace_read_string(struct trace_reader *reader)
+{
+	const void *p = trace_read(reader, sizeof(uint32_t));
+	uint32_t len;
+
+	if (!p)
+		return NULL;
+
+	memcpy(&len, p, sizeof(len));
+
+	p = trace_read(reader, len);
+	if (!p)
+		return NULL;
+
+	return l_strndup(p, len);
+}
+
+struct trace_desc {
+	char *file;
+	char *func;
+	char *format;
+};
+
+static void trace_desc_free(void *data)
+{
+	struct trace_desc *desc = data;
+
+	l_free(desc->file);
+	l_free(desc->func);
+	l_free(desc->format);
+	l_free(desc);
+}
+
+/*
+ * Parse a width or precision, either given in the format or recorded for
+ * a '*'.  Dumps are untrusted, so the value is clamped.
+ */
+static int trace_render_width(const char **s, const char *end,
+				const uint64_t *words, size_t n_words,
+				size_t *pos)
+{
+	int64_t value = 0;
+
+	if (*s < end && **s == '*') {
+		*s += 1;
+
+		if (*pos < n_words)
+			value = (int) words[(*pos)++];
+	} else {
+		for (; *s < end && **s >= '0' && **s <= '9'; *s += 1)
+			if (value <= TRACE_WIDTH_MAX)
+				value = value * 10 + **s - '0';
+	}
+
+	if (value > TRACE_WIDTH_MAX)
+		return TRACE_WIDTH_MAX;
+
+	if (value < -TRACE_WIDTH_MAX)
+		return -TRACE_WIDTH_MAX;
+
+	return value;
+}
+
+/*
+ * Render one conversion.  The specification is rebuilt from its parts,
+ * with recorded '*' values substituted, so that it can be handed to
+ * printf on its own no matter how long the original was.
+ */
+static void trace_render_spec(struct l_string *out,
+				const struct trace_spec *spec,
+				const uint64_t *words, size_t n_words,
+				size_t *pos)
+{
+	char fmt[64];
+	const char *s = spec->start + 1;
+	const char *end = spec->start + spec->len;
+	size_t len = 0;
+	uint64_t value = 0;
+	unsigned int h = 0;
+	int width;
+
+	fmt[len++] = '%';
+
+	/* Flags may be repeated, each is only needed once */
+	for (; s < end && strchr("#0- +'I", *s); s++)
+		if (!memchr(fmt + 1, *s, len - 1))
+			fmt[len++] = *s;
+
+	if (s < end && (*s == '*' || (*s >= '0' && *s <= '9'))) {
+		width = trace_render_width(&s, end, words, n_words, pos);
+		len += sprintf(fmt + len, "%d", width);
+	}
+
+	if (s < end && *s == '.') {
+		s++;
+		width = trace_render_width(&s, end, words, n_words, pos);
+
+		/* A negative precision is taken as if it was omitted */
+		if (width >= 0)
+			len += sprintf(fmt + len, ".%d", width);
+	}
+
+	/* The recorded argument type decides the length modifier */
+	for (; s < end && strchr("hlLqjzt", *s); s++)
+		if (*s == 'h' && h < 2)
+			h++;
+
+	switch (spec->arg) {
+	case TRACE_ARG_INT:
+		for (; h; h--)
+			fmt[len++] = 'h';
+		break;
+	case TRACE_ARG_LONG:
+		fmt[len++] = 'l';
+		break;
+	case TRACE_ARG_LONG_LONG:
+		fmt[len++] = 'l';
+		fmt[len++] = 'l';
+		break;
+	case TRACE_ARG_NONE:
+	case TRACE_ARG_DOUBLE:
+	case TRACE_ARG_POINTER:
+	case TRACE_ARG_STRING:
+	case TRACE_ARG_ERRNO:
+	case TRACE_ARG_UNSUPPORTED:
+		break;
+	}
+
+	fmt[len++] = end[-1];
+	fmt[len] = '\0';
+
+	if (spec->arg != TRACE_ARG_NONE && spec->arg != TRACE_ARG_STRING) {
+		if (*pos >= n_words) {
+			l_string_append(out, "<missing>");
+			return;
+		}
+
+		value = words[(*pos)++];
+	}
+
+	switch (spec->arg) {
+	case TRACE_ARG_NONE:
+		l_string_append_c(out, '%');
+		break;
+	case TRACE_ARG_INT:
+		l_string_append_printf(out, fmt, (int) value);
+		break;
+	case TRACE_ARG_LONG:
+		l_string_append_printf(out, fmt, (long) value);
+		break;
+	case TRACE_ARG_LONG_LONG:
+		l_string_append_printf(out, fmt, (long long) value);
+		break;
+	case TRACE_ARG_DOUBLE:
+	{
+		double d;
+
+		memcpy(&d, &value, sizeof(d));
+		l_string_append_printf(out, fmt, d);
+		break;
+	}
+	case TRACE_ARG_POINTER:
+		l_string_append_printf(out, fmt, (void *) (uintptr_t) value);
+		break;
+	case TRACE_ARG_STRING:
+	{
+		char *str;
+
+		if (*pos >= n_words) {
+			l_string_append(out, "<missing>");
+			return;
+		}
+
+		value = words[(*pos)++];
+
+		if (value == UINT64_MAX) {
+			l_string_append_printf(out, fmt, "(null)");
+			break;
+		}
+
+		if (align_len(value, 8) / 8 > n_words - *pos) {
+			l_string_append(out, "<truncated>");
+			*pos = n_words;
+			break;
+		}
+
+		str = l_strndup((const char *) &words[*pos], value);
+		l_string_append_printf(out, fmt, str);
+		l_free(str);
+		*pos += align_len(value, 8) / 8;
+		break;
+	}
+	case TRACE_ARG_ERRNO:
+		l_string_append(out, strerror(value));
+		break;
+	case TRACE_ARG_UNSUPPORTED:
+		l_string_append_fixed(out, spec->start, spec->len);
+		*pos = n_words;
+		break;
+	}
+}
+
+static void trace_render(const struct trace_desc *desc, uint64_t timestamp,
+				const uint64_t *words, size_t n_words,
+				l_debug_trace_func_t function, void *user_data)
+{
+	struct l_string *out = l_string_new(128);
+	const char *format = desc->format;
+	struct trace_spec spec;
+	size_t pos = 0;
+	const char *next;
+	char *str;
+
+	l_string_append_printf(out, "[%" PRIu64 ".%06" PRIu64 "] %s:%s() ",
+				(uint64_t) (timestamp / L_USEC_PER_SEC),
+				(uint64_t) (timestamp % L_USEC_PER_SEC),
+				desc->file, desc->func);
+
+	while ((next = trace_next_spec(format, &spec))) {
+		l_string_append_fixed(out, format, spec.start - format);
+		trace_render_spec(out, &spec, words, n_words, &pos);
+
+		if (spec.arg == TRACE_ARG_UNSUPPORTED)
+			l_string_append(out, next);
+
+		format = spec.arg == TRACE_ARG_UNSUPPORTED ? "" : next;
+	}
+
+	l_string_append(out, format);
+
+	str = l_string_unwrap(out);
+	function(str, user_data);
+	l_free(str);
+}
+
+/**
+ * l_debug_trace_decode:
+ * @data: contents written by l_debug_trace_dump()
+ * @len: length of @data
+ * @function: callback invoked with each rendered line
+ * @user_data: user data for @function
+ *
+ * Renders every record of a trace dump, oldest first, as the line the
+ * corresponding l_debug statement would have logged, prefixed with its
+ * timestamp.
+ *
+ * Returns: #true if @data was a well-formed dump
+ **/
+LIB_EXPORT bool l_debug_trace_decode(const void *data, size_t len,
+				l_debug_trace_func_t function, void *user_data)
+{
+	struct trace_reader reader = { .data = data, .len = len };
+	struct l_hashmap *descs;
+	const uint8_t *p;
+	uint32_t version, count, i;
+	uint64_t n_words;
+	uint64_t *words = NULL;
+	uint64_t pos;
+	bool ret = false;
+
+	if (unlikely(!data || !function))
+		return false;
+
+	p = trace_read(&reader, 8);
+	if (!p || memcmp(p, TRACE_MAGIC, 8))
+		return false;
+
+	p = trace_read(&reader, 8);
+	if (!p)
+		return false;
+
+	memcpy(&version, p, sizeof(version));
+	memcpy(&count, p + 4, sizeof(count));
+
+	if (version != TRACE_VERSION)
+		return false;
+
+	descs = l_hashmap_new();
+
+	for (i = 0; i < count; i++) {
+		struct trace_desc *desc;
+		uint64_t addr;
+
+		if (!trace_read_u64(&reader, &addr))
+			goto done;
+
+		desc = l_new(struct trace_desc, 1);
+		desc->file = trace_read_string(&reader);
+		desc->func = trace_read_string(&reader);
+		desc->format = trace_read_string(&reader);
+
+		if (!desc->file || !desc->func || !desc->format) {
+			trace_desc_free(desc);
+			goto done;
+		}
+
+		if (!l_hashmap_insert(descs, L_UINT_TO_PTR(addr), desc))
+			trace_desc_free(desc);
+	}
+
+	if (!trace_read_u64(&reader, &n_words) ||
+				n_words > (len - reader.pos) / 8)
+		goto done;
+
+	words = l_new(uint64_t, n_words + 1);
+	memcpy(words, reader.data + reader.pos, n_words * 8);
+
+	for (pos = 0; pos + TRACE_RECORD_HEADER <= n_words; ) {
+		const struct trace_desc *desc;
+		uint64_t n = words[pos + 3];
+
+		if (n > n_words - pos - TRACE_RECORD_HEADER)
+			goto done;
+
+		desc = l_hashmap_lookup(descs, L_UINT_TO_PTR(words[pos]));
+		if (desc)
+			trace_render(desc, words[pos + 2],
+					words + pos + TRACE_RECORD_HEADER, n,
+					function, user_data);
+
+		pos += TRACE_RECORD_HEADER + n;
+	}
+
+	ret = true;
+
+done:
+	l_free(words);
+	l_hashmap_destroy(descs, trace_desc_free);
+	return ret;
+}
+
 __attribute__((constructor)) static void register_debug_section()
 {
 	extern struct l_debug_desc __start___ell_debug[];
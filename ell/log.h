@@ -23,6 +23,7 @@
 #ifndef __ELL_LOG_H
 #define __ELL_LOG_H
 
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
@@ -45,6 +46,10 @@ void l_log_set_stderr(void);
 void l_log_set_syslog(void);
 void l_log_set_journal(void);
 
+void l_log_set_async(size_t size);
+void l_log_flush(void);
+unsigned int l_log_get_dropped(void);
+
 void l_log_with_location(int priority, const char *file, const char *line,
 				const char *func, const char *format, ...)
 				__attribute__((format(printf, 5, 6)));
@@ -58,16 +63,21 @@ struct l_debug_desc {
 	const char *func;
 #define L_DEBUG_FLAG_DEFAULT (0)
 #define L_DEBUG_FLAG_PRINT   (1 << 0)
+#define L_DEBUG_FLAG_TRACE   (1 << 1)
 	unsigned int flags;
 } __attribute__((aligned(8)));
 
+void l_debug_trace(const struct l_debug_desc *desc, const char *format, ...);
+
 #define L_DEBUG_SYMBOL(symbol, format, ...) do { \
 	static struct l_debug_desc symbol \
 	__attribute__((used, section("__ell_debug"), aligned(8))) = { \
 		.file = __FILE__, .func = __func__, \
 		.flags = L_DEBUG_FLAG_DEFAULT, \
 	}; \
-	if (symbol.flags & L_DEBUG_FLAG_PRINT) \
+	if (symbol.flags & L_DEBUG_FLAG_TRACE) \
+		l_debug_trace(&symbol, format, ##__VA_ARGS__); \
+	else if (symbol.flags & L_DEBUG_FLAG_PRINT) \
 		l_log(L_LOG_DEBUG, "%s:%s() " format, __FILE__, \
 					__func__ , ##__VA_ARGS__); \
 } while (0)
@@ -89,6 +99,14 @@ _Pragma("GCC diagnostic pop") \
 
 void l_debug_disable(void);
 
+typedef void (*l_debug_trace_func_t) (const char *str, void *user_data);
+
+bool l_debug_trace_enable(size_t size);
+void l_debug_trace_disable(void);
+bool l_debug_trace_dump(int fd);
+bool l_debug_trace_decode(const void *data, size_t len,
+				l_debug_trace_func_t function, void *user_data);
+
 #define l_error(format, ...)  l_log(L_LOG_ERR, format, ##__VA_ARGS__)
 #define l_warn(format, ...)   l_log(L_LOG_WARNING, format, ##__VA_ARGS__)
 #define l_info(format, ...)   l_log(L_LOG_INFO, format, ##__VA_ARGS__)
@@ -547,6 +547,8 @@ LIB_EXPORT bool l_main_exit(void)
 		return false;
 	}
 
+	l_log_flush();
+
 	for (i = 0; i < watch_entries; i++) {
 		struct watch_data *data = watch_list[i];
 
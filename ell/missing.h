@@ -55,6 +55,35 @@
 #  endif
 #endif
 
+#ifndef __NR_memfd_create
+#  if defined __x86_64__
+#    define __NR_memfd_create 319
+#  elif defined(__i386__)
+#    define __NR_memfd_create 356
+#  elif defined(__arm__)
+#    define __NR_memfd_create 385
+#  elif defined(__aarch64__)
+#    define __NR_memfd_create 279
+#  else
+#    warning "__NR_memfd_create unknown for your architecture"
+#    define __NR_memfd_create 0xffffffff
+#  endif
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#define F_GET_SEALS		(1024 + 10)
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE		0x0008
+#endif
+
 #ifndef HAVE_EXPLICIT_BZERO
 static inline void explicit_bzero(void *s, size_t n)
 {
@@ -24,11 +24,20 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "log.h"
+#include "time.h"
 #include "test.h"
 #include "private.h"
 
@@ -43,25 +52,487 @@ struct test {
 	const char *name;
 	l_test_func_t function;
 	const void *test_data;
+	bool bench;
 	struct test *next;
 };
 
+enum bench_format {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_CSV,
+};
+
 static struct test *test_head;
 static struct test *test_tail;
+static bool run_bench;
+static enum bench_format bench_format;
+static unsigned int test_jobs;
+static unsigned int test_timeout;
+
+#define BENCH_WARMUP_NS		(20 * L_NSEC_PER_MSEC)
+#define BENCH_SAMPLE_NS		(1 * L_NSEC_PER_MSEC)
+#define BENCH_SAMPLES		200
+
+/*
+ * Log-linear histogram of per-operation times: 16 sub-buckets for every
+ * power of two, which keeps each bucket within about 6% of its values.
+ */
+#define BENCH_HIST_SUB_BITS	4
+#define BENCH_HIST_SUB		(1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS	((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+#define TEST_TIMEOUT_DEFAULT	60
+#define TEST_JOBS_MAX		256
+
+struct test_job {
+	const struct test *test;
+	pid_t pid;
+	int fd;
+	uint64_t start;
+	bool timed_out;
+	bool exited;
+	int status;
+	char *output;
+	size_t output_len;
+	size_t output_size;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * L_NSEC_PER_SEC + ts.tv_nsec;
+}
 
 /**
  * l_test_init:
  * @argc: pointer to @argc parameter of main() function
  * @argv: pointer to @argv parameter of main() function
  *
- * Initialize testing framework.
+ * Initialize testing framework.  When the program is started with --bench
+ * only the benchmarks added with l_test_add_bench() are run, otherwise
+ * only the tests.  Passing --bench-format=csv as well prints one comma
+ * separated line per benchmark, suitable for comparing results between
+ * builds.
+ *
+ * Passing --jobs=N runs every test in its own forked process, up to N of
+ * them concurrently.  A crashing test then only fails itself, and a test
+ * still running after --timeout=SECONDS (60 by default) is killed.  The
+ * output of each test is captured and printed once it finishes, followed
+ * by its result and duration.
  **/
 LIB_EXPORT void l_test_init(int *argc, char ***argv)
 {
+	int i;
+
 	test_head = NULL;
 	test_tail = NULL;
+	run_bench = false;
+	bench_format = BENCH_FORMAT_TEXT;
+	test_jobs = 0;
+	test_timeout = TEST_TIMEOUT_DEFAULT;
 
 	l_log_set_stderr();
+
+	if (!argc || !argv)
+		return;
+
+	for (i = 1; i < *argc; i++) {
+		const char *arg = (*argv)[i];
+
+		if (!strcmp(arg, "--bench"))
+			run_bench = true;
+		else if (!strcmp(arg, "--bench-format=csv"))
+			bench_format = BENCH_FORMAT_CSV;
+		else if (!strcmp(arg, "--bench-format=text"))
+			bench_format = BENCH_FORMAT_TEXT;
+		else if (!strncmp(arg, "--jobs=", 7))
+			test_jobs = strtoul(arg + 7, NULL, 10);
+		else if (!strncmp(arg, "--timeout=", 10))
+			test_timeout = strtoul(arg + 10, NULL, 10);
+	}
+
+	if (test_jobs > TEST_JOBS_MAX)
+		test_jobs = TEST_JOBS_MAX;
+}
+
+static unsigned int bench_hist_index(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < BENCH_HIST_SUB)
+		return ns;
+
+	exp = 63 - __builtin_clzll(ns);
+
+	return (exp - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+		((ns >> (exp - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* Midpoint of the values that fall into bucket @index */
+static double bench_hist_value(unsigned int index)
+{
+	unsigned int exp;
+	uint64_t low;
+
+	if (index < BENCH_HIST_SUB)
+		return index;
+
+	exp = index / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+	low = (uint64_t) (BENCH_HIST_SUB + index % BENCH_HIST_SUB) <<
+						(exp - BENCH_HIST_SUB_BITS);
+
+	return low + ((1ULL << (exp - BENCH_HIST_SUB_BITS)) - 1) / 2.0;
+}
+
+static double bench_percentile(const uint64_t *hist, uint64_t count,
+							unsigned int percent)
+{
+	uint64_t rank = count * percent / 100;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += hist[i];
+
+		if (seen > rank)
+			return bench_hist_value(i);
+	}
+
+	return bench_hist_value(BENCH_HIST_BUCKETS - 1);
+}
+
+static uint64_t bench_batch(const struct test *test, uint64_t iterations)
+{
+	uint64_t start = bench_now();
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++)
+		test->function(test->test_data);
+
+	return bench_now() - start;
+}
+
+/* The cheapest back-to-back clock read, subtracted from every sample */
+static uint64_t bench_clock_overhead(void)
+{
+	uint64_t overhead = UINT64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < 1000; i++) {
+		uint64_t start = bench_now();
+		uint64_t ns = bench_now() - start;
+
+		if (ns < overhead)
+			overhead = ns;
+	}
+
+	return overhead;
+}
+
+/*
+ * Time every operation of a batch on its own and add it to the
+ * histogram.  Consecutive operations share a clock read.
+ */
+static uint64_t bench_batch_sampled(const struct test *test,
+					uint64_t iterations, uint64_t overhead,
+					uint64_t *hist)
+{
+	uint64_t total_ns = 0;
+	uint64_t last = bench_now();
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t now;
+		uint64_t ns;
+
+		test->function(test->test_data);
+
+		now = bench_now();
+		ns = now - last > overhead ? now - last - overhead : 0;
+		last = now;
+
+		hist[bench_hist_index(ns)] += 1;
+		total_ns += ns;
+	}
+
+	return total_ns;
+}
+
+/*
+ * Warm up for a fixed time, then grow the batch size until one batch
+ * takes at least BENCH_SAMPLE_NS, and finally run BENCH_SAMPLES batches
+ * of that size.  Percentiles are taken over every operation of the whole
+ * run rather than over the batch averages.
+ */
+static void bench_run(const struct test *test)
+{
+	uint64_t *hist = calloc(BENCH_HIST_BUCKETS, sizeof(uint64_t));
+	uint64_t iterations = 1;
+	uint64_t total_ns = 0;
+	uint64_t overhead;
+	uint64_t count;
+	uint64_t start;
+	double ns_per_op;
+	double p50, p90, p99;
+	unsigned int i;
+
+	if (!hist)
+		abort();
+
+	overhead = bench_clock_overhead();
+	start = bench_now();
+
+	do {
+		test->function(test->test_data);
+	} while (bench_now() - start < BENCH_WARMUP_NS);
+
+	while (bench_batch(test, iterations) < BENCH_SAMPLE_NS &&
+						iterations < (1ULL << 40))
+		iterations *= 2;
+
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		total_ns += bench_batch_sampled(test, iterations,
+							overhead, hist);
+
+	count = iterations * BENCH_SAMPLES;
+	ns_per_op = (double) total_ns / count;
+
+	p50 = bench_percentile(hist, count, 50);
+	p90 = bench_percentile(hist, count, 90);
+	p99 = bench_percentile(hist, count, 99);
+	free(hist);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_TEXT:
+		printf("BENCH: %s: %.2f ns/op, %.0f ops/s, "
+			"p50 %.2f ns, p90 %.2f ns, p99 %.2f ns "
+			"(%" PRIu64 " x %u)\n",
+			test->name, ns_per_op, L_NSEC_PER_SEC / ns_per_op,
+			p50, p90, p99, iterations, BENCH_SAMPLES);
+		break;
+	case BENCH_FORMAT_CSV:
+		printf("%s,%" PRIu64 ",%.3f,%.0f,%.3f,%.3f,%.3f\n",
+			test->name, iterations * BENCH_SAMPLES,
+			ns_per_op, L_NSEC_PER_SEC / ns_per_op,
+			p50, p90, p99);
+		break;
+	}
+}
+
+static bool job_start(struct test_job *job, const struct test *test)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return false;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (job->pid == 0) {
+		/* Own process group so that a timeout kills helpers too */
+		setpgid(0, 0);
+
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+
+		test->function(test->test_data);
+
+		fflush(stdout);
+		fflush(stderr);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	/* Lets the pipe be drained without blocking once the child exits */
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	job->test = test;
+	job->fd = fds[0];
+	job->start = bench_now();
+	job->timed_out = false;
+	job->exited = false;
+	job->output = NULL;
+	job->output_len = 0;
+	job->output_size = 0;
+
+	return true;
+}
+
+/* Returns true if more output may be available right away */
+static bool job_read(struct test_job *job)
+{
+	ssize_t len;
+
+	if (job->output_size - job->output_len < 4096) {
+		job->output_size = job->output_size * 2 + 4096;
+		job->output = realloc(job->output, job->output_size);
+
+		if (!job->output)
+			abort();
+	}
+
+	len = TEMP_FAILURE_RETRY(read(job->fd, job->output + job->output_len,
+					job->output_size - job->output_len));
+	if (len > 0) {
+		job->output_len += len;
+		return true;
+	}
+
+	if (len < 0 && errno == EAGAIN)
+		return false;
+
+	close(job->fd);
+	job->fd = -1;
+
+	return false;
+}
+
+/*
+ * Completion is decided by the child exiting, not by the pipe reaching
+ * EOF, since a helper the test left behind may still hold the pipe open.
+ * Whatever the child wrote is drained once it is gone.
+ */
+static void job_poll_exit(struct test_job *job)
+{
+	if (TEMP_FAILURE_RETRY(waitpid(job->pid, &job->status,
+						WNOHANG)) != job->pid)
+		return;
+
+	job->exited = true;
+
+	while (job->fd >= 0 && job_read(job))
+		;
+
+	if (job->fd >= 0) {
+		close(job->fd);
+		job->fd = -1;
+	}
+}
+
+static bool job_finish(struct test_job *job)
+{
+	double ms = (bench_now() - job->start) / (double) L_NSEC_PER_MSEC;
+	bool passed = false;
+	int status = job->status;
+
+	printf("TEST: %s\n", job->test->name);
+
+	if (job->output_len) {
+		fwrite(job->output, 1, job->output_len, stdout);
+
+		if (job->output[job->output_len - 1] != '\n')
+			putchar('\n');
+	}
+
+	if (job->timed_out)
+		printf("FAIL: %s: timed out after %u s\n",
+					job->test->name, test_timeout);
+	else if (WIFSIGNALED(status))
+		printf("FAIL: %s: killed by signal %d (%.1f ms)\n",
+				job->test->name, WTERMSIG(status), ms);
+	else if (WEXITSTATUS(status))
+		printf("FAIL: %s: exit status %d (%.1f ms)\n",
+				job->test->name, WEXITSTATUS(status), ms);
+	else {
+		printf("PASS: %s (%.1f ms)\n", job->test->name, ms);
+		passed = true;
+	}
+
+	fflush(stdout);
+	free(job->output);
+	job->output = NULL;
+
+	return passed;
+}
+
+/*
+ * Run every test in a forked child, keeping up to test_jobs of them in
+ * flight.  Children write into a pipe that the parent drains while
+ * waiting, so a chatty test can never block on a full pipe.
+ */
+static unsigned int run_forked(void)
+{
+	struct test_job jobs[TEST_JOBS_MAX];
+	struct pollfd pfds[TEST_JOBS_MAX];
+	const struct test *next = test_head;
+	unsigned int running = 0;
+	unsigned int failed = 0;
+	uint64_t timeout_ns = test_timeout * L_NSEC_PER_SEC;
+
+	while (next || running) {
+		uint64_t now;
+		unsigned int i;
+
+		while (next && running < test_jobs) {
+			if (next->bench) {
+				next = next->next;
+				continue;
+			}
+
+			if (!job_start(&jobs[running], next)) {
+				printf("FAIL: %s: unable to fork\n",
+								next->name);
+				failed++;
+			} else
+				running++;
+
+			next = next->next;
+		}
+
+		if (!running)
+			continue;
+
+		for (i = 0; i < running; i++) {
+			pfds[i].fd = jobs[i].fd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+
+		poll(pfds, running, 100);
+
+		now = bench_now();
+
+		for (i = 0; i < running; i++) {
+			struct test_job *job = &jobs[i];
+
+			if (pfds[i].revents)
+				job_read(job);
+
+			job_poll_exit(job);
+
+			if (!job->exited && !job->timed_out && test_timeout &&
+					now - job->start > timeout_ns) {
+				kill(-job->pid, SIGKILL);
+				kill(job->pid, SIGKILL);
+				job->timed_out = true;
+			}
+		}
+
+		for (i = 0; i < running; ) {
+			if (!jobs[i].exited) {
+				i++;
+				continue;
+			}
+
+			if (!job_finish(&jobs[i]))
+				failed++;
+
+			jobs[i] = jobs[--running];
+		}
+	}
+
+	return failed;
 }
 
 /**
@@ -74,35 +545,39 @@ LIB_EXPORT void l_test_init(int *argc, char ***argv)
 LIB_EXPORT int l_test_run(void)
 {
 	struct test *test = test_head;
+	unsigned int failed = 0;
 
-	while (test) {
-		struct test *tmp = test;
+	/* Benchmarks always run in-process and one at a time */
+	if (test_jobs && !run_bench) {
+		failed = run_forked();
+		test = NULL;
+	} else if (run_bench && bench_format == BENCH_FORMAT_CSV)
+		printf("name,iterations,ns_per_op,ops_per_sec,"
+					"p50_ns,p90_ns,p99_ns\n");
 
-		printf("TEST: %s\n", test->name);
+	for (; test; test = test->next) {
+		if (!test->bench && !run_bench) {
+			printf("TEST: %s\n", test->name);
 
-		test->function(test->test_data);
+			test->function(test->test_data);
+		} else if (test->bench && run_bench)
+			bench_run(test);
+	}
 
-		test = test->next;
+	while (test_head) {
+		test = test_head;
+		test_head = test->next;
 
-		free(tmp);
+		free(test);
 	}
 
-	test_head = NULL;
 	test_tail = NULL;
 
-	return 0;
+	return failed ? EXIT_FAILURE : 0;
 }
 
-/**
- * l_test_add:
- * @name: test name
- * @function: test function
- * @test_data: test data
- *
- * Add new test.
- **/
-LIB_EXPORT void l_test_add(const char *name, l_test_func_t function,
-						const void *test_data)
+static void test_add(const char *name, l_test_func_t function,
+					const void *test_data, bool bench)
 {
 	struct test *test;
 
@@ -117,6 +592,7 @@ LIB_EXPORT void l_test_add(const char *name, l_test_func_t function,
 	test->name = name;
 	test->function = function;
 	test->test_data = test_data;
+	test->bench = bench;
 	test->next = NULL;
 
 	if (test_tail)
@@ -127,3 +603,35 @@ LIB_EXPORT void l_test_add(const char *name, l_test_func_t function,
 	if (!test_head)
 		test_head = test;
 }
+
+/**
+ * l_test_add:
+ * @name: test name
+ * @function: test function
+ * @test_data: test data
+ *
+ * Add new test.
+ **/
+LIB_EXPORT void l_test_add(const char *name, l_test_func_t function,
+						const void *test_data)
+{
+	test_add(name, function, test_data, false);
+}
+
+/**
+ * l_test_add_bench:
+ * @name: benchmark name
+ * @function: function performing one operation
+ * @test_data: test data
+ *
+ * Add new benchmark.  When benchmarks are enabled @function is called
+ * repeatedly, first to warm up and to calibrate an iteration count, then
+ * in timed batches.  Every call is timed, and the mean cost per call, the
+ * resulting throughput and the 50th, 90th and 99th percentile cost of a
+ * single call over the whole run are reported.
+ **/
+LIB_EXPORT void l_test_add_bench(const char *name, l_test_func_t function,
+						const void *test_data)
+{
+	test_add(name, function, test_data, true);
+}
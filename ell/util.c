@@ -26,12 +26,12 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
-#include <ctype.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <limits.h>
 
 #include "util.h"
+#include "utf8.h"
 #include "private.h"
 
 /**
@@ -342,22 +342,88 @@ LIB_EXPORT bool l_str_has_suffix(const char *str, const char *suffix)
 	return !strcmp(&str[len_diff], suffix);
 }
 
+/*
+ * Two output characters per input byte, indexed by byte value * 2.  This
+ * turns encoding into a single 16-bit copy per byte instead of two nibble
+ * lookups.
+ */
+static const char hexpairs_lower[513] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char hexpairs_upper[513] =
+	"000102030405060708090A0B0C0D0E0F"
+	"101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F"
+	"303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F"
+	"505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F"
+	"707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F"
+	"909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+	"B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+	"D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+	"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* Nibble value of an ASCII hex digit, 0xff for anything else */
+static const unsigned char hexvals[256] = {
+	[0x00 ... 0x2f] = 0xff,
+	['0'] = 0x0, ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0x4,
+	['5'] = 0x5, ['6'] = 0x6, ['7'] = 0x7, ['8'] = 0x8, ['9'] = 0x9,
+	[0x3a ... 0x40] = 0xff,
+	['A'] = 0xa, ['B'] = 0xb, ['C'] = 0xc,
+	['D'] = 0xd, ['E'] = 0xe, ['F'] = 0xf,
+	[0x47 ... 0x60] = 0xff,
+	['a'] = 0xa, ['b'] = 0xb, ['c'] = 0xc,
+	['d'] = 0xd, ['e'] = 0xe, ['f'] = 0xf,
+	[0x67 ... 0xff] = 0xff,
+};
+
+static inline void hex_encode(char *out, const unsigned char *buf,
+				size_t len, const char hexpairs[static 512])
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4, out += 8) {
+		memcpy(out + 0, hexpairs + buf[i + 0] * 2, 2);
+		memcpy(out + 2, hexpairs + buf[i + 1] * 2, 2);
+		memcpy(out + 4, hexpairs + buf[i + 2] * 2, 2);
+		memcpy(out + 6, hexpairs + buf[i + 3] * 2, 2);
+	}
+
+	for (; i < len; i++, out += 2)
+		memcpy(out, hexpairs + buf[i] * 2, 2);
+}
+
 static char *hexstring_common(const unsigned char *buf, size_t len,
-				const char hexdigits[static 16])
+				const char hexpairs[static 512])
 {
 	char *str;
-	size_t i;
 
 	if (unlikely(!buf) || unlikely(!len))
 		return NULL;
 
 	str = l_malloc(len * 2 + 1);
 
-	for (i = 0; i < len; i++) {
-		str[(i * 2) + 0] = hexdigits[buf[i] >> 4];
-		str[(i * 2) + 1] = hexdigits[buf[i] & 0xf];
-	}
-
+	hex_encode(str, buf, len, hexpairs);
 	str[len * 2] = '\0';
 
 	return str;
@@ -374,8 +440,7 @@ static char *hexstring_common(const unsigned char *buf, size_t len,
  **/
 LIB_EXPORT char *l_util_hexstring(const unsigned char *buf, size_t len)
 {
-	static const char hexdigits[] = "0123456789abcdef";
-	return hexstring_common(buf, len, hexdigits);
+	return hexstring_common(buf, len, hexpairs_lower);
 }
 
 /**
@@ -389,8 +454,7 @@ LIB_EXPORT char *l_util_hexstring(const unsigned char *buf, size_t len)
  **/
 LIB_EXPORT char *l_util_hexstring_upper(const unsigned char *buf, size_t len)
 {
-	static const char hexdigits[] = "0123456789ABCDEF";
-	return hexstring_common(buf, len, hexdigits);
+	return hexstring_common(buf, len, hexpairs_upper);
 }
 
 /**
@@ -403,92 +467,86 @@ LIB_EXPORT char *l_util_hexstring_upper(const unsigned char *buf, size_t len)
 LIB_EXPORT unsigned char *l_util_from_hexstring(const char *str,
 							size_t *out_len)
 {
-	size_t i, j;
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i;
 	size_t len;
-	char c;
 	unsigned char *buf;
 
 	if (unlikely(!str))
 		return NULL;
 
-	for (i = 0; str[i]; i++) {
-		c = toupper(str[i]);
-
-		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))
-			continue;
-
-		return NULL;
-	}
+	len = strlen(str);
 
-	if ((i % 2) != 0)
+	if ((len % 2) != 0)
 		return NULL;
 
-	len = i;
-	buf = l_malloc(i >> 1);
-
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = toupper(str[i]);
+	buf = l_malloc(len >> 1);
 
-		if (c >= '0' && c <= '9')
-			buf[j] = c - '0';
-		else if (c >= 'A' && c <= 'F')
-			buf[j] = 10 + c - 'A';
+	/*
+	 * Decode and validate in one pass.  Either nibble being invalid
+	 * sets the high bit of the OR-ed lookups, which is checked once
+	 * per output byte.
+	 */
+	for (i = 0; i < len; i += 2) {
+		unsigned char hi = hexvals[s[i]];
+		unsigned char lo = hexvals[s[i + 1]];
 
-		i += 1;
-
-		c = toupper(str[i]);
+		if (unlikely((hi | lo) & 0xf0)) {
+			l_free(buf);
+			return NULL;
+		}
 
-		if (c >= '0' && c <= '9')
-			buf[j] = buf[j] * 16 + c - '0';
-		else if (c >= 'A' && c <= 'F')
-			buf[j] = buf[j] * 16 + 10 + c - 'A';
+		buf[i >> 1] = (hi << 4) | lo;
 	}
 
 	if (out_len)
-		*out_len = j;
+		*out_len = len >> 1;
 
 	return buf;
 }
 
-static void hexdump(const char dir, const unsigned char *buf, size_t len,
-			l_util_hexdump_func_t function, void *user_data)
+/*
+ * Render one hexdump line of up to 16 bytes:
+ *
+ *   "d xx xx .. xx  cccccccccccccccc"
+ *
+ * Exactly 67 characters plus the terminating NUL are written to @str
+ * regardless of @len, short lines are padded with spaces.
+ */
+static void hexdump_line(char str[static 68], char dir,
+					const unsigned char *buf, size_t len)
 {
-	static const char hexdigits[] = "0123456789abcdef";
-	char str[68];
 	size_t i;
 
-	if (unlikely(!len))
-		return;
-
 	str[0] = dir;
 
 	for (i = 0; i < len; i++) {
-		str[((i % 16) * 3) + 1] = ' ';
-		str[((i % 16) * 3) + 2] = hexdigits[buf[i] >> 4];
-		str[((i % 16) * 3) + 3] = hexdigits[buf[i] & 0xf];
-		str[(i % 16) + 51] = isprint(buf[i]) ? buf[i] : '.';
-
-		if ((i + 1) % 16 == 0) {
-			str[49] = ' ';
-			str[50] = ' ';
-			str[67] = '\0';
-			function(str, user_data);
-			str[0] = ' ';
-		}
+		str[(i * 3) + 1] = ' ';
+		memcpy(str + (i * 3) + 2, hexpairs_lower + buf[i] * 2, 2);
+		str[i + 51] = l_ascii_isprint(buf[i]) ? buf[i] : '.';
 	}
 
-	if (i % 16 > 0) {
-		size_t j;
-		for (j = (i % 16); j < 16; j++) {
-			str[(j * 3) + 1] = ' ';
-			str[(j * 3) + 2] = ' ';
-			str[(j * 3) + 3] = ' ';
-			str[j + 51] = ' ';
-		}
-		str[49] = ' ';
-		str[50] = ' ';
-		str[67] = '\0';
+	if (i < 16) {
+		memset(str + (i * 3) + 1, ' ', (16 - i) * 3);
+		memset(str + i + 51, ' ', 16 - i);
+	}
+
+	str[49] = ' ';
+	str[50] = ' ';
+	str[67] = '\0';
+}
+
+static void hexdump(const char dir, const unsigned char *buf, size_t len,
+			l_util_hexdump_func_t function, void *user_data)
+{
+	char str[68];
+	char prefix = dir;
+	size_t i;
+
+	for (i = 0; i < len; i += 16) {
+		hexdump_line(str, prefix, buf + i, len - i < 16 ? len - i : 16);
 		function(str, user_data);
+		prefix = ' ';
 	}
 }
 
@@ -517,56 +575,52 @@ LIB_EXPORT void l_util_hexdumpv(bool in, const struct iovec *iov,
 					l_util_hexdump_func_t function,
 					void *user_data)
 {
-	static const char hexdigits[] = "0123456789abcdef";
 	char str[68];
+	unsigned char line[16];
+	size_t line_len = 0;
+	char prefix;
 	size_t i;
-	size_t len;
-	size_t c;
-	const uint8_t *buf;
 
 	if (unlikely(!iov || !n_iov))
 		return;
 
-	str[0] = in ? '<' : '>';
+	prefix = in ? '<' : '>';
 
-	for (i = 0, len = 0; i < n_iov; i++)
-		len += iov[i].iov_len;
+	for (i = 0; i < n_iov; i++) {
+		const unsigned char *buf = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
 
-	c = 0;
-	buf = iov[0].iov_base;
+		/* Top up a line left partially filled by the previous iovec */
+		if (line_len) {
+			size_t n = 16 - line_len < len ? 16 - line_len : len;
 
-	for (i = 0; i < len; i++, c++) {
-		if (c == iov[0].iov_len) {
-			c = 0;
-			iov += 1;
-			buf = iov[0].iov_base;
-		}
+			memcpy(line + line_len, buf, n);
+			line_len += n;
+			buf += n;
+			len -= n;
 
-		str[((i % 16) * 3) + 1] = ' ';
-		str[((i % 16) * 3) + 2] = hexdigits[buf[c] >> 4];
-		str[((i % 16) * 3) + 3] = hexdigits[buf[c] & 0xf];
-		str[(i % 16) + 51] = isprint(buf[c]) ? buf[c] : '.';
+			if (line_len < 16)
+				continue;
 
-		if ((i + 1) % 16 == 0) {
-			str[49] = ' ';
-			str[50] = ' ';
-			str[67] = '\0';
+			hexdump_line(str, prefix, line, 16);
 			function(str, user_data);
-			str[0] = ' ';
+			prefix = ' ';
+			line_len = 0;
 		}
-	}
 
-	if (i % 16 > 0) {
-		size_t j;
-		for (j = (i % 16); j < 16; j++) {
-			str[(j * 3) + 1] = ' ';
-			str[(j * 3) + 2] = ' ';
-			str[(j * 3) + 3] = ' ';
-			str[j + 51] = ' ';
+		/* Whole lines are rendered straight from the iovec */
+		for (; len >= 16; buf += 16, len -= 16) {
+			hexdump_line(str, prefix, buf, 16);
+			function(str, user_data);
+			prefix = ' ';
 		}
-		str[49] = ' ';
-		str[50] = ' ';
-		str[67] = '\0';
+
+		memcpy(line, buf, len);
+		line_len = len;
+	}
+
+	if (line_len) {
+		hexdump_line(str, prefix, line, line_len);
 		function(str, user_data);
 	}
 }
@@ -0,0 +1,64 @@
+/*
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2019  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+static void print_line(const char *str, void *user_data)
+{
+	printf("%s\n", str);
+}
+
+int main(int argc, char *argv[])
+{
+	void *data;
+	size_t len;
+	bool ok;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	data = l_file_get_contents(argv[1], &len);
+	if (!data) {
+		fprintf(stderr, "Could not read %s: %s\n",
+						argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ok = l_debug_trace_decode(data, len, print_line, NULL);
+	l_free(data);
+
+	if (!ok) {
+		fprintf(stderr, "%s is not a valid trace dump\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+#define NUM_OBJECTS	10
+
+static struct l_dbus_server *server;
+static struct l_dbus *server_dbus;
+static struct l_dbus *client_dbus;
+static struct l_dbus_client *client;
+static uint32_t values[NUM_OBJECTS];
+static unsigned int proxies_added;
+static bool success;
+
+static void test_assert_fail(int line, const char *condition)
+{
+	l_info("%i: Assertion failed: %s", line, condition);
+	l_main_quit();
+}
+
+#define test_assert(cond)	\
+	do {	\
+		if (!(cond)) {	\
+			test_assert_fail(__LINE__, #cond);	\
+			return;	\
+		}	\
+	} while (0)
+
+static bool test_name_getter(struct l_dbus *dbus,
+				struct l_dbus_message *message,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "object%u", L_PTR_TO_UINT(user_data));
+
+	return l_dbus_message_builder_append_basic(builder, 's', name);
+}
+
+static bool test_value_getter(struct l_dbus *dbus,
+				struct l_dbus_message *message,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	return l_dbus_message_builder_append_basic(builder, 'u',
+					&values[L_PTR_TO_UINT(user_data)]);
+}
+
+static bool test_tags_getter(struct l_dbus *dbus,
+				struct l_dbus_message *message,
+				struct l_dbus_message_builder *builder,
+				void *user_data)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "tag%u", L_PTR_TO_UINT(user_data));
+
+	l_dbus_message_builder_enter_array(builder, "s");
+	l_dbus_message_builder_append_basic(builder, 's', "common");
+	l_dbus_message_builder_append_basic(builder, 's', tag);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static void setup_test_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_property(interface, "Name", 0, "s",
+					test_name_getter, NULL);
+	l_dbus_interface_property(interface, "Value", 0, "u",
+					test_value_getter, NULL);
+	l_dbus_interface_property(interface, "Tags", 0, "as",
+					test_tags_getter, NULL);
+}
+
+static void connect_callback(struct l_dbus_server *server,
+				struct l_dbus *dbus, void *user_data)
+{
+	unsigned int i;
+	char path[16];
+
+	test_assert(!server_dbus);
+
+	server_dbus = dbus;
+
+	test_assert(l_dbus_register_interface(dbus, "org.test",
+						setup_test_interface,
+						NULL, false));
+	test_assert(l_dbus_object_manager_enable(dbus));
+
+	for (i = 0; i < NUM_OBJECTS; i++) {
+		values[i] = i;
+
+		snprintf(path, sizeof(path), "/obj%u", i);
+		test_assert(l_dbus_object_add_interface(dbus, path, "org.test",
+							L_UINT_TO_PTR(i)));
+		test_assert(l_dbus_object_add_interface(dbus, path,
+					L_DBUS_INTERFACE_PROPERTIES, NULL));
+	}
+}
+
+static unsigned int object_index(struct l_dbus_proxy *proxy)
+{
+	return strtoul(l_dbus_proxy_get_path(proxy) + 4, NULL, 10);
+}
+
+static void proxy_added(struct l_dbus_proxy *proxy, void *user_data)
+{
+	struct l_dbus_message_iter tags;
+	const char *name;
+	uint32_t value;
+	int32_t wrong;
+	char expected[16];
+	unsigned int i;
+
+	test_assert(!strcmp(l_dbus_proxy_get_interface(proxy), "org.test"));
+
+	snprintf(expected, sizeof(expected), "object%u", object_index(proxy));
+
+	test_assert(l_dbus_proxy_get_property(proxy, "Name", "s", &name));
+	test_assert(!strcmp(name, expected));
+	test_assert(l_dbus_proxy_get_property(proxy, "Value", "u", &value));
+	test_assert(value == object_index(proxy));
+	test_assert(!l_dbus_proxy_get_property(proxy, "Missing", "u",
+								&value));
+
+	test_assert(!strcmp(l_dbus_proxy_get_string(proxy, "Name"), expected));
+	test_assert(l_dbus_proxy_get_uint32(proxy, "Value", &value));
+	test_assert(value == object_index(proxy));
+	test_assert(!l_dbus_proxy_get_int32(proxy, "Value", &wrong));
+	test_assert(!l_dbus_proxy_get_string(proxy, "Value"));
+	test_assert(!l_dbus_proxy_get_uint32(proxy, "Missing", &value));
+
+	/* Complex values can be read any number of times */
+	snprintf(expected, sizeof(expected), "tag%u", object_index(proxy));
+
+	for (i = 0; i < 2; i++) {
+		test_assert(l_dbus_proxy_get_property(proxy, "Tags", "as",
+								&tags));
+		test_assert(l_dbus_message_iter_next_entry(&tags, &name));
+		test_assert(!strcmp(name, "common"));
+		test_assert(l_dbus_message_iter_next_entry(&tags, &name));
+		test_assert(!strcmp(name, expected));
+		test_assert(!l_dbus_message_iter_next_entry(&tags, &name));
+	}
+
+	test_assert(!l_dbus_proxy_get_property(proxy, "Tags", "s", &name));
+	test_assert(!l_dbus_proxy_get_string(proxy, "Tags"));
+
+	proxies_added += 1;
+}
+
+static void property_changed(struct l_dbus_proxy *proxy, const char *name,
+				struct l_dbus_message *msg, void *user_data)
+{
+	static bool changed[NUM_OBJECTS];
+	uint32_t value, cached;
+
+	if (strcmp(name, "Value"))
+		return;
+
+	test_assert(l_dbus_message_get_arguments(msg, "u", &value));
+	test_assert(l_dbus_proxy_get_property(proxy, "Value", "u", &cached));
+	test_assert(value == cached);
+	test_assert(l_dbus_proxy_get_uint32(proxy, "Value", &cached));
+	test_assert(value == cached);
+
+	/* Each change must reach the proxy of its own object only */
+	if (value >= 100) {
+		test_assert(value == object_index(proxy) * 100);
+		changed[object_index(proxy)] = true;
+	}
+
+	if (!changed[3] || !changed[7])
+		return;
+
+	success = true;
+	l_main_quit();
+}
+
+static void client_ready(struct l_dbus_client *client, void *user_data)
+{
+	test_assert(proxies_added == NUM_OBJECTS);
+
+	values[3] = 300;
+	test_assert(l_dbus_property_changed(server_dbus, "/obj3", "org.test",
+								"Value"));
+	values[7] = 700;
+	test_assert(l_dbus_property_changed(server_dbus, "/obj7", "org.test",
+								"Value"));
+}
+
+static void timeout_callback(struct l_timeout *timeout, void *user_data)
+{
+	l_info("Timed out");
+	l_main_quit();
+}
+
+int main(int argc, char *argv[])
+{
+	struct l_timeout *timeout;
+	char address[64];
+
+	if (!l_main_init())
+		return -1;
+
+	l_log_set_stderr();
+
+	snprintf(address, sizeof(address), "unix:abstract=ell-test-client-%i",
+								getpid());
+
+	server = l_dbus_server_new(address);
+	if (!server)
+		goto done;
+
+	l_dbus_server_set_connect_handler(server, connect_callback,
+						NULL, NULL);
+
+	client_dbus = l_dbus_new_peer(address);
+	if (!client_dbus)
+		goto done;
+
+	client = l_dbus_client_new(client_dbus, "org.test", "/");
+	if (!client)
+		goto done;
+
+	l_dbus_client_set_proxy_handlers(client, proxy_added, NULL,
+						property_changed, NULL, NULL);
+	l_dbus_client_set_ready_handler(client, client_ready, NULL, NULL);
+
+	timeout = l_timeout_create(5, timeout_callback, NULL, NULL);
+
+	l_main_run();
+
+	l_timeout_remove(timeout);
+
+done:
+	l_dbus_client_destroy(client);
+	l_dbus_destroy(client_dbus);
+	l_dbus_destroy(server_dbus);
+	l_dbus_server_destroy(server);
+
+	l_main_exit();
+
+	if (!success)
+		abort();
+
+	return 0;
+}
@@ -0,0 +1,370 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+#define NUM_WORK	10
+#define MAX_PENDING	2
+
+static struct l_dbus_server *server;
+static struct l_dbus *server_dbus;
+static struct l_dbus *client_dbus;
+static struct l_dbus_pending_reply *held;
+static struct l_dbus_pending_reply *blocked;
+static unsigned int block_replies;
+static bool block_dropped;
+static unsigned int in_progress;
+static unsigned int max_in_progress;
+static unsigned int work_replies;
+static bool work_seen[NUM_WORK];
+static bool ping_seen;
+static bool ping_early;
+static bool success;
+
+static void test_assert_fail(int line, const char *condition)
+{
+	l_info("%i: Assertion failed: %s", line, condition);
+	l_main_quit();
+}
+
+#define test_assert(cond)	\
+	do {	\
+		if (!(cond)) {	\
+			test_assert_fail(__LINE__, #cond);	\
+			return;	\
+		}	\
+	} while (0)
+
+static void check_done(void)
+{
+	if (!ping_seen || work_replies < NUM_WORK || block_replies < 2)
+		return;
+
+	/* A call still queued when its interface goes gets an error */
+	test_assert(block_dropped);
+
+	/* Slow calls on one interface do not hold up the others */
+	test_assert(ping_early);
+	test_assert(max_in_progress == MAX_PENDING);
+	test_assert(in_progress == 0);
+
+	success = true;
+	l_main_quit();
+}
+
+/* Stands in for a worker finishing the job */
+static void work_complete(struct l_timeout *timeout, void *user_data)
+{
+	struct l_dbus_pending_reply *pending = user_data;
+	struct l_dbus_message *message;
+	struct l_dbus_message *reply;
+	const char *str;
+
+	l_timeout_remove(timeout);
+
+	message = l_dbus_pending_reply_get_message(pending);
+	test_assert(l_dbus_message_get_arguments(message, "s", &str));
+
+	reply = l_dbus_message_new_method_return(message);
+	l_dbus_message_set_arguments(reply, "s", str);
+
+	in_progress -= 1;
+	test_assert(l_dbus_pending_reply_send(pending, reply));
+}
+
+static struct l_dbus_message *work_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_pending_reply *pending;
+
+	pending = l_dbus_method_defer(dbus, message);
+	if (!pending)
+		return l_dbus_message_new_error(message, "org.test.Failed",
+							"Defer failed");
+
+	/* A call only ever has one reply to defer */
+	if (l_dbus_method_defer(dbus, message))
+		return NULL;
+
+	in_progress += 1;
+
+	if (in_progress > max_in_progress)
+		max_in_progress = in_progress;
+
+	l_timeout_create_ms(20, work_complete, pending, NULL);
+
+	return NULL;
+}
+
+static struct l_dbus_message *ping_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	return l_dbus_message_new_method_return(message);
+}
+
+static struct l_dbus_message *hold_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	/* Only completed once the connection is gone */
+	held = l_dbus_method_defer(dbus, message);
+
+	return NULL;
+}
+
+static struct l_dbus_message *block_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	/* Only one call is let through, the next one waits behind it */
+	blocked = l_dbus_method_defer(dbus, message);
+
+	return NULL;
+}
+
+static struct l_dbus_message *drop_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_message *reply;
+
+	if (!blocked || !l_dbus_unregister_interface(dbus, "org.test.Slow"))
+		return l_dbus_message_new_error(message, "org.test.Failed",
+							"Drop failed");
+
+	reply = l_dbus_message_new_method_return(
+				l_dbus_pending_reply_get_message(blocked));
+	l_dbus_message_set_arguments(reply, "");
+	l_dbus_pending_reply_send(blocked, reply);
+	blocked = NULL;
+
+	return l_dbus_message_new_method_return(message);
+}
+
+static void setup_slow_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Block", L_DBUS_METHOD_FLAG_ASYNC,
+				block_callback, "", "");
+	l_dbus_interface_set_max_pending_replies(interface, 1);
+}
+
+static void setup_work_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Work", L_DBUS_METHOD_FLAG_ASYNC,
+				work_callback, "s", "s", "result", "job");
+	l_dbus_interface_set_max_pending_replies(interface, MAX_PENDING);
+}
+
+static void setup_other_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Ping", 0, ping_callback, "", "");
+	l_dbus_interface_method(interface, "Hold", L_DBUS_METHOD_FLAG_ASYNC,
+				hold_callback, "", "");
+	l_dbus_interface_method(interface, "Drop", 0, drop_callback, "", "");
+}
+
+static void connect_callback(struct l_dbus_server *server,
+				struct l_dbus *dbus, void *user_data)
+{
+	test_assert(!server_dbus);
+
+	server_dbus = dbus;
+
+	test_assert(l_dbus_register_interface(dbus, "org.test.Work",
+						setup_work_interface,
+						NULL, false));
+	test_assert(l_dbus_register_interface(dbus, "org.test.Other",
+						setup_other_interface,
+						NULL, false));
+	test_assert(l_dbus_object_add_interface(dbus, "/test",
+						"org.test.Work", NULL));
+	test_assert(l_dbus_object_add_interface(dbus, "/test",
+						"org.test.Other", NULL));
+
+	test_assert(l_dbus_register_interface(dbus, "org.test.Slow",
+						setup_slow_interface,
+						NULL, false));
+	test_assert(l_dbus_object_add_interface(dbus, "/test",
+						"org.test.Slow", NULL));
+}
+
+static void work_setup(struct l_dbus_message *message, void *user_data)
+{
+	char job[16];
+
+	snprintf(job, sizeof(job), "job%u", L_PTR_TO_UINT(user_data));
+	l_dbus_message_set_arguments(message, "s", job);
+}
+
+static void work_reply(struct l_dbus_message *message, void *user_data)
+{
+	unsigned int index = L_PTR_TO_UINT(user_data);
+	const char *str;
+	char job[16];
+
+	test_assert(!l_dbus_message_is_error(message));
+	test_assert(l_dbus_message_get_arguments(message, "s", &str));
+
+	snprintf(job, sizeof(job), "job%u", index);
+	test_assert(!strcmp(str, job));
+	test_assert(!work_seen[index]);
+
+	work_seen[index] = true;
+	work_replies += 1;
+
+	check_done();
+}
+
+static void ping_reply(struct l_dbus_message *message, void *user_data)
+{
+	test_assert(!l_dbus_message_is_error(message));
+
+	ping_seen = true;
+	ping_early = work_replies < NUM_WORK;
+
+	check_done();
+}
+
+static void empty_setup(struct l_dbus_message *message, void *user_data)
+{
+	l_dbus_message_set_arguments(message, "");
+}
+
+static void block_reply(struct l_dbus_message *message, void *user_data)
+{
+	const char *name;
+
+	if (L_PTR_TO_UINT(user_data) == 0)
+		test_assert(!l_dbus_message_is_error(message));
+	else {
+		test_assert(l_dbus_message_get_error(message, &name, NULL));
+		test_assert(!strcmp(name,
+				"org.freedesktop.DBus.Error.UnknownMethod"));
+		block_dropped = true;
+	}
+
+	block_replies += 1;
+
+	check_done();
+}
+
+static void drop_reply(struct l_dbus_message *message, void *user_data)
+{
+	test_assert(!l_dbus_message_is_error(message));
+}
+
+static void client_ready(void *user_data)
+{
+	unsigned int i;
+
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test.Other", "Hold", empty_setup,
+					NULL, NULL, NULL));
+
+	for (i = 0; i < 2; i++)
+		test_assert(l_dbus_method_call(client_dbus, "org.test",
+						"/test", "org.test.Slow",
+						"Block", empty_setup,
+						block_reply, L_UINT_TO_PTR(i),
+						NULL));
+
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test.Other", "Drop", empty_setup,
+					drop_reply, NULL, NULL));
+
+	for (i = 0; i < NUM_WORK; i++)
+		test_assert(l_dbus_method_call(client_dbus, "org.test",
+						"/test", "org.test.Work",
+						"Work", work_setup, work_reply,
+						L_UINT_TO_PTR(i), NULL));
+
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test.Other", "Ping", empty_setup,
+					ping_reply, NULL, NULL));
+}
+
+static void timeout_callback(struct l_timeout *timeout, void *user_data)
+{
+	l_info("Timed out");
+	l_main_quit();
+}
+
+int main(int argc, char *argv[])
+{
+	struct l_timeout *timeout;
+	char address[64];
+
+	if (!l_main_init())
+		return -1;
+
+	l_log_set_stderr();
+
+	snprintf(address, sizeof(address), "unix:abstract=ell-test-defer-%i",
+								getpid());
+
+	server = l_dbus_server_new(address);
+	if (!server)
+		goto done;
+
+	l_dbus_server_set_connect_handler(server, connect_callback,
+						NULL, NULL);
+
+	client_dbus = l_dbus_new_peer(address);
+	if (!client_dbus)
+		goto done;
+
+	l_dbus_set_ready_handler(client_dbus, client_ready, NULL, NULL);
+
+	timeout = l_timeout_create(5, timeout_callback, NULL, NULL);
+
+	l_main_run();
+
+	l_timeout_remove(timeout);
+
+done:
+	l_dbus_destroy(client_dbus);
+	l_dbus_destroy(server_dbus);
+	l_dbus_server_destroy(server);
+
+	/* A reply outliving its connection goes nowhere */
+	if (success && (!held || !l_dbus_pending_reply_send(held, NULL)))
+		success = false;
+
+	l_main_exit();
+
+	if (!success)
+		abort();
+
+	return 0;
+}
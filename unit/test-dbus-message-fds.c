@@ -41,21 +41,28 @@
 #define WAIT_ANY (-1) /* Any process */
 #endif
 
-#define TEST_BUS_ADDRESS "unix:path=/tmp/ell-test-bus"
-
+static char bus_address[64];
 static pid_t dbus_daemon_pid = -1;
 
 static bool start_dbus_daemon(void)
 {
-	char *prg_argv[5];
+	char *prg_argv[6];
 	char *prg_envp[1];
+	char address_arg[96];
 	pid_t pid;
 
+	/* Each test gets a bus of its own so tests can run in parallel */
+	snprintf(bus_address, sizeof(bus_address),
+				"unix:abstract=ell-test-bus-%i", getpid());
+	snprintf(address_arg, sizeof(address_arg), "--address=%s",
+								bus_address);
+
 	prg_argv[0] = "/usr/bin/dbus-daemon";
 	prg_argv[1] = "--nopidfile";
 	prg_argv[2] = "--nofork";
 	prg_argv[3] = "--config-file=" UNITDIR "dbus.conf";
-	prg_argv[4] = NULL;
+	prg_argv[4] = address_arg;
+	prg_argv[5] = NULL;
 
 	prg_envp[0] = NULL;
 
@@ -209,10 +216,43 @@ static struct l_dbus_message *get_random_callback(struct l_dbus *dbus,
 	return reply;
 }
 
+static struct l_dbus_message *get_payload_callback(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	uint8_t *data;
+	uint32_t size, i;
+
+	if (!l_dbus_message_get_arguments(message, "u", &size))
+		return l_dbus_message_new_error(message,
+						"org.test.InvalidArgs",
+						"Invalid arguments");
+
+	data = l_malloc(size);
+
+	for (i = 0; i < size; i++)
+		data[i] = i * 7;
+
+	reply = l_dbus_message_new_method_return(message);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_append_payload(builder, data, size);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_free(data);
+
+	return reply;
+}
+
 static void setup_test_interface(struct l_dbus_interface *interface)
 {
 	l_dbus_interface_method(interface, "GetRandom", 0, get_random_callback,
 				"h", "", "randomfd");
+	l_dbus_interface_method(interface, "GetPayload", 0,
+				get_payload_callback, "v", "u",
+				"payload", "size");
 }
 
 static int count_fds(void)
@@ -301,6 +341,58 @@ static void test_fd_passing_1(struct l_dbus *dbus, void *test_data)
 				NULL, get_random_return_callback, NULL, NULL);
 }
 
+static void get_payload_setup(struct l_dbus_message *message,
+					void *user_data)
+{
+	l_dbus_message_set_arguments(message, "u", L_PTR_TO_UINT(user_data));
+}
+
+static void get_payload_return_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	uint32_t expected = L_PTR_TO_UINT(user_data);
+	struct l_dbus_message_iter iter, variant;
+	const uint8_t *data;
+	const void *payload;
+	size_t size, i;
+	int fd;
+
+	test_assert(!l_dbus_message_get_error(message, NULL, NULL));
+
+	test_assert(l_dbus_message_get_arguments(message, "v", &iter));
+	test_assert(l_dbus_message_iter_get_payload(&iter, &payload, &size));
+	test_assert(size == expected);
+
+	data = payload;
+
+	for (i = 0; i < size; i++)
+		test_assert(data[i] == (uint8_t) (i * 7));
+
+	/* Large payloads must have been passed in a sealed memfd */
+	if (size >= 64 * 1024) {
+		uint64_t offset, fd_size;
+
+		test_assert(l_dbus_message_get_arguments(message, "v",
+								&variant));
+		test_assert(l_dbus_message_iter_get_variant(&variant, "(htt)",
+						&fd, &offset, &fd_size));
+		test_assert(offset == 0 && fd_size == size);
+		test_assert(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE);
+		close(fd);
+	}
+
+	test_assert(l_idle_oneshot(get_random_idle_callback, NULL, NULL));
+}
+
+static void test_payload(struct l_dbus *dbus, void *test_data)
+{
+	open_fds = count_fds();
+
+	l_dbus_method_call(dbus, "org.test", "/test", "org.test", "GetPayload",
+				get_payload_setup, get_payload_return_callback,
+				test_data, NULL);
+}
+
 static void test_run(void)
 {
 	success = false;
@@ -331,6 +423,9 @@ int main(int argc, char *argv[])
 		return -1;
 
 	test_add("FD passing 1", test_fd_passing_1, NULL);
+	test_add("Inline payload", test_payload, L_UINT_TO_PTR(1000));
+	test_add("Memfd payload", test_payload,
+					L_UINT_TO_PTR(4 * 1024 * 1024));
 
 	sigchld = l_signal_create(SIGCHLD, sigchld_handler, NULL, NULL);
 
@@ -342,7 +437,7 @@ int main(int argc, char *argv[])
 	for (i = 0; i < 10; i++) {
 		usleep(200 * 1000);
 
-		dbus = l_dbus_new(TEST_BUS_ADDRESS);
+		dbus = l_dbus_new(bus_address);
 		if (dbus)
 			break;
 	}
@@ -2684,6 +2684,147 @@ static void check_complex_5(const void *data)
 	l_dbus_message_unref(msg);
 }
 
+static void message_pool(const void *data)
+{
+	struct _dbus_message_pool *pool = _dbus_message_pool_new();
+	struct l_dbus_message *call, *reply;
+	const void *shell, *body;
+	const char *str;
+
+	call = _dbus_message_new_method_call(1, "org.test", "/test",
+						"org.test", "Method");
+	_dbus_message_set_pool(call, pool);
+
+	reply = l_dbus_message_new_method_return(call);
+	assert(l_dbus_message_set_arguments(reply, "s", "first"));
+	shell = reply;
+	body = _dbus_message_get_body(reply, NULL);
+	l_dbus_message_unref(reply);
+
+	/* The next reply reuses the memory the previous one released */
+	reply = l_dbus_message_new_method_return(call);
+	assert(reply == shell);
+	assert(l_dbus_message_set_arguments(reply, "s", "second"));
+	assert(_dbus_message_get_body(reply, NULL) == body);
+	assert(l_dbus_message_get_arguments(reply, "s", &str));
+	assert(!strcmp(str, "second"));
+
+	/* Messages may outlive the pool */
+	_dbus_message_pool_free(pool);
+	l_dbus_message_unref(call);
+	l_dbus_message_unref(reply);
+}
+
+static void check_payload(struct _dbus_message_pool *pool,
+				const uint8_t *data, size_t size,
+				uint32_t expected_fds)
+{
+	struct l_dbus_message *msg;
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message_iter iter;
+	const void *payload;
+	size_t payload_size;
+	uint32_t num_fds;
+
+	msg = _dbus_message_new_method_call(1, "org.test", "/test",
+						"org.test", "Method");
+	_dbus_message_set_pool(msg, pool);
+
+	builder = l_dbus_message_builder_new(msg);
+	assert(l_dbus_message_builder_append_payload(builder, data, size));
+	assert(l_dbus_message_builder_finalize(builder));
+	l_dbus_message_builder_destroy(builder);
+
+	_dbus_message_get_fds(msg, &num_fds);
+	assert(num_fds == expected_fds);
+
+	assert(l_dbus_message_get_arguments(msg, "v", &iter));
+	assert(l_dbus_message_iter_get_payload(&iter, &payload,
+							&payload_size));
+	assert(payload_size == size);
+	assert(!memcmp(payload, data, size));
+
+	l_dbus_message_unref(msg);
+}
+
+static void message_payload(const void *data)
+{
+	struct _dbus_message_pool *pool = _dbus_message_pool_new();
+	size_t size = 256 * 1024;
+	uint8_t *bytes = l_malloc(size);
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		bytes[i] = i * 7;
+
+	check_payload(NULL, bytes, 1000, 0);
+
+	/* Without a connection able to pass fds the bytes go inline */
+	check_payload(NULL, bytes, size, 0);
+	check_payload(pool, bytes, size, 0);
+
+	_dbus_message_pool_set_unix_fds(pool, true);
+	check_payload(pool, bytes, 1000, 0);
+	check_payload(pool, bytes, size, 1);
+
+	_dbus_message_pool_free(pool);
+	l_free(bytes);
+}
+
+static bool message_in_buffer(struct l_dbus_message *msg,
+					struct _dbus_recv_buffer *buffer)
+{
+	size_t size;
+	const uint8_t *header = _dbus_message_get_header(msg, &size);
+
+	return header >= buffer->data && header < buffer->data + buffer->size;
+}
+
+static void message_view(const void *data)
+{
+	const struct message_data *msg_data = data;
+	struct _dbus_recv_buffer *buffer;
+	struct l_dbus_message *msg;
+	const char *str;
+
+	buffer = _dbus_recv_buffer_new(DBUS_RECV_BUFFER_SIZE);
+	memcpy(buffer->data, msg_data->binary, msg_data->binary_len);
+
+	/* Received messages always carry a serial */
+	buffer->data[8] = 1;
+
+	/* A default sized buffer is shared with the message */
+	msg = _dbus_message_new_view(buffer, 0, 128,
+					msg_data->binary_len - 128, NULL, 0);
+	assert(msg);
+	assert(message_in_buffer(msg, buffer));
+	assert(buffer->refcount == 2);
+
+	assert(l_dbus_message_get_arguments(msg, "s", &str));
+	assert(!strcmp(str, "Linus Torvalds"));
+
+	l_dbus_message_unref(msg);
+	assert(buffer->refcount == 1);
+	_dbus_recv_buffer_unref(buffer);
+
+	/* A small message does not pin a buffer grown for a large one */
+	buffer = _dbus_recv_buffer_new(DBUS_RECV_BUFFER_SIZE * 4);
+	memcpy(buffer->data, msg_data->binary, msg_data->binary_len);
+	buffer->data[8] = 1;
+
+	msg = _dbus_message_new_view(buffer, 0, 128,
+					msg_data->binary_len - 128, NULL, 0);
+	assert(msg);
+	assert(!message_in_buffer(msg, buffer));
+	assert(buffer->refcount == 1);
+	_dbus_recv_buffer_unref(buffer);
+
+	assert(l_dbus_message_get_arguments(msg, "s", &str));
+	assert(!strcmp(str, "Linus Torvalds"));
+
+	l_dbus_message_unref(msg);
+}
+
 static void builder_rewind(const void *data)
 {
 	struct l_dbus_message *msg = build_message(data);
@@ -2967,6 +3108,10 @@ int main(int argc, char *argv[])
 	l_test_add("Message Builder Rewind Complex 1", builder_rewind,
 						&message_data_complex_1);
 
+	l_test_add("Message pool", message_pool, NULL);
+	l_test_add("Message payload", message_payload, NULL);
+	l_test_add("Message view", message_view, &message_data_basic_1);
+
 	l_test_add("FDs (parse)", message_fds_parse, NULL);
 	l_test_add("FDs (build)", message_fds_build, NULL);
 
@@ -0,0 +1,595 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+static struct l_dbus_server *server;
+static struct l_dbus *server_dbus;
+static struct l_dbus *client_dbus;
+static bool signal_seen;
+static bool reply_seen;
+static unsigned int echoed_signals;
+static bool service_seen;
+static bool name_seen;
+static unsigned int burst_replies;
+static uint32_t level_a, level_b;
+static unsigned int level_signals;
+static unsigned int tick_signals;
+static bool ordered_reply_seen;
+static bool writable_events[2];
+static unsigned int num_writable_events;
+static bool success;
+
+static void test_assert_fail(int line, const char *condition)
+{
+	l_info("%i: Assertion failed: %s", line, condition);
+	l_main_quit();
+}
+
+#define test_assert(cond)	\
+	do {	\
+		if (!(cond)) {	\
+			test_assert_fail(__LINE__, #cond);	\
+			return;	\
+		}	\
+	} while (0)
+
+#define BURST_CALLS	1000
+#define TICKS		5
+
+static void check_queue_done(void)
+{
+	if (level_signals < 2 || tick_signals < TICKS ||
+			num_writable_events < 2 || !ordered_reply_seen)
+		return;
+
+	test_assert(level_signals == 2);
+	test_assert(level_a == 9 && level_b == 4);
+	test_assert(!writable_events[0] && writable_events[1]);
+
+	success = true;
+	l_main_quit();
+}
+
+static void level_signal(struct l_dbus_message *message, void *user_data)
+{
+	const char *name;
+	uint32_t value;
+
+	test_assert(l_dbus_message_get_arguments(message, "su",
+							&name, &value));
+
+	level_signals += 1;
+
+	if (!strcmp(name, "a"))
+		level_a = value;
+	else if (!strcmp(name, "b"))
+		level_b = value;
+
+	check_queue_done();
+}
+
+static void tick_signal(struct l_dbus_message *message, void *user_data)
+{
+	tick_signals += 1;
+	check_queue_done();
+}
+
+static void ordered_reply(struct l_dbus_message *message, void *user_data)
+{
+	test_assert(!l_dbus_message_is_error(message));
+
+	/* The call went out after the signals queued before it */
+	test_assert(tick_signals == TICKS);
+	test_assert(echoed_signals == BURST_CALLS + 2);
+
+	ordered_reply_seen = true;
+	check_queue_done();
+}
+
+static void writable_changed(bool writable, void *user_data)
+{
+	test_assert(num_writable_events < L_ARRAY_SIZE(writable_events));
+
+	writable_events[num_writable_events++] = writable;
+	check_queue_done();
+}
+
+static void echo_setup(struct l_dbus_message *message, void *user_data)
+{
+	l_dbus_message_set_arguments(message, "s", "hello");
+}
+
+static uint32_t send_level(const char *name, uint32_t value)
+{
+	struct l_dbus_message *signal;
+
+	signal = l_dbus_message_new_signal(client_dbus, "/test", "org.test",
+						"Level");
+	l_dbus_message_set_arguments(signal, "su", name, value);
+	l_dbus_message_set_replaceable(signal, true);
+
+	return l_dbus_send(client_dbus, signal);
+}
+
+static void test_queue(void)
+{
+	struct l_dbus_message *signal;
+	uint32_t serial_a, serial_b;
+	unsigned int i;
+
+	l_dbus_add_signal_watch(server_dbus, NULL, "/test", "org.test",
+				"Level", L_DBUS_MATCH_NONE,
+				level_signal, NULL);
+	l_dbus_add_signal_watch(server_dbus, NULL, "/test", "org.test",
+				"Tick", L_DBUS_MATCH_NONE,
+				tick_signal, NULL);
+
+	test_assert(l_dbus_set_send_watermarks(client_dbus, 2, 4));
+	test_assert(l_dbus_set_writable_handler(client_dbus, writable_changed,
+							NULL, NULL));
+
+	/* Queued replaceable signals are superseded by newer ones */
+	serial_a = send_level("a", 0);
+	serial_b = send_level("b", 0);
+	test_assert(serial_a && serial_b && serial_a != serial_b);
+
+	for (i = 1; i < 10; i++)
+		test_assert(send_level("a", i) == serial_a);
+
+	for (i = 1; i < 5; i++)
+		test_assert(send_level("b", i) == serial_b);
+
+	for (i = 0; i < TICKS; i++) {
+		signal = l_dbus_message_new_signal(client_dbus, "/test",
+							"org.test", "Tick");
+		l_dbus_message_set_arguments(signal, "u", i);
+		test_assert(l_dbus_send(client_dbus, signal));
+	}
+
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test", "Echo", echo_setup,
+					ordered_reply, NULL, NULL));
+}
+
+static uint64_t histogram_count(const uint64_t *buckets)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < L_DBUS_STATS_HISTOGRAM_BUCKETS; i++)
+		count += buckets[i];
+
+	return count;
+}
+
+static void call_histogram(enum l_dbus_stats_histogram type,
+				const char *interface, const char *member,
+				const uint64_t *buckets, void *user_data)
+{
+	uint64_t *counts = user_data;
+
+	if (type != L_DBUS_STATS_CALL_LATENCY || strcmp(interface, "org.test"))
+		return;
+
+	if (!strcmp(member, "Echo"))
+		counts[0] = histogram_count(buckets);
+	else if (!strcmp(member, "Stall"))
+		counts[1] = histogram_count(buckets);
+}
+
+static void histograms_reply(struct l_dbus_message *message, void *user_data)
+{
+	struct l_dbus_message_iter histograms, buckets;
+	const char *type, *interface, *member;
+	uint64_t bucket, count;
+	unsigned int found = 0;
+
+	test_assert(l_dbus_message_get_arguments(message, "a(sssat)",
+								&histograms));
+
+	while (l_dbus_message_iter_next_entry(&histograms, &type, &interface,
+							&member, &buckets)) {
+		if (strcmp(type, "dispatch") || strcmp(interface, "org.test"))
+			continue;
+
+		count = 0;
+
+		while (l_dbus_message_iter_next_entry(&buckets, &bucket))
+			count += bucket;
+
+		if (!strcmp(member, "Echo"))
+			test_assert(count == BURST_CALLS + 1);
+		else if (!strcmp(member, "Stall"))
+			test_assert(count == 1);
+
+		found += 1;
+	}
+
+	test_assert(found == 2);
+
+	test_queue();
+}
+
+static void test_stats(void)
+{
+	struct l_dbus_stats stats;
+	uint64_t counts[2] = { 0, 0 };
+
+	test_assert(l_dbus_stats_get(client_dbus, &stats));
+	test_assert(stats.calls_timed_out == 1);
+	test_assert(stats.replies_received >= BURST_CALLS + 1);
+	test_assert(stats.calls_sent >= BURST_CALLS + 2);
+	test_assert(stats.send_queue_max >= BURST_CALLS);
+	test_assert(stats.pending_calls_max > 1);
+	test_assert(stats.bytes_sent && stats.bytes_received);
+
+	test_assert(l_dbus_stats_foreach_histogram(client_dbus, call_histogram,
+								counts));
+	test_assert(counts[0] == BURST_CALLS + 1);
+
+	/* Timed out calls have no round trip */
+	test_assert(counts[1] == 0);
+
+	/* The server's own statistics are read over the connection */
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/stats",
+					L_DBUS_INTERFACE_STATS, "GetHistograms",
+					NULL, histograms_reply, NULL, NULL));
+}
+
+static void burst_reply(struct l_dbus_message *message, void *user_data)
+{
+	test_assert(!l_dbus_message_is_error(message));
+
+	/* Each Echoed signal was sent before its reply */
+	test_assert(echoed_signals == ++burst_replies + 1);
+
+	if (burst_replies < BURST_CALLS)
+		return;
+
+	test_stats();
+}
+
+static void test_burst(void)
+{
+	unsigned int i;
+
+	test_assert(l_dbus_set_max_pending_calls(client_dbus, 0));
+
+	for (i = 0; i < BURST_CALLS; i++)
+		test_assert(l_dbus_method_call(client_dbus, "org.test",
+						"/test", "org.test", "Echo",
+						echo_setup, burst_reply,
+						NULL, NULL));
+}
+
+static void stall_reply(struct l_dbus_message *message, void *user_data)
+{
+	const char *name;
+
+	test_assert(l_dbus_message_get_error(message, &name, NULL));
+	test_assert(!strcmp(name, "org.freedesktop.DBus.Error.NoReply"));
+
+	test_burst();
+}
+
+static void stall_setup(struct l_dbus_message *message, void *user_data)
+{
+	l_dbus_message_set_arguments(message, "");
+	l_dbus_message_set_reply_timeout(message, 100);
+}
+
+static void rejected_destroy(void *user_data)
+{
+	unsigned int *count = user_data;
+
+	*count += 1;
+}
+
+static void test_stall(void)
+{
+	struct l_dbus_message *message;
+	unsigned int destroyed = 0;
+
+	test_assert(l_dbus_set_max_pending_calls(client_dbus, 1));
+
+	test_assert(l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test", "Stall", stall_setup,
+					stall_reply, NULL, NULL));
+
+	/* The limit of one outstanding call has been reached */
+	test_assert(!l_dbus_method_call(client_dbus, "org.test", "/test",
+					"org.test", "Echo", echo_setup,
+					burst_reply, &destroyed,
+					rejected_destroy));
+
+	message = l_dbus_message_new_method_call(client_dbus, "org.test",
+						"/test", "org.test", "Echo");
+	echo_setup(message, NULL);
+	test_assert(!l_dbus_send_with_reply(client_dbus, message, burst_reply,
+						&destroyed, rejected_destroy));
+
+	/* Calls turned away are released right away */
+	test_assert(destroyed == 2);
+}
+
+static void check_done(void)
+{
+	static bool done;
+
+	if (done || !signal_seen || !reply_seen || !service_seen ||
+			!name_seen)
+		return;
+
+	done = true;
+	test_stall();
+}
+
+static struct l_dbus_message *echo_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_message *reply;
+	struct l_dbus_message *signal;
+	const char *str;
+
+	if (!l_dbus_message_get_arguments(message, "s", &str))
+		return l_dbus_message_new_error(message,
+						"org.test.InvalidArgs",
+						"Invalid arguments");
+
+	reply = l_dbus_message_new_method_return(message);
+	l_dbus_message_set_arguments(reply, "s", str);
+
+	signal = l_dbus_message_new_signal(dbus, "/test", "org.test",
+						"Echoed");
+	l_dbus_message_set_arguments(signal, "s", str);
+	l_dbus_send(dbus, signal);
+
+	return reply;
+}
+
+static struct l_dbus_message *stall_callback(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	/* Never replied to */
+	return NULL;
+}
+
+static void setup_test_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "Echo", 0, echo_callback,
+				"s", "s", "reply", "str");
+	l_dbus_interface_method(interface, "Stall", 0, stall_callback,
+				"", "");
+	l_dbus_interface_signal(interface, "Echoed", 0, "s", "str");
+}
+
+static void connect_callback(struct l_dbus_server *server,
+				struct l_dbus *dbus, void *user_data)
+{
+	test_assert(!server_dbus);
+
+	server_dbus = dbus;
+
+	test_assert(l_dbus_register_interface(dbus, "org.test",
+						setup_test_interface,
+						NULL, false));
+	test_assert(l_dbus_object_add_interface(dbus, "/test", "org.test",
+						NULL));
+	test_assert(l_dbus_stats_export(dbus, "/stats"));
+}
+
+static void echo_reply(struct l_dbus_message *message, void *user_data)
+{
+	const char *str;
+
+	test_assert(!l_dbus_message_is_error(message));
+	test_assert(l_dbus_message_get_arguments(message, "s", &str));
+	test_assert(!strcmp(str, "hello"));
+	test_assert(echoed_signals == 1);
+
+	reply_seen = true;
+	check_done();
+}
+
+static void echoed_signal(struct l_dbus_message *message, void *user_data)
+{
+	const char *str;
+
+	test_assert(l_dbus_message_get_arguments(message, "s", &str));
+	test_assert(!strcmp(str, "hello"));
+
+	echoed_signals += 1;
+	signal_seen = true;
+	check_done();
+}
+
+static void service_connect(struct l_dbus *dbus, void *user_data)
+{
+	service_seen = true;
+	check_done();
+}
+
+static void name_acquired(struct l_dbus *dbus, bool success, bool queued,
+				void *user_data)
+{
+	test_assert(success && !queued);
+
+	name_seen = true;
+	check_done();
+}
+
+static void name_cancelled(struct l_dbus *dbus, bool success, bool queued,
+				void *user_data)
+{
+	test_assert_fail(__LINE__, "cancelled name request answered");
+}
+
+static void client_ready(void *user_data)
+{
+	struct l_dbus *dbus = user_data;
+	uint32_t serial;
+
+	/* The peer answers name requests itself, they can be cancelled */
+	serial = l_dbus_name_acquire(dbus, "org.test.Cancelled", false, false,
+					false, name_cancelled, NULL);
+	test_assert(serial);
+	test_assert(l_dbus_cancel(dbus, serial));
+	test_assert(!l_dbus_cancel(dbus, serial));
+
+	test_assert(l_dbus_name_acquire(dbus, "org.test.Client", false, false,
+					false, name_acquired, NULL));
+
+	l_dbus_add_signal_watch(dbus, "org.test", "/test", "org.test",
+				"Echoed", L_DBUS_MATCH_NONE,
+				echoed_signal, NULL);
+	l_dbus_add_service_watch(dbus, "org.test", service_connect, NULL,
+					NULL, NULL);
+
+	l_dbus_method_call(dbus, "org.test", "/test", "org.test", "Echo",
+				echo_setup, echo_reply, NULL, NULL);
+}
+
+/* Every message must have been captured as one D-Bus pcap record */
+static bool check_capture(const char *path, uint64_t messages)
+{
+	uint32_t file_header[6];
+	uint32_t record_header[4];
+	uint8_t *data;
+	uint64_t records = 0;
+	bool valid = false;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	if (fread(file_header, sizeof(file_header), 1, fp) != 1 ||
+			file_header[0] != 0xa1b2c3d4 || file_header[5] != 231)
+		goto done;
+
+	while (fread(record_header, sizeof(record_header), 1, fp) == 1) {
+		if (record_header[2] < 16 ||
+				record_header[2] != record_header[3])
+			goto done;
+
+		data = l_malloc(record_header[2]);
+
+		if (fread(data, record_header[2], 1, fp) != 1 ||
+				(data[0] != 'l' && data[0] != 'B')) {
+			l_free(data);
+			goto done;
+		}
+
+		l_free(data);
+		records += 1;
+	}
+
+	valid = records == messages;
+
+done:
+	fclose(fp);
+
+	return valid;
+}
+
+static void timeout_callback(struct l_timeout *timeout, void *user_data)
+{
+	l_info("Timed out");
+	l_main_quit();
+}
+
+int main(int argc, char *argv[])
+{
+	struct l_timeout *timeout;
+	struct l_dbus_stats stats;
+	char address[64];
+	char capture[64];
+
+	if (!l_main_init())
+		return -1;
+
+	l_log_set_stderr();
+
+	snprintf(address, sizeof(address), "unix:abstract=ell-test-peer-%i",
+								getpid());
+
+	server = l_dbus_server_new(address);
+	if (!server)
+		goto done;
+
+	l_dbus_server_set_connect_handler(server, connect_callback,
+						NULL, NULL);
+
+	client_dbus = l_dbus_new_peer(address);
+	if (!client_dbus)
+		goto done;
+
+	l_dbus_set_ready_handler(client_dbus, client_ready, client_dbus, NULL);
+	l_dbus_stats_enable(client_dbus, true);
+
+	snprintf(capture, sizeof(capture), "/tmp/ell-test-peer-%i.pcap",
+								getpid());
+	l_dbus_capture_start(client_dbus, capture);
+
+	timeout = l_timeout_create(5, timeout_callback, NULL, NULL);
+
+	l_main_run();
+
+	l_timeout_remove(timeout);
+
+	if (success) {
+		l_dbus_stats_get(client_dbus, &stats);
+		l_dbus_capture_stop(client_dbus);
+
+		success = check_capture(capture, stats.messages_sent +
+						stats.messages_received);
+		if (!success)
+			l_info("Capture does not match the messages");
+	}
+
+	unlink(capture);
+
+done:
+	l_dbus_destroy(client_dbus);
+	l_dbus_destroy(server_dbus);
+	l_dbus_server_destroy(server);
+
+	l_main_exit();
+
+	if (!success)
+		abort();
+
+	return 0;
+}
@@ -38,21 +38,28 @@
 #define WAIT_ANY (-1) /* Any process */
 #endif
 
-#define TEST_BUS_ADDRESS "unix:path=/tmp/ell-test-bus"
-
+static char bus_address[64];
 static pid_t dbus_daemon_pid = -1;
 
 static bool start_dbus_daemon(void)
 {
-	char *prg_argv[5];
+	char *prg_argv[6];
 	char *prg_envp[1];
+	char address_arg[96];
 	pid_t pid;
 
+	/* Each test gets a bus of its own so tests can run in parallel */
+	snprintf(bus_address, sizeof(bus_address),
+				"unix:abstract=ell-test-bus-%i", getpid());
+	snprintf(address_arg, sizeof(address_arg), "--address=%s",
+								bus_address);
+
 	prg_argv[0] = "/usr/bin/dbus-daemon";
 	prg_argv[1] = "--nopidfile";
 	prg_argv[2] = "--nofork";
 	prg_argv[3] = "--config-file=" UNITDIR "dbus.conf";
-	prg_argv[4] = NULL;
+	prg_argv[4] = address_arg;
+	prg_argv[5] = NULL;
 
 	prg_envp[0] = NULL;
 
@@ -190,11 +197,20 @@ static void disconnect_callback(void *user_data)
 	l_main_quit();
 }
 
+static void poke(struct l_dbus *dbus);
+static bool poke_from_getter;
+
 static bool test_string_getter(struct l_dbus *dbus,
 				struct l_dbus_message *message,
 				struct l_dbus_message_builder *builder,
 				void *user_data)
 {
+	if (poke_from_getter && !strcmp(l_dbus_message_get_member(message),
+						"GetManagedObjects")) {
+		poke_from_getter = false;
+		poke(dbus);
+	}
+
 	return l_dbus_message_builder_append_basic(builder, 's', "foo");
 }
 
@@ -277,8 +293,31 @@ static bool test_path_getter(struct l_dbus *dbus,
 	return l_dbus_message_builder_append_basic(builder, 'o', "/foo/bar");
 }
 
+static void poke(struct l_dbus *dbus)
+{
+	struct l_dbus_message *signal;
+
+	l_dbus_property_changed(dbus, "/test", "org.test", "String");
+
+	signal = l_dbus_message_new_signal(dbus, "/test", "org.test", "Poked");
+	l_dbus_message_set_arguments(signal, "");
+	l_dbus_send(dbus, signal);
+}
+
+static struct l_dbus_message *test_poke(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	poke(dbus);
+
+	return l_dbus_message_new_method_return(message);
+}
+
 static void setup_test_interface(struct l_dbus_interface *interface)
 {
+	l_dbus_interface_method(interface, "Poke", 0, test_poke, "", "");
+	l_dbus_interface_signal(interface, "Poked", 0, "");
+
 	l_dbus_interface_property(interface, "String", 0, "s",
 					test_string_getter, test_string_setter);
 	l_dbus_interface_property(interface, "Integer", 0, "u",
@@ -775,6 +814,66 @@ static void test_property_signals(struct l_dbus *dbus, void *test_data)
 						"org.test", "String"));
 }
 
+static void setup_limited_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_property(interface, "String", 0, "s",
+					test_string_getter, NULL);
+	l_dbus_interface_set_emit_interval(interface, 100);
+}
+
+static struct l_timeout *limited_timeout;
+static unsigned int limited_signals;
+static uint64_t limited_first;
+
+static void limited_timeout_callback(struct l_timeout *timeout,
+					void *user_data)
+{
+	l_timeout_remove(limited_timeout);
+	limited_timeout = NULL;
+
+	/* The leading change and one merged trailing change */
+	test_assert(limited_signals == 2);
+
+	test_next();
+}
+
+static void test_limited_signal_callback(struct l_dbus_message *message,
+						void *user_data)
+{
+	int i;
+
+	if (!limited_timeout)
+		return;
+
+	limited_signals += 1;
+
+	if (limited_signals > 1) {
+		test_assert(l_time_diff(limited_first, l_time_now()) >=
+							90 * L_USEC_PER_MSEC);
+		return;
+	}
+
+	limited_first = l_time_now();
+
+	/* These all fall in the interval started by the first signal */
+	for (i = 0; i < 10; i++)
+		test_assert(l_dbus_property_changed(dbus, "/test",
+							"org.test.Limited",
+							"String"));
+}
+
+static void test_limited_signals(struct l_dbus *dbus, void *test_data)
+{
+	limited_signals = 0;
+
+	limited_timeout = l_timeout_create_ms(500, limited_timeout_callback,
+						NULL, NULL);
+	test_assert(limited_timeout);
+
+	test_assert(l_dbus_property_changed(dbus, "/test", "org.test.Limited",
+						"String"));
+}
+
 static void object_manager_callback(struct l_dbus_message *message,
 					void *user_data)
 {
@@ -916,6 +1015,176 @@ static void test_object_manager_signals(struct l_dbus *dbus, void *test_data)
 						NULL));
 }
 
+#define MANY_OBJECTS 200
+
+static void many_objects_add(struct l_dbus *dbus)
+{
+	char buf[32];
+	int i;
+
+	/* Enough objects for the reply to be built over several idles */
+	for (i = 0; i < MANY_OBJECTS; i++) {
+		snprintf(buf, sizeof(buf), "/many/obj%d", i);
+		l_dbus_object_add_interface(dbus, buf, "org.test", NULL);
+	}
+}
+
+static bool many_objects_check(struct l_dbus_message *message)
+{
+	struct l_dbus_message_iter objects, interfaces;
+	const char *path;
+	unsigned int count = 0;
+	char buf[32];
+	int i;
+
+	if (l_dbus_message_get_error(message, NULL, NULL))
+		return false;
+
+	if (!l_dbus_message_get_arguments(message, "a{oa{sa{sv}}}", &objects))
+		return false;
+
+	while (l_dbus_message_iter_next_entry(&objects, &path, &interfaces))
+		if (l_str_has_prefix(path, "/many/"))
+			count++;
+
+	for (i = 0; i < MANY_OBJECTS; i++) {
+		snprintf(buf, sizeof(buf), "/many/obj%d", i);
+		l_dbus_unregister_object(dbus, buf);
+	}
+
+	return count == MANY_OBJECTS;
+}
+
+static void many_objects_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	test_assert(many_objects_check(message));
+
+	test_next();
+}
+
+static void get_many_objects(struct l_dbus *dbus, const char *path,
+				l_dbus_message_func_t callback)
+{
+	struct l_dbus_message *call;
+
+	call = l_dbus_message_new_method_call(dbus, "org.test", path,
+					"org.freedesktop.DBus.ObjectManager",
+					"GetManagedObjects");
+	test_assert(call);
+	test_assert(l_dbus_message_set_arguments(call, ""));
+
+	test_assert(l_dbus_send_with_reply(dbus, call, callback, NULL, NULL));
+}
+
+static void test_object_manager_batches(struct l_dbus *dbus, void *test_data)
+{
+	many_objects_add(dbus);
+	get_many_objects(dbus, "/", many_objects_callback);
+}
+
+static bool batch_active;
+static bool batch_reply_received;
+static bool batch_changed_received;
+static bool subtree_active;
+static bool subtree_poked_received;
+
+static void batch_reply_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	test_assert(many_objects_check(message));
+	test_assert(!batch_changed_received);
+
+	batch_reply_received = true;
+}
+
+static void batch_changed_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	if (subtree_active) {
+		batch_changed_received = true;
+		return;
+	}
+
+	if (!batch_active)
+		return;
+
+	test_assert(batch_reply_received);
+
+	batch_changed_received = true;
+}
+
+static void batch_poked_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	if (subtree_active) {
+		test_assert(batch_changed_received);
+		subtree_poked_received = true;
+		return;
+	}
+
+	if (!batch_active)
+		return;
+
+	/* The signals held for /test have to go out before this one */
+	test_assert(batch_reply_received);
+	test_assert(batch_changed_received);
+
+	batch_active = false;
+
+	test_next();
+}
+
+static void test_object_manager_batch_order(struct l_dbus *dbus,
+						void *test_data)
+{
+	struct l_dbus_message *call;
+
+	batch_active = true;
+
+	many_objects_add(dbus);
+	get_many_objects(dbus, "/", batch_reply_callback);
+
+	/* Dispatched while the reply above is still being built */
+	call = l_dbus_message_new_method_call(dbus, "org.test", "/test",
+						"org.test", "Poke");
+	test_assert(call);
+	test_assert(l_dbus_message_set_arguments(call, ""));
+	test_assert(l_dbus_send(dbus, call));
+}
+
+static void subtree_reply_callback(struct l_dbus_message *message,
+					void *user_data)
+{
+	test_assert(many_objects_check(message));
+	test_assert(subtree_poked_received);
+
+	subtree_active = false;
+	test_assert(l_dbus_unregister_object(dbus, "/many"));
+
+	test_next();
+}
+
+static void test_object_manager_batch_subtree(struct l_dbus *dbus,
+						void *test_data)
+{
+	subtree_active = true;
+	batch_changed_received = false;
+
+	test_assert(l_dbus_object_add_interface(dbus, "/many",
+					L_DBUS_INTERFACE_OBJECT_MANAGER,
+					dbus));
+	many_objects_add(dbus);
+
+	/*
+	 * The first object's getter sends on /test, outside the subtree of
+	 * the reply being built, which must neither wait for nor complete
+	 * the reply.
+	 */
+	poke_from_getter = true;
+	get_many_objects(dbus, "/many", subtree_reply_callback);
+}
+
 static void test_run(void)
 {
 	success = false;
@@ -934,6 +1203,18 @@ static void test_run(void)
 		return;
 	}
 
+	if (!l_dbus_register_interface(dbus, "org.test.Limited",
+					setup_limited_interface, NULL, false)) {
+		l_info("Unable to register interface");
+		return;
+	}
+
+	if (!l_dbus_object_add_interface(dbus, "/test", "org.test.Limited",
+						NULL)) {
+		l_info("Unable to instantiate interface");
+		return;
+	}
+
 	if (!l_dbus_object_add_interface(dbus, "/test",
 				"org.freedesktop.DBus.Properties", NULL)) {
 		l_info("Unable to instantiate the properties interface");
@@ -948,6 +1229,19 @@ static void test_run(void)
 				"PropertiesChanged", L_DBUS_MATCH_ARGUMENT(0),
 				"org.test", L_DBUS_MATCH_NONE,
 				test_new_signal_callback, NULL);
+	l_dbus_add_signal_watch(dbus, "org.test", "/test",
+				"org.freedesktop.DBus.Properties",
+				"PropertiesChanged", L_DBUS_MATCH_ARGUMENT(0),
+				"org.test.Limited", L_DBUS_MATCH_NONE,
+				test_limited_signal_callback, NULL);
+	l_dbus_add_signal_watch(dbus, "org.test", "/test",
+				"org.freedesktop.DBus.Properties",
+				"PropertiesChanged", L_DBUS_MATCH_ARGUMENT(0),
+				"org.test", L_DBUS_MATCH_NONE,
+				batch_changed_callback, NULL);
+	l_dbus_add_signal_watch(dbus, "org.test", "/test", "org.test",
+				"Poked", L_DBUS_MATCH_NONE,
+				batch_poked_callback, NULL);
 
 	if (!l_dbus_object_manager_enable(dbus)) {
 		l_info("Unable to enable Object Manager");
@@ -976,10 +1270,18 @@ int main(int argc, char *argv[])
 	test_add("org.freedesktop.DBus.Properties get", test_new_get, NULL);
 	test_add("org.freedesktop.DBus.Properties set", test_new_set, NULL);
 	test_add("Property changed signals", test_property_signals, NULL);
+	test_add("Rate limited property changed signals",
+			test_limited_signals, NULL);
 	test_add("org.freedesktop.DBus.ObjectManager get",
 			test_object_manager_get, NULL);
 	test_add("org.freedesktop.DBus.ObjectManager signals",
 			test_object_manager_signals, NULL);
+	test_add("org.freedesktop.DBus.ObjectManager get in batches",
+			test_object_manager_batches, NULL);
+	test_add("org.freedesktop.DBus.ObjectManager signals behind batches",
+			test_object_manager_batch_order, NULL);
+	test_add("org.freedesktop.DBus.ObjectManager batches of a subtree",
+			test_object_manager_batch_subtree, NULL);
 
 	sigchld = l_signal_create(SIGCHLD, sigchld_handler, NULL, NULL);
 
@@ -991,7 +1293,7 @@ int main(int argc, char *argv[])
 	for (i = 0; i < 10; i++) {
 		usleep(200 * 1000);
 
-		dbus = l_dbus_new(TEST_BUS_ADDRESS);
+		dbus = l_dbus_new(bus_address);
 		if (dbus)
 			break;
 	}
@@ -27,6 +27,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <ell/ell.h>
 #include "ell/dbus-private.h"
@@ -307,9 +308,11 @@ static void test_dbus_object_tree_3(const void *test_data)
 	char path[50];
 	struct l_hashmap *paths;
 	unsigned int count = 0;
-	struct l_dbus_message *message, *reply;
+	struct l_dbus_message *message, *reply, *reply2;
 	struct l_dbus_message_iter objects, interfaces;
 	const char *obj_path;
+	void *body, *body2;
+	size_t body_size, body2_size;
 
 	tree = _dbus_object_tree_new();
 	assert(tree);
@@ -383,6 +386,15 @@ static void test_dbus_object_tree_3(const void *test_data)
 	while (l_dbus_message_iter_next_entry(&objects, &obj_path, &interfaces))
 		assert(l_hashmap_remove(paths, obj_path));
 
+	/* The second reply is put together from the cached object entries */
+	reply2 = _dbus_object_tree_get_objects(tree, NULL, "/", message);
+	assert(reply2);
+	body = _dbus_message_get_body(reply, &body_size);
+	body2 = _dbus_message_get_body(reply2, &body2_size);
+	assert(body_size == body2_size);
+	assert(!memcmp(body, body2, body_size));
+	l_dbus_message_unref(reply2);
+
 	l_dbus_message_unref(message);
 	l_dbus_message_unref(reply);
 
@@ -396,6 +408,81 @@ static void test_dbus_object_tree_3(const void *test_data)
 	_dbus_object_tree_free(tree);
 }
 
+#define CHILD_INDEX_COUNT 20
+
+static char *introspect_xml(struct _dbus_object_tree *tree, const char *path)
+{
+	struct l_string *buf = l_string_new(1024);
+
+	_dbus_object_tree_introspect(tree, path, buf);
+
+	return l_string_unwrap(buf);
+}
+
+static void test_dbus_object_tree_child_index(const void *test_data)
+{
+	struct _dbus_object_tree *tree;
+	struct object_node *leaves[CHILD_INDEX_COUNT];
+	char path[32];
+	char *xml;
+	unsigned int i;
+
+	tree = _dbus_object_tree_new();
+
+	/* Enough children for the parent to index them */
+	for (i = 0; i < CHILD_INDEX_COUNT; i++) {
+		snprintf(path, sizeof(path), "/idx/c%u/leaf", i);
+		leaves[i] = _dbus_object_tree_makepath(tree, path);
+		assert(leaves[i]);
+	}
+
+	for (i = 0; i < CHILD_INDEX_COUNT; i++) {
+		snprintf(path, sizeof(path), "/idx/c%u/leaf", i);
+		assert(_dbus_object_tree_lookup(tree, path) == leaves[i]);
+		assert(_dbus_object_tree_makepath(tree, path) == leaves[i]);
+	}
+
+	/* Elements match in full, not by prefix */
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c"));
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c1x"));
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c20"));
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c1/lea"));
+
+	xml = introspect_xml(tree, "/idx");
+	assert(strstr(xml, "<node name=\"c5\"/>"));
+	assert(strstr(xml, "<node name=\"c15\"/>"));
+	l_free(xml);
+
+	/* Removal updates both the index and the cached XML */
+	_dbus_object_tree_prune_node(leaves[5]);
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c5/leaf"));
+	assert(!_dbus_object_tree_lookup(tree, "/idx/c5"));
+	assert(_dbus_object_tree_lookup(tree, "/idx/c15/leaf") == leaves[15]);
+
+	xml = introspect_xml(tree, "/idx");
+	assert(!strstr(xml, "<node name=\"c5\"/>"));
+	assert(strstr(xml, "<node name=\"c15\"/>"));
+	l_free(xml);
+
+	leaves[5] = _dbus_object_tree_makepath(tree, "/idx/c5/leaf");
+	assert(_dbus_object_tree_lookup(tree, "/idx/c5/leaf") == leaves[5]);
+
+	xml = introspect_xml(tree, "/idx");
+	assert(strstr(xml, "<node name=\"c5\"/>"));
+	l_free(xml);
+
+	for (i = 0; i < CHILD_INDEX_COUNT; i++)
+		_dbus_object_tree_prune_node(leaves[i]);
+
+	assert(!_dbus_object_tree_lookup(tree, "/idx"));
+
+	xml = introspect_xml(tree, "/");
+	assert(!strstr(xml, "idx"));
+	l_free(xml);
+
+	_dbus_object_tree_free(tree);
+}
+
 static struct l_dbus_message *get_modems_callback(struct l_dbus *dbus,
 					struct l_dbus_message *message,
 					void *user_data)
@@ -451,6 +538,13 @@ static void test_dbus_object_tree_introspection(const void *test_data)
 						NULL, false);
 	_dbus_object_tree_add_interface(tree, "/", "org.ofono.Manager", NULL);
 
+	buf = l_string_new(1024);
+	_dbus_object_tree_introspect(tree, "/", buf);
+	xml = l_string_unwrap(buf);
+	assert(!strstr(xml, "phonesim"));
+	l_free(xml);
+
+	/* Adding a child has to drop the XML cached for the parent */
 	_dbus_object_tree_makepath(tree, "/phonesim");
 
 	buf = l_string_new(1024);
@@ -459,6 +553,15 @@ static void test_dbus_object_tree_introspection(const void *test_data)
 	assert(!strcmp(ofono_manager_introspection, xml));
 	l_free(xml);
 
+	assert(_dbus_object_tree_remove_interface(tree, "/",
+							"org.ofono.Manager"));
+
+	buf = l_string_new(1024);
+	_dbus_object_tree_introspect(tree, "/", buf);
+	xml = l_string_unwrap(buf);
+	assert(!strstr(xml, "org.ofono.Manager"));
+	l_free(xml);
+
 	_dbus_object_tree_free(tree);
 }
 
@@ -552,6 +655,10 @@ int main(int argc, char *argv[])
 	l_test_add("_dbus_object_tree Sanity Tests 3",
 					test_dbus_object_tree_3, NULL);
 
+	l_test_add("_dbus_object_tree Child Index",
+					test_dbus_object_tree_child_index,
+					NULL);
+
 	l_test_add("_dbus_object_tree Introspection",
 					test_dbus_object_tree_introspection,
 					NULL);
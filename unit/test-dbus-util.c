@@ -25,6 +25,7 @@
 #endif
 
 #include <assert.h>
+#include <string.h>
 
 #include <ell/ell.h>
 #include "ell/dbus-private.h"
@@ -67,6 +68,108 @@ static void test_signature(const void *test_data)
 	assert(valid == test->valid);
 }
 
+static void test_signature_length(const void *test_data)
+{
+	char sig[257];
+	struct _dbus_signature *signature;
+
+	memset(sig, 'y', 256);
+	sig[256] = '\0';
+
+	/* 255 characters is the most a signature may have */
+	signature = _dbus_signature_get(sig, 255);
+	assert(signature);
+	assert(signature->len == 255);
+	assert(signature->num_children == 255);
+	_dbus_signature_put(signature);
+
+	assert(!_dbus_signature_get(sig, 256));
+	assert(!_dbus_valid_signature(sig));
+
+	sig[255] = '\0';
+	assert(_dbus_valid_signature(sig));
+
+	assert(!_dbus_signature_get(sig, 0));
+}
+
+static void test_signature_cache(const void *test_data)
+{
+	struct _dbus_signature *first, *again;
+	char sig[256];
+	const char types[] = "ynq";
+	unsigned int i, n;
+
+	first = _dbus_signature_get("a{sv}", 5);
+	assert(first);
+	assert(first->num_children == 1);
+	assert(first->types[0].length == 5);
+	assert(first->types[1].length == 4);
+	assert(first->types[1].alignment == 8);
+
+	/* Looking the same signature up again hits the cache */
+	again = _dbus_signature_get("a{sv}", 5);
+	assert(again == first);
+	_dbus_signature_put(again);
+
+	/* So does a signature that is only part of a longer string */
+	again = _dbus_signature_get("a{sv}as", 5);
+	assert(again == first);
+	_dbus_signature_put(again);
+
+	/* More distinct signatures than the cache holds start it over */
+	for (i = 0; i < strlen(types); i++) {
+		for (n = 1; n < sizeof(sig); n++) {
+			memset(sig, types[i], n);
+
+			again = _dbus_signature_get(sig, n);
+			assert(again);
+			_dbus_signature_put(again);
+		}
+	}
+
+	again = _dbus_signature_get("a{sv}", 5);
+	assert(again && again != first);
+	_dbus_signature_put(again);
+
+	/* The evicted one stays valid for as long as it is held */
+	assert(first->len == 5 && !memcmp(first->str, "a{sv}", 5));
+	assert(first->types[0].length == 5);
+	_dbus_signature_put(first);
+}
+
+static void test_message_signature(const void *test_data)
+{
+	struct l_dbus_message *message;
+	struct _dbus_signature *signature;
+	const struct _dbus_signature_type *types;
+	char sig[] = "ua(ib)";
+
+	message = _dbus_message_new_signal(1, "/test", "org.test", "Test");
+	assert(message);
+
+	/* Iterators find their compiled types through the message */
+	signature = _dbus_message_signature_get(message, sig, 6);
+	assert(signature);
+	assert(_dbus_message_signature_types(message, sig, 6) ==
+							signature->types);
+
+	_dbus_message_signature_enter(message, sig, sig + 2);
+	types = _dbus_message_signature_types(message, sig + 2, 4);
+	assert(types == &signature->types[2]);
+	assert(types->length == 4);
+
+	/* Starts the message doesn't know about are looked up instead */
+	assert(!_dbus_message_signature_types(message, sig + 1, 5));
+	assert(!_dbus_message_signature_types(NULL, sig, 6));
+
+	/* A start whose characters changed since is not trusted */
+	sig[2] = '{';
+	sig[5] = '}';
+	assert(!_dbus_message_signature_types(message, sig + 2, 4));
+
+	l_dbus_message_unref(message);
+}
+
 struct interface_test {
 	bool valid;
 	const char *interface;
@@ -171,6 +274,9 @@ int main(int argc, char *argv[])
 	l_test_add("Signature test 14", test_signature, &sig_test14);
 	l_test_add("Signature test 15", test_signature, &sig_test15);
 	l_test_add("Signature test 16", test_signature, &sig_test16);
+	l_test_add("Signature length", test_signature_length, NULL);
+	l_test_add("Signature cache", test_signature_cache, NULL);
+	l_test_add("Message signature", test_message_signature, NULL);
 
 	l_test_add("Interface Test 1", test_interface, &iface_test1);
 	l_test_add("Interface Test 2", test_interface, &iface_test2);
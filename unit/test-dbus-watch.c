@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 
@@ -283,6 +284,106 @@ static void test_filter_tree(const void *test_data)
 			test.calls[4] == 1);
 }
 
+static bool many_add_match(struct l_dbus *dbus, unsigned int id,
+				const struct _dbus_filter_condition *rule,
+				int rule_len)
+{
+	return true;
+}
+
+static bool many_remove_match(struct l_dbus *dbus, unsigned int id)
+{
+	return true;
+}
+
+static void many_watches_cb(struct l_dbus_message *message, void *user_data)
+{
+	unsigned int *calls = user_data;
+
+	(*calls)++;
+}
+
+#define MANY_WATCHES 1000
+
+static void test_filter_many_watches(const void *test_data)
+{
+	struct _dbus_filter *filter;
+	struct l_dbus dbus;
+	static const struct _dbus_filter_ops filter_ops = {
+		.skip_register = true,
+		.add_match = many_add_match,
+		.remove_match = many_remove_match,
+	};
+	struct _dbus_filter_condition rule[] = {
+		{ L_DBUS_MATCH_TYPE, "signal" },
+		{ L_DBUS_MATCH_PATH, NULL },
+		{ L_DBUS_MATCH_MEMBER, "PropertiesChanged" },
+	};
+	unsigned int calls[MANY_WATCHES] = {};
+	unsigned int ids[MANY_WATCHES];
+	unsigned int i;
+	char path[32];
+	struct l_dbus_message *message;
+
+	filter = _dbus_filter_new(&dbus, &filter_ops, NULL);
+	assert(filter);
+
+	for (i = 0; i < MANY_WATCHES; i++) {
+		snprintf(path, sizeof(path), "/obj/%u", i);
+		rule[1].value = path;
+
+		ids[i] = _dbus_filter_add_rule(filter, rule,
+						L_ARRAY_SIZE(rule),
+						many_watches_cb, &calls[i]);
+		assert(ids[i]);
+	}
+
+	message = _dbus_message_new_signal(2, "/obj/500", "org.test",
+						"PropertiesChanged");
+	l_dbus_message_set_arguments(message, "");
+	_dbus_filter_dispatch(message, filter);
+	l_dbus_message_unref(message);
+
+	message = _dbus_message_new_signal(2, "/obj/501", "org.test",
+						"InterfacesAdded");
+	l_dbus_message_set_arguments(message, "");
+	_dbus_filter_dispatch(message, filter);
+	l_dbus_message_unref(message);
+
+	for (i = 0; i < MANY_WATCHES; i++)
+		assert(calls[i] == (i == 500 ? 1 : 0));
+
+	for (i = 0; i < MANY_WATCHES; i += 2)
+		assert(_dbus_filter_remove_rule(filter, ids[i]));
+
+	for (i = 498; i < 502; i++) {
+		snprintf(path, sizeof(path), "/obj/%u", i);
+		message = _dbus_message_new_signal(2, path, "org.test",
+							"PropertiesChanged");
+		l_dbus_message_set_arguments(message, "");
+		_dbus_filter_dispatch(message, filter);
+		l_dbus_message_unref(message);
+	}
+
+	assert(calls[498] == 0 && calls[499] == 1 &&
+			calls[500] == 1 && calls[501] == 1);
+
+	/* The same rule again ends up on the existing node */
+	rule[1].value = "/obj/501";
+	assert(_dbus_filter_add_rule(filter, rule, L_ARRAY_SIZE(rule),
+					many_watches_cb, &calls[501]));
+
+	message = _dbus_message_new_signal(2, "/obj/501", "org.test",
+						"PropertiesChanged");
+	l_dbus_message_set_arguments(message, "");
+	_dbus_filter_dispatch(message, filter);
+	l_dbus_message_unref(message);
+
+	assert(calls[501] == 3);
+
+	_dbus_filter_free(filter);
+}
+
 int main(int argc, char *argv[])
 {
 	l_test_init(&argc, &argv);
@@ -290,6 +391,7 @@ int main(int argc, char *argv[])
 	l_test_add("_dbus_filter_rule_to_str", test_rule_to_str, NULL);
 
 	l_test_add("DBus filter tree", test_filter_tree, NULL);
+	l_test_add("DBus filter many watches", test_filter_many_watches, NULL);
 
 	return l_test_run();
 }
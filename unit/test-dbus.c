@@ -25,6 +25,7 @@
 #endif
 
 #define _GNU_SOURCE
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -35,21 +36,28 @@
 #define WAIT_ANY (-1) /* Any process */
 #endif
 
-#define TEST_BUS_ADDRESS "unix:path=/tmp/ell-test-bus"
-
+static char bus_address[64];
 static pid_t dbus_daemon_pid = -1;
 
 static void start_dbus_daemon(void)
 {
-	char *prg_argv[5];
+	char *prg_argv[6];
 	char *prg_envp[1];
+	char address_arg[96];
 	pid_t pid;
 
+	/* Each test gets a bus of its own so tests can run in parallel */
+	snprintf(bus_address, sizeof(bus_address),
+				"unix:abstract=ell-test-bus-%i", getpid());
+	snprintf(address_arg, sizeof(address_arg), "--address=%s",
+								bus_address);
+
 	prg_argv[0] = "/usr/bin/dbus-daemon";
 	prg_argv[1] = "--nopidfile";
 	prg_argv[2] = "--nofork";
 	prg_argv[3] = "--config-file=" UNITDIR "dbus.conf";
-	prg_argv[4] = NULL;
+	prg_argv[4] = address_arg;
+	prg_argv[5] = NULL;
 
 	prg_envp[0] = NULL;
 
@@ -214,7 +222,7 @@ int main(int argc, char *argv[])
 	for (i = 0; i < 10; i++) {
 		usleep(200 * 1000);
 
-		dbus = l_dbus_new(TEST_BUS_ADDRESS);
+		dbus = l_dbus_new(bus_address);
 		if (dbus)
 			break;
 	}
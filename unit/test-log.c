@@ -0,0 +1,338 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2016  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <ell/ell.h>
+#include "ell/log-private.h"
+
+#define NUM_RECORDS	16
+
+static int log_socket(char *path, size_t len)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	snprintf(path, len, "/tmp/ell-test-log-%i", getpid());
+	unlink(path);
+
+	fd = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	assert(fd >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	assert(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+
+	return fd;
+}
+
+static unsigned int drain(int fd, char *buf, size_t len, ssize_t *last_len)
+{
+	unsigned int count = 0;
+	ssize_t n;
+
+	while ((n = recv(fd, buf, len, MSG_DONTWAIT)) >= 0) {
+		*last_len = n;
+		count += 1;
+	}
+
+	return count;
+}
+
+static void test_async_dropped(const void *data)
+{
+	static char message[2000];
+	char path[64];
+	char buf[8192];
+	ssize_t len = 0;
+	unsigned int received;
+	unsigned int i;
+	int fd;
+
+	assert(l_main_init());
+
+	fd = log_socket(path, sizeof(path));
+
+	memset(message, 'x', sizeof(message) - 1);
+
+	_log_set_syslog(path);
+	l_log_set_async(1);
+
+	/*
+	 * The loop never runs, so the smallest ring fills up after a few
+	 * records and the rest are lost.  Few enough get queued for the
+	 * flush not to block on the unread socket.
+	 */
+	for (i = 0; i < NUM_RECORDS; i++)
+		l_info("%u %s", i, message);
+
+	l_log_flush();
+	received = drain(fd, buf, sizeof(buf), &len);
+
+	assert(l_log_get_dropped() > 0);
+	assert(received + l_log_get_dropped() == NUM_RECORDS);
+
+	l_log_set_async(0);
+	l_log_set_null();
+	l_main_exit();
+
+	close(fd);
+	unlink(path);
+}
+
+static void test_journal_truncate(const void *data)
+{
+	static char message[6000];
+	char path[64];
+	char buf[8192];
+	ssize_t len = 0;
+	int fd;
+
+	assert(l_main_init());
+
+	fd = log_socket(path, sizeof(path));
+
+	memset(message, 'x', sizeof(message) - 1);
+
+	_log_set_journal(path);
+	l_log_set_async(1);
+
+	l_info("%s", message);
+	l_log_flush();
+
+	assert(drain(fd, buf, sizeof(buf) - 1, &len) == 1);
+	assert(l_log_get_dropped() == 0);
+	assert(len <= 4096);
+	buf[len] = '\0';
+
+	/* The message is cut short but the record stays well formed */
+	assert(!strncmp(buf, "MESSAGE=xxx", 11));
+	assert(strstr(buf, "x\nPRIORITY=6\nCODE_FILE="));
+	assert(strstr(buf, "\nCODE_FUNC=test_journal_truncate\n"));
+	assert(buf[len - 1] == '\n');
+
+	l_log_set_async(0);
+	l_log_set_null();
+	l_main_exit();
+
+	close(fd);
+	unlink(path);
+}
+
+struct trace_lines {
+	unsigned int count;
+	char *last;
+};
+
+static void trace_line(const char *str, void *user_data)
+{
+	struct trace_lines *lines = user_data;
+
+	lines->count += 1;
+	l_free(lines->last);
+	lines->last = l_strdup(str);
+}
+
+static void *trace_dump(size_t *len)
+{
+	FILE *f = tmpfile();
+	struct stat st;
+	void *data;
+
+	assert(f);
+	assert(l_debug_trace_dump(fileno(f)));
+	assert(fstat(fileno(f), &st) == 0);
+
+	*len = st.st_size;
+	data = l_malloc(*len);
+	assert(pread(fileno(f), data, *len, 0) == (ssize_t) *len);
+
+	fclose(f);
+	return data;
+}
+
+static void test_debug_desc(const void *data)
+{
+	/* Debug sections of existing binaries are walked one desc at a time */
+	struct {
+		const char *file;
+		const char *func;
+		unsigned int flags;
+	} __attribute__((aligned(8))) layout;
+
+	assert(sizeof(struct l_debug_desc) == sizeof(layout));
+}
+
+static void test_trace(const void *data)
+{
+	struct trace_lines lines = {};
+	void *dump;
+	size_t len;
+
+	l_debug_enable("*");
+
+	assert(!l_debug_trace_enable(8));
+	assert(l_debug_trace_enable(4096));
+
+	l_debug("trace %d %s %*u %.3s %%", -42, "hello", 6, 7u, "abcdef");
+	l_debug("done");
+
+	dump = trace_dump(&len);
+	assert(l_debug_trace_decode(dump, len, trace_line, &lines));
+	assert(lines.count == 2);
+	assert(strstr(lines.last, "test-log.c:test_trace() done"));
+
+	/* A truncated dump is rejected */
+	assert(!l_debug_trace_decode(dump, 12, trace_line, &lines));
+	l_free(dump);
+
+	lines.count = 0;
+	l_debug("trace %d %s %*u %.3s %%", -42, "hello", 6, 7u, "abcdef");
+
+	dump = trace_dump(&len);
+	assert(l_debug_trace_decode(dump, len, trace_line, &lines));
+	assert(lines.count == 3);
+	l_free(dump);
+
+	/* The rings are gone, tracing starts over once enabled again */
+	l_debug_trace_disable();
+	assert(l_debug_trace_enable(4096));
+
+	lines.count = 0;
+	l_debug("trace %d %s %*u %.3s %%", -42, "hello", 6, 7u, "abcdef");
+
+	dump = trace_dump(&len);
+	assert(l_debug_trace_decode(dump, len, trace_line, &lines));
+	assert(lines.count == 1);
+	assert(l_str_has_suffix(lines.last,
+				"test_trace() trace -42 hello      7 abc %"));
+	l_free(dump);
+
+	l_debug_trace_disable();
+	l_debug_disable();
+	l_free(lines.last);
+}
+
+struct trace_builder {
+	uint8_t buf[512];
+	size_t len;
+};
+
+static void trace_append(struct trace_builder *builder,
+					const void *data, size_t len)
+{
+	assert(builder->len + len <= sizeof(builder->buf));
+
+	memcpy(builder->buf + builder->len, data, len);
+	builder->len += len;
+}
+
+static void trace_append_u32(struct trace_builder *builder, uint32_t value)
+{
+	trace_append(builder, &value, sizeof(value));
+}
+
+static void trace_append_u64(struct trace_builder *builder, uint64_t value)
+{
+	trace_append(builder, &value, sizeof(value));
+}
+
+static void trace_append_string(struct trace_builder *builder,
+							const char *str)
+{
+	trace_append_u32(builder, strlen(str));
+	trace_append(builder, str, strlen(str));
+}
+
+static void test_trace_decode_untrusted(const void *data)
+{
+	static const char format[] = "%99999999999999999999d|%*d|%.*s|"
+		"%0000000000000000000000000000000000000000000000000000005x";
+	struct trace_builder builder = {};
+	struct trace_lines lines = {};
+	const char *p;
+
+	trace_append(&builder, "ELLTRACE", 8);
+	trace_append_u32(&builder, 1);
+	trace_append_u32(&builder, 1);
+	trace_append_u64(&builder, 0x1000);
+	trace_append_string(&builder, "file.c");
+	trace_append_string(&builder, "func");
+	trace_append_string(&builder, format);
+
+	trace_append_u64(&builder, 11);
+	trace_append_u64(&builder, 0x1000);
+	trace_append_u64(&builder, 0x2000);
+	trace_append_u64(&builder, 0);
+	trace_append_u64(&builder, 7);
+	trace_append_u64(&builder, 1);
+	trace_append_u64(&builder, 2000000000);
+	trace_append_u64(&builder, 2);
+	trace_append_u64(&builder, 3);
+	trace_append_u64(&builder, 6);
+	trace_append(&builder, "abcdef\0\0", 8);
+	trace_append_u64(&builder, 255);
+
+	assert(l_debug_trace_decode(builder.buf, builder.len,
+						trace_line, &lines));
+	assert(lines.count == 1);
+
+	/* Widths are clamped and every conversion is still rendered */
+	p = strstr(lines.last, "func() ");
+	assert(p);
+	p += 7;
+
+	assert(strlen(p) == 1024 + 1 + 1024 + 1 + 3 + 1 + 5);
+	assert(p[1023] == '1');
+	assert(p[1024 + 1 + 1023] == '2');
+	assert(l_str_has_suffix(p, "|abc|000ff"));
+
+	l_free(lines.last);
+}
+
+int main(int argc, char *argv[])
+{
+	l_test_init(&argc, &argv);
+
+	l_test_add("Async dropped records", test_async_dropped, NULL);
+	l_test_add("Journal truncation", test_journal_truncate, NULL);
+	l_test_add("Debug descriptor layout", test_debug_desc, NULL);
+	l_test_add("Trace record and decode", test_trace, NULL);
+	l_test_add("Trace decode untrusted", test_trace_decode_untrusted,
+									NULL);
+
+	return l_test_run();
+}
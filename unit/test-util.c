@@ -71,6 +71,97 @@ static void test_from_hexstring(const void *test_data)
 
 	bytes = l_util_from_hexstring(invalid2, &len);
 	assert(!bytes);
+
+	bytes = l_util_from_hexstring("0aBcDeF9", &len);
+	assert(bytes);
+	assert(len == 4);
+	assert(bytes[0] == 0x0a && bytes[1] == 0xbc &&
+			bytes[2] == 0xde && bytes[3] == 0xf9);
+	l_free(bytes);
+
+	bytes = l_util_from_hexstring("0g", &len);
+	assert(!bytes);
+
+	bytes = l_util_from_hexstring("g0", &len);
+	assert(!bytes);
+
+	bytes = l_util_from_hexstring("00\xff" "0", &len);
+	assert(!bytes);
+}
+
+struct hexdump_data {
+	const char **lines;
+	unsigned int n_lines;
+	unsigned int pos;
+};
+
+static void hexdump_check(const char *str, void *user_data)
+{
+	struct hexdump_data *data = user_data;
+
+	assert(data->pos < data->n_lines);
+	assert(!strcmp(str, data->lines[data->pos]));
+	data->pos += 1;
+}
+
+static const unsigned char hexdump_buf[] = {
+	0x6c, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x00, 0x00, 0x6d, 0x00, 0x00, 0x00,
+	0x41, 0x42, 0x43, 0x7f, 0x20,
+};
+
+static const char *hexdump_lines[] = {
+	"< 6c 01 00 01 00 00 00 00 01 00 00 00 6d 00 00 00  l...........m...",
+	"  41 42 43 7f 20                                   ABC.            ",
+};
+
+static void test_hexdump(const void *test_data)
+{
+	struct hexdump_data data = {
+		.lines = hexdump_lines,
+		.n_lines = L_ARRAY_SIZE(hexdump_lines),
+	};
+	struct iovec iov[3];
+
+	l_util_hexdump(true, hexdump_buf, sizeof(hexdump_buf),
+					hexdump_check, &data);
+	assert(data.pos == data.n_lines);
+
+	iov[0].iov_base = (void *) hexdump_buf;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = (void *) hexdump_buf + 3;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = (void *) hexdump_buf + 3;
+	iov[2].iov_len = sizeof(hexdump_buf) - 3;
+
+	data.pos = 0;
+	l_util_hexdumpv(true, iov, 3, hexdump_check, &data);
+	assert(data.pos == data.n_lines);
+}
+
+static unsigned char bench_buf[1024];
+
+static void bench_hexstring(const void *test_data)
+{
+	l_free(l_util_hexstring(bench_buf, sizeof(bench_buf)));
+}
+
+static void bench_from_hexstring(const void *test_data)
+{
+	const char *hex = test_data;
+	size_t len;
+
+	l_free(l_util_from_hexstring(hex, &len));
+}
+
+static void hexdump_discard(const char *str, void *user_data)
+{
+}
+
+static void bench_hexdump(const void *test_data)
+{
+	l_util_hexdump(true, bench_buf, sizeof(bench_buf),
+						hexdump_discard, NULL);
 }
 
 static void test_has_suffix(const void *test_data)
@@ -126,15 +217,30 @@ static void test_strlcpy(const void *test_data)
 
 int main(int argc, char *argv[])
 {
+	char *hex;
+	int ret;
+
 	l_test_init(&argc, &argv);
 
 	l_test_add("l_util_hexstring", test_hexstring, NULL);
 	l_test_add("l_util_hexstring_upper", test_hexstring_upper, NULL);
 	l_test_add("l_util_from_hexstring", test_from_hexstring, NULL);
+	l_test_add("l_util_hexdump", test_hexdump, NULL);
 
 	l_test_add("l_util_has_suffix", test_has_suffix, NULL);
 
 	l_test_add("l_strlcpy", test_strlcpy, NULL);
 
-	return l_test_run();
+	hex = l_util_hexstring(bench_buf, sizeof(bench_buf));
+
+	l_test_add_bench("l_util_hexstring 1k", bench_hexstring, NULL);
+	l_test_add_bench("l_util_from_hexstring 1k",
+					bench_from_hexstring, hex);
+	l_test_add_bench("l_util_hexdump 1k", bench_hexdump, NULL);
+
+	ret = l_test_run();
+
+	l_free(hex);
+
+	return ret;
 }